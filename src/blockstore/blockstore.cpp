@@ -14,3 +14,8 @@ blockstore_i* blockstore_i::create(blockstore_config_t & config, ring_loop_i *ri
     else
         return new v1::blockstore_impl_t(config, ringloop, tfd);
 }
+
+bool blockstore_i::needs_sqe128(blockstore_config_t & config)
+{
+    return config["data_io"] == "passthru" || config["meta_io"] == "passthru" || config["journal_io"] == "passthru";
+}
@@ -173,10 +173,50 @@ struct __attribute__ ((visibility("default"))) blockstore_op_t
 
 typedef std::map<std::string, std::string> blockstore_config_t;
 
+#define BS_COMPACT_IDLE 0
+#define BS_COMPACT_THROTTLED 1
+#define BS_COMPACT_ELEVATED 2
+#define BS_COMPACT_URGENT 3
+
+// Compaction scheduler state
+struct blockstore_compaction_stats_t
+{
+    // Objects ready for compaction and objects which become ready after the next fsync
+    uint64_t queue_size = 0;
+    uint64_t future_queue_size = 0;
+    // Buffer area bytes not yet moved to their final location
+    uint64_t debt = 0;
+    // Metadata blocks with little free space and garbage entries in metadata
+    uint64_t meta_nearfull_blocks = 0;
+    uint64_t garbage_entries = 0;
+    // BS_COMPACT_*: idle clients or urgent = no limit, throttled = target limit, elevated = 4x target limit
+    int pressure = BS_COMPACT_IDLE;
+    // Current limits, 0 = unlimited
+    uint64_t iops_limit = 0;
+    uint64_t bps_limit = 0;
+    // Totals and throughput during the last second
+    uint64_t compacted_count = 0;
+    uint64_t compacted_bytes = 0;
+    uint64_t iops = 0;
+    uint64_t bps = 0;
+};
+
+// Metadata write batching counters
+struct blockstore_meta_write_stats_t
+{
+    // Client operations modifying metadata (write, delete, stabilize, rollback)
+    uint64_t client_writes = 0;
+    // Metadata write requests and metadata blocks written by them
+    uint64_t meta_writes = 0;
+    uint64_t meta_blocks = 0;
+};
+
 class __attribute__((visibility("default"))) blockstore_i
 {
 public:
     static blockstore_i* create(blockstore_config_t & config, ring_loop_i *ringloop, timerfd_manager_t *tfd);
+    // NVMe passthrough I/O (data_io, meta_io or journal_io = passthru) requires a ring with 128-byte SQEs
+    static bool needs_sqe128(blockstore_config_t & config);
 
     virtual ~blockstore_i() = default;
 
@@ -233,4 +273,10 @@ public:
     virtual uint64_t get_live_memory() = 0;
     virtual uint64_t get_garbage_entries() = 0;
     virtual uint64_t get_garbage_memory() = 0;
+
+    // Get compaction scheduler state
+    virtual blockstore_compaction_stats_t get_compaction_stats() = 0;
+
+    // Get metadata write batching counters
+    virtual blockstore_meta_write_stats_t get_meta_write_stats() = 0;
 };
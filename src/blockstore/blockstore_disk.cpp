@@ -3,6 +3,8 @@
 
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/nvme_ioctl.h>
 #include <unistd.h>
 
 #include <stdexcept>
@@ -379,6 +381,66 @@ static int bs_openmode(const std::string & mode)
         return O_DIRECT;
 }
 
+static std::string read_sysfs_line(const std::string & path)
+{
+    char buf[256];
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return "";
+    int r = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (r <= 0)
+        return "";
+    buf[r] = 0;
+    return trim(std::string(buf));
+}
+
+// Find and open the NVMe generic char device for the namespace opened as block device <fd>
+static void open_nvme_passthru(int fd, blockstore_nvme_dev_t *nvme, std::string name)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        throw std::runtime_error("Failed to stat "+name);
+    }
+    if (!S_ISBLK(st.st_mode))
+    {
+        throw std::runtime_error(name+" is not a block device, passthru I/O mode requires an NVMe namespace");
+    }
+    std::string sys_path = "/sys/dev/block/"+std::to_string(major(st.st_rdev))+":"+std::to_string(minor(st.st_rdev));
+    char link[1024];
+    int r = readlink(sys_path.c_str(), link, sizeof(link)-1);
+    if (r <= 0)
+    {
+        throw std::runtime_error("Failed to resolve "+sys_path+": "+strerror(errno));
+    }
+    link[r] = 0;
+    std::string ns_name = link;
+    ns_name = ns_name.substr(ns_name.rfind('/')+1);
+    if (ns_name.substr(0, 4) != "nvme" || read_sysfs_line(sys_path+"/partition") != "")
+    {
+        throw std::runtime_error(name+" ("+ns_name+") is not an NVMe namespace, passthru I/O mode can't be used with partitions and other devices");
+    }
+    if (stoull_full(read_sysfs_line(sys_path+"/metadata_bytes")) != 0)
+    {
+        // Commands would need separate metadata buffers
+        throw std::runtime_error(name+" ("+ns_name+") is formatted with metadata, passthru I/O mode is not supported");
+    }
+    uint64_t max_kb = stoull_full(read_sysfs_line(sys_path+"/queue/max_hw_sectors_kb"));
+    nvme->max_io = max_kb ? (max_kb < 1024*1024 ? max_kb*1024 : 1024*1024*1024) : 128*1024;
+    nvme->nsid = ioctl(fd, NVME_IOCTL_ID);
+    if ((int)nvme->nsid <= 0)
+    {
+        throw std::runtime_error("Failed to get NVMe namespace ID of "+name+": "+strerror(errno));
+    }
+    std::string char_path = "/dev/ng"+ns_name.substr(4);
+    nvme->fd = open(char_path.c_str(), O_RDWR);
+    if (nvme->fd < 0)
+    {
+        throw std::runtime_error("Failed to open NVMe generic device "+char_path+" for "+name+": "+strerror(errno));
+    }
+}
+
 void blockstore_disk_t::open_data()
 {
     if (data_fd >= 0)
@@ -409,6 +471,10 @@ void blockstore_disk_t::open_data()
     {
         throw std::runtime_error(std::string("Failed to lock data device: ") + strerror(errno));
     }
+    if (!mock_mode && data_io == "passthru")
+    {
+        open_nvme_passthru(data_fd, &data_nvme, "data device");
+    }
 }
 
 void blockstore_disk_t::open_meta()
@@ -436,10 +502,15 @@ void blockstore_disk_t::open_meta()
         {
             throw std::runtime_error(std::string("Failed to lock metadata device: ") + strerror(errno));
         }
+        if (!mock_mode && meta_io == "passthru")
+        {
+            open_nvme_passthru(meta_fd, &meta_nvme, "metadata device");
+        }
     }
     else
     {
         meta_fd = data_fd;
+        meta_nvme = data_nvme;
         meta_device_sect = data_device_sect;
         meta_device_size = 0;
         if (meta_offset >= data_device_size)
@@ -481,10 +552,15 @@ void blockstore_disk_t::open_journal()
         {
             throw std::runtime_error(std::string("Failed to lock journal device: ") + strerror(errno));
         }
+        if (!mock_mode && journal_io == "passthru")
+        {
+            open_nvme_passthru(journal_fd, &journal_nvme, "journal device");
+        }
     }
     else
     {
         journal_fd = meta_fd;
+        journal_nvme = meta_nvme;
         journal_device_sect = meta_device_sect;
         journal_device_size = 0;
         if (journal_offset >= data_device_size)
@@ -511,8 +587,15 @@ void blockstore_disk_t::close_all()
             close(meta_fd);
         if (journal_fd >= 0 && journal_fd != meta_fd)
             close(journal_fd);
+        if (data_nvme.fd >= 0)
+            close(data_nvme.fd);
+        if (meta_nvme.fd >= 0 && meta_nvme.fd != data_nvme.fd)
+            close(meta_nvme.fd);
+        if (journal_nvme.fd >= 0 && journal_nvme.fd != meta_nvme.fd)
+            close(journal_nvme.fd);
     }
     data_fd = meta_fd = journal_fd = -1;
+    data_nvme = meta_nvme = journal_nvme = blockstore_nvme_dev_t();
 }
 
 // Sadly DISCARD only works through ioctl(), but it seems to always block the device queue,
@@ -23,6 +23,15 @@
 
 class allocator_t;
 
+// NVMe generic char device (/dev/ngXnY) used for passthrough I/O
+struct blockstore_nvme_dev_t
+{
+    int fd = -1;
+    uint32_t nsid = 0;
+    // Maximum transfer size in bytes
+    uint32_t max_io = 0;
+};
+
 struct blockstore_disk_t
 {
     std::string data_device, meta_device, journal_device;
@@ -48,6 +57,7 @@ struct blockstore_disk_t
     bool disable_flock = false;
     // I/O modes for data, metadata and journal: direct or "" = O_DIRECT, cached = O_SYNC, directsync = O_DIRECT|O_SYNC
     // O_SYNC without O_DIRECT = use Linux page cache for reads and writes
+    // passthru = O_DIRECT + NVMe passthrough commands through the generic char device
     std::string data_io, meta_io, journal_io;
     // It is safe to disable fsync() if drive write cache is writethrough
     bool disable_data_fsync = false, disable_meta_fsync = false, disable_journal_fsync = false;
@@ -65,6 +75,7 @@ struct blockstore_disk_t
     uint64_t discard_granularity = 0;
 
     int meta_fd = -1, data_fd = -1, journal_fd = -1;
+    blockstore_nvme_dev_t data_nvme, meta_nvme, journal_nvme;
     uint64_t meta_offset = 0, meta_device_sect = 0, meta_device_size = 0, meta_area_size = 0, min_meta_len = 0;
     uint64_t data_offset = 0, data_device_sect = 0, data_device_size = 0, data_len = 0;
     uint64_t journal_offset = 0, journal_device_sect = 0, journal_device_size = 0, journal_len = 0;
@@ -9,6 +9,10 @@
 #define META_BLOCK_UNREAD 0
 #define META_BLOCK_READ 1
 
+// Compaction budget is recalculated every COMPACT_REFILL_US and may accumulate up to COMPACT_BURST_US
+#define COMPACT_REFILL_US 10000
+#define COMPACT_BURST_US 100000
+
 // FIXME rename to compactor_t
 journal_flusher_t::journal_flusher_t(blockstore_impl_t *bs)
 {
@@ -37,24 +41,33 @@ journal_flusher_t::journal_flusher_t(blockstore_impl_t *bs)
 journal_flusher_co::journal_flusher_co()
 {
     wait_state = 0;
-    simple_callback_r = [this](ring_data_t* data)
-    {
-        bs->live = true;
-        if (data->res != data->iov.iov_len)
-            bs->disk_error_abort("read operation during flush", data->res, data->iov.iov_len);
-        wait_count--;
-    };
-    simple_callback_w = [this](ring_data_t* data)
-    {
-        bs->live = true;
-        if (data->res != data->iov.iov_len)
-            bs->disk_error_abort("write operation during flush", data->res, data->iov.iov_len);
-        wait_count--;
-    };
+}
+
+void journal_flusher_co::simple_callback_r(void *co, void *unused, ring_data_t* data)
+{
+    auto self = (journal_flusher_co*)co;
+    self->bs->live = true;
+    if (data->res != data->iov.iov_len)
+        self->bs->disk_error_abort("read operation during flush", data->res, data->iov.iov_len);
+    self->wait_count--;
+}
+
+void journal_flusher_co::simple_callback_w(void *co, void *unused, ring_data_t* data)
+{
+    auto self = (journal_flusher_co*)co;
+    self->bs->live = true;
+    if (data->res != data->iov.iov_len)
+        self->bs->disk_error_abort("write operation during flush", data->res, data->iov.iov_len);
+    self->wait_count--;
 }
 
 journal_flusher_t::~journal_flusher_t()
 {
+    if (compact_timer_id >= 0)
+    {
+        bs->tfd->clear_timer(compact_timer_id);
+        compact_timer_id = -1;
+    }
     delete[] co;
 }
 
@@ -106,10 +119,127 @@ void journal_flusher_t::dump_diagnostics()
         bs->heap->get_meta_used_space(), bs->heap->get_meta_total_space(),
         bs->heap->get_meta_nearfull_blocks(), bs->dsk.meta_area_size/bs->dsk.meta_block_size-1
     );
+    printf(
+        "Compaction scheduler: pressure %d, limit %ju iops / %ju B/s, tokens %.1f / %.0f B, %ju iops / %ju B/s\n",
+        compact_pressure, compact_iops_limit, compact_bps_limit, compact_op_tokens, compact_byte_tokens,
+        compact_iops, compact_bps
+    );
+}
+
+static uint64_t us_between(const timespec & a, const timespec & b)
+{
+    return (b.tv_sec - a.tv_sec)*1000000 + (b.tv_nsec - a.tv_nsec)/1000;
+}
+
+void journal_flusher_t::update_compact_budget()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!compact_refill_ts.tv_sec)
+    {
+        compact_refill_ts = compact_stat_ts = now;
+        prev_client_op_count = bs->client_op_count;
+    }
+    uint64_t passed_us = us_between(compact_refill_ts, now);
+    bool client_active = bs->client_op_count != prev_client_op_count || bs->write_iodepth > 0;
+    // Clients throttle idle compaction immediately, but it's only unthrottled after a whole idle interval
+    if (passed_us < COMPACT_REFILL_US && (!client_active || compact_pressure != BS_COMPACT_IDLE))
+    {
+        return;
+    }
+    compact_refill_ts = now;
+    // Estimate space pressure
+    uint64_t buffer_used = bs->heap->get_buffer_area_used_space();
+    uint64_t meta_blocks = bs->dsk.meta_area_size/bs->dsk.meta_block_size - 1;
+    uint64_t nearfull = bs->heap->get_meta_nearfull_blocks();
+    if (force_start > 0 || buffer_used*4 >= bs->dsk.journal_len*3 || nearfull*10 >= meta_blocks*9)
+        compact_pressure = BS_COMPACT_URGENT;
+    else if (buffer_used*2 >= bs->dsk.journal_len || nearfull*4 >= meta_blocks*3 ||
+        bs->heap->get_garbage_entries() > bs->heap->get_live_entries())
+        compact_pressure = BS_COMPACT_ELEVATED;
+    else if (client_active)
+        compact_pressure = BS_COMPACT_THROTTLED;
+    else
+        compact_pressure = BS_COMPACT_IDLE;
+    prev_client_op_count = bs->client_op_count;
+    // Adjust the budget
+    uint64_t mul = (compact_pressure == BS_COMPACT_THROTTLED ? 1 : (compact_pressure == BS_COMPACT_ELEVATED ? 4 : 0));
+    compact_iops_limit = mul * bs->compaction_target_iops;
+    compact_bps_limit = mul * bs->compaction_target_mbs * 1024*1024;
+    if (compact_iops_limit)
+    {
+        double max_tokens = (double)compact_iops_limit * COMPACT_BURST_US / 1000000;
+        compact_op_tokens += (double)compact_iops_limit * passed_us / 1000000;
+        if (compact_op_tokens > (max_tokens < 1 ? 1 : max_tokens))
+            compact_op_tokens = (max_tokens < 1 ? 1 : max_tokens);
+    }
+    if (compact_bps_limit)
+    {
+        double max_tokens = (double)compact_bps_limit * COMPACT_BURST_US / 1000000;
+        compact_byte_tokens += (double)compact_bps_limit * passed_us / 1000000;
+        if (compact_byte_tokens > max_tokens)
+            compact_byte_tokens = max_tokens;
+    }
+    // Calculate throughput
+    passed_us = us_between(compact_stat_ts, now);
+    if (passed_us >= 1000000)
+    {
+        compact_iops = (compacted_count - stat_compacted_count) * 1000000 / passed_us;
+        compact_bps = (compacted_bytes - stat_compacted_bytes) * 1000000 / passed_us;
+        stat_compacted_count = compacted_count;
+        stat_compacted_bytes = compacted_bytes;
+        compact_stat_ts = now;
+    }
+}
+
+bool journal_flusher_t::can_start_compaction()
+{
+    if (force_start > 0 || !bs->tfd ||
+        (!compact_iops_limit || compact_op_tokens >= 1) && (!compact_bps_limit || compact_byte_tokens > 0))
+    {
+        return true;
+    }
+    if (compact_timer_id < 0)
+    {
+        compact_timer_id = bs->tfd->set_timer_us(COMPACT_REFILL_US, false, [this](int timer_id)
+        {
+            compact_timer_id = -1;
+            bs->ringloop->wakeup();
+        });
+    }
+    return false;
+}
+
+void journal_flusher_t::charge_compaction(uint64_t bytes)
+{
+    // Tokens may go below zero, then the next compaction waits until the debt is repaid
+    if (compact_iops_limit)
+        compact_op_tokens--;
+    if (compact_bps_limit)
+        compact_byte_tokens -= bytes;
+}
+
+blockstore_compaction_stats_t journal_flusher_t::get_compaction_stats()
+{
+    blockstore_compaction_stats_t st;
+    st.queue_size = bs->heap->get_compact_queue_size();
+    st.future_queue_size = bs->heap->get_to_compact_count();
+    st.debt = bs->heap->get_buffer_area_used_space();
+    st.meta_nearfull_blocks = bs->heap->get_meta_nearfull_blocks();
+    st.garbage_entries = bs->heap->get_garbage_entries();
+    st.pressure = compact_pressure;
+    st.iops_limit = compact_iops_limit;
+    st.bps_limit = compact_bps_limit;
+    st.compacted_count = compacted_count;
+    st.compacted_bytes = compacted_bytes;
+    st.iops = compact_iops;
+    st.bps = compact_bps;
+    return st;
 }
 
 void journal_flusher_t::loop()
 {
+    update_compact_budget();
     target_flusher_count = bs->write_iodepth*2;
     if (target_flusher_count < min_flusher_count)
         target_flusher_count = min_flusher_count;
@@ -182,7 +312,7 @@ resume_0:
     wait_state = 0;
     wait_count = 0;
     cur_oid = {};
-    res = bs->heap->get_next_compact(cur_oid);
+    res = flusher->can_start_compaction() ? bs->heap->get_next_compact(cur_oid) : ENOENT;
     if ((bs->intent_write_counter >= bs->journal_trim_interval) && co_id == 0)
     {
         // Advance fsynced_lsn every <journal_trim_interval> intent writes
@@ -277,14 +407,17 @@ resume_1:
         goto resume_0;
     }
     flusher->active_flushers++;
+    copy_bytes = 0;
     for (i = 0; i < read_vec.size(); i++)
     {
         if ((read_vec[i].copy_flags & COPY_BUF_JOURNAL) &&
             !(read_vec[i].copy_flags & COPY_BUF_COALESCED))
         {
             copy_count++;
+            copy_bytes += read_vec[i].len;
         }
     }
+    flusher->charge_compaction(copy_bytes);
     if (copy_count > 0 && !bs->dsk.disable_data_fsync)
     {
         init_fsync_data();
@@ -417,7 +550,7 @@ resume_9:
             await_sqe(10);
             data->iov = (struct iovec){ read_vec[i].buf + (read_vec[i].copy_flags & COPY_BUF_PADDED
                 ? read_vec[i].offset - read_vec[i].disk_offset : 0), (size_t)read_vec[i].len };
-            data->callback = simple_callback_w;
+            data->set_callback(simple_callback_w, this);
             assert(clean_loc + read_vec[i].offset + data->iov.iov_len <= bs->dsk.block_count*bs->dsk.data_block_size);
             io_uring_prep_writev(sqe, bs->dsk.data_fd, &data->iov, 1, bs->dsk.data_offset + clean_loc + read_vec[i].offset);
             wait_count++;
@@ -481,6 +614,8 @@ resume_13:
     {
         printf("Compacted %jx:%jx l%ju (%d writes)\n", cur_oid.inode, cur_oid.stripe, compact_info.compact_lsn, copy_count);
     }
+    flusher->compacted_count++;
+    flusher->compacted_bytes += copy_bytes;
     flusher->active_flushers--;
     if (should_repeat)
     {
@@ -573,6 +708,10 @@ int journal_flusher_co::check_and_punch_checksums()
         return ENOENT;
     }
     bool csum_ok = true;
+    csum_ranges.clear();
+    csum_iovs.clear();
+    csum_range_vecs.clear();
+    csum_iovs.reserve(read_vec.size());
     for (int i = 0; i < read_vec.size(); i++)
     {
         auto & vec = read_vec[i];
@@ -582,19 +721,33 @@ int journal_flusher_co::check_and_punch_checksums()
                 + (vec.disk_offset/bs->dsk.csum_block_size)*(bs->dsk.data_csum_type & 0xFF)
                 - ((vec.wr->type() == BS_HEAP_BIG_WRITE || vec.wr->type() == BS_HEAP_BIG_INTENT)
                     ? 0 : (vec.wr->small().offset/bs->dsk.csum_block_size)*(bs->dsk.data_csum_type & 0xFF)));
-            bs->heap->calc_block_checksums(
-                csums, vec.buf, vec.wr->get_int_bitmap(bs->heap), vec.disk_offset, vec.disk_offset+vec.disk_len, false,
-                [&](uint32_t mismatch_pos, uint32_t expected_csum, uint32_t real_csum)
-                {
-                    printf("Checksum mismatch during compaction in object %jx:%jx v%ju, offset 0x%x in %s area at offset 0x%jx: got %08x, expected %08x\n",
-                        cur_oid.inode, cur_oid.stripe, vec.wr->version, mismatch_pos,
-                        (vec.copy_flags & COPY_BUF_JOURNAL ? "buffer" : "data"),
-                        vec.disk_loc+vec.disk_offset, real_csum, expected_csum);
-                    csum_ok = false;
-                }
-            );
+            assert(vec.disk_offset+vec.disk_len <= bs->dsk.data_block_size);
+            csum_iovs.push_back((struct iovec){ vec.buf, (size_t)vec.disk_len });
+            csum_ranges.push_back((heap_csum_range_t){
+                .block_csums = csums,
+                .bitmap = vec.wr->get_int_bitmap(bs->heap),
+                .start = (uint32_t)vec.disk_offset,
+                .end = (uint32_t)(vec.disk_offset+vec.disk_len),
+                .iov = &csum_iovs.back(),
+                .iovcnt = 1,
+            });
+            csum_range_vecs.push_back(i);
         }
     }
+    if (csum_ranges.size())
+    {
+        bs->heap->calc_block_checksums(csum_ranges.data(), csum_ranges.size(), false,
+            [&](int range_idx, uint32_t mismatch_pos, uint32_t expected_csum, uint32_t real_csum)
+            {
+                auto & vec = read_vec[csum_range_vecs[range_idx]];
+                printf("Checksum mismatch during compaction in object %jx:%jx v%ju, offset 0x%x in %s area at offset 0x%jx: got %08x, expected %08x\n",
+                    cur_oid.inode, cur_oid.stripe, vec.wr->version, mismatch_pos,
+                    (vec.copy_flags & COPY_BUF_JOURNAL ? "buffer" : "data"),
+                    vec.disk_loc+vec.disk_offset, real_csum, expected_csum);
+                csum_ok = false;
+            }
+        );
+    }
     if (!csum_ok)
     {
         // Checksum error, abort compaction
@@ -642,39 +795,39 @@ bool journal_flusher_co::calc_block_checksums()
     }
     memcpy(new_csums, compact_info.clean_wr->get_checksums(bs->heap), bs->dsk.data_block_size/bs->dsk.csum_block_size * (bs->dsk.data_csum_type & 0xFF));
     // Update block checksums
+    csum_ranges.clear();
+    csum_iovs.clear();
+    csum_iovs.reserve(read_vec.size());
     size_t i = 0;
     while (i < read_vec.size() && !(read_vec[i].copy_flags & COPY_BUF_CSUM_FILL))
     {
         uint32_t start = read_vec[i].offset;
-        uint32_t end = read_vec[i].offset+read_vec[i].len;
-        i++;
-        while (i < read_vec.size() && !(read_vec[i].copy_flags & COPY_BUF_CSUM_FILL) &&
-            read_vec[i].offset == end)
+        uint32_t end = start;
+        size_t iov_start = csum_iovs.size();
+        // `read_vec` should contain aligned items, possibly split into pieces
+        do
         {
-            end = read_vec[i].offset+read_vec[i].len;
+            auto & vec = read_vec[i];
+            csum_iovs.push_back((struct iovec){ vec.buf + vec.offset-vec.disk_offset, (size_t)vec.len });
+            end = vec.offset+vec.len;
             i++;
-        }
-        // `read_vec` should contain aligned items, possibly split into pieces
+        } while (i < read_vec.size() && !(read_vec[i].copy_flags & COPY_BUF_CSUM_FILL) &&
+            read_vec[i].offset == end);
         assert(!(start % bs->dsk.csum_block_size));
         assert(!(end % bs->dsk.csum_block_size));
         uint32_t csum_off = start/bs->dsk.csum_block_size * (bs->dsk.data_csum_type & 0xFF);
-        bs->heap->calc_block_checksums(
-            (uint32_t*)(new_csums+csum_off), new_bmp, start, end,
-            [&](uint32_t start, uint32_t & len)
-            {
-                // O(n^2) search, may be fixed later :-p
-                for (size_t i = 0; i < read_vec.size(); i++)
-                {
-                    assert(read_vec[i].offset <= start);
-                    if (read_vec[i].offset+read_vec[i].len > start)
-                    {
-                        len = read_vec[i].offset+read_vec[i].len-start;
-                        return read_vec[i].buf + start-read_vec[i].disk_offset;
-                    }
-                }
-                return (uint8_t*)NULL;
-            }, true, NULL
-        );
+        csum_ranges.push_back((heap_csum_range_t){
+            .block_csums = (uint32_t*)(new_csums+csum_off),
+            .bitmap = new_bmp,
+            .start = start,
+            .end = end,
+            .iov = csum_iovs.data()+iov_start,
+            .iovcnt = (int)(csum_iovs.size()-iov_start),
+        });
+    }
+    if (csum_ranges.size())
+    {
+        bs->heap->calc_block_checksums(csum_ranges.data(), csum_ranges.size(), true, NULL);
     }
     return true;
 }
@@ -730,7 +883,7 @@ bool journal_flusher_co::read_buffered(int wait_base)
                 &data->iov, 1,
                 ((vec.copy_flags & COPY_BUF_JOURNAL) ? bs->dsk.journal_offset : bs->dsk.data_offset) + vec.disk_loc + vec.disk_offset
             );
-            data->callback = simple_callback_r;
+            data->set_callback(simple_callback_r, this);
         }
     }
     // Wait for reads/writes if the journal is not inmemory
@@ -775,7 +928,7 @@ resume_0:
         // Sync batch is ready. Do it.
         await_sqe(1);
         data->iov = { 0 };
-        data->callback = simple_callback_w;
+        data->set_callback(simple_callback_w, this);
         io_uring_prep_fsync(sqe, bs->dsk.data_fd, IORING_FSYNC_DATASYNC);
         cur_sync->sent = true;
         wait_count++;
@@ -823,7 +976,7 @@ resume_0:
     // Sync batch is ready. Do it.
     await_sqe(1);
     data->iov = { 0 };
-    data->callback = simple_callback_w;
+    data->set_callback(simple_callback_w, this);
     io_uring_prep_fsync(sqe, bs->dsk.meta_fd, IORING_FSYNC_DATASYNC);
     wait_count++;
 resume_2:
@@ -889,7 +1042,7 @@ bool journal_flusher_co::trim_lsn(int wait_base)
     ((blockstore_meta_header_v3_t*)bs->meta_superblock)->set_crc32c();
     await_sqe(0);
     data->iov = (struct iovec){ bs->meta_superblock, (size_t)bs->dsk.meta_block_size };
-    data->callback = simple_callback_w;
+    data->set_callback(simple_callback_w, this);
     io_uring_prep_writev(sqe, bs->dsk.meta_fd, &data->iov, 1, bs->dsk.meta_offset);
     // Update superblock with datasync
     sqe->rw_flags = RWF_DSYNC;
@@ -50,7 +50,8 @@ class journal_flusher_co
     uint8_t *punch_bmp = NULL;
     uint8_t *new_ext_bmp = NULL;
 
-    std::function<void(ring_data_t*)> simple_callback_r, simple_callback_w;
+    static void simple_callback_r(void *co, void *unused, ring_data_t* data);
+    static void simple_callback_w(void *co, void *unused, ring_data_t* data);
 
     object_id cur_oid;
     heap_entry_t *cur_obj;
@@ -63,10 +64,14 @@ class journal_flusher_co
 
     std::vector<copy_buffer_t> read_vec;
     std::vector<heap_entry_t*> csum_copy;
+    std::vector<heap_csum_range_t> csum_ranges;
+    std::vector<iovec> csum_iovs;
+    std::vector<int> csum_range_vecs;
     uint32_t overwrite_start, overwrite_end;
     int i, res;
     bool read_to_fill_incomplete;
     int copy_count;
+    uint64_t copy_bytes;
     std::list<flusher_data_sync_t>::iterator cur_sync;
 
     friend class journal_flusher_t;
@@ -105,6 +110,23 @@ class journal_flusher_t
     bool fsyncing_meta = false;
     int syncing_buffer = 0;
 
+    // Compaction scheduler: limits compaction to compaction_target_iops/mbs while clients
+    // are active, raises the limit when space runs out and lifts it when clients are idle
+    int compact_pressure = BS_COMPACT_IDLE;
+    uint64_t compact_iops_limit = 0, compact_bps_limit = 0;
+    double compact_op_tokens = 0, compact_byte_tokens = 0;
+    timespec compact_refill_ts = {};
+    uint64_t prev_client_op_count = 0;
+    int compact_timer_id = -1;
+    uint64_t compacted_count = 0, compacted_bytes = 0;
+    timespec compact_stat_ts = {};
+    uint64_t stat_compacted_count = 0, stat_compacted_bytes = 0;
+    uint64_t compact_iops = 0, compact_bps = 0;
+
+    void update_compact_budget();
+    bool can_start_compaction();
+    void charge_compaction(uint64_t bytes);
+
 public:
     journal_flusher_t(blockstore_impl_t *bs);
     ~journal_flusher_t();
@@ -114,4 +136,5 @@ public:
     void request_trim();
     void release_trim();
     void dump_diagnostics();
+    blockstore_compaction_stats_t get_compaction_stats();
 };
@@ -13,6 +13,7 @@
 #include "../util/allocator.h"
 #include "../util/crc32c.h"
 #include "../util/malloc_or_die.h"
+#include "../util/worker_pool.h"
 
 #define BS_HEAP_FREE_MVCC 1
 #define BS_HEAP_FREE_MAIN 2
@@ -29,16 +30,17 @@
 #define IMAP_MALLOC_LOW_BITS ((size_t)0x0F)
 #define IMAP_MAX_LOW 16
 #define POSTPONE_INSERT_COUNT 10
+#define HEAP_LOAD_BATCH_SIZE 1048576
 
 #define list_item_overhead(a) (((a) + sizeof(heap_list_item_t) - sizeof(heap_entry_t) + sizeof(void*) + 15) & ~15)
 
-void inode_map_put(void* & inode_idx, heap_list_item_t* li);
+void inode_map_put(uint64_t & mem, void* & inode_idx, heap_list_item_t* li);
 void inode_map_get(void *inode_idx, heap_inode_map_t::iterator & li_it, heap_list_item_t* & li, uint64_t stripe);
-void inode_map_free(void* inode_idx);
+void inode_map_free(uint64_t & mem, void* inode_idx);
 bool inode_map_is_big(void* & inode_idx);
 void inode_map_iterate(void* & inode_idx, std::function<void(heap_list_item_t*)> cb);
 void inode_map_replace(void* & inode_idx, const heap_inode_map_t::iterator & li_it, heap_list_item_t* new_li);
-void inode_map_erase(robin_hood::unordered_flat_map<inode_t, void*, i64hash_t> & pg_idx, void* & inode_idx,
+void inode_map_erase(uint64_t & mem, robin_hood::unordered_flat_map<inode_t, void*, i64hash_t> & pg_idx, void* & inode_idx,
     const heap_inode_map_t::iterator & li_it, heap_list_item_t* li);
 
 static inline heap_list_item_t *list_item(heap_entry_t *wr)
@@ -260,7 +262,7 @@ blockstore_heap_t::~blockstore_heap_t()
     {
         for (auto & ip: pgp.second)
         {
-            inode_map_free(ip.second);
+            inode_map_free(index_memory, ip.second);
         }
     }
     for (auto & inflight: inflight_lsn)
@@ -279,6 +281,11 @@ blockstore_heap_t::~blockstore_heap_t()
     }
     block_info.clear();
     object_mvcc.clear();
+    if (load_pool)
+    {
+        delete load_pool;
+        load_pool = NULL;
+    }
     delete meta_alloc;
     delete data_alloc;
     delete buffer_alloc;
@@ -289,9 +296,37 @@ void blockstore_heap_t::start_load(uint64_t completed_lsn)
     this->completed_lsn = completed_lsn;
 }
 
+void blockstore_heap_t::set_load_threads(int threads, uint64_t batch_size)
+{
+    load_threads = threads < 1 ? 1 : threads;
+    load_batch_size = batch_size ? batch_size : HEAP_LOAD_BATCH_SIZE;
+    if (load_pool)
+    {
+        delete load_pool;
+        load_pool = NULL;
+    }
+    if (load_threads > 1)
+    {
+        // The calling thread is also used, and the pool is stopped after finish_load()
+        load_pool = new worker_pool_t(load_threads-1, NULL);
+    }
+}
+
 int blockstore_heap_t::read_blocks(uint64_t disk_offset, uint64_t disk_size, uint8_t *buf, bool allow_corrupted,
     std::function<void(uint32_t block_num, heap_entry_t* wr)> handle_write,
     std::function<void(uint32_t, uint32_t, uint8_t*)> handle_block)
+{
+    std::vector<uint32_t> corrupted_blocks;
+    int res = parse_blocks(disk_offset, disk_size, buf, allow_corrupted, corrupted_blocks, handle_write, handle_block);
+    recheck_modified_blocks.insert(corrupted_blocks.begin(), corrupted_blocks.end());
+    return res;
+}
+
+// Only touches <buf> and <corrupted_blocks>, so it may be called from multiple threads for different blocks
+int blockstore_heap_t::parse_blocks(uint64_t disk_offset, uint64_t disk_size, uint8_t *buf, bool allow_corrupted,
+    std::vector<uint32_t> & corrupted_blocks,
+    const std::function<void(uint32_t block_num, heap_entry_t* wr)> & handle_write,
+    const std::function<void(uint32_t, uint32_t, uint8_t*)> & handle_block)
 {
     for (uint64_t buf_offset = 0; buf_offset < disk_size; buf_offset += dsk->meta_block_size)
     {
@@ -310,7 +345,7 @@ corrupted_block:
                 if (allow_corrupted)
                 {
                     fprintf(stderr, "Metadata block is corrupted, skipping\n");
-                    recheck_modified_blocks.insert(block_num);
+                    corrupted_blocks.push_back(block_num);
                     break;
                 }
                 else
@@ -354,7 +389,7 @@ corrupted_object:
                 if (allow_corrupted)
                 {
                     fprintf(stderr, "Entry is corrupted, skipping\n");
-                    recheck_modified_blocks.insert(block_num);
+                    corrupted_blocks.push_back(block_num);
                     block_offset += wr->size;
                     continue;
                 }
@@ -427,6 +462,10 @@ corrupted_object:
 int blockstore_heap_t::load_blocks(uint64_t disk_offset, uint64_t size, uint8_t *buf, bool allow_corrupted, uint64_t &entries_loaded)
 {
     entries_loaded = 0;
+    if (load_pool && size > dsk->meta_block_size)
+    {
+        return load_blocks_parallel(disk_offset, size, buf, allow_corrupted, entries_loaded);
+    }
     return read_blocks(disk_offset, size, buf, allow_corrupted, [&](uint32_t block_num, heap_entry_t *wr_orig)
     {
         auto alloc_size = wr_orig->size + sizeof(heap_list_item_t) - sizeof(heap_entry_t);
@@ -455,6 +494,117 @@ int blockstore_heap_t::load_blocks(uint64_t disk_offset, uint64_t size, uint8_t
     });
 }
 
+struct heap_load_block_t
+{
+    uint32_t block_num;
+    uint32_t entry_count;
+    uint32_t used_space;
+};
+
+struct heap_load_shard_t
+{
+    std::vector<heap_list_item_t*> items;
+    std::vector<heap_load_block_t> blocks;
+    std::vector<uint32_t> corrupted_blocks;
+    uint64_t max_lsn = 0;
+    uint64_t memory = 0;
+    int res = 0;
+};
+
+// Parse and check blocks in load_threads threads, then add entries to block_info in the calling thread.
+// Entries are not indexed here, they're all indexed in parallel in finish_load()
+int blockstore_heap_t::load_blocks_parallel(uint64_t disk_offset, uint64_t size, uint8_t *buf, bool allow_corrupted, uint64_t &entries_loaded)
+{
+    uint64_t block_count = (size + dsk->meta_block_size - 1) / dsk->meta_block_size;
+    int thread_count = block_count < load_threads ? block_count : load_threads;
+    uint64_t thread_size = (block_count + thread_count - 1) / thread_count * dsk->meta_block_size;
+    std::vector<heap_load_shard_t> shards(thread_count);
+    load_pool->run_parallel(thread_count, [&](int t)
+    {
+        auto & sh = shards[t];
+        uint64_t start = t*thread_size;
+        uint64_t end = start+thread_size < size ? start+thread_size : size;
+        if (start >= end)
+        {
+            return;
+        }
+        uint32_t block_used = 0;
+        size_t block_first = 0;
+        sh.items.reserve((end-start) / get_big_entry_size());
+        sh.res = parse_blocks(disk_offset+start, end-start, buf+start, allow_corrupted, sh.corrupted_blocks,
+            [&](uint32_t block_num, heap_entry_t *wr_orig)
+        {
+            auto alloc_size = wr_orig->size + sizeof(heap_list_item_t) - sizeof(heap_entry_t);
+            heap_list_item_t *li = (heap_list_item_t*)malloc_or_die(alloc_size);
+            li->block_num = block_num;
+            li->prev = li->next = NULL;
+            memcpy(&li->entry, wr_orig, wr_orig->size);
+            if (wr_orig->lsn > sh.max_lsn)
+            {
+                sh.max_lsn = wr_orig->lsn;
+            }
+            sh.memory += list_item_overhead(wr_orig->size);
+            block_used += wr_orig->size;
+            sh.items.push_back(li);
+        }, [&](uint32_t block_num, uint32_t last_offset, uint8_t *buf)
+        {
+            sh.blocks.push_back((heap_load_block_t){
+                .block_num = block_num,
+                .entry_count = (uint32_t)(sh.items.size()-block_first),
+                .used_space = block_used,
+            });
+            block_first = sh.items.size();
+            block_used = 0;
+        });
+    });
+    int res = 0;
+    for (auto & sh: shards)
+    {
+        if (sh.res != 0)
+        {
+            res = sh.res;
+        }
+    }
+    if (res != 0)
+    {
+        for (auto & sh: shards)
+        {
+            for (auto li: sh.items)
+            {
+                free(li);
+            }
+        }
+        return res;
+    }
+    for (auto & sh: shards)
+    {
+        recheck_modified_blocks.insert(sh.corrupted_blocks.begin(), sh.corrupted_blocks.end());
+        auto li_it = sh.items.begin();
+        for (auto & blk: sh.blocks)
+        {
+            if (!blk.entry_count)
+            {
+                continue;
+            }
+            modify_alloc(blk.block_num, [&](heap_block_info_t & inf)
+            {
+                inf.entries.insert(inf.entries.end(), li_it, li_it+blk.entry_count);
+                inf.used_space += blk.used_space;
+            });
+            li_it += blk.entry_count;
+        }
+        postponed_items.insert(postponed_items.end(), sh.items.begin(), sh.items.end());
+        live_entries += sh.items.size();
+        live_memory += sh.memory;
+        entries_loaded += sh.items.size();
+        if (sh.max_lsn > next_lsn)
+        {
+            next_lsn = sh.max_lsn;
+        }
+    }
+    return 0;
+}
+
 // Validate object entry sequence
 bool blockstore_heap_t::validate_object(heap_entry_t *obj)
 {
@@ -546,17 +696,29 @@ bool blockstore_heap_t::validate_object(heap_entry_t *obj)
     return true;
 }
 
+// object ASC, lsn DESC
+static bool postponed_item_less(const heap_list_item_t* a, const heap_list_item_t* b)
+{
+    return a->entry.inode < b->entry.inode || a->entry.inode == b->entry.inode &&
+        (a->entry.stripe < b->entry.stripe || a->entry.stripe == b->entry.stripe &&
+            b->entry.is_before(&a->entry));
+}
+
 void blockstore_heap_t::finish_load()
 {
+    if (postponed_items.size() && load_pool && block_index.empty())
+    {
+        index_postponed_parallel();
+    }
+    if (load_pool)
+    {
+        delete load_pool;
+        load_pool = NULL;
+    }
     if (postponed_items.size())
     {
         // Sort "postponed" items and load in batches
-        std::sort(postponed_items.begin(), postponed_items.end(), [this](const heap_list_item_t* a, const heap_list_item_t* b)
-        {
-            return a->entry.inode < b->entry.inode || a->entry.inode == b->entry.inode &&
-                (a->entry.stripe < b->entry.stripe || a->entry.stripe == b->entry.stripe &&
-                    !a->entry.is_before(&b->entry)); // object ASC, lsn DESC
-        });
+        std::sort(postponed_items.begin(), postponed_items.end(), postponed_item_less);
         size_t s = 0, e, n = postponed_items.size();
         for (e = 1; e <= n; e++)
         {
@@ -571,6 +733,137 @@ void blockstore_heap_t::finish_load()
     }
 }
 
+// Sort key of a loaded item: object ASC, lsn DESC, overwrite first. Kept separately from the item
+// so that sorting doesn't dereference item pointers
+struct heap_load_key_t
+{
+    inode_t inode;
+    uint64_t stripe;
+    uint64_t neg_lsn;
+    // item pointer | 1 if the entry isn't an overwrite
+    uintptr_t li_bits;
+
+    inline heap_list_item_t *li() const
+    {
+        return (heap_list_item_t*)(li_bits & ~(uintptr_t)1);
+    }
+
+    inline bool operator<(const heap_load_key_t & b) const
+    {
+        return inode < b.inode || inode == b.inode && (stripe < b.stripe || stripe == b.stripe &&
+            (neg_lsn < b.neg_lsn || neg_lsn == b.neg_lsn && (li_bits & 1) < (b.li_bits & 1)));
+    }
+};
+
+// Index all loaded items when the index is empty, i.e. when all of them are loaded by load_blocks_parallel().
+// Items are distributed between threads and batches by PG and inode, so every inode index is built by a single
+// thread, and sort keys are only created for one batch at a time
+void blockstore_heap_t::index_postponed_parallel()
+{
+    const int thread_count = load_threads;
+    const int batch_count = (postponed_items.size() + load_batch_size - 1) / load_batch_size;
+    const int bucket_count = thread_count*batch_count;
+    // Partition items
+    std::vector<std::vector<std::vector<heap_list_item_t*>>> parts(thread_count);
+    size_t per_thread = (postponed_items.size() + thread_count - 1) / thread_count;
+    load_pool->run_parallel(thread_count, [&](int t)
+    {
+        parts[t].resize(bucket_count);
+        size_t end = (t+1)*per_thread < postponed_items.size() ? (t+1)*per_thread : postponed_items.size();
+        for (size_t i = t*per_thread; i < end; i++)
+        {
+            auto li = postponed_items[i];
+            uint64_t pg_id = get_pg_id(li->entry.inode, li->entry.stripe);
+            parts[t][robin_hood::hash_int(li->entry.inode*31 + pg_id) % bucket_count].push_back(li);
+        }
+    });
+    std::vector<heap_list_item_t*>().swap(postponed_items);
+    std::vector<std::vector<heap_load_key_t>> shards(thread_count);
+    std::vector<std::vector<std::pair<uint64_t, inode_t>>> shard_inodes(thread_count);
+    std::vector<uint64_t> shard_memory(thread_count);
+    for (int batch = 0; batch < batch_count; batch++)
+    {
+        // Sort each shard and collect its (pg, inode) pairs
+        load_pool->run_parallel(thread_count, [&](int t)
+        {
+            auto & v = shards[t];
+            int bucket = batch*thread_count + t;
+            size_t total = 0;
+            for (int i = 0; i < thread_count; i++)
+                total += parts[i][bucket].size();
+            v.reserve(total);
+            for (int i = 0; i < thread_count; i++)
+            {
+                for (auto li: parts[i][bucket])
+                {
+                    v.push_back((heap_load_key_t){
+                        .inode = li->entry.inode,
+                        .stripe = li->entry.stripe,
+                        .neg_lsn = ~li->entry.lsn,
+                        .li_bits = (uintptr_t)li | (li->entry.is_overwrite() ? 0 : 1),
+                    });
+                }
+                std::vector<heap_list_item_t*>().swap(parts[i][bucket]);
+            }
+            std::sort(v.begin(), v.end());
+            auto & keys = shard_inodes[t];
+            for (size_t i = 0; i < v.size(); i++)
+            {
+                std::pair<uint64_t, inode_t> key(get_pg_id(v[i].inode, v[i].stripe), v[i].inode);
+                if (!keys.size() || keys.back() != key)
+                    keys.push_back(key);
+            }
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        });
+        // Create inode indexes in advance, so that worker threads don't modify block_index structure
+        for (auto & keys: shard_inodes)
+        {
+            for (auto & key: keys)
+            {
+                block_index[key.first][key.second] = NULL;
+            }
+            keys.clear();
+        }
+        // Link object entry lists and add them to inode indexes
+        load_pool->run_parallel(thread_count, [&](int t)
+        {
+            auto & v = shards[t];
+            void **inode_idx = NULL;
+            uint64_t cur_pg_id = 0, mem = 0;
+            inode_t cur_inode = 0;
+            size_t s = 0, e, n = v.size();
+            for (e = 1; e <= n; e++)
+            {
+                if (e >= n || v[e].inode != v[s].inode || v[e].stripe != v[s].stripe)
+                {
+                    for (size_t i = s; i < e; i++)
+                    {
+                        auto li = v[i].li();
+                        li->next = i > s ? v[i-1].li() : NULL;
+                        li->prev = i < e-1 ? v[i+1].li() : NULL;
+                    }
+                    uint64_t pg_id = get_pg_id(v[s].inode, v[s].stripe);
+                    if (!inode_idx || pg_id != cur_pg_id || v[s].inode != cur_inode)
+                    {
+                        cur_pg_id = pg_id;
+                        cur_inode = v[s].inode;
+                        inode_idx = &block_index.find(cur_pg_id)->second.find(cur_inode)->second;
+                    }
+                    inode_map_put(mem, *inode_idx, v[s].li());
+                    s = e;
+                }
+            }
+            shard_memory[t] += mem;
+            v.clear();
+        });
+    }
+    for (auto mem: shard_memory)
+    {
+        index_memory += mem;
+    }
+}
+
 void blockstore_heap_t::fill_recheck_queue()
 {
     for (auto & pgp: block_index)
@@ -1097,85 +1390,171 @@ bool blockstore_heap_t::calc_checksums(heap_entry_t *wr, uint8_t *data, bool set
 bool blockstore_heap_t::calc_block_checksums(uint32_t *block_csums, uint8_t *data, uint8_t *bitmap, uint32_t start, uint32_t end,
     bool set, std::function<void(uint32_t, uint32_t, uint32_t)> bad_block_cb)
 {
-    return calc_block_checksums(block_csums, bitmap, start, end, [&](uint32_t pos, uint32_t & len)
+    struct iovec iov = { data, (size_t)(end-start) };
+    heap_csum_range_t range = {
+        .block_csums = block_csums,
+        .bitmap = bitmap,
+        .start = start,
+        .end = end,
+        .iov = &iov,
+        .iovcnt = 1,
+    };
+    if (!bad_block_cb)
+        return calc_block_checksums(&range, 1, set, NULL);
+    return calc_block_checksums(&range, 1, set, [&](int range_idx, uint32_t pos, uint32_t expected, uint32_t real)
     {
-        len = UINT32_MAX;
-        return data+pos-start;
-    }, set, bad_block_cb);
+        bad_block_cb(pos, expected, real);
+    });
 }
 
-static uint32_t crc32c_iter(uint32_t prev_crc, const std::function<uint8_t*(uint32_t start, uint32_t & len)> & next, uint32_t pos, uint32_t size)
+static bool bitmap_full(uint8_t *bitmap, uint32_t start, uint32_t len, uint32_t bitmap_granularity)
 {
-    uint32_t cur_len = 0;
-    while (size > 0)
+    for (uint32_t bit = start/bitmap_granularity, bit_end = (start+len)/bitmap_granularity; bit < bit_end; bit++)
     {
-        uint8_t *data = next(pos, cur_len);
-        assert(data);
-        cur_len = (cur_len < size ? cur_len : size);
-        prev_crc = crc32c(prev_crc, data, cur_len);
-        pos += cur_len;
-        size -= cur_len;
+        if (!(bitmap[bit/8] & (1 << (bit%8))))
+            return false;
     }
-    return prev_crc;
+    return true;
 }
 
-bool blockstore_heap_t::calc_block_checksums(uint32_t *block_csums, uint8_t *bitmap,
-    uint32_t start, uint32_t end, std::function<uint8_t*(uint32_t start, uint32_t & len)> next,
-    bool set, std::function<void(uint32_t, uint32_t, uint32_t)> bad_block_cb)
+// Full checksum blocks are collected and checksummed in batches of this size
+#define HEAP_CSUM_BATCH 64
+
+bool blockstore_heap_t::calc_block_checksums(heap_csum_range_t *ranges, int count, bool set,
+    const std::function<void(int, uint32_t, uint32_t, uint32_t)> & bad_block_cb)
 {
+    const uint32_t csum_block_size = dsk->csum_block_size;
+    const uint8_t *batch_bufs[HEAP_CSUM_BATCH];
+    uint32_t batch_crcs[HEAP_CSUM_BATCH];
+    uint32_t *batch_csums[HEAP_CSUM_BATCH];
+    int batch_ranges[HEAP_CSUM_BATCH];
+    uint32_t batch_pos[HEAP_CSUM_BATCH];
+    int batch_size = 0;
     bool res = true;
-    uint32_t pos = start;
-    uint32_t block_end = (start/dsk->csum_block_size + 1)*dsk->csum_block_size;
-    uint32_t block_crc = 0;
-    bool isset = false;
-    while (pos < end)
+    // returns false if the calculation should be stopped
+    auto check_block = [&](int range_idx, uint32_t pos, uint32_t *block_csum, uint32_t block_crc)
     {
-        uint32_t blk_start = pos;
-        if (bitmap)
-        {
-            uint32_t prev = pos;
-            while (pos < end && pos < block_end)
-            {
-                while (pos < end && pos < block_end && !(bitmap[pos/dsk->bitmap_granularity/8] & (1 << ((pos/dsk->bitmap_granularity) % 8))))
-                    pos += dsk->bitmap_granularity;
-                // zero padding at the beginning or at the end of the block is not counted
-                if (pos > prev && prev > 0 && pos < block_end)
-                    block_crc = crc32c_pad(block_crc, NULL, 0, pos-prev, 0);
-                prev = pos;
-                while (pos < end && pos < block_end && (bitmap[pos/dsk->bitmap_granularity/8] & (1 << ((pos/dsk->bitmap_granularity) % 8))))
-                    pos += dsk->bitmap_granularity;
-                if (pos > prev)
-                {
-                    isset = true;
-                    block_crc = crc32c_iter(block_crc, next, prev, pos-prev);
-                }
-                prev = pos;
-            }
-        }
-        else
+        if (set)
+            *block_csum = block_crc;
+        else if (block_crc != *block_csum)
         {
-            block_crc = crc32c_iter(block_crc, next, pos, (end > block_end ? block_end : end)-pos);
-            pos = (end > block_end ? block_end : end);
-            isset = true;
+            res = false;
+            if (!bad_block_cb)
+                return false;
+            bad_block_cb(range_idx, pos, *block_csum, block_crc);
         }
-        if (set)
+        return true;
+    };
+    auto flush_batch = [&]()
+    {
+        memset(batch_crcs, 0, sizeof(uint32_t)*batch_size);
+        crc32c_multi(batch_crcs, batch_bufs, batch_size, csum_block_size);
+        int n = batch_size;
+        batch_size = 0;
+        for (int i = 0; i < n; i++)
         {
-            *block_csums = block_crc;
+            if (!check_block(batch_ranges[i], batch_pos[i], batch_csums[i], batch_crcs[i]))
+                return false;
         }
-        else if (isset && block_crc != *block_csums)
+        return true;
+    };
+    for (int r = 0; r < count; r++)
+    {
+        const heap_csum_range_t & range = ranges[r];
+        int iov_idx = 0;
+        uint32_t iov_start = range.start;
+        // returns data at <pos> and the length of contiguous data available there
+        auto seek = [&](uint32_t pos, uint32_t & avail)
         {
-            if (bad_block_cb)
+            while (iov_idx < range.iovcnt && pos >= iov_start + range.iov[iov_idx].iov_len)
             {
-                bad_block_cb(blk_start, *block_csums, block_crc);
-                res = false;
+                iov_start += range.iov[iov_idx].iov_len;
+                iov_idx++;
+            }
+            assert(iov_idx < range.iovcnt);
+            avail = iov_start + range.iov[iov_idx].iov_len - pos;
+            return (uint8_t*)range.iov[iov_idx].iov_base + pos - iov_start;
+        };
+        auto crc32c_range = [&](uint32_t crc, uint32_t pos, uint32_t size)
+        {
+            while (size > 0)
+            {
+                uint32_t avail = 0;
+                uint8_t *data = seek(pos, avail);
+                avail = (avail < size ? avail : size);
+                crc = crc32c(crc, data, avail);
+                pos += avail;
+                size -= avail;
+            }
+            return crc;
+        };
+        uint32_t *block_csums = range.block_csums;
+        uint32_t pos = range.start;
+        uint32_t block_end = (range.start/csum_block_size + 1)*csum_block_size;
+        bool isset = false;
+        while (pos < range.end)
+        {
+            uint32_t blk_start = pos;
+            if (!(pos % csum_block_size) && block_end <= range.end &&
+                (!range.bitmap || bitmap_full(range.bitmap, pos, csum_block_size, dsk->bitmap_granularity)))
+            {
+                // Full block, add it to the batch if it's contiguous in memory
+                uint32_t avail = 0;
+                uint8_t *data = seek(pos, avail);
+                if (avail >= csum_block_size)
+                {
+                    batch_bufs[batch_size] = data;
+                    batch_csums[batch_size] = block_csums;
+                    batch_ranges[batch_size] = r;
+                    batch_pos[batch_size] = pos;
+                    batch_size++;
+                    isset = true;
+                    if (batch_size >= HEAP_CSUM_BATCH && !flush_batch())
+                        return false;
+                    pos = block_end;
+                    block_end += csum_block_size;
+                    block_csums++;
+                    continue;
+                }
+            }
+            uint32_t block_crc = 0;
+            if (range.bitmap)
+            {
+                uint8_t *bitmap = range.bitmap;
+                uint32_t prev = pos;
+                while (pos < range.end && pos < block_end)
+                {
+                    while (pos < range.end && pos < block_end && !(bitmap[pos/dsk->bitmap_granularity/8] & (1 << ((pos/dsk->bitmap_granularity) % 8))))
+                        pos += dsk->bitmap_granularity;
+                    // zero padding at the beginning or at the end of the block is not counted
+                    if (pos > prev && prev > 0 && pos < block_end)
+                        block_crc = crc32c_pad(block_crc, NULL, 0, pos-prev, 0);
+                    prev = pos;
+                    while (pos < range.end && pos < block_end && (bitmap[pos/dsk->bitmap_granularity/8] & (1 << ((pos/dsk->bitmap_granularity) % 8))))
+                        pos += dsk->bitmap_granularity;
+                    if (pos > prev)
+                    {
+                        isset = true;
+                        block_crc = crc32c_range(block_crc, prev, pos-prev);
+                    }
+                    prev = pos;
+                }
             }
             else
+            {
+                uint32_t blk_end = (range.end > block_end ? block_end : range.end);
+                block_crc = crc32c_range(block_crc, pos, blk_end-pos);
+                pos = blk_end;
+                isset = true;
+            }
+            if ((set || isset) && !check_block(r, blk_start, block_csums, block_crc))
                 return false;
+            block_end += csum_block_size;
+            block_csums++;
         }
-        block_end += dsk->csum_block_size;
-        block_crc = 0;
-        block_csums++;
     }
+    if (batch_size > 0 && !flush_batch())
+        return false;
     return res;
 }
 
@@ -1193,6 +1572,7 @@ struct heap_reshard_state_t
     robin_hood::unordered_flat_map<inode_t, void*, i64hash_t>::iterator inode_it;
     heap_inode_map_t *stripe_map = NULL;
     heap_inode_map_t::iterator stripe_it;
+    uint64_t *index_memory = NULL;
 
     void add(heap_list_item_t *li);
     bool run(uint64_t chunk_limit);
@@ -1203,7 +1583,7 @@ void heap_reshard_state_t::add(heap_list_item_t *li)
     // like map_to_pg()
     uint64_t pg_num = (li->entry.stripe / pg_stripe_size) % pg_count + 1;
     uint64_t shard_id = (pool_id << (64-POOL_ID_BITS)) | pg_num;
-    inode_map_put(new_shards[shard_id][li->entry.inode], li);
+    inode_map_put(*index_memory, new_shards[shard_id][li->entry.inode], li);
     chunk_size++;
 }
 
@@ -1245,7 +1625,7 @@ resume_2:
                     add(*stripe_it);
                 }
             }
-            inode_map_free(inode_it->second);
+            inode_map_free(*index_memory, inode_it->second);
         }
     }
     return true;
@@ -1263,6 +1643,7 @@ void* blockstore_heap_t::reshard_start(pool_id_t pool, uint32_t pg_count, uint32
     st->pg_count = pg_count;
     st->pg_stripe_size = pg_stripe_size;
     st->old_pg_count = !pool_settings.pg_count ? 1 : pool_settings.pg_count;
+    st->index_memory = &index_memory;
     for (uint32_t pg_num = 0; pg_num <= st->old_pg_count; pg_num++)
     {
         auto sh_it = block_index.find((st->pool_id << (64-POOL_ID_BITS)) | pg_num);
@@ -1498,7 +1879,7 @@ void blockstore_heap_t::insert_list_items(heap_list_item_t** v, size_t count, bo
             if (old_head)
                 inode_map_replace(inode_idx, li_it, li);
             else
-                inode_map_put(inode_idx, li);
+                inode_map_put(index_memory, inode_idx, li);
         }
         // Insert <li> between <next_li> and <prev_li>
         li->next = next_li;
@@ -2436,7 +2817,7 @@ uint64_t blockstore_heap_t::get_live_entries()
 
 uint64_t blockstore_heap_t::get_live_memory()
 {
-    return live_memory-garbage_memory;
+    return live_memory-garbage_memory+index_memory;
 }
 
 uint64_t blockstore_heap_t::get_garbage_entries()
@@ -2572,7 +2953,7 @@ void blockstore_heap_t::unlink_list_item(heap_list_item_t *li)
         heap_list_item_t *old_li = NULL;
         inode_map_get(inode_idx, li_it, old_li, wr->stripe);
         if (!prev)
-            inode_map_erase(pg_idx, inode_idx, li_it, old_li);
+            inode_map_erase(index_memory, pg_idx, inode_idx, li_it, old_li);
         else
             inode_map_replace(inode_idx, li_it, prev);
     }
@@ -2667,6 +3048,13 @@ void blockstore_heap_t::recalc_inode_space_stats(uint64_t pool_id, bool per_inod
 // - 4 lower bits equal to 2-15 mean that the stored void* is an array of heap_list_item_t** of that size (some of them possibly zero).
 // This is some really crazy shit but it seems to work well :)
 // At the same time it has almost zero overhead and works just as fast for fat inodes.
+// Memory used by the maps is tracked in <mem> (blockstore_heap_t::index_memory).
+
+static inline uint64_t imap_memory(heap_inode_map_t *imap)
+{
+    // robin_hood keeps a pointer and an info byte per slot
+    return sizeof(heap_inode_map_t) + (imap->mask()+1)*(sizeof(heap_list_item_t*)+1);
+}
 
 void inode_map_get(void *inode_idx, heap_inode_map_t::iterator & li_it, heap_list_item_t* & li, uint64_t stripe)
 {
@@ -2698,15 +3086,17 @@ void inode_map_get(void *inode_idx, heap_inode_map_t::iterator & li_it, heap_lis
     }
 }
 
-void inode_map_free(void* inode_idx)
+void inode_map_free(uint64_t & mem, void* inode_idx)
 {
     size_t n = ((size_t)inode_idx & IMAP_MALLOC_LOW_BITS);
     if (!n)
     {
+        mem -= imap_memory((heap_inode_map_t*)inode_idx);
         delete (heap_inode_map_t*)inode_idx;
     }
     else if (n > 1)
     {
+        mem -= n*sizeof(heap_list_item_t*);
         free((heap_list_item_t**)((size_t)inode_idx & ~IMAP_MALLOC_LOW_BITS));
     }
 }
@@ -2743,7 +3133,7 @@ void inode_map_iterate(void* & inode_idx, std::function<void(heap_list_item_t*)>
     }
 }
 
-void inode_map_put(void* & inode_idx, heap_list_item_t* li)
+void inode_map_put(uint64_t & mem, void* & inode_idx, heap_list_item_t* li)
 {
     if (!inode_idx)
     {
@@ -2755,7 +3145,11 @@ void inode_map_put(void* & inode_idx, heap_list_item_t* li)
     size_t map_n = ((size_t)inode_idx & IMAP_MALLOC_LOW_BITS);
     if (!map_n)
     {
-        ((heap_inode_map_t*)inode_idx)->insert(li);
+        auto imap = (heap_inode_map_t*)inode_idx;
+        auto old_mask = imap->mask();
+        imap->insert(li);
+        if (imap->mask() != old_mask)
+            mem += (imap->mask()-old_mask)*(sizeof(heap_list_item_t*)+1);
     }
     else if (map_n == 1)
     {
@@ -2766,6 +3160,7 @@ void inode_map_put(void* & inode_idx, heap_list_item_t* li)
         lis[0] = single;
         lis[1] = li;
         inode_idx = (void*)(2 | (size_t)lis);
+        mem += sizeof(heap_list_item_t *) * 2;
     }
     else
     {
@@ -2779,6 +3174,7 @@ void inode_map_put(void* & inode_idx, heap_list_item_t* li)
                 return;
             }
         }
+        mem -= sizeof(heap_list_item_t *) * map_n;
         if (map_n == IMAP_MAX_LOW-1)
         {
             // Convert to map
@@ -2791,6 +3187,7 @@ void inode_map_put(void* & inode_idx, heap_list_item_t* li)
             imap->insert(li);
             inode_idx = (void*)imap;
             free(lis);
+            mem += imap_memory(imap);
         }
         else
         {
@@ -2808,6 +3205,7 @@ void inode_map_put(void* & inode_idx, heap_list_item_t* li)
                 new_lis[i] = 0;
             free(lis);
             inode_idx = (void*)(next_n | (size_t)new_lis);
+            mem += sizeof(heap_list_item_t *) * next_n;
         }
     }
 }
@@ -2838,7 +3236,7 @@ void inode_map_replace(void* & inode_idx, const heap_inode_map_t::iterator & li_
     }
 }
 
-void inode_map_erase(robin_hood::unordered_flat_map<inode_t, void*, i64hash_t> & pg_idx, void* & inode_idx,
+void inode_map_erase(uint64_t & mem, robin_hood::unordered_flat_map<inode_t, void*, i64hash_t> & pg_idx, void* & inode_idx,
     const heap_inode_map_t::iterator & li_it, heap_list_item_t* li)
 {
     size_t map_n = ((size_t)inode_idx & IMAP_MALLOC_LOW_BITS);
@@ -2858,6 +3256,8 @@ void inode_map_erase(robin_hood::unordered_flat_map<inode_t, void*, i64hash_t> &
                 lis[i++] = li;
             }
             inode_idx = (void*)(imap->size() | (size_t)lis);
+            mem -= imap_memory(imap);
+            mem += sizeof(heap_list_item_t *) * imap->size();
             delete imap;
         }
     }
@@ -2883,6 +3283,7 @@ void inode_map_erase(robin_hood::unordered_flat_map<inode_t, void*, i64hash_t> &
         if (filled <= map_n/2)
         {
             assert(filled > 0);
+            mem -= sizeof(heap_list_item_t *) * map_n;
             if (filled == 1)
             {
                 // Convert to a single entry
@@ -2913,6 +3314,7 @@ void inode_map_erase(robin_hood::unordered_flat_map<inode_t, void*, i64hash_t> &
                 assert(j == filled);
                 free(lis);
                 inode_idx = (void*)(filled | (size_t)new_lis);
+                mem += sizeof(heap_list_item_t *) * filled;
             }
         }
     }
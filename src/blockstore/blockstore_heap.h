@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <sys/uio.h>
+
 #include <map>
 #include <unordered_map>
 #include <set>
@@ -34,6 +36,7 @@ struct pool_shard_settings_t
 #define BS_HEAP_GARBAGE 0x80
 
 class blockstore_heap_t;
+class worker_pool_t;
 
 struct heap_small_write_t;
 struct heap_big_write_t;
@@ -168,6 +171,19 @@ struct heap_recheck_state_t
     heap_entry_t *bad_wr = NULL;
 };
 
+// Object data range for batched checksum calculation
+struct heap_csum_range_t
+{
+    // checksums of blocks starting with the one containing <start>
+    uint32_t *block_csums;
+    // NULL if all data in the range is present
+    uint8_t *bitmap;
+    uint32_t start, end;
+    // buffers with data of [start, end) without gaps
+    const iovec *iov;
+    int iovcnt;
+};
+
 using i64hash_t = robin_hood::hash<uint64_t>;
 using heap_inode_map_t = robin_hood::unordered_flat_set<heap_list_item_t*, heap_li_hash, heap_li_equal, 88>;
 using heap_block_index_t = robin_hood::unordered_flat_map<uint64_t,
@@ -201,6 +217,8 @@ class blockstore_heap_t
     uint64_t live_memory = 0;
     uint64_t garbage_entries = 0;
     uint64_t garbage_memory = 0;
+    // object index size in bytes
+    uint64_t index_memory = 0;
 
     uint64_t next_lsn = 0;
     uint32_t last_allocated_block = UINT32_MAX;
@@ -227,6 +245,9 @@ class blockstore_heap_t
     bool in_recheck = false;
     std::function<void(bool is_data, uint64_t offset, uint64_t len, uint8_t* buf, std::function<void()>)> recheck_cb;
     int recheck_queue_depth = 0;
+    int load_threads = 1;
+    uint64_t load_batch_size = 0;
+    worker_pool_t *load_pool = NULL;
 
     uint64_t get_pg_id(inode_t inode, uint64_t stripe);
     bool validate_object(heap_entry_t *obj);
@@ -241,6 +262,13 @@ class blockstore_heap_t
     void recheck_buffer(heap_entry_t *cwr, uint8_t *buf);
     void defragment_block(uint32_t block_num);
     void reshard_add(heap_reshard_state_t *st, heap_list_item_t *li);
+    int parse_blocks(uint64_t disk_offset, uint64_t size, uint8_t *buf, bool allow_corrupted,
+        std::vector<uint32_t> & corrupted_blocks,
+        const std::function<void(uint32_t block_num, heap_entry_t* wr)> & handle_write,
+        const std::function<void(uint32_t, uint32_t, uint8_t*)> & handle_block);
+    int load_blocks_parallel(uint64_t disk_offset, uint64_t size, uint8_t *buf,
+        bool allow_corrupted, uint64_t &entries_loaded);
+    void index_postponed_parallel();
 
     void gc_block(heap_block_info_t & inf);
     int allocate_entry(uint32_t entry_size, uint32_t *block_num, bool allow_last_free);
@@ -261,6 +289,9 @@ public:
     blockstore_heap_t(blockstore_disk_t *dsk, uint8_t *buffer_area, int log_level = 0);
     ~blockstore_heap_t();
     void start_load(uint64_t completed_lsn);
+    // parse, check and index loaded metadata in <threads> threads, 1 = in the calling thread,
+    // index entries in batches of up to <batch_size> entries, 0 = HEAP_LOAD_BATCH_SIZE
+    void set_load_threads(int threads, uint64_t batch_size = 0);
     // load data from the disk, returns EDOM on corruption
     int read_blocks(uint64_t disk_offset, uint64_t size, uint8_t *buf, bool allow_corrupted,
         std::function<void(uint32_t block_num, heap_entry_t* wr)> handle_write,
@@ -293,9 +324,10 @@ public:
     // set or verify raw block checksums
     bool calc_block_checksums(uint32_t *block_csums, uint8_t *data, uint8_t *bitmap, uint32_t start, uint32_t end,
         bool set, std::function<void(uint32_t, uint32_t, uint32_t)> bad_block_cb);
-    bool calc_block_checksums(uint32_t *block_csums, uint8_t *bitmap,
-        uint32_t start, uint32_t end, std::function<uint8_t*(uint32_t start, uint32_t & len)> next,
-        bool set, std::function<void(uint32_t, uint32_t, uint32_t)> bad_block_cb);
+    // set or verify block checksums of multiple ranges at once, full blocks are checksummed in parallel streams
+    // bad_block_cb(range index, block offset, expected, actual) is called for mismatched blocks if set
+    bool calc_block_checksums(heap_csum_range_t *ranges, int count, bool set,
+        const std::function<void(int, uint32_t, uint32_t, uint32_t)> & bad_block_cb);
     // adds a small_write or intent_write entry to an object
     // return 0 if OK, or maybe ENOSPC
     int add_small_write(object_id oid, heap_entry_t **obj_ptr, uint16_t type, uint64_t version,
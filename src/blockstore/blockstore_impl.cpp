@@ -6,6 +6,7 @@
 #include "blockstore_impl.h"
 #include "blockstore_internal.h"
 #include "crc32c.h"
+#include "buffer_pool.h"
 
 blockstore_impl_t::blockstore_impl_t(blockstore_config_t & config, ring_loop_i *ringloop, timerfd_manager_t *tfd, bool mock_mode)
 {
@@ -30,6 +31,27 @@ blockstore_impl_t::blockstore_impl_t(blockstore_config_t & config, ring_loop_i *
         dsk.close_all();
         throw;
     }
+    if (!mock_mode)
+    {
+        // Let the ring skip fd lookups and page pinning for data I/O
+        ringloop->register_fd(dsk.data_fd);
+        ringloop->register_fd(dsk.meta_fd);
+        ringloop->register_fd(dsk.journal_fd);
+        register_passthru(dsk.data_fd, dsk.data_nvme, dsk.data_device_sect, "data");
+        register_passthru(dsk.meta_fd, dsk.meta_nvme, dsk.meta_device_sect, "metadata");
+        register_passthru(dsk.journal_fd, dsk.journal_nvme, dsk.journal_device_sect, "journal");
+        if (disk_iopoll)
+        {
+            register_iopoll(dsk.data_fd, dsk.data_io, "data");
+            register_iopoll(dsk.meta_fd, dsk.meta_io, "metadata");
+            register_iopoll(dsk.journal_fd, dsk.journal_io, "journal");
+        }
+        void *pool_base = NULL;
+        size_t pool_size = 0;
+        pool_get_region(&pool_base, &pool_size);
+        if (pool_base && fixed_buffer_limit > 0)
+            ringloop->register_buffer_region(pool_base, pool_size, fixed_buffer_limit, pool_set_pinned);
+    }
     meta_superblock = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, dsk.meta_block_size);
     memset(meta_superblock, 0, dsk.meta_block_size);
     flusher = new journal_flusher_t(this);
@@ -38,6 +60,7 @@ blockstore_impl_t::blockstore_impl_t(blockstore_config_t & config, ring_loop_i *
         buffer_area = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, dsk.journal_len);
     }
     heap = new blockstore_heap_t(&dsk, buffer_area, log_level);
+    heap->set_load_threads(meta_load_threads);
     ringloop->wakeup();
 }
 
@@ -52,9 +75,55 @@ blockstore_impl_t::~blockstore_impl_t()
     if (meta_superblock)
         free(meta_superblock);
     ringloop->unregister_consumer(&ring_consumer);
+    if (!dsk.mock_mode)
+    {
+        ringloop->unregister_fd(dsk.data_fd);
+        ringloop->unregister_fd(dsk.meta_fd);
+        ringloop->unregister_fd(dsk.journal_fd);
+        for (auto nvme: { &dsk.data_nvme, &dsk.meta_nvme, &dsk.journal_nvme })
+        {
+            if (nvme->fd >= 0)
+                ringloop->unregister_fd(nvme->fd);
+        }
+        ringloop->unregister_passthru(dsk.data_fd);
+        ringloop->unregister_passthru(dsk.meta_fd);
+        ringloop->unregister_passthru(dsk.journal_fd);
+        ringloop->unregister_iopoll_fd(dsk.data_fd);
+        ringloop->unregister_iopoll_fd(dsk.meta_fd);
+        ringloop->unregister_iopoll_fd(dsk.journal_fd);
+    }
     dsk.close_all();
 }
 
+void blockstore_impl_t::register_passthru(int fd, blockstore_nvme_dev_t & nvme, uint64_t lba_size, const char *name)
+{
+    if (nvme.fd < 0)
+    {
+        return;
+    }
+    int r = ringloop->register_passthru(fd, nvme.fd, nvme.nsid, lba_size, nvme.max_io);
+    if (r < 0)
+    {
+        fprintf(stderr, "Warning: NVMe passthrough can't be used for the %s device: %s, falling back to block device I/O\n", name, strerror(-r));
+        return;
+    }
+    ringloop->register_fd(nvme.fd);
+}
+
+void blockstore_impl_t::register_iopoll(int fd, const std::string & io_mode, const char *name)
+{
+    if (io_mode == "cached")
+    {
+        // Polling only works with O_DIRECT
+        return;
+    }
+    int r = ringloop->register_iopoll_fd(fd);
+    if (r < 0)
+    {
+        fprintf(stderr, "Warning: polled I/O can't be used for the %s device: %s, falling back to interrupts\n", name, strerror(-r));
+    }
+}
+
 bool blockstore_impl_t::is_started()
 {
     return initialized == 10;
@@ -191,14 +260,11 @@ void blockstore_impl_t::loop()
         {
             flusher->loop();
         }
-        for (auto & block_num: pending_modified_blocks)
+        if (deferred_cleanup_blocks.size())
         {
-            auto & mb = modified_blocks[block_num];
-            heap->get_meta_block(block_num, mb.buf);
-            heap->start_block_write(block_num);
-            mb.sent = true;
+            continue_deferred_cleanup();
         }
-        pending_modified_blocks.clear();
+        submit_meta_block_writes();
         int ret = ringloop->submit();
         if (ret < 0)
         {
@@ -217,7 +283,8 @@ bool blockstore_impl_t::is_safe_to_stop()
 {
     // It's safe to stop blockstore when there are no in-flight operations,
     // no in-progress syncs and flusher isn't doing anything
-    if (submit_queue.size() > 0 || !readonly && flusher->is_active())
+    if (submit_queue.size() > 0 || !readonly && flusher->is_active() ||
+        deferred_cleanup_blocks.size() > 0 || modified_blocks.size() > 0)
     {
         return false;
     }
@@ -301,6 +368,12 @@ void blockstore_impl_t::enqueue_op(blockstore_op_t *op)
     }
     init_op(op);
     submit_queue.push_back(op);
+    client_op_count++;
+    if (op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE || op->opcode == BS_OP_DELETE ||
+        op->opcode == BS_OP_STABLE || op->opcode == BS_OP_ROLLBACK)
+    {
+        client_write_count++;
+    }
     ringloop->wakeup();
 }
 
@@ -411,3 +484,17 @@ bool blockstore_impl_t::reshard_continue(void *reshard_state, uint64_t chunk_lim
 {
     return heap->reshard_continue(reshard_state, chunk_limit);
 }
+
+blockstore_compaction_stats_t blockstore_impl_t::get_compaction_stats()
+{
+    return flusher->get_compaction_stats();
+}
+
+blockstore_meta_write_stats_t blockstore_impl_t::get_meta_write_stats()
+{
+    return (blockstore_meta_write_stats_t){
+        .client_writes = client_write_count,
+        .meta_writes = meta_write_count,
+        .meta_blocks = meta_write_block_count,
+    };
+}
@@ -64,7 +64,6 @@ struct blockstore_op_private_t
 struct bs_modified_block_t
 {
     bool sent;
-    uint8_t *buf;
 };
 
 class blockstore_impl_t: public blockstore_i
@@ -80,6 +79,9 @@ public:
     bool inmemory_meta = false;
     bool skip_corrupted_meta_entries = false;
     uint32_t meta_write_recheck_parallelism = 0;
+    // Metadata reads in flight and threads used to parse and index metadata during start
+    uint32_t meta_read_parallelism = 0;
+    uint32_t meta_load_threads = 0;
     // Maximum and minimum flusher count
     unsigned max_flusher_count = 0, min_flusher_count = 0;
     unsigned journal_trim_interval = 0;
@@ -101,6 +103,18 @@ public:
     // Enable correct block checksum validation on objects updated with small writes when checksum block
     // is larger than bitmap_granularity, at the expense of extra metadata fsyncs during compaction
     bool perfect_csum_update = false;
+    // Submit O_DIRECT disk reads and writes to a separate io_uring with polled completions
+    bool disk_iopoll = false;
+    // Maximum memory pinned for io_uring fixed buffers, 0 = don't use fixed buffers
+    uint64_t fixed_buffer_limit = 256*1024*1024;
+    // Rewrite metadata blocks cleared from garbage on start in background, through the
+    // regular metadata write queue, and report readiness right after loading the index
+    bool defer_meta_cleanup = false;
+    // Compaction budget while clients are active, 0 = unlimited
+    uint64_t compaction_target_iops = 0;
+    uint64_t compaction_target_mbs = 0;
+    // Maximum number of adjacent metadata blocks merged into one write
+    uint32_t meta_write_merge_blocks = 32;
     /******* END OF OPTIONS *******/
 
     struct ring_consumer_t ring_consumer;
@@ -109,14 +123,25 @@ public:
     uint8_t* meta_superblock = NULL;
     uint8_t *buffer_area = NULL;
     std::vector<blockstore_op_t*> submit_queue;
+    // Temporary lists for batched checksum verification
+    std::vector<heap_csum_range_t> csum_ranges;
+    std::vector<iovec> csum_iovs;
+    std::vector<int> csum_range_vecs;
     int unsynced_data_write_count = 0, unsynced_buffer_write_count = 0, unsynced_meta_write_count = 0;
     int unsynced_queued_ops = 0;
 
     std::vector<uint32_t> pending_modified_blocks;
     robin_hood::unordered_flat_map<uint32_t, bs_modified_block_t> modified_blocks;
+    // Blocks left to rewrite after start in defer_meta_cleanup mode
+    std::vector<uint32_t> deferred_cleanup_blocks;
+    size_t deferred_cleanup_pos = 0;
 
     journal_flusher_t *flusher;
     int write_iodepth = 0;
+    // Incremented for every client operation, used by the compaction scheduler to detect client load
+    uint64_t client_op_count = 0;
+    // Client writes and metadata block writes, reported as meta writes per client write
+    uint64_t client_write_count = 0, meta_write_count = 0, meta_write_block_count = 0;
     int inflight_big = 0;
     int intent_write_counter = 0;
     bool fsyncing_data = false;
@@ -137,6 +162,8 @@ public:
     void open_journal();
 
     void disk_error_abort(const char *op, int retval, int expected);
+    void register_passthru(int fd, blockstore_nvme_dev_t & nvme, uint64_t lba_size, const char *name);
+    void register_iopoll(int fd, const std::string & io_mode, const char *name);
 
     // Asynchronous init
     int initialized;
@@ -159,16 +186,27 @@ public:
         std::function<void(int&, uint32_t, uint32_t)> callback);
     void free_read_buffers(std::vector<copy_buffer_t> & rv);
     void handle_read_event(ring_data_t *data, blockstore_op_t *op);
+    static void handle_read_cb(void *bs, void *op, ring_data_t *data)
+    {
+        ((blockstore_impl_t*)bs)->handle_read_event(data, (blockstore_op_t*)op);
+    }
     bool verify_read_checksums(blockstore_op_t *op);
 
     // Write
     bool enqueue_write(blockstore_op_t *op);
     void prepare_meta_block_write(uint32_t modified_block);
+    void submit_meta_block_writes();
+    void handle_meta_block_write(ring_data_t *data, uint32_t first_block, uint32_t count);
     bool meta_block_is_pending(uint32_t modified_block);
+    void continue_deferred_cleanup();
     bool intent_write_allowed(blockstore_op_t *op, heap_entry_t *obj);
     int dequeue_write(blockstore_op_t *op);
     int continue_write(blockstore_op_t *op);
     void handle_write_event(ring_data_t *data, blockstore_op_t *op);
+    static void handle_write_cb(void *bs, void *op, ring_data_t *data)
+    {
+        ((blockstore_impl_t*)bs)->handle_write_event(data, (blockstore_op_t*)op);
+    }
 
     // Sync
     int continue_sync(blockstore_op_t *op);
@@ -234,4 +272,6 @@ public:
     inline uint64_t get_live_memory() { return heap->get_live_memory(); }
     inline uint64_t get_garbage_entries() { return heap->get_garbage_entries(); }
     inline uint64_t get_garbage_memory() { return heap->get_garbage_memory(); }
+    blockstore_compaction_stats_t get_compaction_stats();
+    blockstore_meta_write_stats_t get_meta_write_stats();
 };
@@ -53,7 +53,8 @@ int blockstore_init_meta::loop()
     else if (wait_state == 7) goto resume_7;
     else if (wait_state == 8) goto resume_8;
     else if (wait_state == 9) goto resume_9;
-    metadata_buffer = memalign(MEM_ALIGNMENT, 2*bs->metadata_buf_size);
+    bufs.resize(bs->meta_read_parallelism);
+    metadata_buffer = memalign(MEM_ALIGNMENT, bufs.size()*bs->metadata_buf_size);
     if (!metadata_buffer)
         throw std::runtime_error("Failed to allocate metadata read buffer");
     // Read metadata superblock
@@ -194,40 +195,41 @@ resume_3:
     next_offset = md_offset;
     // Read the rest of the metadata
 resume_4:
-    if (next_offset < bs->dsk.meta_area_size && submitted == 0)
+    // Keep up to meta_read_parallelism reads in flight while parsing completed buffers
+    for (int i = 0; i < bufs.size() && next_offset < bs->dsk.meta_area_size; i++)
     {
-        // Submit one read
-        for (int i = 0; i < 2; i++)
+        if (!bufs[i].state)
         {
-            if (!bufs[i].state)
+            sqe = bs->get_sqe();
+            if (!sqe)
             {
-                bufs[i].buf = (uint8_t*)metadata_buffer + i*bs->metadata_buf_size;
-                bufs[i].offset = next_offset;
-                bufs[i].size = bs->dsk.meta_area_size-next_offset > bs->metadata_buf_size
-                    ? bs->metadata_buf_size : bs->dsk.meta_area_size-next_offset;
-                bufs[i].state = INIT_META_READING;
-                submitted++;
-                next_offset += bufs[i].size;
-                GET_SQE();
-                assert(bufs[i].size <= 0x7fffffff);
-                data->iov = { bufs[i].buf, (size_t)bufs[i].size };
-                data->callback = [this, i](ring_data_t *data) { handle_event(data, i); };
-                if (!zero_on_init)
-                    io_uring_prep_readv(sqe, bs->dsk.meta_fd, &data->iov, 1, bs->dsk.meta_offset + bufs[i].offset);
-                else
-                {
-                    // Fill metadata with empty block pattern
-                    memset(bufs[i].buf, 0, bufs[i].size);
-                    for (uint64_t o = 0; o < bufs[i].size; o += bs->dsk.meta_block_size)
-                        bs->heap->fill_block_empty_space(bufs[i].buf + o, 0);
-                    io_uring_prep_writev(sqe, bs->dsk.meta_fd, &data->iov, 1, bs->dsk.meta_offset + bufs[i].offset);
-                }
-                bs->ringloop->submit();
                 break;
             }
+            data = ((ring_data_t*)sqe->user_data);
+            bufs[i].buf = (uint8_t*)metadata_buffer + i*bs->metadata_buf_size;
+            bufs[i].offset = next_offset;
+            bufs[i].size = bs->dsk.meta_area_size-next_offset > bs->metadata_buf_size
+                ? bs->metadata_buf_size : bs->dsk.meta_area_size-next_offset;
+            bufs[i].state = INIT_META_READING;
+            submitted++;
+            next_offset += bufs[i].size;
+            assert(bufs[i].size <= 0x7fffffff);
+            data->iov = { bufs[i].buf, (size_t)bufs[i].size };
+            data->callback = [this, i](ring_data_t *data) { handle_event(data, i); };
+            if (!zero_on_init)
+                io_uring_prep_readv(sqe, bs->dsk.meta_fd, &data->iov, 1, bs->dsk.meta_offset + bufs[i].offset);
+            else
+            {
+                // Fill metadata with empty block pattern
+                memset(bufs[i].buf, 0, bufs[i].size);
+                for (uint64_t o = 0; o < bufs[i].size; o += bs->dsk.meta_block_size)
+                    bs->heap->fill_block_empty_space(bufs[i].buf + o, 0);
+                io_uring_prep_writev(sqe, bs->dsk.meta_fd, &data->iov, 1, bs->dsk.meta_offset + bufs[i].offset);
+            }
         }
     }
-    for (int i = 0; i < 2; i++)
+    bs->ringloop->submit();
+    for (int i = 0; i < bufs.size(); i++)
     {
         if (bufs[i].state == INIT_META_READ_DONE)
         {
@@ -241,7 +243,7 @@ resume_4:
             bs->ringloop->wakeup();
         }
     }
-    if (submitted > 0)
+    if (submitted > 0 || next_offset < bs->dsk.meta_area_size)
     {
         wait_state = 4;
         return 1;
@@ -287,6 +289,14 @@ resume_7:
         recheck_mod.clear();
         printf("Actual metadata entries: %ju\n", bs->heap->get_live_entries());
     }
+    else if (bs->defer_meta_cleanup && recheck_mod.size())
+    {
+        // Cleared blocks are written after start along with regular metadata writes.
+        // They're fsynced by the next sync, and cleared again on restart if lost before it
+        printf("Actual metadata entries: %ju, clearing garbage in %zu metadata blocks in background\n", bs->heap->get_live_entries(), recheck_mod.size());
+        bs->deferred_cleanup_blocks.swap(recheck_mod);
+        bs->deferred_cleanup_pos = 0;
+    }
     else
     {
         printf("Actual metadata entries: %ju, clearing garbage in %zu metadata blocks\n", bs->heap->get_live_entries(), recheck_mod.size());
@@ -329,7 +339,7 @@ resume_9:
     }
     free(metadata_buffer);
     metadata_buffer = NULL;
-    if (!bs->dsk.disable_meta_fsync && !bs->readonly)
+    if (!bs->dsk.disable_meta_fsync && !bs->readonly && (!bs->defer_meta_cleanup || zero_on_init))
     {
         GET_SQE();
         io_uring_prep_fsync(sqe, bs->dsk.meta_fd, IORING_FSYNC_DATASYNC);
@@ -18,7 +18,7 @@ class blockstore_init_meta
     int wait_count = 0;
     bool zero_on_init = false;
     void *metadata_buffer = NULL;
-    blockstore_init_meta_buf bufs[2] = {};
+    std::vector<blockstore_init_meta_buf> bufs;
     int submitted = 0;
     struct io_uring_sqe *sqe;
     struct ring_data_t *data;
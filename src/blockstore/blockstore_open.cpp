@@ -4,6 +4,7 @@
 #include <sys/file.h>
 #include <stdexcept>
 #include "blockstore_impl.h"
+#include "str_util.h"
 
 void blockstore_impl_t::parse_config(blockstore_config_t & config)
 {
@@ -27,6 +28,9 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config, bool init)
     throttle_target_mbs = strtoull(config["throttle_target_mbs"].c_str(), NULL, 10);
     throttle_target_parallelism = strtoull(config["throttle_target_parallelism"].c_str(), NULL, 10);
     throttle_threshold_us = strtoull(config["throttle_threshold_us"].c_str(), NULL, 10);
+    compaction_target_iops = strtoull(config["compaction_target_iops"].c_str(), NULL, 10);
+    compaction_target_mbs = strtoull(config["compaction_target_mbs"].c_str(), NULL, 10);
+    meta_write_merge_blocks = strtoull(config["meta_write_merge_blocks"].c_str(), NULL, 10);
     perfect_csum_update = config["perfect_csum_update"] == "true" || config["perfect_csum_update"] == "1" || config["perfect_csum_update"] == "yes";
     skip_corrupted_meta_entries = config["skip_corrupted_meta_entries"] == "true" || config["skip_corrupted_meta_entries"] == "1" || config["skip_corrupted_meta_entries"] == "yes";
     if (config["autosync_writes"] != "")
@@ -69,6 +73,10 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config, bool init)
     {
         throttle_threshold_us = 50;
     }
+    if (!meta_write_merge_blocks)
+    {
+        meta_write_merge_blocks = 32;
+    }
     if (!init)
     {
         return;
@@ -91,7 +99,15 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config, bool init)
     }
     metadata_buf_size = strtoull(config["meta_buf_size"].c_str(), NULL, 10);
     meta_write_recheck_parallelism = strtoull(config["meta_write_recheck_parallelism"].c_str(), NULL, 10);
+    meta_read_parallelism = strtoull(config["meta_read_parallelism"].c_str(), NULL, 10);
+    meta_load_threads = strtoull(config["meta_load_threads"].c_str(), NULL, 10);
     log_level = strtoull(config["log_level"].c_str(), NULL, 10);
+    disk_iopoll = config["disk_iopoll"] == "true" || config["disk_iopoll"] == "1" || config["disk_iopoll"] == "yes";
+    defer_meta_cleanup = config["defer_meta_cleanup"] == "true" || config["defer_meta_cleanup"] == "1" || config["defer_meta_cleanup"] == "yes";
+    if (config.find("fixed_buffer_limit") != config.end())
+    {
+        fixed_buffer_limit = parse_size(config["fixed_buffer_limit"]);
+    }
     // Validate
     if (metadata_buf_size < 65536)
     {
@@ -105,6 +121,14 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config, bool init)
     {
         meta_write_recheck_parallelism = 16;
     }
+    if (!meta_read_parallelism)
+    {
+        meta_read_parallelism = 8;
+    }
+    if (!meta_load_threads)
+    {
+        meta_load_threads = 4;
+    }
     if (immediate_commit != IMMEDIATE_NONE && !dsk.disable_journal_fsync)
     {
         throw std::runtime_error("immediate_commit requires disable_journal_fsync");
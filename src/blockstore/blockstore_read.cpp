@@ -147,7 +147,7 @@ int blockstore_impl_t::fulfill_read(blockstore_op_t *op)
                 &data->iov, 1,
                 ((vec.copy_flags & COPY_BUF_JOURNAL) ? dsk.journal_offset : dsk.data_offset) + vec.disk_loc + vec.disk_offset
             );
-            data->callback = [this, op](ring_data_t *data) { handle_read_event(data, op); };
+            data->set_callback(handle_read_cb, this, op);
         }
     }
     return 1;
@@ -420,8 +420,14 @@ bool blockstore_impl_t::verify_read_checksums(blockstore_op_t *op)
         }
     }
     auto & rv = PRIV(op)->read_vec;
-    for (auto & vec: rv)
+    csum_ranges.clear();
+    csum_iovs.clear();
+    csum_range_vecs.clear();
+    // iovecs are referenced by ranges, so they must not be reallocated
+    csum_iovs.reserve(rv.size());
+    for (int i = 0; i < rv.size(); i++)
     {
+        auto & vec = rv[i];
         if (vec.copy_flags & COPY_BUF_ZERO)
             continue;
         if (vec.copy_flags & COPY_BUF_PADDED)
@@ -434,22 +440,35 @@ bool blockstore_impl_t::verify_read_checksums(blockstore_op_t *op)
             + (vec.disk_offset/dsk.csum_block_size)*(dsk.data_csum_type & 0xFF)
             - ((vec.wr->type() == BS_HEAP_BIG_WRITE || vec.wr->type() == BS_HEAP_BIG_INTENT)
                 ? 0 : (vec.wr->small().offset/dsk.csum_block_size)*(dsk.data_csum_type & 0xFF)));
-        if (!heap->calc_block_checksums(csums, buf, vec.wr->get_int_bitmap(heap),
-            vec.disk_offset, vec.disk_offset+vec.disk_len, false, [&](uint32_t mismatch_pos, uint32_t expected_csum, uint32_t real_csum)
-            {
-                printf(
-                    "Checksum mismatch in object %jx:%jx v%ju, offset 0x%x in %s area at offset 0x%jx during read %x+%x: %08x expected vs %08x actual\n",
-                    op->oid.inode, op->oid.stripe, op->version, mismatch_pos,
-                    (vec.copy_flags & COPY_BUF_JOURNAL) ? "buffer" : "data", vec.disk_loc + vec.disk_offset,
-                    op->offset, op->len,
-                    expected_csum, real_csum
-                );
-            }))
-        {
-            return false;
-        }
+        // Offsets are inside the object, so they fit in 32 bits
+        assert(vec.disk_offset+vec.disk_len <= dsk.data_block_size);
+        csum_iovs.push_back((struct iovec){ buf, (size_t)vec.disk_len });
+        csum_ranges.push_back((heap_csum_range_t){
+            .block_csums = csums,
+            .bitmap = vec.wr->get_int_bitmap(heap),
+            .start = (uint32_t)vec.disk_offset,
+            .end = (uint32_t)(vec.disk_offset+vec.disk_len),
+            .iov = &csum_iovs.back(),
+            .iovcnt = 1,
+        });
+        csum_range_vecs.push_back(i);
     }
-    return true;
+    if (!csum_ranges.size())
+    {
+        return true;
+    }
+    return heap->calc_block_checksums(csum_ranges.data(), csum_ranges.size(), false,
+        [&](int range_idx, uint32_t mismatch_pos, uint32_t expected_csum, uint32_t real_csum)
+        {
+            auto & vec = rv[csum_range_vecs[range_idx]];
+            printf(
+                "Checksum mismatch in object %jx:%jx v%ju, offset 0x%x in %s area at offset 0x%jx during read %x+%x: %08x expected vs %08x actual\n",
+                op->oid.inode, op->oid.stripe, op->version, mismatch_pos,
+                (vec.copy_flags & COPY_BUF_JOURNAL) ? "buffer" : "data", vec.disk_loc + vec.disk_offset,
+                op->offset, op->len,
+                expected_csum, real_csum
+            );
+        });
 }
 
 int blockstore_impl_t::read_bitmap(object_id oid, uint64_t target_version, void *bitmap, uint64_t *result_version)
@@ -40,14 +40,15 @@ bool blockstore_impl_t::submit_fsyncs(int & wait_count)
     {
         return true;
     }
-    auto cb = [this, & wait_count](ring_data_t *data)
+    auto cb = [](void *bs, void *wait_count_ptr, ring_data_t *data)
     {
+        int & wait_count = *(int*)wait_count_ptr;
         if (data->res != 0)
-            disk_error_abort("sync meta", data->res, 0);
+            ((blockstore_impl_t*)bs)->disk_error_abort("sync meta", data->res, 0);
         wait_count--;
         assert(wait_count >= 0);
         if (!wait_count)
-            ringloop->wakeup();
+            ((blockstore_impl_t*)bs)->ringloop->wakeup();
     };
     if (unsynced_meta_write_count > 0 && !dsk.disable_meta_fsync)
     {
@@ -57,7 +58,7 @@ bool blockstore_impl_t::submit_fsyncs(int & wait_count)
         ring_data_t *data = ((ring_data_t*)sqe->user_data);
         io_uring_prep_fsync(sqe, dsk.meta_fd, IORING_FSYNC_DATASYNC);
         data->iov = { 0 };
-        data->callback = cb;
+        data->set_callback(cb, this, &wait_count);
         wait_count++;
     }
     if (unsynced_buffer_write_count > 0 && !dsk.disable_journal_fsync && dsk.meta_fd != dsk.journal_fd)
@@ -68,7 +69,7 @@ bool blockstore_impl_t::submit_fsyncs(int & wait_count)
         ring_data_t *data = ((ring_data_t*)sqe->user_data);
         io_uring_prep_fsync(sqe, dsk.journal_fd, IORING_FSYNC_DATASYNC);
         data->iov = { 0 };
-        data->callback = cb;
+        data->set_callback(cb, this, &wait_count);
         wait_count++;
     }
     if (unsynced_data_write_count > 0 && !dsk.disable_data_fsync && dsk.data_fd != dsk.meta_fd && dsk.data_fd != dsk.journal_fd)
@@ -79,7 +80,7 @@ bool blockstore_impl_t::submit_fsyncs(int & wait_count)
         ring_data_t *data = ((ring_data_t*)sqe->user_data);
         io_uring_prep_fsync(sqe, dsk.data_fd, IORING_FSYNC_DATASYNC);
         data->iov = { 0 };
-        data->callback = cb;
+        data->set_callback(cb, this, &wait_count);
         wait_count++;
     }
     unsynced_data_write_count = 0;
@@ -0,0 +1,345 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <stdexcept>
+
+#include "blockstore_thread.h"
+#include "epoll_manager.h"
+
+blockstore_thread_t::blockstore_thread_t(blockstore_config_t & config, ring_loop_i *outer_loop, timerfd_manager_t *outer_tfd,
+    const ring_loop_config_t & ring_config)
+{
+    this->outer_loop = outer_loop;
+    this->outer_tfd = outer_tfd;
+    submit_eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    complete_eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (submit_eventfd < 0 || complete_eventfd < 0)
+    {
+        throw std::runtime_error(std::string("failed to create eventfd: ") + strerror(errno));
+    }
+    thread = std::thread(&blockstore_thread_t::run, this, std::ref(config), ring_config);
+    {
+        // Wait until the blockstore is created, the config is only valid during the constructor
+        std::unique_lock<std::mutex> lk(mu);
+        while (!created)
+            created_cond.wait(lk);
+    }
+    if (create_error)
+    {
+        thread.join();
+        close(submit_eventfd);
+        close(complete_eventfd);
+        std::rethrow_exception(create_error);
+    }
+    outer_tfd->set_fd_handler(complete_eventfd, false, [this](int fd, int events) { handle_complete(); });
+}
+
+blockstore_thread_t::~blockstore_thread_t()
+{
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        stopped = true;
+    }
+    wakeup_thread();
+    thread.join();
+    outer_tfd->set_fd_handler(complete_eventfd, false, NULL);
+    epmgr->set_fd_handler(submit_eventfd, false, NULL);
+    delete bs;
+    delete epmgr;
+    delete ringloop;
+    close(submit_eventfd);
+    close(complete_eventfd);
+}
+
+// Called in the blockstore thread
+void blockstore_thread_t::init(blockstore_config_t & config, const ring_loop_config_t & ring_config)
+{
+    try
+    {
+        ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false, blockstore_i::needs_sqe128(config), ring_config);
+        epmgr = new epoll_manager_t(ringloop);
+        bs = blockstore_i::create(config, ringloop, epmgr->tfd);
+        // Only lock the blockstore while it's actually running, not during the whole loop
+        ringloop->set_loop_mutex(&mu);
+        epmgr->set_fd_handler(submit_eventfd, false, [this](int fd, int events) { handle_submit(); });
+    }
+    catch (...)
+    {
+        create_error = std::current_exception();
+        delete bs;
+        delete epmgr;
+        delete ringloop;
+        bs = NULL;
+        epmgr = NULL;
+        ringloop = NULL;
+    }
+    std::lock_guard<std::mutex> lk(mu);
+    created = true;
+    created_cond.notify_all();
+}
+
+void blockstore_thread_t::run(blockstore_config_t & config, ring_loop_config_t ring_config)
+{
+    init(config, ring_config);
+    if (create_error)
+    {
+        return;
+    }
+    while (true)
+    {
+        ringloop->loop();
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            if (stopped)
+            {
+                break;
+            }
+            if (!started && bs->is_started())
+            {
+                started = true;
+                wakeup_outer();
+            }
+        }
+        ringloop->wait();
+    }
+}
+
+void blockstore_thread_t::wakeup_thread()
+{
+    uint64_t n = 1;
+    if (write(submit_eventfd, &n, sizeof(n)) < 0)
+        fprintf(stderr, "Error writing eventfd: %s\n", strerror(errno));
+}
+
+void blockstore_thread_t::wakeup_outer()
+{
+    uint64_t n = 1;
+    if (write(complete_eventfd, &n, sizeof(n)) < 0)
+        fprintf(stderr, "Error writing eventfd: %s\n", strerror(errno));
+}
+
+// Called in the blockstore thread
+void blockstore_thread_t::handle_submit()
+{
+    uint64_t n = 0;
+    if (read(submit_eventfd, &n, sizeof(n)) < 0 && errno != EAGAIN && errno != EINTR)
+        fprintf(stderr, "Error resetting eventfd: %s\n", strerror(errno));
+    submit_queued();
+}
+
+// Hand queued operations over to the blockstore, called with <mu> locked
+void blockstore_thread_t::submit_queued()
+{
+    queue_mu.lock();
+    submit_queue2.swap(submit_queue);
+    queue_mu.unlock();
+    for (auto op: submit_queue2)
+    {
+        bs->enqueue_op(op);
+    }
+    submit_queue2.clear();
+}
+
+// Called in the caller's thread
+void blockstore_thread_t::handle_complete()
+{
+    uint64_t n = 0;
+    if (read(complete_eventfd, &n, sizeof(n)) < 0 && errno != EAGAIN && errno != EINTR)
+        fprintf(stderr, "Error resetting eventfd: %s\n", strerror(errno));
+    queue_mu.lock();
+    complete_queue2.swap(complete_queue);
+    queue_mu.unlock();
+    for (auto & c: complete_queue2)
+    {
+        blockstore_op_t *op = c.first;
+        op->callback.swap(callbacks[c.second]);
+        callbacks[c.second] = NULL;
+        free_callbacks.push_back(c.second);
+        std::function<void (blockstore_op_t*)>(op->callback)(op);
+    }
+    complete_queue2.clear();
+    outer_loop->wakeup();
+}
+
+void blockstore_thread_t::enqueue_op(blockstore_op_t *op)
+{
+    // Keep the original callback in our thread and replace it with a handoff
+    int slot;
+    if (free_callbacks.size())
+    {
+        slot = free_callbacks.back();
+        free_callbacks.pop_back();
+    }
+    else
+    {
+        slot = callbacks.size();
+        callbacks.emplace_back();
+    }
+    callbacks[slot].swap(op->callback);
+    op->callback = [this, slot](blockstore_op_t *op)
+    {
+        queue_mu.lock();
+        complete_queue.push_back({ op, slot });
+        bool wake = complete_queue.size() == 1;
+        queue_mu.unlock();
+        if (wake)
+            wakeup_outer();
+    };
+    queue_mu.lock();
+    submit_queue.push_back(op);
+    bool wake = submit_queue.size() == 1;
+    queue_mu.unlock();
+    if (wake)
+        wakeup_thread();
+}
+
+void blockstore_thread_t::parse_config(blockstore_config_t & config)
+{
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        bs->parse_config(config);
+    }
+    wakeup_thread();
+}
+
+void* blockstore_thread_t::reshard_start(pool_id_t pool, uint32_t pg_count, uint32_t pg_stripe_size, uint64_t chunk_limit)
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->reshard_start(pool, pg_count, pg_stripe_size, chunk_limit);
+}
+
+bool blockstore_thread_t::reshard_continue(void *reshard_state, uint64_t chunk_limit)
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->reshard_continue(reshard_state, chunk_limit);
+}
+
+void blockstore_thread_t::loop()
+{
+    wakeup_thread();
+}
+
+bool blockstore_thread_t::is_started()
+{
+    return started;
+}
+
+bool blockstore_thread_t::is_stalled()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->is_stalled();
+}
+
+bool blockstore_thread_t::is_safe_to_stop()
+{
+    bool safe;
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        safe = bs->is_safe_to_stop();
+    }
+    if (!safe)
+        wakeup_thread();
+    return safe;
+}
+
+int blockstore_thread_t::read_bitmap(object_id oid, uint64_t target_version, void *bitmap, uint64_t *result_version)
+{
+    std::lock_guard<std::mutex> lk(mu);
+    // Operations submitted earlier must be visible, like with a blockstore in the same thread.
+    // The blockstore thread is already woken up by enqueue_op() to run them
+    submit_queued();
+    return bs->read_bitmap(oid, target_version, bitmap, result_version);
+}
+
+const std::map<uint64_t, uint64_t> & blockstore_thread_t::get_inode_space_stats()
+{
+    // Return a copy because the original is modified by the blockstore thread
+    std::lock_guard<std::mutex> lk(mu);
+    inode_space_stats = bs->get_inode_space_stats();
+    return inode_space_stats;
+}
+
+void blockstore_thread_t::set_no_inode_stats(const std::vector<uint64_t> & pool_ids)
+{
+    std::lock_guard<std::mutex> lk(mu);
+    bs->set_no_inode_stats(pool_ids);
+}
+
+void blockstore_thread_t::dump_diagnostics()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    bs->dump_diagnostics();
+}
+
+std::string blockstore_thread_t::get_op_diag(blockstore_op_t *op)
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->get_op_diag(op);
+}
+
+uint32_t blockstore_thread_t::get_block_size()
+{
+    return bs->get_block_size();
+}
+
+uint64_t blockstore_thread_t::get_block_count()
+{
+    return bs->get_block_count();
+}
+
+uint64_t blockstore_thread_t::get_free_block_count()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->get_free_block_count();
+}
+
+uint64_t blockstore_thread_t::get_journal_size()
+{
+    return bs->get_journal_size();
+}
+
+uint32_t blockstore_thread_t::get_bitmap_granularity()
+{
+    return bs->get_bitmap_granularity();
+}
+
+uint64_t blockstore_thread_t::get_live_entries()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->get_live_entries();
+}
+
+uint64_t blockstore_thread_t::get_live_memory()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->get_live_memory();
+}
+
+uint64_t blockstore_thread_t::get_garbage_entries()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->get_garbage_entries();
+}
+
+uint64_t blockstore_thread_t::get_garbage_memory()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->get_garbage_memory();
+}
+
+blockstore_compaction_stats_t blockstore_thread_t::get_compaction_stats()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->get_compaction_stats();
+}
+
+blockstore_meta_write_stats_t blockstore_thread_t::get_meta_write_stats()
+{
+    std::lock_guard<std::mutex> lk(mu);
+    return bs->get_meta_write_stats();
+}
@@ -0,0 +1,84 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "blockstore.h"
+
+class epoll_manager_t;
+
+// Runs a blockstore in a separate thread with its own io_uring and event loop.
+// The ring and the blockstore are created in that thread, so that single issuer rings work.
+// Operations are handed over through a queue and an eventfd, and their callbacks
+// are called back in the caller's thread. Other methods take a lock which the blockstore
+// thread only holds while running blockstore callbacks.
+class blockstore_thread_t: public blockstore_i
+{
+    blockstore_i *bs = NULL;
+    ring_loop_i *outer_loop = NULL;
+    timerfd_manager_t *outer_tfd = NULL;
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    std::thread thread;
+    // Held by the blockstore thread while it runs completion callbacks and consumers
+    std::mutex mu;
+    bool stopped = false;
+    // Set by the blockstore thread when the blockstore is created or failed to be created
+    bool created = false;
+    std::condition_variable created_cond;
+    std::exception_ptr create_error;
+    std::atomic<bool> started { false };
+    // Protects submit and completion queues
+    std::mutex queue_mu;
+    std::vector<blockstore_op_t*> submit_queue, submit_queue2;
+    std::vector<std::pair<blockstore_op_t*, int>> complete_queue, complete_queue2;
+    int submit_eventfd = -1, complete_eventfd = -1;
+    // Original callbacks of submitted operations, only accessed in the caller's thread
+    std::vector<std::function<void(blockstore_op_t*)>> callbacks;
+    std::vector<int> free_callbacks;
+    std::map<uint64_t, uint64_t> inode_space_stats;
+
+    void run(blockstore_config_t & config, ring_loop_config_t ring_config);
+    void init(blockstore_config_t & config, const ring_loop_config_t & ring_config);
+    void submit_queued();
+    void handle_submit();
+    void handle_complete();
+    void wakeup_thread();
+    void wakeup_outer();
+public:
+    blockstore_thread_t(blockstore_config_t & config, ring_loop_i *outer_loop, timerfd_manager_t *outer_tfd,
+        const ring_loop_config_t & ring_config = ring_loop_config_t());
+    ~blockstore_thread_t();
+
+    void parse_config(blockstore_config_t & config);
+    void* reshard_start(pool_id_t pool, uint32_t pg_count, uint32_t pg_stripe_size, uint64_t chunk_limit);
+    bool reshard_continue(void *reshard_state, uint64_t chunk_limit);
+    void loop();
+    bool is_started();
+    bool is_stalled();
+    bool is_safe_to_stop();
+    void enqueue_op(blockstore_op_t *op);
+    int read_bitmap(object_id oid, uint64_t target_version, void *bitmap, uint64_t *result_version = NULL);
+    const std::map<uint64_t, uint64_t> & get_inode_space_stats();
+    void set_no_inode_stats(const std::vector<uint64_t> & pool_ids);
+    void dump_diagnostics();
+    std::string get_op_diag(blockstore_op_t *op);
+    uint32_t get_block_size();
+    uint64_t get_block_count();
+    uint64_t get_free_block_count();
+    uint64_t get_journal_size();
+    uint32_t get_bitmap_granularity();
+    uint64_t get_live_entries();
+    uint64_t get_live_memory();
+    uint64_t get_garbage_entries();
+    uint64_t get_garbage_memory();
+    blockstore_compaction_stats_t get_compaction_stats();
+    blockstore_meta_write_stats_t get_meta_write_stats();
+};
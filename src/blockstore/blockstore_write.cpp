@@ -5,6 +5,8 @@
 #include "blockstore_internal.h"
 #include "allocator.h"
 
+#include <algorithm>
+
 #define _REDIRECT_INTENT 0x101
 
 bool blockstore_impl_t::enqueue_write(blockstore_op_t *op)
@@ -17,33 +19,75 @@ void blockstore_impl_t::prepare_meta_block_write(uint32_t modified_block)
 {
     if (modified_blocks.find(modified_block) != modified_blocks.end())
         return;
-    io_uring_sqe *sqe = get_sqe();
-    assert(sqe != NULL);
-    ring_data_t *data = ((ring_data_t*)sqe->user_data);
-    uint8_t *buf = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, dsk.meta_block_size);
-    data->iov = (struct iovec){ buf, (size_t)dsk.meta_block_size };
-    data->callback = [this, modified_block](ring_data_t *data)
+    assert(((uint64_t)modified_block+2)*dsk.meta_block_size <= dsk.meta_area_size);
+    unsynced_meta_write_count++;
+    pending_modified_blocks.push_back(modified_block);
+    modified_blocks[modified_block] = { .sent = false };
+}
+
+// Group commit: blocks modified during one event loop iteration are written at its end,
+// sorted and with adjacent blocks merged into single writes
+void blockstore_impl_t::submit_meta_block_writes()
+{
+    if (!pending_modified_blocks.size())
+        return;
+    std::sort(pending_modified_blocks.begin(), pending_modified_blocks.end());
+    size_t pos = 0;
+    while (pos < pending_modified_blocks.size())
     {
-        live = true;
-        if (data->res != data->iov.iov_len)
+        uint32_t first_block = pending_modified_blocks[pos];
+        uint32_t count = 1;
+        while (pos+count < pending_modified_blocks.size() && count < meta_write_merge_blocks &&
+            pending_modified_blocks[pos+count] == first_block+count)
+        {
+            count++;
+        }
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe)
         {
-            // FIXME: our state becomes corrupted after a write error. maybe do something better than just die
-            disk_error_abort("data write", data->res, data->iov.iov_len);
+            // Ring is full, submit the rest in the next iteration
+            break;
         }
-        auto it = modified_blocks.find(modified_block);
+        ring_data_t *data = ((ring_data_t*)sqe->user_data);
+        uint8_t *buf = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, (size_t)count*dsk.meta_block_size);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            heap->get_meta_block(first_block+i, buf + (size_t)i*dsk.meta_block_size);
+            heap->start_block_write(first_block+i);
+            modified_blocks[first_block+i].sent = true;
+        }
+        data->iov = (struct iovec){ buf, (size_t)count*dsk.meta_block_size };
+        data->set_callback([](void *bs, void *blocks, ring_data_t *data)
+        {
+            ((blockstore_impl_t*)bs)->handle_meta_block_write(data, (uint32_t)(uint64_t)blocks, (uint32_t)((uint64_t)blocks >> 32));
+        }, this, (void*)((uint64_t)first_block | ((uint64_t)count << 32)));
+        io_uring_prep_writev(
+            sqe, dsk.meta_fd, &data->iov, 1, dsk.meta_offset + ((uint64_t)first_block+1)*dsk.meta_block_size
+        );
+        meta_write_count++;
+        meta_write_block_count += count;
+        pos += count;
+    }
+    pending_modified_blocks.erase(pending_modified_blocks.begin(), pending_modified_blocks.begin()+pos);
+}
+
+void blockstore_impl_t::handle_meta_block_write(ring_data_t *data, uint32_t first_block, uint32_t count)
+{
+    live = true;
+    if (data->res != data->iov.iov_len)
+    {
+        // FIXME: our state becomes corrupted after a write error. maybe do something better than just die
+        disk_error_abort("data write", data->res, data->iov.iov_len);
+    }
+    free(data->iov.iov_base);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        auto it = modified_blocks.find(first_block+i);
         assert(it != modified_blocks.end());
-        free(it->second.buf);
         modified_blocks.erase(it);
-        heap->complete_block_write(modified_block);
-        ringloop->wakeup();
-    };
-    assert(((uint64_t)modified_block+2)*dsk.meta_block_size <= dsk.meta_area_size);
-    io_uring_prep_writev(
-        sqe, dsk.meta_fd, &data->iov, 1, dsk.meta_offset + ((uint64_t)modified_block+1)*dsk.meta_block_size
-    );
-    unsynced_meta_write_count++;
-    pending_modified_blocks.push_back(modified_block);
-    modified_blocks[modified_block] = { .sent = false, .buf = buf };
+        heap->complete_block_write(first_block+i);
+    }
+    ringloop->wakeup();
 }
 
 bool blockstore_impl_t::meta_block_is_pending(uint32_t modified_block)
@@ -52,6 +96,27 @@ bool blockstore_impl_t::meta_block_is_pending(uint32_t modified_block)
     return mb_it != modified_blocks.end();
 }
 
+void blockstore_impl_t::continue_deferred_cleanup()
+{
+    // Regular operations are submitted first, so they have priority over the cleanup.
+    // Blocks only go to the group commit queue here, so ring space doesn't matter, but the
+    // number of queued and in-flight metadata block writes is limited
+    while (deferred_cleanup_pos < deferred_cleanup_blocks.size() &&
+        modified_blocks.size() < meta_write_recheck_parallelism)
+    {
+        // Blocks already being written are skipped: their new contents are taken from the heap
+        // at submission time and are thus already cleared
+        prepare_meta_block_write(deferred_cleanup_blocks[deferred_cleanup_pos++]);
+    }
+    if (deferred_cleanup_pos >= deferred_cleanup_blocks.size())
+    {
+        printf("Background metadata cleanup finished: %zu blocks rewritten\n", deferred_cleanup_blocks.size());
+        deferred_cleanup_blocks.clear();
+        deferred_cleanup_blocks.shrink_to_fit();
+        deferred_cleanup_pos = 0;
+    }
+}
+
 bool blockstore_impl_t::intent_write_allowed(blockstore_op_t *op, heap_entry_t *obj)
 {
     // Parallel writes to the same object are forbidden so "one intent at a time" is fulfilled automatically
@@ -177,7 +242,7 @@ enospc:
         io_uring_sqe *sqe = get_sqe();
         ring_data_t *data = ((ring_data_t*)sqe->user_data);
         data->iov = (struct iovec){ op->buf, op->len };
-        data->callback = [this, op](ring_data_t *data) { handle_write_event(data, op); };
+        data->set_callback(handle_write_cb, this, op);
         assert(loc+op->offset+op->len <= dsk.block_count*dsk.data_block_size);
         io_uring_prep_writev(sqe, dsk.data_fd, &data->iov, 1, dsk.data_offset + loc + op->offset);
         PRIV(op)->pending_ops++;
@@ -265,7 +330,7 @@ enospc:
             }
             BS_SUBMIT_GET_SQE(sqe2, data2);
             data2->iov = (struct iovec){ op->buf, op->len };
-            data2->callback = [this, op](ring_data_t *data) { handle_write_event(data, op); };
+            data2->set_callback(handle_write_cb, this, op);
             assert(loc+op->len <= dsk.journal_len);
             io_uring_prep_writev(sqe2, dsk.journal_fd, &data2->iov, 1, dsk.journal_offset + loc);
             PRIV(op)->pending_ops++;
@@ -341,11 +406,11 @@ resume_12:
         BS_SUBMIT_GET_SQE(sqe, data);
         io_uring_prep_fsync(sqe, dsk.data_fd, IORING_FSYNC_DATASYNC);
         data->iov = { 0 };
-        data->callback = [this, op](ring_data_t *data)
+        data->set_callback([](void *bs, void *op, ring_data_t *data)
         {
-            fsyncing_data = false;
-            handle_write_event(data, op);
-        };
+            ((blockstore_impl_t*)bs)->fsyncing_data = false;
+            ((blockstore_impl_t*)bs)->handle_write_event(data, (blockstore_op_t*)op);
+        }, this, op);
         PRIV(op)->pending_ops++;
         PRIV(op)->op_state = 3;
         return 1;
@@ -455,7 +520,7 @@ resume_10:
     // LSN is not marked as completed so big_write won't be freed
     BS_SUBMIT_GET_SQE(sqe, data);
     data->iov = (struct iovec){ op->buf, op->len };
-    data->callback = [this, op](ring_data_t *data) { handle_write_event(data, op); };
+    data->set_callback(handle_write_cb, this, op);
     assert(PRIV(op)->location + op->offset <= dsk.block_count*dsk.data_block_size);
     io_uring_prep_writev(sqe, dsk.data_fd, &data->iov, 1, dsk.data_offset + PRIV(op)->location + op->offset);
     if (dsk.use_atomic_flag)
@@ -168,7 +168,7 @@ static int bs_init(struct thread_data *td)
     }
     bsd->bitmap = (uint8_t*)malloc_or_die(MAX_DATA_BLOCK_SIZE/512/8);
     memset(bsd->bitmap, 0, MAX_DATA_BLOCK_SIZE/512/8);
-    bsd->ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
+    bsd->ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false, blockstore_i::needs_sqe128(config));
     bsd->epmgr = new epoll_manager_t(bsd->ringloop);
     bsd->bs = blockstore_i::create(config, bsd->ringloop, bsd->epmgr->tfd);
     bsd->block_size = bsd->bs->get_block_size();
@@ -36,27 +36,33 @@ journal_flusher_t::journal_flusher_t(blockstore_impl_t *bs)
 journal_flusher_co::journal_flusher_co()
 {
     wait_state = 0;
-    simple_callback_r = [this](ring_data_t* data)
-    {
-        bs->live = true;
-        if (data->res != data->iov.iov_len)
-            bs->disk_error_abort("read operation during flush", data->res, data->iov.iov_len);
-        wait_count--;
-    };
-    simple_callback_rj = [this](ring_data_t* data)
-    {
-        bs->live = true;
-        if (data->res != data->iov.iov_len)
-            bs->disk_error_abort("read operation during flush", data->res, data->iov.iov_len);
-        wait_journal_count--;
-    };
-    simple_callback_w = [this](ring_data_t* data)
-    {
-        bs->live = true;
-        if (data->res != data->iov.iov_len)
-            bs->disk_error_abort("write operation during flush", data->res, data->iov.iov_len);
-        wait_count--;
-    };
+}
+
+void journal_flusher_co::simple_callback_r(void *co, void *unused, ring_data_t* data)
+{
+    auto self = (journal_flusher_co*)co;
+    self->bs->live = true;
+    if (data->res != data->iov.iov_len)
+        self->bs->disk_error_abort("read operation during flush", data->res, data->iov.iov_len);
+    self->wait_count--;
+}
+
+void journal_flusher_co::simple_callback_rj(void *co, void *unused, ring_data_t* data)
+{
+    auto self = (journal_flusher_co*)co;
+    self->bs->live = true;
+    if (data->res != data->iov.iov_len)
+        self->bs->disk_error_abort("read operation during flush", data->res, data->iov.iov_len);
+    self->wait_journal_count--;
+}
+
+void journal_flusher_co::simple_callback_w(void *co, void *unused, ring_data_t* data)
+{
+    auto self = (journal_flusher_co*)co;
+    self->bs->live = true;
+    if (data->res != data->iov.iov_len)
+        self->bs->disk_error_abort("write operation during flush", data->res, data->iov.iov_len);
+    self->wait_count--;
 }
 
 journal_flusher_t::~journal_flusher_t()
@@ -519,7 +525,7 @@ resume_2:
             {
                 await_sqe(15);
                 data->iov = (struct iovec){ it->buf, (size_t)it->len };
-                data->callback = simple_callback_w;
+                data->set_callback(simple_callback_w, this);
                 assert(clean_loc+it->offset+it->len <= bs->dsk.block_count*bs->dsk.data_block_size);
                 io_uring_prep_writev(
                     sqe, bs->dsk.data_fd, &data->iov, 1, bs->dsk.data_offset + clean_loc + it->offset
@@ -749,7 +755,7 @@ bool journal_flusher_co::write_meta_block(flusher_meta_write_t & meta_block, int
         goto resume_0;
     await_sqe(0);
     data->iov = (struct iovec){ meta_block.buf, (size_t)bs->dsk.meta_block_size };
-    data->callback = simple_callback_w;
+    data->set_callback(simple_callback_w, this);
     assert(bs->dsk.meta_block_size + meta_block.sector + bs->dsk.meta_block_size <= bs->dsk.meta_area_size);
     io_uring_prep_writev(
         sqe, bs->dsk.meta_fd, &data->iov, 1, bs->dsk.meta_offset + bs->dsk.meta_block_size + meta_block.sector
@@ -1133,7 +1139,7 @@ bool journal_flusher_co::read_dirty(int wait_base)
         assert(vi.len != 0);
         vi.buf = memalign_or_die(MEM_ALIGNMENT, vi.len);
         data->iov = (struct iovec){ vi.buf, (size_t)vi.len };
-        data->callback = simple_callback_r;
+        data->set_callback(simple_callback_r, this);
         io_uring_prep_readv(
             sqe, bs->dsk.data_fd, &data->iov, 1, bs->dsk.data_offset + old_clean_loc + vi.offset
         );
@@ -1165,7 +1171,7 @@ bool journal_flusher_co::read_dirty(int wait_base)
                     v[i].buf = memalign_or_die(MEM_ALIGNMENT, v[i].len);
                 await_sqe(1);
                 data->iov = (struct iovec){ v[i].buf, (size_t)v[i].len };
-                data->callback = simple_callback_rj;
+                data->set_callback(simple_callback_rj, this);
                 io_uring_prep_readv(
                     sqe, bs->dsk.journal_fd, &data->iov, 1, bs->journal.offset + v[i].disk_offset
                 );
@@ -1257,7 +1263,7 @@ bool journal_flusher_co::modify_meta_read(uint64_t meta_loc, flusher_meta_write_
         }).first;
         await_sqe(0);
         data->iov = (struct iovec){ wr.it->second.buf, (size_t)bs->dsk.meta_block_size };
-        data->callback = simple_callback_r;
+        data->set_callback(simple_callback_r, this);
         wr.submitted = true;
         io_uring_prep_readv(
             sqe, bs->dsk.meta_fd, &data->iov, 1, bs->dsk.meta_offset + bs->dsk.meta_block_size + wr.sector
@@ -1356,7 +1362,7 @@ bool journal_flusher_co::fsync_batch(bool fsync_meta, int wait_base)
                 // Sync batch is ready. Do it.
                 await_sqe(0);
                 data->iov = { 0 };
-                data->callback = simple_callback_w;
+                data->set_callback(simple_callback_w, this);
                 io_uring_prep_fsync(sqe, fsync_meta ? bs->dsk.meta_fd : bs->dsk.data_fd, IORING_FSYNC_DATASYNC);
                 cur_sync->state = 1;
                 wait_count++;
@@ -1432,7 +1438,7 @@ bool journal_flusher_co::trim_journal(int wait_base)
             };
             ((journal_entry_start*)flusher->journal_superblock)->crc32 = je_crc32((journal_entry*)flusher->journal_superblock);
             data->iov = (struct iovec){ flusher->journal_superblock, (size_t)bs->dsk.journal_block_size };
-            data->callback = simple_callback_w;
+            data->set_callback(simple_callback_w, this);
             io_uring_prep_writev(sqe, bs->dsk.journal_fd, &data->iov, 1, bs->journal.offset);
             wait_count++;
         resume_2:
@@ -1446,7 +1452,7 @@ bool journal_flusher_co::trim_journal(int wait_base)
                 await_sqe(3);
                 io_uring_prep_fsync(sqe, bs->dsk.journal_fd, IORING_FSYNC_DATASYNC);
                 data->iov = { 0 };
-                data->callback = simple_callback_w;
+                data->set_callback(simple_callback_w, this);
                 wait_count++;
             resume_4:
                 if (wait_count > 0)
@@ -50,7 +50,9 @@ class journal_flusher_co
     obj_ver_id cur;
     std::map<obj_ver_id, dirty_entry>::iterator dirty_it, dirty_start, dirty_end;
     std::map<object_id, uint64_t>::iterator repeat_it;
-    std::function<void(ring_data_t*)> simple_callback_r, simple_callback_rj, simple_callback_w;
+    static void simple_callback_r(void *co, void *unused, ring_data_t* data);
+    static void simple_callback_rj(void *co, void *unused, ring_data_t* data);
+    static void simple_callback_w(void *co, void *unused, ring_data_t* data);
 
     bool try_trim = false;
     bool skip_copy, has_delete, has_writes;
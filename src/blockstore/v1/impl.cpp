@@ -880,4 +880,16 @@ uint64_t blockstore_impl_t::get_garbage_memory()
     return (sizeof(obj_ver_id) + sizeof(dirty_entry) + 32) * dirty_db.size();
 }
 
+blockstore_compaction_stats_t blockstore_impl_t::get_compaction_stats()
+{
+    // The old store flushes the journal without a scheduler
+    return blockstore_compaction_stats_t();
+}
+
+blockstore_meta_write_stats_t blockstore_impl_t::get_meta_write_stats()
+{
+    // Metadata writes of the old store are batched by the journal
+    return blockstore_meta_write_stats_t();
+}
+
 } // namespace v1
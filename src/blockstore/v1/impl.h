@@ -207,6 +207,10 @@ class blockstore_impl_t: public blockstore_i
     // Journaling
     void prepare_journal_sector_write(int sector, blockstore_op_t *op);
     void handle_journal_write(ring_data_t *data, uint64_t flush_id);
+    static void handle_journal_write_cb(void *bs, void *flush_id, ring_data_t *data)
+    {
+        ((blockstore_impl_t*)bs)->handle_journal_write(data, (uint64_t)flush_id);
+    }
     void disk_error_abort(const char *op, int retval, int expected);
 
     // Asynchronous init
@@ -247,6 +251,10 @@ class blockstore_impl_t: public blockstore_i
     int fulfill_read_push(blockstore_op_t *op, void *buf, uint64_t offset, uint64_t len,
         uint32_t item_state, uint64_t item_version);
     void handle_read_event(ring_data_t *data, blockstore_op_t *op);
+    static void handle_read_cb(void *bs, void *op, ring_data_t *data)
+    {
+        ((blockstore_impl_t*)bs)->handle_read_event(data, (blockstore_op_t*)op);
+    }
 
     // Write
     bool enqueue_write(blockstore_op_t *op);
@@ -256,6 +264,10 @@ class blockstore_impl_t: public blockstore_i
     int continue_write(blockstore_op_t *op);
     void release_journal_sectors(blockstore_op_t *op);
     void handle_write_event(ring_data_t *data, blockstore_op_t *op);
+    static void handle_write_cb(void *bs, void *op, ring_data_t *data)
+    {
+        ((blockstore_impl_t*)bs)->handle_write_event(data, (blockstore_op_t*)op);
+    }
 
     // Sync
     int continue_sync(blockstore_op_t *op);
@@ -336,6 +348,8 @@ public:
     uint64_t get_live_memory();
     uint64_t get_garbage_entries();
     uint64_t get_garbage_memory();
+    blockstore_compaction_stats_t get_compaction_stats();
+    blockstore_meta_write_stats_t get_meta_write_stats();
 };
 
 } // namespace v1
@@ -192,7 +192,7 @@ void blockstore_impl_t::prepare_journal_sector_write(int cur_sector, blockstore_
                 : (uint8_t*)journal.sector_buf + journal.block_size*cur_sector),
             (size_t)journal.block_size
         };
-        data->callback = [this, flush_id = journal.submit_id](ring_data_t *data) { handle_journal_write(data, flush_id); };
+        data->set_callback(handle_journal_write_cb, this, (void*)journal.submit_id);
         assert(journal.sector_info[cur_sector].offset+journal.block_size <= dsk.journal_len);
         io_uring_prep_writev(
             sqe, dsk.journal_fd, &data->iov, 1, journal.offset + journal.sector_info[cur_sector].offset
@@ -367,7 +367,7 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
             PRIV(op)->iov_zerofill[vcnt++] = (struct iovec){ zero_object, (size_t)stripe_end };
         }
         data->iov.iov_len = op->len + stripe_offset + stripe_end; // to check it in the callback
-        data->callback = [this, op](ring_data_t *data) { handle_write_event(data, op); };
+        data->set_callback(handle_write_cb, this, op);
         const uint64_t write_offset = (loc * dsk.data_block_size) + op->offset - stripe_offset;
         assert(write_offset+op->len+stripe_offset+stripe_end <= dsk.block_count*dsk.data_block_size);
         io_uring_prep_writev(sqe, dsk.data_fd, PRIV(op)->iov_zerofill, vcnt, dsk.data_offset + write_offset);
@@ -494,7 +494,7 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
                 .sector = -1,
                 .op = op,
             });
-            data2->callback = [this, flush_id = journal.submit_id](ring_data_t *data) { handle_journal_write(data, flush_id); };
+            data2->set_callback(handle_journal_write_cb, this, (void*)journal.submit_id);
             assert(journal.next_free+op->len <= dsk.journal_len);
             io_uring_prep_writev(sqe2, dsk.journal_fd, &data2->iov, 1, journal.offset + journal.next_free);
             PRIV(op)->pending_ops++;
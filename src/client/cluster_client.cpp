@@ -14,6 +14,8 @@
 cluster_client_t::cluster_client_t(ring_loop_t *ringloop, timerfd_manager_t *tfd, json11::Json config)
 {
     wb = new writeback_cache_t();
+    read_cache = new read_cache_t();
+    readahead = new readahead_t();
 
     cli_config = config.object_items();
     file_config = osd_messenger_t::read_config(config);
@@ -97,6 +99,10 @@ cluster_client_t::~cluster_client_t()
     free(scrap_buffer);
     delete wb;
     wb = NULL;
+    delete read_cache;
+    read_cache = NULL;
+    delete readahead;
+    readahead = NULL;
 }
 
 cluster_op_t::~cluster_op_t()
@@ -180,8 +186,44 @@ void cluster_client_t::init_msgr()
     }
 }
 
+void cluster_op_list_t::push_back(cluster_op_t *op, cluster_op_link_t cluster_op_t::*link)
+{
+    (op->*link).prev = tail;
+    (op->*link).next = NULL;
+    if (tail)
+        (tail->*link).next = op;
+    else
+        head = op;
+    tail = op;
+}
+
+void cluster_op_list_t::push_front(cluster_op_t *op, cluster_op_link_t cluster_op_t::*link)
+{
+    (op->*link).prev = NULL;
+    (op->*link).next = head;
+    if (head)
+        (head->*link).prev = op;
+    else
+        tail = op;
+    head = op;
+}
+
+void cluster_op_list_t::erase(cluster_op_t *op, cluster_op_link_t cluster_op_t::*link)
+{
+    if ((op->*link).prev)
+        ((op->*link).prev->*link).next = (op->*link).next;
+    else
+        head = (op->*link).next;
+    if ((op->*link).next)
+        ((op->*link).next->*link).prev = (op->*link).prev;
+    else
+        tail = (op->*link).prev;
+    (op->*link).prev = (op->*link).next = NULL;
+}
+
 void cluster_client_t::unshift_op(cluster_op_t *op)
 {
+    op->seq = op_queue_head ? op_queue_head->seq-1 : next_op_seq++;
     op->next = op_queue_head;
     if (op_queue_head)
     {
@@ -190,36 +232,74 @@ void cluster_client_t::unshift_op(cluster_op_t *op)
     }
     else
         op_queue_tail = op_queue_head = op;
-    inc_wait(op->opcode, op->flags, op->next, 1);
+    // Following operations wait for it automatically because it becomes the head of barrier lists
+    add_barrier(op, true);
+}
+
+void cluster_client_t::add_barrier(cluster_op_t *op, bool front)
+{
+    if (op->opcode != OSD_OP_SYNC && (op->flags & OP_IMMEDIATE_COMMIT) && !enable_writeback)
+    {
+        // Immediately committed writes don't have to be synced, so SYNCs don't wait for them
+        return;
+    }
+    op->is_barrier = true;
+    auto & list = op->opcode == OSD_OP_SYNC ? sync_barriers : write_barriers;
+    if (front)
+        list.push_front(op, &cluster_op_t::barrier_link);
+    else
+        list.push_back(op, &cluster_op_t::barrier_link);
+    if (op->opcode != OSD_OP_SYNC && (op->flags & OP_FLUSH_BUFFER))
+    {
+        if (front)
+            flush_barriers.push_front(op, &cluster_op_t::flush_link);
+        else
+            flush_barriers.push_back(op, &cluster_op_t::flush_link);
+    }
+}
+
+void cluster_client_t::remove_barrier(cluster_op_t *op)
+{
+    op->is_barrier = false;
+    if (op->opcode == OSD_OP_SYNC)
+        sync_barriers.erase(op, &cluster_op_t::barrier_link);
+    else
+    {
+        write_barriers.erase(op, &cluster_op_t::barrier_link);
+        if (op->flags & OP_FLUSH_BUFFER)
+            flush_barriers.erase(op, &cluster_op_t::flush_link);
+    }
+}
+
+bool cluster_client_t::is_blocked(cluster_op_t *op)
+{
+    if (!op->is_barrier)
+        return false;
+    if (sync_barriers.head && sync_barriers.head->seq < op->seq)
+        return true;
+    if (op->opcode == OSD_OP_SYNC)
+        return write_barriers.head && write_barriers.head->seq < op->seq;
+    if (!(op->flags & OP_FLUSH_BUFFER))
+        return flush_barriers.head && flush_barriers.head->seq < op->seq;
+    return false;
 }
 
 void cluster_client_t::calc_wait(cluster_op_t *op)
 {
-    op->prev_wait = 0;
     if (op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE)
     {
-        for (auto prev = op->prev; prev; prev = prev->prev)
-        {
-            if (prev->opcode == OSD_OP_SYNC ||
-                (prev->opcode == OSD_OP_WRITE || prev->opcode == OSD_OP_DELETE) && !(op->flags & OP_FLUSH_BUFFER) && (prev->flags & OP_FLUSH_BUFFER))
-            {
-                op->prev_wait++;
-            }
-        }
-        if (!op->prev_wait)
+        add_barrier(op, false);
+        if (is_blocked(op))
+            (op->flags & OP_FLUSH_BUFFER ? waiting_flushes : waiting_writes).push_back(op);
+        else
             continue_rw(op);
     }
     else if (op->opcode == OSD_OP_SYNC)
     {
-        for (auto prev = op->prev; prev; prev = prev->prev)
-        {
-            if (prev->opcode == OSD_OP_SYNC || (prev->opcode == OSD_OP_WRITE || prev->opcode == OSD_OP_DELETE) &&
-                (!(prev->flags & OP_IMMEDIATE_COMMIT) || enable_writeback))
-            {
-                op->prev_wait++;
-            }
-        }
-        if (!op->prev_wait)
+        add_barrier(op, false);
+        if (is_blocked(op))
+            waiting_syncs.push_back(op);
+        else
             continue_sync(op);
     }
     else /* if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP) */
@@ -228,61 +308,51 @@ void cluster_client_t::calc_wait(cluster_op_t *op)
     }
 }
 
-void cluster_client_t::inc_wait(uint64_t opcode, uint64_t flags, cluster_op_t *next, int inc)
+void cluster_client_t::continue_waiting()
 {
-    if (opcode != OSD_OP_WRITE && opcode != OSD_OP_DELETE && opcode != OSD_OP_SYNC)
-    {
-        return;
-    }
-    cluster_op_t *bh_ops_local[32], **bh_ops = bh_ops_local;
-    int bh_op_count = 0, bh_op_max = 32;
-    while (next)
+    // Waiting lists are sorted by queue position, so only their heads have to be checked
+    bool progress = true;
+    while (progress)
     {
-        auto n2 = next->next;
-        if ((opcode == OSD_OP_WRITE || opcode == OSD_OP_DELETE)
-            ? (next->opcode == OSD_OP_SYNC && (!(flags & OP_IMMEDIATE_COMMIT) || enable_writeback) ||
-                (next->opcode == OSD_OP_WRITE || next->opcode == OSD_OP_DELETE) && (flags & OP_FLUSH_BUFFER) && !(next->flags & OP_FLUSH_BUFFER))
-            : (next->opcode == OSD_OP_SYNC || next->opcode == OSD_OP_WRITE || next->opcode == OSD_OP_DELETE))
+        progress = false;
+        if (waiting_syncs.size() && !is_blocked(waiting_syncs.front()))
         {
-            next->prev_wait += inc;
-            assert(next->prev_wait >= 0);
-            if (!next->prev_wait)
-            {
-                // Kind of std::vector with local "small vector optimisation"
-                if (bh_op_count >= bh_op_max)
-                {
-                    bh_op_max *= 2;
-                    cluster_op_t **n = (cluster_op_t**)malloc_or_die(sizeof(cluster_op_t*) * bh_op_max);
-                    memcpy(n, bh_ops, sizeof(cluster_op_t*) * bh_op_count);
-                    if (bh_ops != bh_ops_local)
-                    {
-                        free(bh_ops);
-                    }
-                    bh_ops = n;
-                }
-                bh_ops[bh_op_count++] = next;
-            }
+            cluster_op_t *op = waiting_syncs.front();
+            waiting_syncs.pop_front();
+            continue_sync(op);
+            progress = true;
+        }
+        if (waiting_flushes.size() && !is_blocked(waiting_flushes.front()))
+        {
+            cluster_op_t *op = waiting_flushes.front();
+            waiting_flushes.pop_front();
+            continue_rw(op);
+            progress = true;
+        }
+        if (waiting_writes.size() && !is_blocked(waiting_writes.front()))
+        {
+            cluster_op_t *op = waiting_writes.front();
+            waiting_writes.pop_front();
+            continue_rw(op);
+            progress = true;
         }
-        next = n2;
-    }
-    for (int i = 0; i < bh_op_count; i++)
-    {
-        cluster_op_t *next = bh_ops[i];
-        if (next->opcode == OSD_OP_SYNC)
-            continue_sync(next);
-        else
-            continue_rw(next);
     }
-    if (bh_ops != bh_ops_local)
+}
+
+void cluster_client_t::queue_retry(cluster_op_t *op)
+{
+    if (!op->retry_queued)
     {
-        free(bh_ops);
+        op->retry_queued = true;
+        op->retry_epoch = retry_epoch;
+        retry_ops.push_back(op, &cluster_op_t::retry_link);
     }
 }
 
 void cluster_client_t::erase_op(cluster_op_t *op)
 {
-    uint64_t opcode = op->opcode, flags = op->flags;
-    cluster_op_t *next = op->next;
+    uint64_t flags = op->flags;
+    bool was_barrier = op->is_barrier;
     if (op->prev)
         op->prev->next = op->next;
     if (op->next)
@@ -292,23 +362,40 @@ void cluster_client_t::erase_op(cluster_op_t *op)
     if (op_queue_tail == op)
         op_queue_tail = op->prev;
     op->next = op->prev = NULL;
+    if (was_barrier)
+        remove_barrier(op);
+    if (op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE)
+        finish_write_invalidate(op);
+    if (op->retry_queued)
+    {
+        op->retry_queued = false;
+        retry_ops.erase(op, &cluster_op_t::retry_link);
+    }
     if (flags & OP_FLUSH_BUFFER)
     {
         // Completed flushes change writeback buffer states,
-        // so the callback should be run before inc_wait()
+        // so the callback should be run before continue_waiting()
         // which may continue following SYNCs, but these SYNCs
         // should know about the changed buffer state
         // This is ugly but this is the way we do it
         auto cb = std::move(op->callback);
         cb(op);
     }
-    if (!(flags & OP_IMMEDIATE_COMMIT) || enable_writeback)
+    if (was_barrier)
     {
-        inc_wait(opcode, flags, next, -1);
+        continue_waiting();
+        if (blocked_retry_count > 0)
+        {
+            // Some operations were skipped during retry because they waited for the previous ones
+            if (continuing_ops)
+                continuing_ops = 2;
+            else
+                continue_ops();
+        }
     }
     if (!(flags & OP_FLUSH_BUFFER))
     {
-        // Call callback at the end to avoid inconsistencies in prev_wait
+        // Call callback at the end to avoid inconsistencies in waiting lists
         // if the callback adds more operations itself
         auto cb = std::move(op->callback);
         cb(op);
@@ -344,9 +431,14 @@ void cluster_client_t::continue_ops(int time_passed)
     int reset_duration = 0;
 restart:
     continuing_ops = 1;
-    for (auto op = op_queue_head; op; )
-    {
-        cluster_op_t *next_op = op->next;
+    blocked_retry_count = 0;
+    // Operations queued again during this pass get the new epoch and are not rechecked
+    retry_epoch++;
+    while (retry_ops.head && retry_ops.head->retry_epoch != retry_epoch)
+    {
+        cluster_op_t *op = retry_ops.head;
+        op->retry_queued = false;
+        retry_ops.erase(op, &cluster_op_t::retry_link);
         if (op->retry_after && time_passed)
         {
             op->retry_after = op->retry_after > time_passed ? op->retry_after-time_passed : 0;
@@ -355,18 +447,21 @@ restart:
                 reset_duration = op->retry_after;
             }
         }
-        if (!op->retry_after && !op->prev_wait)
+        if (op->retry_after || is_blocked(op))
         {
-            if (op->opcode == OSD_OP_SYNC)
-                continue_sync(op);
-            else
-                continue_rw(op);
-        }
-        op = next_op;
-        if (continuing_ops == 2)
-        {
-            goto restart;
+            if (!op->retry_after)
+                blocked_retry_count++;
+            queue_retry(op);
         }
+        else if (op->opcode == OSD_OP_SYNC)
+            continue_sync(op);
+        else
+            continue_rw(op);
+    }
+    if (continuing_ops == 2)
+    {
+        time_passed = 0;
+        goto restart;
     }
     continuing_ops = 0;
     reset_retry_timer(reset_duration);
@@ -439,6 +534,14 @@ void cluster_client_t::on_load_config_hook(json11::Json::object & etcd_global_co
     {
         client_max_writeback_iodepth = DEFAULT_CLIENT_MAX_WRITEBACK_IODEPTH;
     }
+    // client_writeback_max_gap
+    client_writeback_max_gap = config["client_writeback_max_gap"].uint64_value();
+    // client_read_cache_size
+    client_read_cache_size = config["client_read_cache_size"].uint64_value();
+    read_cache->set_size(client_read_cache_size);
+    // client_readahead_size
+    client_readahead_size = config["client_readahead_size"].uint64_value();
+    readahead->set_size(client_readahead_size);
     // client_retry_interval
     client_retry_interval = config["client_retry_interval"].uint64_value();
     if (!client_retry_interval)
@@ -636,6 +739,34 @@ bool cluster_client_t::get_immediate_commit(uint64_t inode)
     return pool_it->second.immediate_commit == IMMEDIATE_ALL;
 }
 
+cluster_read_cache_stats_t cluster_client_t::get_read_cache_stats()
+{
+    return read_cache->stats;
+}
+
+cluster_readahead_stats_t cluster_client_t::get_readahead_stats()
+{
+    return readahead->stats;
+}
+
+void cluster_client_t::start_write_invalidate(cluster_op_t *op)
+{
+    if (client_read_cache_size)
+        read_cache->start_write(this, op);
+    if (client_readahead_size)
+        readahead->invalidate(op);
+    if (wb->gap_reads.size())
+        wb->mark_gaps_stale(op->inode, op->offset, op->len);
+}
+
+void cluster_client_t::finish_write_invalidate(cluster_op_t *op)
+{
+    if (op->flags & OP_READ_CACHE)
+        read_cache->finish_write(op);
+    if (client_readahead_size)
+        readahead->invalidate(op);
+}
+
 void cluster_client_t::on_change_osd_state_hook(uint64_t peer_osd)
 {
     osd_tree_metrics.erase(peer_osd);
@@ -744,7 +875,7 @@ void cluster_client_t::execute(cluster_op_t *op)
         offline_ops.push_back(op);
         return;
     }
-    op->flags = op->flags & (OSD_OP_IGNORE_READONLY | OSD_OP_WAIT_UP_TIMEOUT); // allowed client flags
+    op->flags = op->flags & (OSD_OP_IGNORE_READONLY | OSD_OP_WAIT_UP_TIMEOUT | OSD_OP_NO_CACHE); // allowed client flags
     execute_internal(op);
 }
 
@@ -758,16 +889,40 @@ void cluster_client_t::execute_internal(cluster_op_t *op)
     op->done_count = 0;
     op->part_bitmaps = NULL;
     op->bitmap_buf_size = 0;
-    op->prev_wait = 0;
-    assert(!op->prev && !op->next);
+    op->is_barrier = false;
+    assert(!op->prev && !op->next && !op->retry_queued);
     // check alignment, readonly flag and so on
     if (!check_rw(op))
     {
         return;
     }
+    if (op->opcode == OSD_OP_READ && op->len && client_read_cache_size && !(op->flags & OSD_OP_NO_CACHE) &&
+        read_cache->read(this, op))
+    {
+        // Served from the clean read cache
+        op->version = 0;
+        op->retval = op->len;
+        auto cb = std::move(op->callback);
+        cb(op);
+        return;
+    }
+    if (op->opcode == OSD_OP_READ && op->len && client_readahead_size && !(op->flags & (OSD_OP_NO_CACHE | OP_READAHEAD)))
+    {
+        readahead->on_read(this, op);
+    }
     // CAS writes are simplified: they're not cached, not resliced, not retried, and not part of the regular write queue at all
     if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE) && op->version)
     {
+        if (client_read_cache_size || client_readahead_size || wb->gap_reads.size())
+        {
+            start_write_invalidate(op);
+            auto cb = std::move(op->callback);
+            op->callback = [this, cb](cluster_op_t *op)
+            {
+                finish_write_invalidate(op);
+                cb(op);
+            };
+        }
         execute_cas(op);
         return;
     }
@@ -780,17 +935,26 @@ void cluster_client_t::execute_internal(cluster_op_t *op)
             return;
         }
         // Just copy and acknowledge the operation
+        // Later reads get new data from the writeback buffer
+        start_write_invalidate(op);
+        finish_write_invalidate(op);
         wb->copy_write(op, CACHE_DIRTY);
         while (wb->writeback_bytes > client_max_buffered_bytes || wb->writeback_queue_size > client_max_buffered_ops)
         {
             // Initiate some writeback (asynchronously)
             wb->start_writebacks(this, 1);
         }
+        wb->start_gap_reads(this);
         op->retval = op->len;
         auto cb = std::move(op->callback);
         cb(op);
         return;
     }
+    if (op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE)
+    {
+        // Cached data is invalidated now, and reads don't fill the cache until the write is completed in erase_op()
+        start_write_invalidate(op);
+    }
     if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE) && !(op->flags & OP_IMMEDIATE_COMMIT))
     {
         if (!(op->flags & OP_FLUSH_BUFFER))
@@ -833,6 +997,7 @@ void cluster_client_t::execute_internal(cluster_op_t *op)
         dirty_bytes = 0;
         dirty_ops = 0;
     }
+    op->seq = next_op_seq++;
     op->prev = op_queue_tail;
     if (op_queue_tail)
     {
@@ -1106,6 +1271,7 @@ resume_1:
     if (op->state == 1)
     {
         // Some suboperations have to be resent
+        queue_retry(op);
         return 0;
     }
 resume_2:
@@ -1126,7 +1292,9 @@ resume_2:
                 if ((part.flags & (PART_SENT|PART_DONE|PART_VALID)) == (PART_SENT|PART_DONE|PART_VALID))
                     copy_part_bitmap(op, &part);
         }
-        if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_CHAIN_BITMAP)
+        if ((op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_CHAIN_BITMAP) &&
+            // Prefetched data is already read through the whole snapshot chain
+            (op->cur_inode != op->inode || op->readahead_parts < op->parts.size()))
         {
             // Check parent inode
             auto ino_it = st_cli.inode_config.find(op->cur_inode);
@@ -1159,6 +1327,10 @@ resume_2:
             }
         }
         op->retval = op->len;
+        if (op->opcode == OSD_OP_READ && (op->flags & OP_READ_CACHE))
+        {
+            read_cache->fill(this, op);
+        }
         if (op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP)
         {
             auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->inode));
@@ -1276,6 +1448,9 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
     // And we're also free to return data from other cached buffers just
     // because it's faster
     bool dirty_copied = wb->read_from_cache(op, pool_cfg.bitmap_granularity);
+    bool use_readahead = op->opcode == OSD_OP_READ && op->cur_inode == op->inode && !dirty_copied &&
+        client_readahead_size && !(op->flags & (OSD_OP_NO_CACHE | OP_READAHEAD));
+    op->readahead_parts = 0;
     for (uint64_t stripe = first_stripe; stripe <= last_stripe; stripe += pg_block_size)
     {
         pg_num_t pg_num = (stripe/pool_cfg.pg_stripe_size) % pool_cfg.real_pg_count + 1; // like map_to_pg()
@@ -1336,6 +1511,10 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
             op->opcode == OSD_OP_DELETE ? 0 : (uint32_t)(end - begin);
         op->parts[i].pg_num = pg_num;
         op->parts[i].osd_num = 0;
+        if (use_readahead)
+        {
+            readahead->read_part(&op->parts[i], pg_block_size);
+        }
         i++;
     }
 }
@@ -1516,6 +1695,7 @@ resume_1:
             op->inflight_count = 0;
             op->done_count = 0;
             op->state = 0;
+            queue_retry(op);
             return 0;
         }
     }
@@ -1604,6 +1784,10 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
             op->retry_after = op->retval != -EPIPE ? client_eio_retry_interval : client_retry_interval;
         }
         reset_retry_timer(op->retry_after);
+        if (op->retry_after)
+        {
+            queue_retry(op);
+        }
         if (stop_client_id)
         {
             msgr.stop_client(stop_client_id);
@@ -16,9 +16,24 @@
 
 #define OSD_OP_IGNORE_READONLY 0x08
 #define OSD_OP_WAIT_UP_TIMEOUT 0x10
+#define OSD_OP_NO_CACHE 0x20
 
 struct cluster_op_t;
 
+struct cluster_op_link_t
+{
+    cluster_op_t *prev = NULL, *next = NULL;
+};
+
+// Intrusive list of operations linked through one of cluster_op_t link fields
+struct cluster_op_list_t
+{
+    cluster_op_t *head = NULL, *tail = NULL;
+    void push_back(cluster_op_t *op, cluster_op_link_t cluster_op_t::*link);
+    void push_front(cluster_op_t *op, cluster_op_link_t cluster_op_t::*link);
+    void erase(cluster_op_t *op, cluster_op_link_t cluster_op_t::*link);
+};
+
 struct cluster_op_part_t
 {
     cluster_op_t *parent;
@@ -42,6 +57,8 @@ struct __attribute__((visibility("default"))) cluster_op_t
     uint64_t version = 0;
     // flags: OSD_OP_IGNORE_READONLY - ignore inode readonly flag
     // OSD_OP_WAIT_UP_TIMEOUT - do not retry the operation infinitely if PG is inactive, only for for <wait_up_timeout>
+    // OSD_OP_NO_CACHE - do not serve the read from the client read cache and read-ahead buffers
+    // (reads served from them return version 0)
     uint64_t flags = 0;
     // negative retval is an error number
     // write and read return len on success
@@ -69,16 +86,41 @@ protected:
     void *part_bitmaps = NULL;
     unsigned bitmap_buf_size = 0;
     cluster_op_t *prev = NULL, *next = NULL;
-    int prev_wait = 0;
+    // Position in the queue and links in barrier (sync/write and flush) and retry lists
+    int64_t seq = 0;
+    bool is_barrier = false, retry_queued = false;
+    uint64_t retry_epoch = 0;
+    cluster_op_link_t barrier_link, flush_link, retry_link;
     uint64_t flush_id = 0;
+    uint64_t read_cache_seq = 0;
+    int readahead_parts = 0;
     friend class cluster_client_t;
     friend class writeback_cache_t;
+    friend class read_cache_t;
+    friend class readahead_t;
+    friend struct cluster_op_list_t;
+};
+
+struct cluster_read_cache_stats_t
+{
+    uint64_t hits = 0, misses = 0;
+    uint64_t hit_bytes = 0, miss_bytes = 0;
+    uint64_t used_bytes = 0, evicted_bytes = 0;
+};
+
+struct cluster_readahead_stats_t
+{
+    uint64_t prefetch_ops = 0;
+    uint64_t prefetched_bytes = 0, hit_bytes = 0, wasted_bytes = 0;
+    uint64_t used_bytes = 0;
 };
 
 struct inode_list_t;
 struct inode_list_osd_t;
 struct inode_list_pg_t;
 class writeback_cache_t;
+class read_cache_t;
+class readahead_t;
 
 // FIXME: Split into public and private interfaces
 class __attribute__((visibility("default"))) cluster_client_t
@@ -97,6 +139,12 @@ class __attribute__((visibility("default"))) cluster_client_t
     uint64_t client_max_buffered_bytes = 0;
     uint64_t client_max_buffered_ops = 0;
     uint64_t client_max_writeback_iodepth = 0;
+    // maximum hole between dirty buffers of one object filled by reading, 0 = disabled
+    uint64_t client_writeback_max_gap = 0;
+    // clean read cache size, 0 = disabled
+    uint64_t client_read_cache_size = 0;
+    // total size of sequential read-ahead buffers, 0 = disabled
+    uint64_t client_readahead_size = 0;
     std::string conf_hostname;
 
     int log_level = 0;
@@ -113,7 +161,21 @@ class __attribute__((visibility("default"))) cluster_client_t
     int retry_timeout_duration = 0;
     std::vector<cluster_op_t*> offline_ops;
     cluster_op_t *op_queue_head = NULL, *op_queue_tail = NULL;
+    // Dependency tracking: syncs wait for all previous syncs and writes, writes wait for all previous
+    // syncs, and regular writes also wait for all previous buffer flushes. Immediately committed writes
+    // don't wait and aren't waited for when writeback is disabled. Operations which other
+    // operations may wait for are kept in lists sorted by queue position, so an operation may start
+    // when it's before the heads of the lists it depends on. Waiting operations are started in order
+    int64_t next_op_seq = 0;
+    cluster_op_list_t sync_barriers, write_barriers, flush_barriers;
+    std::deque<cluster_op_t*> waiting_syncs, waiting_writes, waiting_flushes;
+    // Operations to continue on retry timer, peer connection or PG state change
+    cluster_op_list_t retry_ops;
+    uint64_t retry_epoch = 0;
+    int blocked_retry_count = 0;
     writeback_cache_t *wb = NULL;
+    read_cache_t *read_cache = NULL;
+    readahead_t *readahead = NULL;
     std::set<osd_num_t> dirty_osds;
     uint64_t dirty_bytes = 0, dirty_ops = 0;
 
@@ -148,6 +210,8 @@ public:
     bool flush();
 
     bool get_immediate_commit(uint64_t inode);
+    cluster_read_cache_stats_t get_read_cache_stats();
+    cluster_readahead_stats_t get_readahead_stats();
 
     void list_inode(inode_t inode, uint64_t min_offset, uint64_t max_offset, int max_parallel_pgs, std::function<void(
         int status, int pgs_left, pg_num_t pg_num, std::set<object_id>&& objects)> pg_callback);
@@ -177,9 +241,15 @@ protected:
     void send_sync(cluster_op_t *op, cluster_op_part_t *part);
     void handle_op_part(cluster_op_part_t *part);
     void copy_part_bitmap(cluster_op_t *op, cluster_op_part_t *part);
+    void start_write_invalidate(cluster_op_t *op);
+    void finish_write_invalidate(cluster_op_t *op);
     void erase_op(cluster_op_t *op);
     void calc_wait(cluster_op_t *op);
-    void inc_wait(uint64_t opcode, uint64_t flags, cluster_op_t *next, int inc);
+    void add_barrier(cluster_op_t *op, bool front);
+    void remove_barrier(cluster_op_t *op);
+    bool is_blocked(cluster_op_t *op);
+    void continue_waiting();
+    void queue_retry(cluster_op_t *op);
     void continue_lists();
     bool continue_listing(inode_list_t *lst);
     bool restart_listing(inode_list_t* lst);
@@ -195,5 +265,7 @@ protected:
     osd_num_t select_nearest_osd(const std::vector<osd_num_t> & osds);
 
     friend class writeback_cache_t;
+    friend class read_cache_t;
+    friend class readahead_t;
     friend class cluster_client_test_t;
 };
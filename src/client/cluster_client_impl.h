@@ -4,6 +4,7 @@
 #pragma once
 
 #include "cluster_client.h"
+#include "cpp-btree/btree_map.h"
 
 #define SCRAP_BUFFER_SIZE 4*1024*1024
 #define PART_SENT 1
@@ -17,6 +18,19 @@
 #define CACHE_REPEATING 4
 #define OP_FLUSH_BUFFER 0x02
 #define OP_IMMEDIATE_COMMIT 0x04
+#define OP_READ_CACHE 0x40
+#define OP_READAHEAD 0x80
+#define READ_CACHE_PROBATION 0
+#define READ_CACHE_PROTECTED 1
+#define READAHEAD_MIN_SEQUENTIAL 2
+
+// Data of one write, shared by the parts of the buffer split by later
+// overlapping writes and by flushes in progress
+struct cluster_buffer_data_t
+{
+    uint8_t *buf;
+    uint64_t refcnt;
+};
 
 struct cluster_buffer_t
 {
@@ -24,10 +38,19 @@ struct cluster_buffer_t
     uint64_t len;
     int state;
     uint64_t flush_id;
-    uint64_t *refcnt;
+    cluster_buffer_data_t *data;
 };
 
-typedef std::map<object_id, cluster_buffer_t>::iterator dirty_buf_it_t;
+// Ordered by inode and offset, so buffers of one inode form a contiguous range
+typedef btree::btree_map<object_id, cluster_buffer_t> dirty_buf_map_t;
+typedef dirty_buf_map_t::iterator dirty_buf_it_t;
+
+// Read of a hole between dirty buffers, its data becomes dirty too when it's still valid
+struct writeback_gap_t
+{
+    uint64_t len;
+    bool stale;
+};
 
 class writeback_cache_t
 {
@@ -37,12 +60,19 @@ public:
     int writebacks_active = 0;
     uint64_t last_flush_id = 0;
 
-    std::map<object_id, cluster_buffer_t> dirty_buffers;
+    // B-tree iterators are invalidated by any insertion or removal
+    dirty_buf_map_t dirty_buffers;
     std::vector<cluster_op_t*> writeback_overflow;
     std::vector<object_id> writeback_queue;
-    std::multimap<uint64_t, uint64_t*> flushed_buffers; // flush_id => refcnt
+    // Unused data headers, recycled to not allocate them for every write
+    std::vector<cluster_buffer_data_t*> free_data;
+    std::map<object_id, writeback_gap_t> gap_reads;
+    // Runs deferred by start_writebacks() until their holes are read
+    std::vector<object_id> gap_fill_queue;
 
     ~writeback_cache_t();
+    cluster_buffer_data_t *alloc_data(uint64_t len);
+    void unref_data(cluster_buffer_data_t *data);
     bool has_inode(uint64_t inode);
     dirty_buf_it_t find_dirty(uint64_t inode, uint64_t offset);
     bool is_left_merged(dirty_buf_it_t dirty_it);
@@ -50,6 +80,11 @@ public:
     void copy_write(cluster_op_t *op, int state, uint64_t new_flush_id = 0);
     int repeat_ops_for(cluster_client_t *cli, osd_num_t peer_osd, pool_id_t pool_id, pg_num_t pg_num);
     void start_writebacks(cluster_client_t *cli, int count);
+    bool start_writeback(cluster_client_t *cli, object_id req, bool align);
+    bool fill_gaps(cluster_client_t *cli, uint64_t inode, uint64_t offset, bool start_read);
+    void start_gap_reads(cluster_client_t *cli);
+    void finish_gap_read(cluster_op_t *op, const std::vector<std::pair<uint64_t, uint64_t>> & holes);
+    void mark_gaps_stale(uint64_t inode, uint64_t offset, uint64_t len);
     bool read_from_cache(cluster_op_t *op, uint32_t bitmap_granularity);
     void flush_buffers(cluster_client_t *cli, dirty_buf_it_t from_it, dirty_buf_it_t to_it);
     void mark_flush_written(uint64_t inode, uint64_t offset, uint64_t len, uint64_t flush_id);
@@ -58,3 +93,123 @@ public:
     void fsync_error();
     void fsync_ok();
 };
+
+// One bitmap_granularity-sized piece of clean data, followed by the data itself
+struct read_cache_entry_t
+{
+    object_id oid;
+    uint64_t gen;
+    read_cache_entry_t *prev, *next;
+    uint32_t len;
+    uint8_t list;
+    bool bitmap_bit;
+    uint8_t *buf() { return (uint8_t*)(this+1); }
+};
+
+struct read_cache_list_t
+{
+    // head is the most recently used entry
+    read_cache_entry_t *head = NULL, *tail = NULL;
+    uint64_t bytes = 0;
+};
+
+struct read_cache_inode_t
+{
+    uint64_t mod_revision = 0;
+    // entries with a different generation are stale
+    uint64_t gen = 0;
+    // changes on every write start and completion, reads don't fill the cache if it changed
+    uint64_t write_seq = 0;
+    uint64_t writes_inflight = 0;
+    uint64_t entry_count = 0;
+};
+
+// Clean read cache: serves reads fully covered by previously read data without
+// sending them to OSDs. Segmented LRU: new data goes to the probation segment
+// and is promoted to the protected segment on a hit, so one-time scans only
+// displace other one-time data. Only writes from this client are tracked
+class read_cache_t
+{
+public:
+    uint64_t max_bytes = 0;
+    cluster_read_cache_stats_t stats;
+
+    robin_hood::unordered_flat_map<object_id, read_cache_entry_t*> entries;
+    std::map<inode_t, read_cache_inode_t> inodes;
+    read_cache_list_t lists[2];
+    std::vector<read_cache_entry_t*> found;
+
+    ~read_cache_t();
+    void set_size(uint64_t new_max_bytes);
+    void clear();
+    bool read(cluster_client_t *cli, cluster_op_t *op);
+    void fill(cluster_client_t *cli, cluster_op_t *op);
+    void start_write(cluster_client_t *cli, cluster_op_t *op);
+    void finish_write(cluster_op_t *op);
+
+protected:
+    read_cache_inode_t & get_inode(cluster_client_t *cli, inode_t inode);
+    void invalidate(read_cache_inode_t & ino, inode_t inode, uint64_t offset, uint64_t len, uint32_t granularity);
+    void link(read_cache_entry_t *e, int list);
+    void unlink(read_cache_entry_t *e);
+    void touch(read_cache_entry_t *e);
+    void free_entry(read_cache_entry_t *e);
+    void evict(uint64_t new_bytes);
+};
+
+// Prefetched object stripe
+struct readahead_chunk_t
+{
+    object_id oid;
+    uint64_t len = 0;
+    uint32_t granularity = 0;
+    uint64_t served_bytes = 0;
+    bool done = false, stale = false;
+    uint8_t *buf = NULL, *bitmap = NULL;
+    // parts of read operations waiting for this chunk
+    std::vector<cluster_op_part_t*> waiting;
+    readahead_chunk_t *prev = NULL, *next = NULL;
+};
+
+struct readahead_stream_t
+{
+    uint64_t mod_revision = 0;
+    // expected offset of the next sequential read
+    uint64_t next_offset = UINT64_MAX;
+    int seq_count = 0;
+    uint64_t prefetch_end = 0;
+    uint64_t window = 0;
+};
+
+// Sequential read-ahead: detects sequential reads of each inode and prefetches
+// whole object stripes ahead of them. The window starts at one stripe, doubles
+// when a prefetched stripe is fully consumed and halves when an unused one is
+// evicted. slice_rw() serves parts of reads from prefetched stripes or makes
+// them wait for stripes which are still being read
+class readahead_t
+{
+public:
+    uint64_t max_bytes = 0;
+    cluster_readahead_stats_t stats;
+
+    std::map<object_id, readahead_chunk_t*> chunks;
+    std::map<inode_t, readahead_stream_t> streams;
+    // eviction order
+    readahead_chunk_t *oldest = NULL, *newest = NULL;
+
+    ~readahead_t();
+    void set_size(uint64_t new_max_bytes);
+    void clear();
+    void on_read(cluster_client_t *cli, cluster_op_t *op);
+    bool read_part(cluster_op_part_t *part, uint64_t pg_block_size);
+    void invalidate(cluster_op_t *op);
+
+protected:
+    void start_chunk(cluster_client_t *cli, inode_t inode, uint64_t offset, uint64_t len, uint32_t granularity);
+    void finish_chunk(cluster_client_t *cli, readahead_chunk_t *chunk, cluster_op_t *rd_op);
+    void serve_part(readahead_chunk_t *chunk, cluster_op_part_t *part);
+    void consumed(readahead_chunk_t *chunk);
+    void drop_chunk(readahead_chunk_t *chunk);
+    void drop_inode(inode_t inode);
+    bool evict_one();
+};
@@ -0,0 +1,293 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <cassert>
+
+#include "cluster_client_impl.h"
+
+read_cache_t::~read_cache_t()
+{
+    clear();
+}
+
+void read_cache_t::set_size(uint64_t new_max_bytes)
+{
+    max_bytes = new_max_bytes;
+    if (!max_bytes)
+        clear();
+    else
+        evict(0);
+}
+
+void read_cache_t::clear()
+{
+    for (auto & ep: entries)
+    {
+        free(ep.second);
+    }
+    entries.clear();
+    for (int i = 0; i < 2; i++)
+    {
+        lists[i] = (read_cache_list_t){};
+    }
+    for (auto & ip: inodes)
+    {
+        // Also prevents reads which are in progress from filling the cache
+        ip.second.gen++;
+        ip.second.write_seq++;
+        ip.second.entry_count = 0;
+    }
+    stats.used_bytes = 0;
+}
+
+read_cache_inode_t & read_cache_t::get_inode(cluster_client_t *cli, inode_t inode)
+{
+    auto & ino = inodes[inode];
+    auto cfg_it = cli->st_cli.inode_config.find(inode);
+    uint64_t mod_revision = cfg_it != cli->st_cli.inode_config.end() ? cfg_it->second.mod_revision : 0;
+    if (ino.mod_revision != mod_revision)
+    {
+        // Inode was resized, renamed, snapshotted, flattened or removed, drop its data lazily
+        ino.mod_revision = mod_revision;
+        ino.gen++;
+        ino.write_seq++;
+    }
+    return ino;
+}
+
+void read_cache_t::link(read_cache_entry_t *e, int list)
+{
+    auto & l = lists[list];
+    e->list = list;
+    e->prev = NULL;
+    e->next = l.head;
+    if (l.head)
+        l.head->prev = e;
+    else
+        l.tail = e;
+    l.head = e;
+    l.bytes += e->len;
+}
+
+void read_cache_t::unlink(read_cache_entry_t *e)
+{
+    auto & l = lists[e->list];
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        l.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        l.tail = e->prev;
+    e->prev = e->next = NULL;
+    l.bytes -= e->len;
+}
+
+void read_cache_t::touch(read_cache_entry_t *e)
+{
+    // Second access promotes the entry to the protected segment which takes up to 3/4 of the cache
+    unlink(e);
+    link(e, READ_CACHE_PROTECTED);
+    auto & prot = lists[READ_CACHE_PROTECTED];
+    while (prot.bytes > max_bytes/4*3 && prot.tail != e)
+    {
+        auto demoted = prot.tail;
+        unlink(demoted);
+        link(demoted, READ_CACHE_PROBATION);
+    }
+}
+
+void read_cache_t::free_entry(read_cache_entry_t *e)
+{
+    unlink(e);
+    entries.erase(e->oid);
+    auto ino_it = inodes.find(e->oid.inode);
+    if (ino_it != inodes.end() && ino_it->second.entry_count > 0)
+        ino_it->second.entry_count--;
+    stats.used_bytes -= e->len;
+    free(e);
+}
+
+void read_cache_t::evict(uint64_t new_bytes)
+{
+    while (stats.used_bytes + new_bytes > max_bytes)
+    {
+        auto e = lists[READ_CACHE_PROBATION].tail;
+        if (!e)
+            e = lists[READ_CACHE_PROTECTED].tail;
+        if (!e)
+            break;
+        stats.evicted_bytes += e->len;
+        free_entry(e);
+    }
+}
+
+// Copy <len> bytes between <buf> and the operation's iovec, starting at iov_idx/iov_pos
+static void copy_iov(osd_op_buf_list_t & iov, int & iov_idx, size_t & iov_pos, uint8_t *buf, uint64_t len, bool to_iov)
+{
+    while (len > 0 && iov_idx < iov.count)
+    {
+        uint64_t cur = iov.buf[iov_idx].iov_len - iov_pos;
+        cur = cur < len ? cur : len;
+        if (to_iov)
+            memcpy((uint8_t*)iov.buf[iov_idx].iov_base + iov_pos, buf, cur);
+        else
+            memcpy(buf, (uint8_t*)iov.buf[iov_idx].iov_base + iov_pos, cur);
+        buf += cur;
+        len -= cur;
+        iov_pos += cur;
+        if (iov_pos >= iov.buf[iov_idx].iov_len)
+        {
+            iov_pos = 0;
+            iov_idx++;
+        }
+    }
+}
+
+bool read_cache_t::read(cluster_client_t *cli, cluster_op_t *op)
+{
+    auto & pool_cfg = cli->st_cli.pool_config.at(INODE_POOL(op->inode));
+    uint32_t granularity = pool_cfg.bitmap_granularity;
+    auto & ino = get_inode(cli, op->inode);
+    found.clear();
+    if (ino.entry_count > 0)
+    {
+        for (uint64_t cur = op->offset; cur < op->offset+op->len; cur += granularity)
+        {
+            auto e_it = entries.find((object_id){ .inode = op->inode, .stripe = cur });
+            if (e_it == entries.end())
+                break;
+            if (e_it->second->gen != ino.gen)
+            {
+                free_entry(e_it->second);
+                break;
+            }
+            found.push_back(e_it->second);
+        }
+    }
+    if (found.size() < op->len/granularity)
+    {
+        // Only full hits are served, partially cached reads are refilled on completion
+        stats.misses++;
+        stats.miss_bytes += op->len;
+        if (!ino.writes_inflight)
+        {
+            op->flags |= OP_READ_CACHE;
+            op->read_cache_seq = ino.write_seq;
+        }
+        return false;
+    }
+    // Allocate memory for the bitmap, like slice_rw()
+    unsigned object_bitmap_size = ((op->len / granularity + 7) / 8);
+    object_bitmap_size = (object_bitmap_size < 8 ? 8 : object_bitmap_size);
+    if (!op->bitmap_buf || op->bitmap_buf_size < object_bitmap_size)
+    {
+        op->bitmap_buf = realloc_or_die(op->bitmap_buf, object_bitmap_size);
+        op->bitmap_buf_size = object_bitmap_size;
+    }
+    op->part_bitmaps = NULL;
+    memset(op->bitmap_buf, 0, object_bitmap_size);
+    int iov_idx = 0;
+    size_t iov_pos = 0;
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        auto e = found[i];
+        copy_iov(op->iov, iov_idx, iov_pos, e->buf(), e->len, true);
+        if (e->bitmap_bit)
+            ((uint8_t*)op->bitmap_buf)[i/8] |= (1 << (i%8));
+        touch(e);
+    }
+    stats.hits++;
+    stats.hit_bytes += op->len;
+    return true;
+}
+
+void read_cache_t::fill(cluster_client_t *cli, cluster_op_t *op)
+{
+    if (!max_bytes || op->len > max_bytes/2)
+    {
+        return;
+    }
+    auto & ino = get_inode(cli, op->inode);
+    if (ino.write_seq != op->read_cache_seq)
+    {
+        // Data may have been changed while the read was in progress
+        return;
+    }
+    auto & pool_cfg = cli->st_cli.pool_config.at(INODE_POOL(op->inode));
+    uint32_t granularity = pool_cfg.bitmap_granularity;
+    int iov_idx = 0;
+    size_t iov_pos = 0;
+    for (uint64_t cur = op->offset, i = 0; cur < op->offset+op->len; cur += granularity, i++)
+    {
+        object_id oid = { .inode = op->inode, .stripe = cur };
+        read_cache_entry_t *e = NULL;
+        auto e_it = entries.find(oid);
+        if (e_it != entries.end())
+        {
+            e = e_it->second;
+            e->gen = ino.gen;
+        }
+        else
+        {
+            evict(granularity);
+            e = (read_cache_entry_t*)malloc_or_die(sizeof(read_cache_entry_t) + granularity);
+            *e = (read_cache_entry_t){
+                .oid = oid,
+                .gen = ino.gen,
+                .len = granularity,
+            };
+            link(e, READ_CACHE_PROBATION);
+            entries[oid] = e;
+            ino.entry_count++;
+            stats.used_bytes += granularity;
+        }
+        e->bitmap_bit = (((uint8_t*)op->bitmap_buf)[i/8] >> (i%8)) & 1;
+        copy_iov(op->iov, iov_idx, iov_pos, e->buf(), granularity, false);
+    }
+}
+
+void read_cache_t::invalidate(read_cache_inode_t & ino, inode_t inode, uint64_t offset, uint64_t len, uint32_t granularity)
+{
+    for (uint64_t cur = offset - offset % granularity; cur < offset+len && ino.entry_count > 0; cur += granularity)
+    {
+        auto e_it = entries.find((object_id){ .inode = inode, .stripe = cur });
+        if (e_it != entries.end())
+            free_entry(e_it->second);
+    }
+}
+
+void read_cache_t::start_write(cluster_client_t *cli, cluster_op_t *op)
+{
+    auto & ino = get_inode(cli, op->inode);
+    if (op->flags & OSD_OP_IGNORE_READONLY)
+    {
+        // Writes to snapshots (merge, flatten) may change data of any child inode
+        clear();
+    }
+    else if (op->opcode == OSD_OP_DELETE)
+    {
+        // Deletes remove whole objects
+        ino.gen++;
+    }
+    else if (ino.entry_count > 0)
+    {
+        auto & pool_cfg = cli->st_cli.pool_config.at(INODE_POOL(op->inode));
+        invalidate(ino, op->inode, op->offset, op->len, pool_cfg.bitmap_granularity);
+    }
+    ino.write_seq++;
+    ino.writes_inflight++;
+    op->flags |= OP_READ_CACHE;
+}
+
+void read_cache_t::finish_write(cluster_op_t *op)
+{
+    auto ino_it = inodes.find(op->inode);
+    if (ino_it != inodes.end())
+    {
+        assert(ino_it->second.writes_inflight > 0);
+        ino_it->second.writes_inflight--;
+        ino_it->second.write_seq++;
+    }
+}
@@ -0,0 +1,336 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <cassert>
+
+#include "cluster_client_impl.h"
+
+readahead_t::~readahead_t()
+{
+    clear();
+}
+
+void readahead_t::set_size(uint64_t new_max_bytes)
+{
+    max_bytes = new_max_bytes;
+    if (!max_bytes)
+    {
+        clear();
+        return;
+    }
+    while (stats.used_bytes > max_bytes && evict_one())
+    {
+    }
+}
+
+void readahead_t::clear()
+{
+    while (chunks.size())
+    {
+        drop_chunk(chunks.begin()->second);
+    }
+    streams.clear();
+}
+
+void readahead_t::drop_chunk(readahead_chunk_t *chunk)
+{
+    if (!chunk->stale)
+    {
+        chunks.erase(chunk->oid);
+        if (chunk->prev)
+            chunk->prev->next = chunk->next;
+        else
+            oldest = chunk->next;
+        if (chunk->next)
+            chunk->next->prev = chunk->prev;
+        else
+            newest = chunk->prev;
+        chunk->prev = chunk->next = NULL;
+        if (chunk->served_bytes < chunk->len)
+            stats.wasted_bytes += chunk->len - chunk->served_bytes;
+    }
+    if (!chunk->done)
+    {
+        // Free it when the read completes
+        chunk->stale = true;
+        return;
+    }
+    stats.used_bytes -= chunk->len;
+    free(chunk->buf);
+    delete chunk;
+}
+
+void readahead_t::drop_inode(inode_t inode)
+{
+    auto it = chunks.lower_bound((object_id){ .inode = inode, .stripe = 0 });
+    while (it != chunks.end() && it->first.inode == inode)
+    {
+        auto chunk = it->second;
+        it++;
+        drop_chunk(chunk);
+    }
+    auto st_it = streams.find(inode);
+    if (st_it != streams.end())
+    {
+        st_it->second.prefetch_end = 0;
+    }
+}
+
+bool readahead_t::evict_one()
+{
+    for (auto chunk = oldest; chunk; chunk = chunk->next)
+    {
+        if (chunk->done)
+        {
+            if (chunk->served_bytes < chunk->len)
+            {
+                // Prefetched too far ahead, shrink the window
+                auto st_it = streams.find(chunk->oid.inode);
+                if (st_it != streams.end() && st_it->second.window > chunk->len)
+                    st_it->second.window /= 2;
+            }
+            drop_chunk(chunk);
+            return true;
+        }
+    }
+    return false;
+}
+
+void readahead_t::consumed(readahead_chunk_t *chunk)
+{
+    auto st_it = streams.find(chunk->oid.inode);
+    if (st_it != streams.end() && st_it->second.window < max_bytes/2)
+    {
+        st_it->second.window *= 2;
+    }
+    drop_chunk(chunk);
+}
+
+void readahead_t::on_read(cluster_client_t *cli, cluster_op_t *op)
+{
+    auto & st = streams[op->inode];
+    auto ino_it = cli->st_cli.inode_config.find(op->inode);
+    uint64_t mod_revision = ino_it != cli->st_cli.inode_config.end() ? ino_it->second.mod_revision : 0;
+    uint64_t inode_size = ino_it != cli->st_cli.inode_config.end() ? ino_it->second.size : 0;
+    if (st.mod_revision != mod_revision)
+    {
+        // Inode was changed, prefetched data may be stale
+        drop_inode(op->inode);
+        st.mod_revision = mod_revision;
+    }
+    if (op->offset != st.next_offset)
+    {
+        st.seq_count = 0;
+        st.window = 0;
+        st.prefetch_end = 0;
+    }
+    else
+        st.seq_count++;
+    st.next_offset = op->offset + op->len;
+    if (st.seq_count < READAHEAD_MIN_SEQUENTIAL || cli->wb->has_inode(op->inode))
+    {
+        // Not sequential yet, or unflushed writes are only visible through the write buffer
+        return;
+    }
+    auto & pool_cfg = cli->st_cli.pool_config.at(INODE_POOL(op->inode));
+    uint32_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    uint64_t pg_block_size = pool_cfg.data_block_size * pg_data_size;
+    if (pg_block_size > max_bytes/2)
+    {
+        return;
+    }
+    if (st.window < pg_block_size)
+    {
+        st.window = pg_block_size;
+    }
+    uint64_t end = op->offset + op->len + st.window;
+    if (inode_size && end > inode_size)
+    {
+        end = inode_size;
+    }
+    uint64_t start = op->offset + op->len;
+    start -= start % pg_block_size;
+    if (start < st.prefetch_end)
+    {
+        start = st.prefetch_end;
+    }
+    for (; start < end; start += pg_block_size)
+    {
+        if (chunks.find((object_id){ .inode = op->inode, .stripe = start }) != chunks.end())
+        {
+            continue;
+        }
+        while (stats.used_bytes + pg_block_size > max_bytes && evict_one())
+        {
+        }
+        if (stats.used_bytes + pg_block_size > max_bytes)
+        {
+            break;
+        }
+        start_chunk(cli, op->inode, start, pg_block_size, pool_cfg.bitmap_granularity);
+    }
+    st.prefetch_end = start;
+}
+
+void readahead_t::start_chunk(cluster_client_t *cli, inode_t inode, uint64_t offset, uint64_t len, uint32_t granularity)
+{
+    auto chunk = new readahead_chunk_t();
+    chunk->oid = (object_id){ .inode = inode, .stripe = offset };
+    chunk->len = len;
+    chunk->granularity = granularity;
+    chunk->buf = (uint8_t*)malloc_or_die(len + (len/granularity + 7)/8);
+    chunk->bitmap = chunk->buf + len;
+    chunk->prev = newest;
+    if (newest)
+        newest->next = chunk;
+    else
+        oldest = chunk;
+    newest = chunk;
+    chunks[chunk->oid] = chunk;
+    stats.used_bytes += len;
+    stats.prefetch_ops++;
+    stats.prefetched_bytes += len;
+    cluster_op_t *rd_op = new cluster_op_t;
+    rd_op->opcode = OSD_OP_READ;
+    rd_op->inode = inode;
+    rd_op->offset = offset;
+    rd_op->len = len;
+    rd_op->flags = OP_READAHEAD | OSD_OP_NO_CACHE;
+    rd_op->iov.push_back(chunk->buf, len);
+    rd_op->callback = [this, cli, chunk](cluster_op_t *rd_op)
+    {
+        finish_chunk(cli, chunk, rd_op);
+        delete rd_op;
+    };
+    cli->execute_internal(rd_op);
+}
+
+void readahead_t::serve_part(readahead_chunk_t *chunk, cluster_op_part_t *part)
+{
+    cluster_op_t *op = part->parent;
+    uint64_t pos = part->offset - chunk->oid.stripe;
+    uint8_t *src = chunk->buf + pos;
+    for (int i = 0; i < part->iov.count; i++)
+    {
+        memcpy(part->iov.buf[i].iov_base, src, part->iov.buf[i].iov_len);
+        src += part->iov.buf[i].iov_len;
+    }
+    uint32_t chunk_bit = pos / chunk->granularity;
+    uint32_t op_bit = (part->offset - op->offset) / chunk->granularity;
+    for (uint32_t i = 0; i < part->len / chunk->granularity; i++, chunk_bit++, op_bit++)
+    {
+        if ((chunk->bitmap[chunk_bit >> 3] >> (chunk_bit & 7)) & 1)
+            ((uint8_t*)op->bitmap_buf)[op_bit >> 3] |= (1 << (op_bit & 7));
+    }
+    chunk->served_bytes += part->len;
+    stats.hit_bytes += part->len;
+}
+
+bool readahead_t::read_part(cluster_op_part_t *part, uint64_t pg_block_size)
+{
+    cluster_op_t *op = part->parent;
+    auto chunk_it = chunks.find((object_id){ .inode = op->inode, .stripe = part->offset - part->offset % pg_block_size });
+    if (chunk_it == chunks.end() || !part->len)
+    {
+        return false;
+    }
+    auto chunk = chunk_it->second;
+    op->readahead_parts++;
+    if (!chunk->done)
+    {
+        // Wait for the chunk like for a sent part
+        part->flags = PART_SENT;
+        op->inflight_count++;
+        chunk->waiting.push_back(part);
+        return true;
+    }
+    serve_part(chunk, part);
+    part->flags = PART_SENT|PART_DONE;
+    op->done_count++;
+    if (chunk->served_bytes >= chunk->len)
+    {
+        consumed(chunk);
+    }
+    return true;
+}
+
+void readahead_t::finish_chunk(cluster_client_t *cli, readahead_chunk_t *chunk, cluster_op_t *rd_op)
+{
+    bool ok = rd_op->retval == rd_op->len;
+    chunk->done = true;
+    if (ok)
+    {
+        memcpy(chunk->bitmap, rd_op->bitmap_buf, (chunk->len/chunk->granularity + 7)/8);
+    }
+    // Data of a stale chunk is still valid for reads started before the invalidation
+    std::vector<cluster_op_t*> wakeup;
+    for (auto part: chunk->waiting)
+    {
+        cluster_op_t *op = part->parent;
+        if (ok)
+        {
+            serve_part(chunk, part);
+            part->flags |= PART_DONE;
+            op->done_count++;
+        }
+        else
+        {
+            // Read the part from OSDs
+            op->readahead_parts--;
+        }
+        op->inflight_count--;
+        if (op->inflight_count == 0 && !op->retry_after)
+            wakeup.push_back(op);
+    }
+    chunk->waiting.clear();
+    if (!ok || chunk->stale || chunk->served_bytes >= chunk->len)
+    {
+        if (ok && !chunk->stale)
+            consumed(chunk);
+        else
+            drop_chunk(chunk);
+    }
+    for (auto op: wakeup)
+    {
+        cli->continue_rw(op);
+    }
+}
+
+void readahead_t::invalidate(cluster_op_t *op)
+{
+    if (op->flags & OSD_OP_IGNORE_READONLY)
+    {
+        // Writes to snapshots (merge, flatten) may change data of any child inode
+        clear();
+        return;
+    }
+    if (op->opcode == OSD_OP_DELETE)
+    {
+        drop_inode(op->inode);
+        return;
+    }
+    auto it = chunks.upper_bound((object_id){ .inode = op->inode, .stripe = op->offset });
+    if (it != chunks.begin())
+    {
+        auto prev_it = std::prev(it);
+        if (prev_it->first.inode == op->inode && prev_it->first.stripe + prev_it->second->len > op->offset)
+            it = prev_it;
+    }
+    bool dropped = false;
+    uint64_t first_dropped = 0;
+    while (it != chunks.end() && it->first.inode == op->inode && it->first.stripe < op->offset+op->len)
+    {
+        auto chunk = it->second;
+        it++;
+        if (!dropped)
+            first_dropped = chunk->oid.stripe;
+        dropped = true;
+        drop_chunk(chunk);
+    }
+    auto st_it = streams.find(op->inode);
+    if (dropped && st_it != streams.end() && st_it->second.prefetch_end > first_dropped)
+    {
+        // Allow to prefetch it again
+        st_it->second.prefetch_end = first_dropped;
+    }
+}
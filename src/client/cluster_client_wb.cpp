@@ -9,12 +9,46 @@ writeback_cache_t::~writeback_cache_t()
 {
     for (auto & bp: dirty_buffers)
     {
-        if (bp.second.buf && !--(*bp.second.refcnt))
+        if (bp.second.buf)
         {
-            free(bp.second.refcnt); // refcnt is allocated with the buffer
+            unref_data(bp.second.data);
         }
     }
     dirty_buffers.clear();
+    for (auto data: free_data)
+    {
+        delete data;
+    }
+    free_data.clear();
+}
+
+cluster_buffer_data_t *writeback_cache_t::alloc_data(uint64_t len)
+{
+    cluster_buffer_data_t *data;
+    if (free_data.size())
+    {
+        data = free_data.back();
+        free_data.pop_back();
+    }
+    else
+    {
+        data = new cluster_buffer_data_t;
+    }
+    // Not from the buffer pool: it would reserve its region in every client process, keep freed
+    // buffers resident and round sizes up to classes not accounted in writeback_bytes
+    data->buf = (uint8_t*)malloc_or_die(len);
+    data->refcnt = 1;
+    return data;
+}
+
+void writeback_cache_t::unref_data(cluster_buffer_data_t *data)
+{
+    if (!--data->refcnt)
+    {
+        free(data->buf);
+        data->buf = NULL;
+        free_data.push_back(data);
+    }
 }
 
 bool writeback_cache_t::has_inode(uint64_t inode)
@@ -118,11 +152,11 @@ void writeback_cache_t::copy_write(cluster_op_t *op, int state, uint64_t new_flu
                     .len = old_end - new_end,
                     .state = dirty_it->second.state,
                     .flush_id = dirty_it->second.flush_id,
-                    .refcnt = dirty_it->second.refcnt,
+                    .data = dirty_it->second.data,
                 });
                 if (dirty_it->second.buf)
                 {
-                    (*dirty_it->second.refcnt)++;
+                    dirty_it->second.data->refcnt++;
                 }
                 if (dirty_it->second.state == CACHE_DIRTY)
                 {
@@ -166,18 +200,18 @@ void writeback_cache_t::copy_write(cluster_op_t *op, int state, uint64_t new_flu
                     writeback_queue_size++;
                 }
             }
-            auto new_dirty_it = dirty_buffers.emplace_hint(dirty_it, (object_id){
-                .inode = op->inode,
-                .stripe = new_end,
-            }, (cluster_buffer_t){
+            cluster_buffer_t end_buf = (cluster_buffer_t){
                 .buf = dirty_it->second.buf ? dirty_it->second.buf + new_end - dirty_it->first.stripe : NULL,
                 .len = old_end - new_end,
                 .state = dirty_it->second.state,
                 .flush_id = dirty_it->second.flush_id,
-                .refcnt = dirty_it->second.refcnt,
-            });
-            dirty_buffers.erase(dirty_it);
-            dirty_it = new_dirty_it;
+                .data = dirty_it->second.data,
+            };
+            dirty_it = dirty_buffers.erase(dirty_it);
+            dirty_it = dirty_buffers.emplace_hint(dirty_it, (object_id){
+                .inode = op->inode,
+                .stripe = new_end,
+            }, end_buf);
             break;
         }
         else
@@ -201,21 +235,17 @@ void writeback_cache_t::copy_write(cluster_op_t *op, int state, uint64_t new_flu
                     writeback_queue_size++;
                 }
             }
-            if (dirty_it->second.buf && !--(*dirty_it->second.refcnt))
+            if (dirty_it->second.buf)
             {
-                free(dirty_it->second.refcnt);
+                unref_data(dirty_it->second.data);
             }
-            dirty_buffers.erase(dirty_it++);
+            dirty_it = dirty_buffers.erase(dirty_it);
         }
     }
     // Overlapping buffers are removed, just insert the new one
     bool is_del = op->opcode == OSD_OP_DELETE;
-    uint64_t *refcnt = is_del ? NULL : (uint64_t*)malloc_or_die(sizeof(uint64_t) + op->len);
-    uint8_t *buf = is_del ? NULL : ((uint8_t*)refcnt + sizeof(uint64_t));
-    if (!is_del)
-    {
-        *refcnt = 1;
-    }
+    cluster_buffer_data_t *data = is_del ? NULL : alloc_data(op->len);
+    uint8_t *buf = is_del ? NULL : data->buf;
     dirty_it = dirty_buffers.emplace_hint(dirty_it, (object_id){
         .inode = op->inode,
         .stripe = op->offset,
@@ -224,7 +254,7 @@ void writeback_cache_t::copy_write(cluster_op_t *op, int state, uint64_t new_flu
         .len = op->len,
         .state = state,
         .flush_id = new_flush_id,
-        .refcnt = refcnt,
+        .data = data,
     });
     if (state == CACHE_DIRTY)
     {
@@ -283,7 +313,15 @@ int writeback_cache_t::repeat_ops_for(cluster_client_t *cli, osd_num_t peer_osd,
                 wr_it->first.stripe != last_it->first.stripe+last_it->second.len))
             {
                 repeated++;
+                if (end)
+                {
+                    flush_buffers(cli, flush_it, wr_it);
+                    break;
+                }
+                // Flush may change dirty_buffers and invalidate wr_it
+                object_id wr_key = wr_it->first;
                 flush_buffers(cli, flush_it, wr_it);
+                wr_it = dirty_buffers.lower_bound(wr_key);
                 flush_it = wr_it;
             }
             if (end)
@@ -310,33 +348,30 @@ void writeback_cache_t::flush_buffers(cluster_client_t *cli, dirty_buf_it_t from
     op->len = prev_it->first.stripe + prev_it->second.len - from_it->first.stripe;
     uint32_t calc_len = 0;
     uint64_t flush_id = ++last_flush_id;
+    // Buffers may be overwritten during the flush, so they're referenced by the flush
+    std::vector<cluster_buffer_data_t*> flushed_data;
     for (auto it = from_it; it != to_it; it++)
     {
         it->second.state = CACHE_REPEATING;
         it->second.flush_id = flush_id;
         if (it->second.buf)
         {
-            (*it->second.refcnt)++;
-            flushed_buffers.emplace(flush_id, it->second.refcnt);
+            it->second.data->refcnt++;
+            flushed_data.push_back(it->second.data);
             op->iov.push_back(it->second.buf, it->second.len);
         }
         calc_len += it->second.len;
     }
     assert(calc_len == op->len);
     writebacks_active++;
-    op->callback = [this, flush_id](cluster_op_t* op)
+    op->callback = [this, flush_id, flushed_data](cluster_op_t* op)
     {
         // Buffer flushes are always retried, regardless of the error,
         // so they should never result in an error here
         assert(op->retval == op->len);
-        for (auto fl_it = flushed_buffers.find(flush_id);
-            fl_it != flushed_buffers.end() && fl_it->first == flush_id; )
+        for (auto data: flushed_data)
         {
-            if (!--(*fl_it->second)) // refcnt
-            {
-                free(fl_it->second);
-            }
-            flushed_buffers.erase(fl_it++);
+            unref_data(data);
         }
         if (op->flags & OP_IMMEDIATE_COMMIT)
         {
@@ -371,11 +406,11 @@ void writeback_cache_t::delete_flush(uint64_t inode, uint64_t offset, uint64_t l
     {
         if (dirty_it->second.flush_id == flush_id && dirty_it->second.state == CACHE_REPEATING)
         {
-            if (dirty_it->second.buf && !--(*dirty_it->second.refcnt))
+            if (dirty_it->second.buf)
             {
-                free(dirty_it->second.refcnt);
+                unref_data(dirty_it->second.data);
             }
-            dirty_buffers.erase(dirty_it++);
+            dirty_it = dirty_buffers.erase(dirty_it);
         }
         else
             dirty_it++;
@@ -402,63 +437,346 @@ void writeback_cache_t::start_writebacks(cluster_client_t *cli, int count)
     {
         return;
     }
-    std::vector<object_id> queue_copy;
+    if (!count)
+    {
+        // Everything is flushed now, data read for holes would only be written again
+        for (auto & gp: gap_reads)
+        {
+            gp.second.stale = true;
+        }
+        gap_fill_queue.clear();
+    }
+    std::vector<object_id> queue_copy, deferred;
     queue_copy.swap(writeback_queue);
     int started = 0, i = 0;
     for (i = 0; i < queue_copy.size() && (!count || started < count); i++)
     {
         object_id & req = queue_copy[i];
-        auto dirty_it = find_dirty(req.inode, req.stripe);
-        if (dirty_it == dirty_buffers.end() ||
-            dirty_it->first.inode != req.inode ||
-            dirty_it->second.state != CACHE_DIRTY)
+        if (count && cli->client_writeback_max_gap && fill_gaps(cli, req.inode, req.stripe, false))
         {
+            // Flush it with one write after reading holes. Holes are only read by start_gap_reads()
+            // after the caller stops flushing, so runs flushed anyway don't get useless reads
+            deferred.push_back(req);
             continue;
         }
-        auto from_it = dirty_it;
-        uint64_t off = dirty_it->first.stripe;
-        bool is_del = (dirty_it->second.buf == NULL);
-        while (from_it != dirty_buffers.begin())
+        if (start_writeback(cli, req, count != 0))
+        {
+            started++;
+        }
+    }
+    if (!started && deferred.size())
+    {
+        // Don't wait for holes if there's nothing else to flush
+        for (int j = 0; j < deferred.size(); j++)
         {
-            from_it--;
-            if (from_it->second.state != CACHE_DIRTY ||
-                (from_it->second.buf == NULL) != is_del ||
-                from_it->first.inode != req.inode ||
-                from_it->first.stripe+from_it->second.len != off)
+            if (start_writeback(cli, deferred[j], true))
             {
-                from_it++;
+                deferred.erase(deferred.begin()+j);
                 break;
             }
-            off = from_it->first.stripe;
         }
-        off = dirty_it->first.stripe + dirty_it->second.len;
-        auto to_it = dirty_it;
+    }
+    queue_copy.erase(queue_copy.begin(), queue_copy.begin()+i);
+    if (writeback_queue.size())
+    {
+        queue_copy.insert(queue_copy.end(), writeback_queue.begin(), writeback_queue.end());
+    }
+    if (deferred.size())
+    {
+        queue_copy.insert(queue_copy.end(), deferred.begin(), deferred.end());
+        gap_fill_queue.insert(gap_fill_queue.end(), deferred.begin(), deferred.end());
+    }
+    queue_copy.swap(writeback_queue);
+}
+
+void writeback_cache_t::start_gap_reads(cluster_client_t *cli)
+{
+    std::vector<object_id> reqs;
+    reqs.swap(gap_fill_queue);
+    for (auto & req: reqs)
+    {
+        // Runs flushed since they were deferred are skipped by fill_gaps()
+        fill_gaps(cli, req.inode, req.stripe, true);
+    }
+}
+
+bool writeback_cache_t::start_writeback(cluster_client_t *cli, object_id req, bool align)
+{
+    auto dirty_it = find_dirty(req.inode, req.stripe);
+    if (dirty_it == dirty_buffers.end() ||
+        dirty_it->first.inode != req.inode ||
+        dirty_it->second.state != CACHE_DIRTY)
+    {
+        return false;
+    }
+    auto from_it = dirty_it;
+    uint64_t off = dirty_it->first.stripe;
+    bool is_del = (dirty_it->second.buf == NULL);
+    while (from_it != dirty_buffers.begin())
+    {
+        from_it--;
+        if (from_it->second.state != CACHE_DIRTY ||
+            (from_it->second.buf == NULL) != is_del ||
+            from_it->first.inode != req.inode ||
+            from_it->first.stripe+from_it->second.len != off)
+        {
+            from_it++;
+            break;
+        }
+        off = from_it->first.stripe;
+    }
+    off = dirty_it->first.stripe + dirty_it->second.len;
+    auto to_it = dirty_it;
+    to_it++;
+    while (to_it != dirty_buffers.end())
+    {
+        if (to_it->second.state != CACHE_DIRTY ||
+            (to_it->second.buf == NULL) != is_del ||
+            to_it->first.inode != req.inode ||
+            to_it->first.stripe != off)
+        {
+            break;
+        }
+        off = to_it->first.stripe + to_it->second.len;
         to_it++;
-        while (to_it != dirty_buffers.end())
+    }
+    uint64_t flush_end = off;
+    auto pool_it = cli->st_cli.pool_config.find(INODE_POOL(req.inode));
+    if (align && !is_del && pool_it != cli->st_cli.pool_config.end())
+    {
+        // Leave the unfinished last object of a long run for following writes,
+        // so that sequential writes are flushed by whole objects
+        auto & pool_cfg = pool_it->second;
+        uint32_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        uint64_t pg_block_size = pool_cfg.data_block_size * pg_data_size;
+        uint64_t last_start = off - off % pg_block_size;
+        if (last_start > from_it->first.stripe && last_start < off)
         {
-            if (to_it->second.state != CACHE_DIRTY ||
-                (to_it->second.buf == NULL) != is_del ||
-                to_it->first.inode != req.inode ||
-                to_it->first.stripe != off)
+            object_id from_key = from_it->first;
+            auto split_it = find_dirty(req.inode, last_start);
+            if (split_it->first.stripe < last_start)
             {
-                break;
+                uint64_t split_end = split_it->first.stripe + split_it->second.len;
+                cluster_buffer_t tail = (cluster_buffer_t){
+                    .buf = split_it->second.buf + last_start - split_it->first.stripe,
+                    .len = split_end - last_start,
+                    .state = CACHE_DIRTY,
+                    .flush_id = split_it->second.flush_id,
+                    .data = split_it->second.data,
+                };
+                split_it->second.data->refcnt++;
+                split_it->second.len = last_start - split_it->first.stripe;
+                split_it = dirty_buffers.emplace_hint(split_it, (object_id){
+                    .inode = req.inode,
+                    .stripe = last_start,
+                }, tail);
             }
-            off = to_it->first.stripe + to_it->second.len;
-            to_it++;
+            to_it = split_it;
+            from_it = dirty_buffers.find(from_key);
+            // The rest remains a separate run
+            writeback_queue.push_back((object_id){
+                .inode = req.inode,
+                .stripe = last_start,
+            });
+            flush_end = last_start;
         }
-        started++;
+    }
+    if (flush_end == off)
+    {
         assert(writeback_queue_size > 0);
         writeback_queue_size--;
-        writeback_bytes -= (is_del ? 0 : off - from_it->first.stripe);
-        assert(writeback_queue_size > 0 || !writeback_bytes);
-        flush_buffers(cli, from_it, to_it);
     }
-    queue_copy.erase(queue_copy.begin(), queue_copy.begin()+i);
-    if (writeback_queue.size())
+    writeback_bytes -= (is_del ? 0 : flush_end - from_it->first.stripe);
+    assert(writeback_queue_size > 0 || !writeback_bytes);
+    flush_buffers(cli, from_it, to_it);
+    return true;
+}
+
+bool writeback_cache_t::fill_gaps(cluster_client_t *cli, uint64_t inode, uint64_t offset, bool start_read)
+{
+    auto dirty_it = find_dirty(inode, offset);
+    if (dirty_it == dirty_buffers.end() ||
+        dirty_it->first.inode != inode ||
+        dirty_it->second.state != CACHE_DIRTY ||
+        !dirty_it->second.buf)
     {
-        queue_copy.insert(queue_copy.end(), writeback_queue.begin(), writeback_queue.end());
+        return false;
+    }
+    auto pool_it = cli->st_cli.pool_config.find(INODE_POOL(inode));
+    if (pool_it == cli->st_cli.pool_config.end())
+    {
+        return false;
+    }
+    auto & pool_cfg = pool_it->second;
+    uint32_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    uint64_t pg_block_size = pool_cfg.data_block_size * pg_data_size;
+    uint64_t obj_start = dirty_it->first.stripe - dirty_it->first.stripe % pg_block_size;
+    uint64_t obj_end = obj_start + pg_block_size;
+    auto ino_it = cli->st_cli.inode_config.find(inode);
+    if (ino_it != cli->st_cli.inode_config.end() && ino_it->second.size && obj_end > ino_it->second.size)
+    {
+        // The last object of the inode is flushed as is
+        return false;
+    }
+    auto gap_it = gap_reads.lower_bound((object_id){ .inode = inode, .stripe = obj_start });
+    if (gap_it != gap_reads.end() && gap_it->first.inode == inode && gap_it->first.stripe < obj_end)
+    {
+        // Holes of this object are already being read
+        return true;
+    }
+    // Find dirty data of the object
+    uint64_t max_gap = cli->client_writeback_max_gap;
+    uint64_t dirty_start = UINT64_MAX, dirty_end = 0, dirty_bytes = 0;
+    for (auto it = find_dirty(inode, obj_start);
+        it != dirty_buffers.end() && it->first.inode == inode && it->first.stripe < obj_end; it++)
+    {
+        if (!it->second.buf)
+        {
+            // Deletes are flushed as is
+            return false;
+        }
+        if (it->second.state == CACHE_REPEATING)
+        {
+            // Part of the object is already being flushed
+            return false;
+        }
+        if (it->second.state == CACHE_DIRTY)
+        {
+            uint64_t begin = it->first.stripe < obj_start ? obj_start : it->first.stripe;
+            uint64_t end = it->first.stripe + it->second.len > obj_end ? obj_end : it->first.stripe + it->second.len;
+            dirty_start = begin < dirty_start ? begin : dirty_start;
+            dirty_end = end > dirty_end ? end : dirty_end;
+            dirty_bytes += end-begin;
+        }
+    }
+    if (dirty_end <= dirty_start)
+    {
+        return false;
+    }
+    // Extend it to the object boundaries and find holes and clean buffers
+    uint64_t fill_start = dirty_start-obj_start <= max_gap ? obj_start : dirty_start;
+    uint64_t fill_end = obj_end-dirty_end <= max_gap ? obj_end : dirty_end;
+    uint64_t pos = fill_start, fill_bytes = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> holes;
+    std::vector<std::pair<uint64_t, cluster_buffer_t>> clean;
+    for (auto it = find_dirty(inode, fill_start);
+        it != dirty_buffers.end() && it->first.inode == inode && it->first.stripe < fill_end; it++)
+    {
+        uint64_t begin = it->first.stripe < fill_start ? fill_start : it->first.stripe;
+        uint64_t end = it->first.stripe + it->second.len > fill_end ? fill_end : it->first.stripe + it->second.len;
+        if (begin > pos)
+        {
+            if (begin-pos > max_gap)
+                return false;
+            holes.push_back(std::make_pair(pos, begin-pos));
+            fill_bytes += begin-pos;
+        }
+        if (it->second.state != CACHE_DIRTY)
+        {
+            // Written, but not fsynced data is just written again
+            clean.push_back(std::make_pair(begin, (cluster_buffer_t){
+                .buf = it->second.buf + begin - it->first.stripe,
+                .len = end-begin,
+                .data = it->second.data,
+            }));
+            fill_bytes += end-begin;
+        }
+        pos = end;
+    }
+    if (pos < fill_end)
+    {
+        if (fill_end-pos > max_gap)
+            return false;
+        holes.push_back(std::make_pair(pos, fill_end-pos));
+        fill_bytes += fill_end-pos;
+    }
+    if (!fill_bytes || fill_bytes > dirty_bytes)
+    {
+        // Nothing to merge or too much extra data
+        return false;
+    }
+    if (holes.size() && !start_read)
+    {
+        // Holes have to be read, but the caller decides whether to wait for it
+        return true;
+    }
+    for (auto & cp: clean)
+    {
+        cp.second.data->refcnt++;
+    }
+    for (auto & cp: clean)
+    {
+        cluster_op_t op;
+        op.opcode = OSD_OP_WRITE;
+        op.inode = inode;
+        op.offset = cp.first;
+        op.len = cp.second.len;
+        op.iov.push_back(cp.second.buf, cp.second.len);
+        copy_write(&op, CACHE_DIRTY);
+        unref_data(cp.second.data);
+    }
+    if (!holes.size())
+    {
+        // Merged without reading
+        return false;
+    }
+    for (auto & h: holes)
+    {
+        gap_reads[(object_id){ .inode = inode, .stripe = h.first }] = (writeback_gap_t){ .len = h.second };
+    }
+    // All holes are read with one operation, dirty data between them is just skipped
+    cluster_op_t *rd_op = new cluster_op_t;
+    rd_op->opcode = OSD_OP_READ;
+    rd_op->inode = inode;
+    rd_op->offset = holes[0].first;
+    rd_op->len = holes[holes.size()-1].first + holes[holes.size()-1].second - rd_op->offset;
+    rd_op->flags = OSD_OP_NO_CACHE;
+    rd_op->iov.push_back(malloc_or_die(rd_op->len), rd_op->len);
+    rd_op->callback = [this, holes](cluster_op_t *rd_op)
+    {
+        finish_gap_read(rd_op, holes);
+    };
+    cli->execute_internal(rd_op);
+    return true;
+}
+
+void writeback_cache_t::finish_gap_read(cluster_op_t *op, const std::vector<std::pair<uint64_t, uint64_t>> & holes)
+{
+    for (auto & h: holes)
+    {
+        auto gap_it = gap_reads.find((object_id){ .inode = op->inode, .stripe = h.first });
+        bool valid = gap_it != gap_reads.end() && !gap_it->second.stale && op->retval == op->len;
+        if (gap_it != gap_reads.end())
+        {
+            gap_reads.erase(gap_it);
+        }
+        if (valid)
+        {
+            // Nothing was written there during the read, so the data is just added to neighbouring dirty buffers
+            cluster_op_t wr_op;
+            wr_op.opcode = OSD_OP_WRITE;
+            wr_op.inode = op->inode;
+            wr_op.offset = h.first;
+            wr_op.len = h.second;
+            wr_op.iov.push_back((uint8_t*)op->iov.buf[0].iov_base + h.first - op->offset, h.second);
+            copy_write(&wr_op, CACHE_DIRTY);
+        }
+    }
+    free(op->iov.buf[0].iov_base);
+    delete op;
+}
+
+void writeback_cache_t::mark_gaps_stale(uint64_t inode, uint64_t offset, uint64_t len)
+{
+    // Zero-length deletes remove whole objects
+    for (auto gap_it = gap_reads.lower_bound((object_id){ .inode = inode, .stripe = 0 });
+        gap_it != gap_reads.end() && gap_it->first.inode == inode && (!len || gap_it->first.stripe < offset+len); gap_it++)
+    {
+        if (!len || gap_it->first.stripe + gap_it->second.len > offset)
+        {
+            gap_it->second.stale = true;
+        }
     }
-    queue_copy.swap(writeback_queue);
 }
 
 static void copy_to_op(cluster_op_t *op, uint64_t offset, uint8_t *buf, uint64_t len, uint32_t bitmap_granularity)
@@ -598,11 +916,11 @@ void writeback_cache_t::fsync_ok()
     {
         if (uw_it->second.state == CACHE_FLUSHING)
         {
-            if (uw_it->second.buf && !--(*uw_it->second.refcnt))
+            if (uw_it->second.buf)
             {
-                free(uw_it->second.refcnt);
+                unref_data(uw_it->second.data);
             }
-            dirty_buffers.erase(uw_it++);
+            uw_it = dirty_buffers.erase(uw_it);
         }
         else
             uw_it++;
@@ -75,6 +75,10 @@ void osd_messenger_t::init()
     {
         init_iothreads();
     }
+    if (ringloop && use_multishot_recv && !use_sync_send_recv && !iothreads.size())
+    {
+        init_recv_buf_ring();
+    }
     keepalive_timer_id = tfd->set_timer(1000, true, [this](int)
     {
         std::vector<uint64_t> clients_to_stop;
@@ -168,6 +172,7 @@ osd_messenger_t::~osd_messenger_t()
         stop_client(clients.begin()->first, true);
     }
     destroy_iothreads();
+    free_recv_buf_ring();
 #ifdef WITH_RDMA
     for (auto rdma_context: rdma_contexts)
     {
@@ -227,6 +232,11 @@ void osd_messenger_t::parse_config(const json11::Json & config)
         this->receive_buffer_size = 65536;
     this->use_sync_send_recv = config["use_sync_send_recv"].bool_value() ||
         config["use_sync_send_recv"].uint64_value();
+    this->use_multishot_recv = config["use_multishot_recv"].bool_value() ||
+        config["use_multishot_recv"].uint64_value();
+    this->multishot_recv_buffers = config["multishot_recv_buffers"].uint64_value();
+    if (!this->multishot_recv_buffers || this->multishot_recv_buffers > 32768)
+        this->multishot_recv_buffers = DEFAULT_MULTISHOT_RECV_BUFFERS;
     this->min_zerocopy_send_size = config["min_zerocopy_send_size"].is_null()
         ? DEFAULT_MIN_ZEROCOPY_SEND_SIZE
         : (int)config["min_zerocopy_send_size"].int64_value();
@@ -399,9 +409,9 @@ void osd_messenger_t::try_connect_peer_tcp(osd_num_t peer_osd, const char *peer_
     cl->peer_state = PEER_CONNECTING;
     cl->connect_timeout_id = -1;
     cl->osd_num = peer_osd;
-    cl->in_buf = malloc_or_die(receive_buffer_size);
     clients[client_id] = cl;
     clients_by_fd[peer_fd] = cl;
+    register_peer_fd(peer_fd);
     tfd->set_fd_handler(peer_fd, true, [this](int peer_fd, int epoll_events)
     {
         // Either OUT (connected) or HUP
@@ -650,6 +660,16 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
     outbox_push(op);
 }
 
+// Socket I/O is submitted to the event loop ring only without I/O threads,
+// so sockets are only added to its registered file table in this case
+void osd_messenger_t::register_peer_fd(int peer_fd)
+{
+    if (ringloop && !use_sync_send_recv && !iothreads.size())
+    {
+        ringloop->register_fd(peer_fd);
+    }
+}
+
 void osd_messenger_t::accept_connections(int listen_fd)
 {
     // Accept new connections
@@ -675,7 +695,7 @@ void osd_messenger_t::accept_connections(int listen_fd)
         cl->peer_port = ntohs(((sockaddr_in*)&addr)->sin_port);
         cl->peer_fd = peer_fd;
         cl->peer_state = PEER_CONNECTED;
-        cl->in_buf = malloc_or_die(receive_buffer_size);
+        register_peer_fd(peer_fd);
         // Add FD to epoll
         tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
         {
@@ -718,6 +738,19 @@ bool osd_messenger_t::is_use_rdmacm()
 }
 #endif
 
+ring_loop_config_t osd_messenger_t::parse_ring_config(const json11::Json & config, bool is_osd)
+{
+    const std::string prefix = is_osd ? "osd_" : "client_";
+    ring_loop_config_t ring_config;
+    ring_config.sqpoll = config[prefix+"sqpoll"].bool_value() || config[prefix+"sqpoll"].uint64_value();
+    if (!config["sqpoll_cpu"].is_null())
+        ring_config.sqpoll_cpu = (int)config["sqpoll_cpu"].int64_value();
+    ring_config.sqpoll_idle = config["sqpoll_idle"].is_null() ? 1000 : (int)config["sqpoll_idle"].uint64_value();
+    ring_config.defer_taskrun = config[prefix+"defer_taskrun"].bool_value() || config[prefix+"defer_taskrun"].uint64_value();
+    ring_config.busy_poll_us = (int)config[prefix+"busy_poll_us"].uint64_value();
+    return ring_config;
+}
+
 json11::Json::object osd_messenger_t::read_config(const json11::Json & config)
 {
     json11::Json::object file_config;
@@ -795,7 +828,14 @@ static const char **cli_only_end = cli_only_params + (sizeof(cli_only_params)/si
 
 static const char* local_only_params[] = {
     // The list has to be sorted
+    "client_busy_poll_us",
+    "client_defer_taskrun",
+    "client_sqpoll",
     "config_path",
+    "multishot_recv_buffers",
+    "osd_busy_poll_us",
+    "osd_defer_taskrun",
+    "osd_sqpoll",
     "rdma_device",
     "rdma_gid_index",
     "rdma_max_msg",
@@ -804,7 +844,10 @@ static const char* local_only_params[] = {
     "rdma_max_sge",
     "rdma_mtu",
     "rdma_port_num",
+    "sqpoll_cpu",
+    "sqpoll_idle",
     "tcp_header_buffer_size",
+    "use_multishot_recv",
     "use_rdma",
     "use_sync_send_recv",
     "min_zerocopy_send_size",
@@ -34,6 +34,8 @@
 #define VITASTOR_CONFIG_PATH "/etc/vitastor/vitastor.conf"
 
 #define DEFAULT_MIN_ZEROCOPY_SEND_SIZE 32*1024
+#define DEFAULT_MULTISHOT_RECV_BUFFERS 256
+#define MSGR_RECV_BUF_GROUP 1
 
 #define MSGR_SENDP_HDR 1
 #define MSGR_SENDP_FREE 2
@@ -78,6 +80,9 @@ struct osd_client_t
     msghdr read_msg = { 0 };
     int read_remaining = 0;
     int read_state = 0;
+    // Armed multishot receive request, if any
+    ring_data_t *recv_multishot = NULL;
+    bool recv_cancelling = false;
     osd_op_buf_list_t recv_list;
     uint64_t read_op_id = 1;
     bool check_sequencing = false;
@@ -129,6 +134,16 @@ struct osd_op_stats_t
     uint64_t subop_stat_count[OSD_OP_MAX+1] = { 0 };
 };
 
+struct osd_conn_stats_t
+{
+    uint64_t client_count = 0;
+    // Per-client receive buffers
+    uint64_t recv_buffer_bytes = 0;
+    // Receive buffer ring shared by all clients
+    uint64_t recv_ring_bytes = 0;
+    bool multishot_recv = false;
+};
+
 class msgr_iothread_t;
 
 #ifdef WITH_RDMA
@@ -154,6 +169,11 @@ protected:
     bool use_sync_send_recv = false;
     int min_zerocopy_send_size = DEFAULT_MIN_ZEROCOPY_SEND_SIZE;
     int iothread_count = 0;
+    bool use_multishot_recv = false;
+    uint32_t multishot_recv_buffers = 0;
+    io_uring_buf_ring *recv_buf_ring = NULL;
+    uint8_t *recv_bufs = NULL;
+    uint32_t recv_buf_size = 0, recv_buf_count = 0;
 
 #ifdef WITH_RDMA
     bool use_rdma = true;
@@ -219,6 +239,9 @@ public:
         const json11::Json::object & file_config,
         const json11::Json::object & etcd_global_config,
         const json11::Json::object & etcd_osd_config);
+    // io_uring setup options can't be changed after creating the ring,
+    // so they are only taken from the command line and the configuration file
+    static ring_loop_config_t parse_ring_config(const json11::Json & config, bool is_osd);
 
 #ifdef WITH_RDMA
     bool is_rdma_enabled();
@@ -232,12 +255,14 @@ public:
 
     void inc_op_stats(osd_op_stats_t & stats, uint64_t opcode, timespec & tv_begin, timespec & tv_end, uint64_t len);
     void measure_exec(osd_op_t *cur_op);
+    osd_conn_stats_t get_conn_stats();
 
 protected:
     void try_connect_peer(uint64_t osd_num);
     void try_connect_peer_tcp(osd_num_t peer_osd, const char *peer_host, int peer_port);
     void handle_peer_epoll(int peer_fd, int epoll_events);
     void handle_connect_epoll(int peer_fd);
+    void register_peer_fd(int peer_fd);
     void on_connect_peer(osd_num_t peer_osd, int errcode, uint64_t client_id);
     void check_peer_config(osd_client_t *cl);
     void cancel_osd_ops(osd_client_t *cl);
@@ -247,6 +272,12 @@ protected:
     void handle_send(int result, bool prev, bool more, osd_client_t *cl);
 
     bool handle_read(int result, osd_client_t *cl);
+    void init_recv_buf_ring();
+    void free_recv_buf_ring();
+    bool submit_multishot_recv(osd_client_t *cl);
+    void cancel_multishot_recv(osd_client_t *cl);
+    void handle_multishot_recv(osd_client_t *cl, ring_data_t *data);
+    void put_recv_buf(int buf_id);
     bool handle_read_buffer(osd_client_t *cl, void *curbuf, int remain);
     bool handle_finished_read(osd_client_t *cl);
     void handle_op_hdr(osd_client_t *cl);
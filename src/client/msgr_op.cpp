@@ -4,6 +4,7 @@
 #include <assert.h>
 
 #include "msgr_op.h"
+#include "buffer_pool.h"
 
 osd_op_t::~osd_op_t()
 {
@@ -15,13 +16,13 @@ osd_op_t::~osd_op_t()
     }
     if (rmw_buf)
     {
-        free(rmw_buf);
+        pool_free(rmw_buf);
     }
     if (buf)
     {
         // Note: reusing osd_op_t WILL currently lead to memory leaks
         // So we don't reuse it, but free it every time
-        free(buf);
+        pool_free(buf);
     }
 }
 
@@ -3,6 +3,7 @@
 
 #include "messenger.h"
 #include "msgr_iothread.h"
+#include "buffer_pool.h"
 
 void osd_messenger_t::read_requests()
 {
@@ -16,8 +17,27 @@ void osd_messenger_t::read_requests()
             continue;
         }
         auto cl = cl_it->second;
+        if (cl->recv_multishot)
+        {
+            // Data is delivered by the armed multishot receive
+            cl->read_ready = 0;
+            continue;
+        }
+        if (recv_buf_ring && use_multishot_recv && cl->read_remaining < recv_buf_size)
+        {
+            if (!submit_multishot_recv(cl))
+            {
+                read_ready_clients.erase(read_ready_clients.begin(), read_ready_clients.begin() + i);
+                return;
+            }
+            continue;
+        }
         if (cl->read_remaining < receive_buffer_size)
         {
+            if (!cl->in_buf)
+            {
+                cl->in_buf = malloc_or_die(receive_buffer_size);
+            }
             cl->read_iov.iov_base = cl->in_buf;
             cl->read_iov.iov_len = receive_buffer_size;
             cl->read_msg.msg_iov = &cl->read_iov;
@@ -50,7 +70,10 @@ void osd_messenger_t::read_requests()
                 return;
             }
             ring_data_t* data = ((ring_data_t*)sqe->user_data);
-            data->callback = [this, cl](ring_data_t *data) { handle_read(data->res, cl); };
+            data->set_callback([](void *msgr, void *cl, ring_data_t *data)
+            {
+                ((osd_messenger_t*)msgr)->handle_read(data->res, (osd_client_t*)cl);
+            }, this, cl);
             io_uring_prep_recvmsg(sqe, cl->peer_fd, &cl->read_msg, 0);
             if (iothread)
             {
@@ -110,7 +133,7 @@ bool osd_messenger_t::handle_read(int result, osd_client_t *cl)
     }
     if (result > 0)
     {
-        if (cl->read_iov.iov_base == cl->in_buf)
+        if (cl->read_msg.msg_iov == &cl->read_iov)
         {
             if (!handle_read_buffer(cl, cl->in_buf, result))
             {
@@ -141,6 +164,175 @@ bool osd_messenger_t::handle_read(int result, osd_client_t *cl)
     return ret;
 }
 
+void osd_messenger_t::init_recv_buf_ring()
+{
+    recv_buf_count = 1;
+    while (recv_buf_count < multishot_recv_buffers)
+    {
+        recv_buf_count *= 2;
+    }
+    int err = 0;
+    recv_buf_ring = ringloop->setup_buf_ring(MSGR_RECV_BUF_GROUP, recv_buf_count, &err);
+    if (!recv_buf_ring)
+    {
+        fprintf(stderr, "Failed to set up receive buffer ring: %s (code %d), multishot receive is disabled\n", strerror(-err), -err);
+        recv_buf_count = 0;
+        return;
+    }
+    recv_buf_size = receive_buffer_size;
+    recv_bufs = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, (size_t)recv_buf_count*recv_buf_size);
+    for (uint32_t i = 0; i < recv_buf_count; i++)
+    {
+        io_uring_buf_ring_add(recv_buf_ring, recv_bufs + (size_t)i*recv_buf_size, recv_buf_size,
+            i, io_uring_buf_ring_mask(recv_buf_count), i);
+    }
+    io_uring_buf_ring_advance(recv_buf_ring, recv_buf_count);
+}
+
+void osd_messenger_t::free_recv_buf_ring()
+{
+    if (recv_buf_ring)
+    {
+        ringloop->free_buf_ring(recv_buf_ring, MSGR_RECV_BUF_GROUP, recv_buf_count);
+        recv_buf_ring = NULL;
+        free(recv_bufs);
+        recv_bufs = NULL;
+        recv_buf_count = recv_buf_size = 0;
+    }
+}
+
+void osd_messenger_t::put_recv_buf(int buf_id)
+{
+    io_uring_buf_ring_add(recv_buf_ring, recv_bufs + (size_t)buf_id*recv_buf_size, recv_buf_size,
+        buf_id, io_uring_buf_ring_mask(recv_buf_count), 0);
+    io_uring_buf_ring_advance(recv_buf_ring, 1);
+}
+
+// Multishot receive stays armed until an error, EOF or cancellation and picks buffers from
+// the ring shared by all clients, so idle connections don't hold receive buffers at all
+bool osd_messenger_t::submit_multishot_recv(osd_client_t *cl)
+{
+    io_uring_sqe* sqe = ringloop->get_sqe();
+    if (!sqe)
+    {
+        return false;
+    }
+    ring_data_t* data = ((ring_data_t*)sqe->user_data);
+    data->set_callback([](void *msgr, void *cl, ring_data_t *data)
+    {
+        ((osd_messenger_t*)msgr)->handle_multishot_recv((osd_client_t*)cl, data);
+    }, this, cl);
+    io_uring_prep_recv_multishot(sqe, cl->peer_fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = MSGR_RECV_BUF_GROUP;
+    cl->recv_multishot = data;
+    cl->read_ready = 0;
+    cl->refs++;
+    return true;
+}
+
+// Large payloads are received directly into operation buffers: multishot receive is
+// cancelled and the rest is read with recvmsg() into recv_list
+void osd_messenger_t::cancel_multishot_recv(osd_client_t *cl)
+{
+    io_uring_sqe* sqe = ringloop->get_sqe();
+    if (!sqe)
+    {
+        // Retried on the next completion. Data is still received correctly meanwhile
+        return;
+    }
+    ring_data_t* data = ((ring_data_t*)sqe->user_data);
+    data->set_callback([](void *msgr, void *arg, ring_data_t *data) {}, this);
+    io_uring_prep_cancel64(sqe, (uint64_t)cl->recv_multishot, 0);
+    cl->recv_cancelling = true;
+    // Submit immediately, because the ring_data_t of the multishot request
+    // may be reused after its last completion is handled
+    ringloop->submit();
+}
+
+void osd_messenger_t::handle_multishot_recv(osd_client_t *cl, ring_data_t *data)
+{
+    int result = data->res;
+    int buf_id = -1;
+    if (data->cqe_flags & IORING_CQE_F_BUFFER)
+    {
+        buf_id = data->cqe_flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    if (!data->more)
+    {
+        cl->recv_multishot = NULL;
+        cl->recv_cancelling = false;
+        cl->refs--;
+    }
+    if (cl->peer_state == PEER_RDMA || cl->peer_state == PEER_STOPPED)
+    {
+        if (buf_id >= 0)
+        {
+            put_recv_buf(buf_id);
+        }
+        if (cl->peer_state == PEER_STOPPED && cl->refs <= 0)
+        {
+            destroy_client(cl);
+        }
+        return;
+    }
+    if (result > 0 && buf_id >= 0)
+    {
+        bool ok = handle_read_buffer(cl, recv_bufs + (size_t)buf_id*recv_buf_size, result);
+        put_recv_buf(buf_id);
+        if (!ok)
+        {
+            handle_immediate_ops();
+            return;
+        }
+        if (cl->recv_multishot && !cl->recv_cancelling && cl->read_remaining >= recv_buf_size)
+        {
+            cancel_multishot_recv(cl);
+        }
+    }
+    else if (buf_id >= 0)
+    {
+        put_recv_buf(buf_id);
+    }
+    if (!data->more)
+    {
+        if (result == -EINVAL)
+        {
+            fprintf(stderr, "Multishot receive is not supported by the kernel, falling back to recvmsg\n");
+            use_multishot_recv = false;
+        }
+        else if (result == 0 || result < 0 && result != -ENOBUFS && result != -ECANCELED &&
+            result != -EAGAIN && result != -EINTR)
+        {
+            if (result != 0)
+            {
+                fprintf(stderr, "Client %ju socket read error: %d (%s). Disconnecting client\n", cl->client_id, -result, strerror(-result));
+            }
+            stop_client(cl->client_id);
+            handle_immediate_ops();
+            return;
+        }
+        // Rearm multishot receive or read the rest of the payload with recvmsg()
+        cl->read_ready = 1;
+        read_ready_clients.push_back(cl->client_id);
+    }
+    handle_immediate_ops();
+}
+
+osd_conn_stats_t osd_messenger_t::get_conn_stats()
+{
+    osd_conn_stats_t st;
+    st.client_count = clients.size();
+    for (auto & cp: clients)
+    {
+        if (cp.second->in_buf)
+            st.recv_buffer_bytes += receive_buffer_size;
+    }
+    st.recv_ring_bytes = (uint64_t)recv_buf_count*recv_buf_size;
+    st.multishot_recv = recv_buf_ring && use_multishot_recv;
+    return st;
+}
+
 void osd_messenger_t::handle_immediate_ops()
 {
     while (set_immediate_ops.size())
@@ -282,7 +474,7 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
         }
         if (cur_op->req.sec_rw.len > 0)
         {
-            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.sec_rw.len);
+            cur_op->buf = pool_alloc(cur_op->req.sec_rw.len);
             cl->recv_list.push_back(cur_op->buf, cur_op->req.sec_rw.len);
         }
         cl->read_remaining = cur_op->req.sec_rw.len + cur_op->req.sec_rw.attr_len;
@@ -310,7 +502,7 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
     {
         if (cur_op->req.rw.len > 0)
         {
-            cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.rw.len);
+            cur_op->buf = pool_alloc(cur_op->req.rw.len);
             cl->recv_list.push_back(cur_op->buf, cur_op->req.rw.len);
         }
         cl->read_remaining = cur_op->req.rw.len;
@@ -410,7 +602,7 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
         cl->read_op = op;
         cl->read_state = CL_READ_REPLY_DATA;
         cl->read_remaining = op->reply.hdr.retval;
-        free(op->buf);
+        pool_free(op->buf);
         op->buf = memalign_or_die(MEM_ALIGNMENT, cl->read_remaining);
         cl->recv_list.push_back(op->buf, cl->read_remaining);
     }
@@ -420,7 +612,7 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
         cl->read_op = op;
         cl->read_state = CL_READ_REPLY_DATA;
         cl->read_remaining = op->reply.hdr.retval;
-        free(op->buf);
+        pool_free(op->buf);
         op->buf = malloc_or_die(op->reply.hdr.retval);
         cl->recv_list.push_back(op->buf, op->reply.hdr.retval);
     }
@@ -430,7 +622,7 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
         cl->read_op = op;
         cl->read_state = CL_READ_REPLY_DATA;
         cl->read_remaining = op->reply.describe.result_bytes;
-        free(op->buf);
+        pool_free(op->buf);
         op->buf = malloc_or_die(op->reply.describe.result_bytes);
         cl->recv_list.push_back(op->buf, op->reply.describe.result_bytes);
     }
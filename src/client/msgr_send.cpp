@@ -213,7 +213,10 @@ bool osd_messenger_t::try_send(osd_client_t *cl)
         cl->write_msg.msg_iovlen = cl->send_list.size() < IOV_MAX ? cl->send_list.size() : IOV_MAX;
         cl->refs++;
         ring_data_t* data = ((ring_data_t*)sqe->user_data);
-        data->callback = [this, cl](ring_data_t *data) { handle_send(data->res, data->prev, data->more, cl); };
+        data->set_callback([](void *msgr, void *cl, ring_data_t *data)
+        {
+            ((osd_messenger_t*)msgr)->handle_send(data->res, data->prev, data->more, (osd_client_t*)cl);
+        }, this, cl);
         bool use_zc = has_sendmsg_zc && min_zerocopy_send_size >= 0;
         if (use_zc && min_zerocopy_send_size > 0)
         {
@@ -146,6 +146,9 @@ void osd_messenger_t::destroy_client(osd_client_t *cl)
             }
         }
         clients_by_fd.erase(cl->peer_fd);
+        // Registered file table holds a reference to the socket, it must be removed before close()
+        if (ringloop)
+            ringloop->unregister_fd(cl->peer_fd);
     }
 #ifdef WITH_RDMA
     if (cl->rdma_conn)
@@ -13,12 +13,20 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
 #include "../liburing/include/ublk_cmd.h"
 #include "cluster_client.h"
 #include "epoll_manager.h"
 #include "str_util.h"
+#include "json_util.h"
 
 const char *exe_name = NULL;
 
@@ -34,6 +42,12 @@ const char *help_text =
     "    Recover a mapped device if the previous ublk server is dead.\n"
     "  --queue_depth 256\n"
     "    Maximum queue size for the device.\n"
+    "  --nr_queues 1\n"
+    "    Number of device hardware queues. Each queue is served by a separate thread\n"
+    "    with its own cluster client. Client write-back cache is disabled with more than 1 queue.\n"
+    "  --user_copy\n"
+    "    Use UBLK_F_USER_COPY: copy request data directly to/from per-request buffers allocated\n"
+    "    on demand instead of preallocating queue_depth * max_io_size buffers. Requires Linux 6.5+.\n"
     "  --max_io_size 1M\n"
     "    Maximum single I/O size for the device. Default: max(1 MB, pool block size * EC part count).\n"
     "  --readonly\n"
@@ -62,6 +76,36 @@ const char *help_text =
     "All usual Vitastor config options like --config_path <path_to_config> may also be specified in CLI.\n"
 ;
 
+struct ublk_queue_t
+{
+    int q_id = 0;
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    cluster_client_t *cli = NULL;
+    inode_watch_t *watch = NULL;
+    ublksrv_io_desc *io_desc = NULL;
+    size_t io_desc_size = 0;
+    std::vector<uint8_t*> buffers;
+    std::vector<uint32_t> buffer_sizes;
+    // Submissions postponed because the submission queue was full
+    ring_consumer_t consumer;
+    std::vector<std::function<void()>> postponed;
+    bool stop = false;
+    std::thread thread;
+    // Calls from other queues (used to broadcast flushes)
+    int call_fd = -1;
+    std::mutex call_mu;
+    std::vector<std::function<void()>> calls;
+};
+
+struct ublk_flush_t
+{
+    ublk_queue_t *q;
+    int tag;
+    std::atomic<int> remaining;
+    std::atomic<int> retval;
+};
+
 class ublk_server
 {
 protected:
@@ -72,8 +116,11 @@ protected:
     bool readonly = false;
     bool hdd = false;
     bool recover = false;
+    bool user_copy = false;
     uint16_t queue_depth = 256;
+    uint16_t nr_queues = 1;
     uint32_t max_io_size = 0;
+    json11::Json client_cfg;
 
     ring_loop_t *ringloop = NULL;
     epoll_manager_t *epmgr = NULL;
@@ -101,11 +148,23 @@ public:
             close(cdev_fd);
             cdev_fd = -1;
         }
-        for (auto & buf: buffers)
+        for (auto q: queues)
         {
-            free(buf);
+            for (auto & buf: q->buffers)
+            {
+                free(buf);
+            }
+            if (q->io_desc)
+            {
+                munmap(q->io_desc, q->io_desc_size);
+            }
+            if (q->call_fd >= 0)
+            {
+                close(q->call_fd);
+            }
+            delete q;
         }
-        buffers.clear();
+        queues.clear();
         if (ringloop)
         {
             delete ringloop;
@@ -127,7 +186,7 @@ public:
             {
                 const char *opt = args[i]+2;
                 cfg[opt] = !strcmp(opt, "json") || !strcmp(opt, "all") ||
-                    !strcmp(opt, "readonly") || !strcmp(opt, "hdd") || !strcmp(opt, "recover") ||
+                    !strcmp(opt, "readonly") || !strcmp(opt, "hdd") || !strcmp(opt, "recover") || !strcmp(opt, "user_copy") ||
                     !strcmp(opt, "force") || i == narg-1 ? "1" : args[++i];
             }
             else if (pos == 0)
@@ -252,6 +311,38 @@ help:
         {
             queue_depth = cli->config["ublk_queue_depth"].uint64_value();
         }
+        if (!cfg["nr_queues"].is_null())
+        {
+            nr_queues = cfg["nr_queues"].uint64_value();
+        }
+        else if (cli->config.find("ublk_nr_queues") != cli->config.end())
+        {
+            nr_queues = cli->config["ublk_nr_queues"].uint64_value();
+        }
+        if (nr_queues < 1 || nr_queues > UBLK_MAX_NR_QUEUES)
+        {
+            fprintf(stderr, "nr_queues must be between 1 and %u\n", UBLK_MAX_NR_QUEUES);
+            exit(1);
+        }
+        if (nr_queues > 1)
+        {
+            // Each queue has its own client, and a write buffered in one client
+            // would be invisible for reads from other queues, so disable write-back
+            auto obj = cfg.object_items();
+            obj["client_writeback_allowed"] = false;
+            cfg = obj;
+            cli->cli_config["client_writeback_allowed"] = false;
+            cli->config["client_writeback_allowed"] = false;
+        }
+        client_cfg = cfg;
+        if (!cfg["user_copy"].is_null())
+        {
+            user_copy = cfg["user_copy"].bool_value();
+        }
+        else if (cli->config.find("ublk_user_copy") != cli->config.end())
+        {
+            user_copy = json_is_true(cli->config["ublk_user_copy"]);
+        }
         if (!cfg["max_io_size"].is_null())
         {
             max_io_size = parse_size(cfg["max_io_size"].string_value());
@@ -317,7 +408,7 @@ help:
                 req_dev_num,
                 (writeback ? UBLK_ATTR_VOLATILE_CACHE : 0) |
                 (readonly ? UBLK_ATTR_READ_ONLY : 0) | (hdd ? UBLK_ATTR_ROTATIONAL : 0),
-                queue_depth, bitmap_granularity, buf_size, pg_data_size, device_size
+                nr_queues, queue_depth, bitmap_granularity, buf_size, pg_data_size, device_size
             );
         }
         int notifyfd[2] = { -1, -1 };
@@ -343,13 +434,18 @@ help:
         }
         else
             printf("/dev/ublkb%d\n", ublk_dev.dev_id);
-        stop = false;
-        while (!stop)
+        auto q0 = queues[0];
+        while (stopped_queues < queues.size())
         {
             ringloop->loop();
             ringloop->wait();
         }
+        ringloop->unregister_consumer(&q0->consumer);
         cli->flush();
+        for (int q_id = 1; q_id < queues.size(); q_id++)
+        {
+            queues[q_id]->thread.join();
+        }
         delete cli;
         delete epmgr;
         cli = NULL;
@@ -545,14 +641,17 @@ help:
     }
 
 protected:
-    bool stop = false;
     bool new_opcodes = true;
     uint64_t ublk_features = 0;
     int max_wait_time_ms = 5000;
     int ctrl_fd = -1, cdev_fd = -1;
     ublksrv_ctrl_dev_info ublk_dev = {};
-    ublksrv_io_desc *ublk_queue = NULL;
-    std::vector<uint8_t*> buffers;
+    std::vector<ublk_queue_t*> queues;
+    std::mutex started_mu;
+    std::condition_variable started_cond;
+    int started_queues = 0;
+    // Queues keep serving calls from other queues until all of them are stopped
+    std::atomic<int> stopped_queues { 0 };
 
     void open_control()
     {
@@ -575,15 +674,20 @@ protected:
         }
     }
 
-    void add_device(int32_t dev_num, uint32_t attrs, uint16_t queue_depth, uint32_t phys_block_size,
+    void add_device(int32_t dev_num, uint32_t attrs, uint16_t nr_queues, uint16_t queue_depth, uint32_t phys_block_size,
         uint32_t max_io_buf_bytes, uint64_t opt_block_size, uint64_t device_size)
     {
         // Add device
         ublk_dev.dev_id = dev_num;
-        ublk_dev.nr_hw_queues = 1;
+        ublk_dev.nr_hw_queues = nr_queues;
         ublk_dev.queue_depth = queue_depth;
         ublk_dev.max_io_buf_bytes = max_io_buf_bytes;
-        ublk_dev.flags = UBLK_F_USER_RECOVERY | UBLK_F_USER_RECOVERY_REISSUE;
+        ublk_dev.flags = UBLK_F_USER_RECOVERY | UBLK_F_USER_RECOVERY_REISSUE | (user_copy ? UBLK_F_USER_COPY : 0);
+        if (user_copy && !(ublk_features & UBLK_F_USER_COPY))
+        {
+            fprintf(stderr, "ublk driver does not support user copy\n");
+            exit(1);
+        }
         int res = sync_ublk_cmd(new_opcodes ? UBLK_U_CMD_ADD_DEV : UBLK_CMD_ADD_DEV, &ublk_dev, sizeof(ublk_dev));
         if (res != 0)
         {
@@ -649,16 +753,16 @@ protected:
         }
     }
 
-    void map_ublk_queue()
+    void map_ublk_queue(ublk_queue_t *q)
     {
         const unsigned page_sz = getpagesize();
-        size_t cmd_buf_size = (ublk_dev.queue_depth * sizeof(ublksrv_io_desc) + page_sz-1) / page_sz * page_sz;
-        //const unsigned queue_offset = (UBLK_MAX_QUEUE_DEPTH * sizeof(ublksrv_io_desc) + page_sz-1) / page_sz * page_sz;
-        //off = q_id * queue_offset;
-        ublk_queue = (ublksrv_io_desc*)mmap(0, cmd_buf_size, PROT_READ, MAP_SHARED | MAP_POPULATE, cdev_fd, 0);
-        if ((void*)ublk_queue == MAP_FAILED)
+        const unsigned queue_offset = (UBLK_MAX_QUEUE_DEPTH * sizeof(ublksrv_io_desc) + page_sz-1) / page_sz * page_sz;
+        q->io_desc_size = (ublk_dev.queue_depth * sizeof(ublksrv_io_desc) + page_sz-1) / page_sz * page_sz;
+        q->io_desc = (ublksrv_io_desc*)mmap(0, q->io_desc_size, PROT_READ, MAP_SHARED | MAP_POPULATE, cdev_fd, q->q_id * queue_offset);
+        if ((void*)q->io_desc == MAP_FAILED)
         {
-            fprintf(stderr, "Failed to mmap() ublk queue buffer\n");
+            q->io_desc = NULL;
+            fprintf(stderr, "Failed to mmap() ublk queue %d buffer\n", q->q_id);
             exit(1);
         }
     }
@@ -672,11 +776,6 @@ protected:
             fprintf(stderr, "Failed to get /dev/ublkb%u device info: %s (code %d)\n", dev_num, strerror(-res), res);
             exit(1);
         }
-        if (ublk_dev.nr_hw_queues != 1)
-        {
-            fprintf(stderr, "Device /dev/ublkb%u is not supported because it has %d queues\n", dev_num, ublk_dev.nr_hw_queues);
-            exit(1);
-        }
         if (ublk_dev.ublksrv_pid != 0)
         {
             res = kill(ublk_dev.ublksrv_pid, 0);
@@ -710,16 +809,30 @@ protected:
             fprintf(stderr, "Failed to open %s: %s (code %d)", ublkc_path.c_str(), strerror(errno), errno);
             exit(1);
         }
-        // FIXME Here we could optionally do ublk_get_queue_affinity
-        // Map queue command buffer
-        map_ublk_queue();
-        // submit initial fetch requests to ublk driver
-        for (int i = 0; i < ublk_dev.queue_depth; i++)
+        // The device may be recovered, so take the mode from the actual device flags
+        user_copy = (ublk_dev.flags & UBLK_F_USER_COPY) != 0;
+        for (int q_id = 0; q_id < ublk_dev.nr_hw_queues; q_id++)
         {
-            buffers.push_back((uint8_t*)memalign_or_die(MEM_ALIGNMENT, ublk_dev.max_io_buf_bytes));
-            submit_request(new_opcodes ? UBLK_U_IO_FETCH_REQ : UBLK_IO_FETCH_REQ, i, 0);
+            auto q = new ublk_queue_t;
+            q->q_id = q_id;
+            queues.push_back(q);
+        }
+        // Queue 0 is served by the main thread and the main cluster client
+        queues[0]->ringloop = ringloop;
+        queues[0]->epmgr = epmgr;
+        queues[0]->cli = cli;
+        queues[0]->watch = watch;
+        for (int q_id = 1; q_id < queues.size(); q_id++)
+        {
+            queues[q_id]->thread = std::thread(&ublk_server::run_queue, this, queues[q_id]);
+        }
+        start_queue(queues[0]);
+        {
+            // The kernel requires all queues to fetch requests before starting the device
+            std::unique_lock<std::mutex> lk(started_mu);
+            while (started_queues < queues.size())
+                started_cond.wait(lk);
         }
-        ringloop->submit();
         // start device
         ublk_dev.ublksrv_pid = getpid();
         int res = sync_unpriv_cmd(false, (recover
@@ -734,9 +847,139 @@ protected:
         ctrl_fd = -1;
     }
 
-    void submit_request(uint64_t ublk_cmd, int i, int res)
+    void start_queue(ublk_queue_t *q)
     {
-        io_uring_sqe *sqe = ringloop->get_sqe();
+        // FIXME Here we could optionally do ublk_get_queue_affinity
+        // Map queue command buffer
+        map_ublk_queue(q);
+        q->consumer.loop = [this, q]()
+        {
+            submit_pending(q);
+        };
+        q->ringloop->register_consumer(&q->consumer);
+        if (queues.size() > 1)
+        {
+            q->call_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+            if (q->call_fd < 0)
+            {
+                fprintf(stderr, "Failed to create eventfd: %s (code %d)\n", strerror(errno), errno);
+                exit(1);
+            }
+            poll_queue_calls(q);
+        }
+        // submit initial fetch requests to ublk driver
+        for (int i = 0; i < ublk_dev.queue_depth; i++)
+        {
+            // With user copy, buffers are allocated on demand
+            q->buffers.push_back(user_copy ? NULL : (uint8_t*)memalign_or_die(MEM_ALIGNMENT, ublk_dev.max_io_buf_bytes));
+            q->buffer_sizes.push_back(user_copy ? 0 : ublk_dev.max_io_buf_bytes);
+            submit_request(q, new_opcodes ? UBLK_U_IO_FETCH_REQ : UBLK_IO_FETCH_REQ, i, 0);
+        }
+        // queue_depth may exceed the ring size, and all fetches must be submitted before starting the device
+        do
+        {
+            submit_pending(q);
+        } while (q->postponed.size());
+        std::unique_lock<std::mutex> lk(started_mu);
+        started_queues++;
+        started_cond.notify_all();
+    }
+
+    // Additional queues run in separate threads, each with its own ring and cluster client
+    void run_queue(ublk_queue_t *q)
+    {
+        q->ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false, true);
+        q->epmgr = new epoll_manager_t(q->ringloop);
+        q->cli = new cluster_client_t(q->ringloop, q->epmgr->tfd, client_cfg);
+        while (!q->cli->is_ready())
+        {
+            q->ringloop->loop();
+            if (q->cli->is_ready())
+                break;
+            q->ringloop->wait();
+        }
+        if (!inode)
+        {
+            q->watch = q->cli->st_cli.watch_inode(image_name);
+            if (!q->watch->cfg.num)
+            {
+                fprintf(stderr, "Image %s does not exist\n", image_name.c_str());
+                exit(1);
+            }
+        }
+        start_queue(q);
+        while (stopped_queues < queues.size())
+        {
+            q->ringloop->loop();
+            q->ringloop->wait();
+        }
+        q->ringloop->unregister_consumer(&q->consumer);
+        q->cli->flush();
+        delete q->cli;
+        delete q->epmgr;
+        delete q->ringloop;
+        q->cli = NULL;
+        q->epmgr = NULL;
+        q->ringloop = NULL;
+    }
+
+    void poll_queue_calls(ublk_queue_t *q)
+    {
+        io_uring_sqe *sqe = q->postponed.size() ? NULL : q->ringloop->get_sqe();
+        if (!sqe)
+        {
+            postpone(q, [this, q]() { poll_queue_calls(q); });
+            return;
+        }
+        ring_data_t* data = ((ring_data_t*)sqe->user_data);
+        io_uring_prep_poll_add(sqe, q->call_fd, POLLIN);
+        data->callback = [this, q](ring_data_t *data)
+        {
+            if (data->res < 0)
+            {
+                fprintf(stderr, "eventfd poll failed: %s (code %d)\n", strerror(-data->res), data->res);
+                exit(1);
+            }
+            uint64_t ctr = 0;
+            if (read(q->call_fd, &ctr, 8) < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                fprintf(stderr, "Error resetting eventfd: %s\n", strerror(errno));
+            }
+            std::vector<std::function<void()>> calls;
+            {
+                std::lock_guard<std::mutex> lk(q->call_mu);
+                calls.swap(q->calls);
+            }
+            for (auto & cb: calls)
+            {
+                cb();
+            }
+            // Stopped queues still serve calls, other queues may be waiting for them
+            poll_queue_calls(q);
+        };
+    }
+
+    void call_in_queue(ublk_queue_t *q, std::function<void()> cb)
+    {
+        {
+            std::lock_guard<std::mutex> lk(q->call_mu);
+            q->calls.push_back(std::move(cb));
+        }
+        uint64_t one = 1;
+        if (write(q->call_fd, &one, 8) < 0)
+        {
+            fprintf(stderr, "Error writing to eventfd: %s\n", strerror(errno));
+        }
+    }
+
+    void submit_request(ublk_queue_t *q, uint64_t ublk_cmd, int i, int res)
+    {
+        io_uring_sqe *sqe = q->postponed.size() ? NULL : q->ringloop->get_sqe();
+        if (!sqe)
+        {
+            postpone(q, [this, q, ublk_cmd, i, res]() { submit_request(q, ublk_cmd, i, res); });
+            return;
+        }
         ring_data_t* data = ((ring_data_t*)sqe->user_data);
         sqe->fd = cdev_fd;
         sqe->opcode = IORING_OP_URING_CMD;
@@ -745,14 +988,174 @@ protected:
         sqe->rw_flags = 0;
         sqe->off = ublk_cmd;
         ublksrv_io_cmd *cmd = (ublksrv_io_cmd *)&sqe->addr3; // sqe128 command buffer address
-        cmd->q_id = 0;
+        cmd->q_id = q->q_id;
         cmd->tag = i;
-        cmd->addr = (uint64_t)buffers[i];
+        cmd->addr = user_copy ? 0 : (uint64_t)q->buffers[i];
         cmd->result = res;
-        data->callback = [this, i](ring_data_t *data) { exec_request(data->res, i); };
+        data->callback = [this, q, i](ring_data_t *data) { exec_request(q, data->res, i); };
     }
 
-    void exec_request(int res, int i)
+    // Submission queue is full, retry from the ring consumer in the same order
+    void postpone(ublk_queue_t *q, std::function<void()> cb)
+    {
+        q->postponed.push_back(std::move(cb));
+        q->ringloop->wakeup();
+    }
+
+    void submit_pending(ublk_queue_t *q)
+    {
+        if (q->postponed.size())
+        {
+            std::vector<std::function<void()>> postponed;
+            postponed.swap(q->postponed);
+            for (auto & cb: postponed)
+            {
+                cb();
+            }
+        }
+        q->ringloop->submit();
+    }
+
+    void stop_queue(ublk_queue_t *q)
+    {
+        if (q->stop)
+        {
+            return;
+        }
+        q->stop = true;
+        if (++stopped_queues == queues.size())
+        {
+            // Wake up other queues so that they exit too
+            for (auto other: queues)
+            {
+                if (other != q)
+                    call_in_queue(other, []() {});
+            }
+        }
+    }
+
+    void complete_request(ublk_queue_t *q, int i, int res)
+    {
+        submit_request(q, new_opcodes ? UBLK_U_IO_COMMIT_AND_FETCH_REQ : UBLK_IO_COMMIT_AND_FETCH_REQ, i, res);
+    }
+
+    // Copy read data into the kernel request and commit it. The commit is linked to the copy,
+    // so that both are submitted at once and the read doesn't take an extra loop iteration
+    void complete_user_copy_read(ublk_queue_t *q, int i, int res)
+    {
+        if (q->postponed.size() || q->ringloop->space_left() < 2)
+        {
+            postpone(q, [this, q, i, res]() { complete_user_copy_read(q, i, res); });
+            return;
+        }
+        io_uring_sqe *sqe = q->ringloop->get_sqe();
+        ring_data_t* data = ((ring_data_t*)sqe->user_data);
+        data->iov = { .iov_base = q->buffers[i], .iov_len = (size_t)res };
+        io_uring_prep_writev(sqe, cdev_fd, &data->iov, 1, user_copy_pos(q, i));
+        sqe->flags |= IOSQE_IO_LINK;
+        data->callback = [res](ring_data_t *data)
+        {
+            // If the copy fails, the linked commit is cancelled and retried with an error in exec_request()
+            if (data->res != res)
+            {
+                fprintf(stderr, "Failed to copy ublk request data: %s (code %d)\n",
+                    data->res < 0 ? strerror(-data->res) : "short copy", data->res);
+            }
+        };
+        complete_request(q, i, res);
+    }
+
+    // Read written data from the kernel request with UBLK_F_USER_COPY
+    void read_user_copy_data(ublk_queue_t *q, int i, uint32_t len, std::function<void()> cb)
+    {
+        io_uring_sqe *sqe = q->postponed.size() ? NULL : q->ringloop->get_sqe();
+        if (!sqe)
+        {
+            postpone(q, [this, q, i, len, cb]() { read_user_copy_data(q, i, len, cb); });
+            return;
+        }
+        ring_data_t* data = ((ring_data_t*)sqe->user_data);
+        data->iov = { .iov_base = q->buffers[i], .iov_len = len };
+        io_uring_prep_readv(sqe, cdev_fd, &data->iov, 1, user_copy_pos(q, i));
+        data->callback = [this, q, i, len, cb](ring_data_t *data)
+        {
+            if (data->res != len)
+            {
+                fprintf(stderr, "Failed to copy ublk request data: %s (code %d)\n",
+                    data->res < 0 ? strerror(-data->res) : "short copy", data->res);
+                complete_request(q, i, data->res < 0 ? data->res : -EIO);
+                return;
+            }
+            cb();
+        };
+    }
+
+    uint64_t user_copy_pos(ublk_queue_t *q, int i)
+    {
+        return UBLKSRV_IO_BUF_OFFSET + ((uint64_t)q->q_id << UBLK_QID_OFF) + ((uint64_t)i << UBLK_TAG_OFF);
+    }
+
+    void alloc_user_copy_buffer(ublk_queue_t *q, int i, uint32_t len)
+    {
+        if (q->buffer_sizes[i] >= len)
+        {
+            return;
+        }
+        // Round up to a power of 2 to not reallocate buffers too often
+        uint32_t size = 4096;
+        while (size < len)
+        {
+            size *= 2;
+        }
+        free(q->buffers[i]);
+        q->buffers[i] = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, size);
+        q->buffer_sizes[i] = size;
+    }
+
+    void sync_queue(ublk_queue_t *q, std::function<void(int)> cb)
+    {
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_SYNC;
+        op->callback = [cb](cluster_op_t *op)
+        {
+            cb(op->retval);
+            delete op;
+        };
+        q->cli->execute(op);
+    }
+
+    // Every queue has its own client with its own unsynced writes, so flushes
+    // are broadcast to all queues and completed when all of them are synced
+    void flush_all_queues(ublk_queue_t *q, int i)
+    {
+        ublk_flush_t *fl = new ublk_flush_t;
+        fl->q = q;
+        fl->tag = i;
+        fl->remaining = queues.size();
+        fl->retval = 0;
+        for (auto other: queues)
+        {
+            auto sync_cb = [this, fl](int retval)
+            {
+                if (retval < 0)
+                    fl->retval = retval;
+                if (--fl->remaining == 0)
+                {
+                    call_in_queue(fl->q, [this, fl]()
+                    {
+                        complete_request(fl->q, fl->tag, fl->retval);
+                        delete fl;
+                    });
+                }
+            };
+            if (other == q)
+                sync_queue(other, sync_cb);
+            else
+                call_in_queue(other, [this, other, sync_cb]() { sync_queue(other, sync_cb); });
+        }
+    }
+
+    void exec_request(ublk_queue_t *q, int res, int i)
     {
         if (res != 0)
         {
@@ -761,50 +1164,79 @@ protected:
             if (res == -ENODEV)
             {
                 // ublk device is removed
-                stop = true;
+                stop_queue(q);
+                return;
+            }
+            if (res == -ECANCELED && user_copy)
+            {
+                // Commit was linked to a failed copy of read data
+                complete_request(q, i, -EIO);
                 return;
             }
             fprintf(stderr, "Fetching ublk request failed: %s (code %d)\n", strerror(-res), res);
             exit(1);
         }
-        ublksrv_io_desc *iod = &ublk_queue[i];
+        ublksrv_io_desc *iod = &q->io_desc[i];
         uint8_t opcode = ublksrv_get_op(iod);
         if (opcode == UBLK_IO_OP_FLUSH)
         {
-            cluster_op_t *op = new cluster_op_t;
-            op->opcode = OSD_OP_SYNC;
-            op->callback = [this, i](cluster_op_t *op)
+            if (queues.size() > 1)
             {
-                submit_request(new_opcodes ? UBLK_U_IO_COMMIT_AND_FETCH_REQ : UBLK_IO_COMMIT_AND_FETCH_REQ, i, op->retval);
-                delete op;
-            };
-            cli->execute(op);
+                flush_all_queues(q, i);
+                return;
+            }
+            sync_queue(q, [this, q, i](int retval) { complete_request(q, i, retval); });
         }
         else if (opcode == UBLK_IO_OP_WRITE_ZEROES || opcode == UBLK_IO_OP_DISCARD)
         {
-            submit_request(new_opcodes ? UBLK_U_IO_COMMIT_AND_FETCH_REQ : UBLK_IO_COMMIT_AND_FETCH_REQ, i, -EINVAL);
+            complete_request(q, i, -EINVAL);
         }
         else if (opcode == UBLK_IO_OP_READ || opcode == UBLK_IO_OP_WRITE)
         {
-            cluster_op_t *op = new cluster_op_t;
-            op->opcode = opcode == UBLK_IO_OP_READ ? OSD_OP_READ : OSD_OP_WRITE;
-            op->inode = inode ? inode : watch->cfg.num;
-            op->offset = iod->start_sector * 512;
-            op->len = iod->nr_sectors * 512;
-            op->iov.push_back(buffers[i], op->len);
-            op->callback = [this, i](cluster_op_t *op)
+            uint64_t offset = iod->start_sector * 512;
+            uint32_t len = iod->nr_sectors * 512;
+            if (user_copy)
             {
-                submit_request(new_opcodes ? UBLK_U_IO_COMMIT_AND_FETCH_REQ : UBLK_IO_COMMIT_AND_FETCH_REQ, i, op->retval);
-                delete op;
-            };
-            cli->execute(op);
+                alloc_user_copy_buffer(q, i, len);
+                if (opcode == UBLK_IO_OP_WRITE)
+                {
+                    // Read written data from the kernel request first
+                    read_user_copy_data(q, i, len, [this, q, i, offset, len]()
+                    {
+                        exec_rw(q, i, UBLK_IO_OP_WRITE, offset, len);
+                    });
+                    return;
+                }
+            }
+            exec_rw(q, i, opcode, offset, len);
         }
         else
         {
-            submit_request(new_opcodes ? UBLK_U_IO_COMMIT_AND_FETCH_REQ : UBLK_IO_COMMIT_AND_FETCH_REQ, i, -EINVAL);
+            complete_request(q, i, -EINVAL);
         }
     }
 
+    void exec_rw(ublk_queue_t *q, int i, uint8_t opcode, uint64_t offset, uint32_t len)
+    {
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = opcode == UBLK_IO_OP_READ ? OSD_OP_READ : OSD_OP_WRITE;
+        op->inode = inode ? inode : q->watch->cfg.num;
+        op->offset = offset;
+        op->len = len;
+        op->iov.push_back(q->buffers[i], op->len);
+        op->callback = [this, q, i](cluster_op_t *op)
+        {
+            int retval = op->retval;
+            bool copy_out = user_copy && op->opcode == OSD_OP_READ && retval == op->len && retval > 0;
+            delete op;
+            if (copy_out)
+                complete_user_copy_read(q, i, retval);
+            else
+                complete_request(q, i, retval);
+        };
+        q->cli->execute(op);
+    }
+
     int get_dev_info(int dev_num, bool unpriv)
     {
         // Get device info
@@ -60,6 +60,21 @@ static json11::Json vitastor_c_common_config(const char *config_path, const char
     return json11::Json(cfg);
 }
 
+static ring_loop_t *vitastor_c_create_ringloop(const json11::Json & cfg_json)
+{
+    auto ring_config = osd_messenger_t::parse_ring_config(osd_messenger_t::merge_configs(
+        cfg_json.object_items(), osd_messenger_t::read_config(cfg_json), json11::Json::object(), json11::Json::object()
+    ), false);
+    try
+    {
+        return new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false, false, ring_config);
+    }
+    catch (std::exception & e)
+    {
+        return NULL;
+    }
+}
+
 static void vitastor_c_read_handler(void *opaque)
 {
     vitastor_qemu_fd_t *data = (vitastor_qemu_fd_t *)opaque;
@@ -111,19 +126,15 @@ vitastor_c *vitastor_c_create_qemu_uring(QEMUSetFDHandler *aio_set_fd_handler, v
     const char *config_path, const char *etcd_host, const char *etcd_prefix,
     int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level)
 {
-    ring_loop_t *ringloop = NULL;
-    try
-    {
-        ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
-    }
-    catch (std::exception & e)
-    {
-        return NULL;
-    }
     json11::Json cfg_json = vitastor_c_common_config(
         config_path, etcd_host, etcd_prefix, use_rdma,
         rdma_device, rdma_port_num, rdma_gid_index, rdma_mtu, log_level
     );
+    ring_loop_t *ringloop = vitastor_c_create_ringloop(cfg_json);
+    if (!ringloop)
+    {
+        return NULL;
+    }
     auto self = vitastor_c_create_qemu_common(aio_set_fd_handler, aio_context);
     self->ringloop = ringloop;
     self->cli = new cluster_client_t(self->ringloop, self->tfd, cfg_json);
@@ -134,19 +145,15 @@ vitastor_c *vitastor_c_create_qemu_uring(QEMUSetFDHandler *aio_set_fd_handler, v
 vitastor_c *vitastor_c_create_uring(const char *config_path, const char *etcd_host, const char *etcd_prefix,
     int use_rdma, const char *rdma_device, int rdma_port_num, int rdma_gid_index, int rdma_mtu, int log_level)
 {
-    ring_loop_t *ringloop = NULL;
-    try
-    {
-        ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
-    }
-    catch (std::exception & e)
-    {
-        return NULL;
-    }
     json11::Json cfg_json = vitastor_c_common_config(
         config_path, etcd_host, etcd_prefix, use_rdma,
         rdma_device, rdma_port_num, rdma_gid_index, rdma_mtu, log_level
     );
+    ring_loop_t *ringloop = vitastor_c_create_ringloop(cfg_json);
+    if (!ringloop)
+    {
+        return NULL;
+    }
     vitastor_c *self = new vitastor_c;
     self->ringloop = ringloop;
     self->epmgr = new epoll_manager_t(self->ringloop);
@@ -166,15 +173,6 @@ int vitastor_c_uring_register_eventfd(vitastor_c *client)
 
 vitastor_c *vitastor_c_create_uring_json(const char **options, int options_len)
 {
-    ring_loop_t *ringloop = NULL;
-    try
-    {
-        ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
-    }
-    catch (std::exception & e)
-    {
-        return NULL;
-    }
     json11::Json::object cfg;
     for (int i = 0; i < options_len-1; i += 2)
     {
@@ -188,6 +186,11 @@ vitastor_c *vitastor_c_create_uring_json(const char **options, int options_len)
             cfg[options[i]] = std::string(options[i+1]);
     }
     json11::Json cfg_json(cfg);
+    ring_loop_t *ringloop = vitastor_c_create_ringloop(cfg_json);
+    if (!ringloop)
+    {
+        return NULL;
+    }
     vitastor_c *self = new vitastor_c;
     self->ringloop = ringloop;
     self->epmgr = new epoll_manager_t(self->ringloop);
@@ -497,6 +497,7 @@ struct snap_merger_t
     {
         cluster_op_t *op = &rwo->op;
         op->opcode = OSD_OP_READ;
+        op->flags = OSD_OP_NO_CACHE;
         op->inode = to_num;
         op->offset = rwo->offset;
         op->len = target_block_size;
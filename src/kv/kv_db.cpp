@@ -577,6 +577,7 @@ struct kv_rescue_t
         }
         cluster_op_t *op = new cluster_op_t;
         op->opcode = OSD_OP_READ;
+        op->flags = OSD_OP_NO_CACHE;
         op->inode = db->inode_id;
         op->offset = pos;
         cur_size = op->len = pos+buf.size() < size ? buf.size() : size-pos;
@@ -814,6 +815,7 @@ void kv_db_t::find_size(uint64_t min, uint64_t max, int phase, std::function<voi
     }
     cluster_op_t *op = new cluster_op_t;
     op->opcode = OSD_OP_READ;
+    op->flags = OSD_OP_NO_CACHE;
     op->inode = inode_id;
     op->offset = (phase == 1 ? min : (min+max)/2) * ino_block_size;
     op->len = kv_block_size;
@@ -1001,6 +1003,7 @@ static void get_block(kv_db_t *db, uint64_t offset, int cur_level, int recheck_p
     }
     cluster_op_t *op = new cluster_op_t;
     op->opcode = OSD_OP_READ;
+    op->flags = OSD_OP_NO_CACHE;
     op->inode = db->inode_id;
     op->offset = offset;
     if (b_it != db->block_cache.end() && !b_it->second.invalidated && !b_it->second.updating)
@@ -1460,6 +1463,7 @@ static void write_new_block(kv_db_t *db, kv_block_t *blk, std::function<void(int
             // of it may change and we MAY recheck if the block is still zero on CAS failure
             cluster_op_t *op = new cluster_op_t;
             op->opcode = OSD_OP_READ;
+            op->flags = OSD_OP_NO_CACHE;
             op->inode = db->inode_id;
             op->offset = blk->offset;
             op->len = db->kv_block_size;
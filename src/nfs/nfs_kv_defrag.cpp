@@ -59,6 +59,7 @@ void kv_fs_defrag_t::read()
     }
     auto op = new cluster_op_t;
     op->opcode = OSD_OP_READ;
+    op->flags = OSD_OP_NO_CACHE;
     op->inode = shared_ino;
     op->offset = last_offset;
     op->len = buf_size;
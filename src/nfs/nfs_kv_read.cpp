@@ -85,6 +85,7 @@ resume_1:
             st->op = new cluster_op_t;
             {
                 st->op->opcode = OSD_OP_READ;
+                st->op->flags = OSD_OP_NO_CACHE;
                 st->op->inode = st->ientry["shared_ino"].uint64_value();
                 // Always read including header to react if the file was possibly moved away
                 auto read_offset = st->ientry["shared_offset"].uint64_value();
@@ -190,6 +191,7 @@ resume_4:
     st->buf = st->aligned_buf + st->offset - st->aligned_offset;
     st->op = new cluster_op_t;
     st->op->opcode = OSD_OP_READ;
+    st->op->flags = OSD_OP_NO_CACHE;
     st->op->inode = st->ino;
     st->op->offset = st->aligned_offset;
     st->op->len = st->aligned_size;
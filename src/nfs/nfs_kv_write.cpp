@@ -193,6 +193,7 @@ void nfs_do_rmw(nfs_rmw_t *rmw)
     }
     auto op = new cluster_op_t;
     op->opcode = OSD_OP_READ;
+    op->flags = OSD_OP_NO_CACHE;
     op->inode = rmw->ino;
     op->offset = rmw->offset & ~(align-1);
     op->len = align;
@@ -285,6 +286,7 @@ static void nfs_do_shared_read(nfs_kv_write_state *st, int state)
     uint64_t shared_offset = st->ientry["shared_offset"].uint64_value();
     auto op = new cluster_op_t;
     op->opcode = OSD_OP_READ;
+    op->flags = OSD_OP_NO_CACHE;
     op->inode = st->ientry["shared_ino"].uint64_value();
     op->offset = align_down(shared_offset);
     // Allow unaligned shared reads
@@ -9,6 +9,7 @@
 #include <arpa/inet.h>
 
 #include "addr_util.h"
+#include "blockstore_thread.h"
 #include "osd_primary.h"
 #include "osd.h"
 #include "http_client.h"
@@ -96,6 +97,8 @@ osd_t::~osd_t()
     }
     ringloop->unregister_consumer(&consumer);
     ringloop->unregister_consumer(&init_consumer);
+    if (peering_pool)
+        delete peering_pool;
     if (bs)
         delete bs;
 #ifdef WITH_RDMACM
@@ -114,7 +117,10 @@ void osd_t::init_blockstore(std::function<void()> on_init)
     if (!json_is_true(this->config["disable_blockstore"]))
     {
         auto bs_cfg = json_to_string_map(this->config);
-        this->bs = blockstore_i::create(bs_cfg, ringloop, tfd);
+        if (json_is_true(this->config["osd_blockstore_thread"]))
+            this->bs = new blockstore_thread_t(bs_cfg, ringloop, tfd, osd_messenger_t::parse_ring_config(this->config, true));
+        else
+            this->bs = blockstore_i::create(bs_cfg, ringloop, tfd);
         // Pre-configure pool PG shards
         for (auto & pool_item: st_cli.pool_config)
         {
@@ -210,6 +216,11 @@ void osd_t::parse_config(bool init)
             etcd_stats_interval = 30;
         readonly = json_is_true(config["readonly"]);
         run_primary = !json_is_false(config["run_primary"]);
+        if (!config["osd_peering_threads"].is_null())
+        {
+            // Allow to set it to 0
+            peering_threads = config["osd_peering_threads"].uint64_value();
+        }
     }
     log_level = config["log_level"].uint64_value();
     auto old_no_rebalance = no_rebalance;
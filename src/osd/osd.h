@@ -22,6 +22,7 @@
 #include "osd_peering_pg.h"
 #include "messenger.h"
 #include "etcd_state_client.h"
+#include "worker_pool.h"
 
 #define OSD_LOADING_PGS 0x01
 #define OSD_PEERING_PGS 0x04
@@ -36,6 +37,7 @@
 #define DEFAULT_RECOVERY_QUEUE 1
 #define DEFAULT_RECOVERY_PG_SWITCH 128
 #define DEFAULT_RECOVERY_BATCH 16
+#define DEFAULT_PEERING_THREADS 4
 
 //#define OSD_STUB
 
@@ -137,6 +139,7 @@ class osd_t
     int recovery_sync_batch = DEFAULT_RECOVERY_BATCH;
     int inode_vanish_time = 60;
     int log_level = 0;
+    int peering_threads = DEFAULT_PEERING_THREADS;
     bool auto_scrub = false;
     uint64_t global_scrub_interval = 30*86400;
     uint64_t scrub_queue_depth = 1;
@@ -178,6 +181,9 @@ class osd_t
     int copies_to_delete_after_sync_count = 0;
     uint64_t misplaced_objects = 0, degraded_objects = 0, incomplete_objects = 0, inconsistent_objects = 0, corrupted_objects = 0;
     int peering_state = 0;
+    // Object states of peering PGs are calculated in these threads
+    worker_pool_t *peering_pool = NULL;
+    uint64_t peering_calc_seq = 0;
     std::map<object_id, osd_recovery_op_t> recovery_ops;
     std::map<object_id, osd_op_t*> scrub_ops;
     bool recovery_last_degraded = true;
@@ -296,6 +302,8 @@ class osd_t
     void rm_inflight(pg_t & pg);
     void continue_pg(pg_t & pg);
     bool continue_pg_peering(pg_t & pg);
+    void submit_calc_object_states(pg_t & pg);
+    void finish_pg_peering(pg_t & pg);
 
     // flushing, recovery and backfill
     void submit_pg_flush_ops(pg_t & pg);
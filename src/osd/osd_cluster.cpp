@@ -7,6 +7,7 @@
 #include "http_client.h"
 #include "osd_rmw.h"
 #include "addr_util.h"
+#include "buffer_pool.h"
 
 // Startup sequence:
 //   Start etcd watcher -> Load global OSD configuration -> Bind socket -> Acquire lease -> Report&lock OSD state
@@ -199,7 +200,43 @@ json11::Json osd_t::get_statistics()
         st["blockstore_ready"] = bs->is_started();
         st["size"] = bs->get_block_count() * bs->get_block_size();
         st["free"] = bs->get_free_block_count() * bs->get_block_size();
+        auto cst = bs->get_compaction_stats();
+        st["compaction"] = json11::Json::object {
+            { "queue", cst.queue_size },
+            { "future_queue", cst.future_queue_size },
+            { "debt", cst.debt },
+            { "meta_nearfull_blocks", cst.meta_nearfull_blocks },
+            { "garbage_entries", cst.garbage_entries },
+            { "pressure", cst.pressure },
+            { "iops_limit", cst.iops_limit },
+            { "bps_limit", cst.bps_limit },
+            { "count", cst.compacted_count },
+            { "bytes", cst.compacted_bytes },
+            { "iops", cst.iops },
+            { "bps", cst.bps },
+        };
+        auto mst = bs->get_meta_write_stats();
+        st["meta_writes"] = json11::Json::object {
+            { "client_writes", mst.client_writes },
+            { "writes", mst.meta_writes },
+            { "blocks", mst.meta_blocks },
+        };
     }
+    auto pool_stats = pool_get_stats();
+    st["buffer_pool"] = json11::Json::object {
+        { "region_used", pool_stats.region_used },
+        { "used", pool_stats.used_bytes },
+        { "allocs", pool_stats.alloc_count },
+        { "fallbacks", pool_stats.fallback_count },
+        { "trimmed", pool_stats.trimmed_bytes },
+    };
+    auto conn_stats = msgr.get_conn_stats();
+    st["connections"] = json11::Json::object {
+        { "count", conn_stats.client_count },
+        { "recv_buffers", conn_stats.recv_buffer_bytes },
+        { "recv_ring", conn_stats.recv_ring_bytes },
+        { "multishot_recv", conn_stats.multishot_recv },
+    };
     st["data_block_size"] = (uint64_t)bs_block_size;
     st["bitmap_granularity"] = (uint64_t)bs_bitmap_granularity;
     st["immediate_commit"] = immediate_commit == IMMEDIATE_ALL ? "all" : (immediate_commit == IMMEDIATE_SMALL ? "small" : "none");
@@ -3,6 +3,7 @@
 
 #include "epoll_manager.h"
 #include "osd.h"
+#include "json_util.h"
 
 #include <sys/prctl.h>
 #include <signal.h>
@@ -63,7 +64,13 @@ int main(int narg, char *args[])
     prctl(PR_SET_NAME, (unsigned long)osdname, 0, 0, 0);
     signal(SIGINT, handle_sigint);
     signal(SIGTERM, handle_sigint);
-    ring_loop_t *ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
+    auto local_config = osd_messenger_t::merge_configs(
+        config, osd_messenger_t::read_config(config), json11::Json::object(), json11::Json::object()
+    );
+    auto ring_config = osd_messenger_t::parse_ring_config(local_config, true);
+    auto bs_config = json_to_string_map(local_config);
+    ring_loop_t *ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false,
+        !json_is_true(local_config["osd_blockstore_thread"]) && blockstore_i::needs_sqe128(bs_config), ring_config);
     epoll_manager_t *epmgr = new epoll_manager_t(ringloop);
     osd = new osd_t(config, ringloop, epmgr->tfd);
     while (1)
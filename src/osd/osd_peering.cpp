@@ -326,11 +326,18 @@ void osd_t::start_pg_peering(pg_t & pg)
     }
     pg.peering_state->locked = false;
     pg.peering_state->lists_done = false;
+    // Discard object states if they're still being calculated
+    pg.peering_state->calc_id = 0;
     report_pg_state(pg);
 }
 
 bool osd_t::continue_pg_peering(pg_t & pg)
 {
+    if (pg.peering_state->calc_id)
+    {
+        // Object states are being calculated in a worker thread
+        return false;
+    }
     if (pg.peering_state->locked)
     {
         pg.peering_state->lists_done = true;
@@ -350,32 +357,102 @@ bool osd_t::continue_pg_peering(pg_t & pg)
     }
     if (pg.peering_state->lists_done)
     {
-        pg.calc_object_states(log_level);
-        report_pg_state(pg);
-        schedule_scrub(pg);
-        inconsistent_objects += pg.inconsistent_objects.size();
-        incomplete_objects += pg.incomplete_objects.size();
-        misplaced_objects += pg.misplaced_objects.size();
-        // FIXME: degraded objects may currently include misplaced, too! Report them separately?
-        degraded_objects += pg.degraded_objects.size();
-        if (pg.state & PG_HAS_UNCLEAN)
-            this->peering_state = peering_state | OSD_FLUSHING_PGS;
-        else if (pg.state & (PG_HAS_DEGRADED | PG_HAS_MISPLACED))
-        {
-            this->peering_state = peering_state | OSD_RECOVERING;
-            if (pg.state & PG_HAS_DEGRADED)
-            {
-                // Restart recovery from degraded objects
-                this->recovery_last_degraded = true;
-                this->recovery_last_pg = {};
-                this->recovery_last_oid = {};
-            }
+        if (peering_threads > 0)
+        {
+            submit_calc_object_states(pg);
+            return false;
         }
+        pg.calc_object_states(log_level);
+        finish_pg_peering(pg);
         return true;
     }
     return false;
 }
 
+// Calculate object states in a copy of the PG so that the event loop isn't blocked
+// and several PGs may be processed in parallel. Results are moved back into the PG
+// if it isn't repeered or stopped in the meantime
+void osd_t::submit_calc_object_states(pg_t & pg)
+{
+    if (!peering_pool)
+    {
+        peering_pool = new worker_pool_t(peering_threads, tfd);
+    }
+    auto calc = std::make_shared<pg_t>();
+    calc->state = pg.state;
+    calc->scheme = pg.scheme;
+    calc->pg_cursize = pg.pg_cursize;
+    calc->pg_size = pg.pg_size;
+    calc->pg_minsize = pg.pg_minsize;
+    calc->pg_data_size = pg.pg_data_size;
+    calc->pool_id = pg.pool_id;
+    calc->pg_num = pg.pg_num;
+    calc->all_peers = pg.all_peers;
+    calc->cur_peers = pg.cur_peers;
+    calc->target_set = pg.target_set;
+    calc->cur_set = pg.cur_set;
+    calc->peering_state = new pg_peering_state_t();
+    calc->peering_state->list_results.swap(pg.peering_state->list_results);
+    uint64_t calc_id = ++peering_calc_seq;
+    pg.peering_state->calc_id = calc_id;
+    int log_level = this->log_level;
+    peering_pool->submit([calc, log_level]()
+    {
+        calc->calc_object_states(log_level);
+        delete calc->peering_state;
+        calc->peering_state = NULL;
+    }, [this, calc, calc_id]()
+    {
+        auto pg_it = pgs.find({ .pool_id = calc->pool_id, .pg_num = calc->pg_num });
+        if (pg_it == pgs.end() || pg_it->second.state != PG_PEERING ||
+            !pg_it->second.peering_state || pg_it->second.peering_state->calc_id != calc_id)
+        {
+            // PG was repeered or stopped, discard results
+            return;
+        }
+        pg_t & pg = pg_it->second;
+        pg.peering_state->calc_id = 0;
+        pg.state = calc->state;
+        pg.epoch = calc->epoch;
+        pg.clean_count = calc->clean_count;
+        pg.total_count = calc->total_count;
+        // Object state pointers stay valid because sets are allocated separately
+        std::swap(pg.state_dict, calc->state_dict);
+        pg.inconsistent_objects.swap(calc->inconsistent_objects);
+        pg.incomplete_objects.swap(calc->incomplete_objects);
+        pg.misplaced_objects.swap(calc->misplaced_objects);
+        pg.degraded_objects.swap(calc->degraded_objects);
+        pg.flush_actions.swap(calc->flush_actions);
+        pg.ver_override.swap(calc->ver_override);
+        finish_pg_peering(pg);
+        ringloop->wakeup();
+    });
+}
+
+void osd_t::finish_pg_peering(pg_t & pg)
+{
+    report_pg_state(pg);
+    schedule_scrub(pg);
+    inconsistent_objects += pg.inconsistent_objects.size();
+    incomplete_objects += pg.incomplete_objects.size();
+    misplaced_objects += pg.misplaced_objects.size();
+    // FIXME: degraded objects may currently include misplaced, too! Report them separately?
+    degraded_objects += pg.degraded_objects.size();
+    if (pg.state & PG_HAS_UNCLEAN)
+        this->peering_state = peering_state | OSD_FLUSHING_PGS;
+    else if (pg.state & (PG_HAS_DEGRADED | PG_HAS_MISPLACED))
+    {
+        this->peering_state = peering_state | OSD_RECOVERING;
+        if (pg.state & PG_HAS_DEGRADED)
+        {
+            // Restart recovery from degraded objects
+            this->recovery_last_degraded = true;
+            this->recovery_last_pg = {};
+            this->recovery_last_oid = {};
+        }
+    }
+}
+
 void osd_t::record_pg_lock(pg_t & pg, osd_num_t peer_osd, uint64_t pg_state)
 {
     if (!pg_state)
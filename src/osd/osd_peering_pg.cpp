@@ -1,7 +1,6 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 (see README.md for details)
 
-#include <unordered_map>
 #include "osd_peering_pg.h"
 
 struct obj_ver_role
@@ -48,6 +47,7 @@ struct pg_obj_state_check_t
     uint64_t n_copies = 0, has_roles = 0, n_roles = 0, n_stable = 0, n_mismatched = 0;
     uint64_t n_unstable = 0, n_invalid = 0;
     pg_osd_set_t osd_set;
+    std::vector<std::pair<obj_piece_id_t, obj_piece_ver_t>> pieces;
     int log_level;
 
     void walk();
@@ -196,10 +196,17 @@ void pg_obj_state_check_t::finish_object()
     if (n_unstable > 0)
     {
         pg->state |= PG_HAS_UNCLEAN;
-        std::unordered_map<obj_piece_id_t, obj_piece_ver_t> pieces;
+        // Objects usually have only a few pieces, so a linear search is faster than a map
+        pieces.clear();
         for (int i = obj_start; i < obj_end; i++)
         {
-            auto & pcs = pieces[(obj_piece_id_t){ .oid = list[i].oid, .osd_num = list[i].osd_num }];
+            obj_piece_id_t id = { .oid = list[i].oid, .osd_num = list[i].osd_num };
+            size_t j = 0;
+            while (j < pieces.size() && !(pieces[j].first == id))
+                j++;
+            if (j == pieces.size())
+                pieces.push_back({ id, {} });
+            auto & pcs = pieces[j].second;
             if (!pcs.max_ver)
             {
                 pcs.max_ver = list[i].version;
@@ -213,12 +220,18 @@ void pg_obj_state_check_t::finish_object()
                 pcs.max_target = list[i].version;
             }
         }
-        for (auto pp: pieces)
+        // Objects are walked in order, so sorted pieces are appended to the end of flush_actions
+        std::sort(pieces.begin(), pieces.end(), [](const std::pair<obj_piece_id_t, obj_piece_ver_t> & a,
+            const std::pair<obj_piece_id_t, obj_piece_ver_t> & b)
+        {
+            return a.first < b.first;
+        });
+        for (auto & pp: pieces)
         {
             auto & pcs = pp.second;
             if (pcs.stable_ver < pcs.max_ver)
             {
-                auto & act = pg->flush_actions[pp.first];
+                auto & act = pg->flush_actions.insert(pg->flush_actions.end(), std::make_pair(pp.first, flush_action_t()))->second;
                 // osd_set doesn't include rollback/stable states, so don't include them in the state code either
                 if (pcs.max_ver > target_ver)
                 {
@@ -330,8 +343,8 @@ void pg_obj_state_check_t::finish_object()
 
 pg_osd_set_state_t* pg_t::add_object_to_state(const object_id oid, const uint64_t state, const pg_osd_set_t & osd_set)
 {
-    auto it = state_dict.find(osd_set);
-    if (it == state_dict.end())
+    pg_osd_set_state_t *st = state_dict.find(osd_set);
+    if (!st)
     {
         std::vector<osd_num_t> read_target;
         bool found = false;
@@ -372,35 +385,144 @@ retry:
             read_target.clear();
             goto retry;
         }
-        state_dict[osd_set] = {
-            .read_target = read_target,
-            .osd_set = osd_set,
-            .state = state,
-            .object_count = 1,
-        };
-        it = state_dict.find(osd_set);
-    }
-    else
-    {
-        it->second.object_count++;
+        st = state_dict.add(osd_set, std::move(read_target), state);
     }
+    st->object_count++;
     if (state & OBJ_INCONSISTENT)
     {
-        inconsistent_objects[oid] = &it->second;
+        inconsistent_objects[oid] = st;
     }
     else if (state & OBJ_INCOMPLETE)
     {
-        incomplete_objects[oid] = &it->second;
+        incomplete_objects[oid] = st;
     }
     else if (state & OBJ_DEGRADED)
     {
-        degraded_objects[oid] = &it->second;
+        degraded_objects[oid] = st;
+    }
+    else
+    {
+        misplaced_objects[oid] = st;
+    }
+    return st;
+}
+
+pg_osd_set_state_t *pg_osd_set_dict_t::find(const pg_osd_set_t & osd_set)
+{
+    if (!count)
+    {
+        return NULL;
+    }
+    size_t hash = std::hash<pg_osd_set_t>()(osd_set);
+    size_t mask = index.size()-1;
+    for (size_t slot = hash & mask; index[slot]; slot = (slot+1) & mask)
+    {
+        pg_osd_set_state_t *st = sets[index[slot]-1].get();
+        if (st->set_hash == hash && st->osd_set == osd_set)
+        {
+            return st;
+        }
+    }
+    return NULL;
+}
+
+pg_osd_set_state_t *pg_osd_set_dict_t::add(const pg_osd_set_t & osd_set, std::vector<osd_num_t> && read_target, uint64_t state)
+{
+    if ((count+1)*2 > index.size())
+    {
+        rehash(index.size() ? index.size()*2 : 16);
+    }
+    uint32_t set_num;
+    if (free_nums.size())
+    {
+        set_num = free_nums.back();
+        free_nums.pop_back();
     }
     else
     {
-        misplaced_objects[oid] = &it->second;
+        set_num = sets.size();
+        sets.emplace_back();
+    }
+    sets[set_num].reset(new pg_osd_set_state_t{
+        .read_target = std::move(read_target),
+        .osd_set = osd_set,
+        .state = state,
+        .set_num = set_num,
+        .set_hash = std::hash<pg_osd_set_t>()(osd_set),
+    });
+    size_t mask = index.size()-1;
+    size_t slot = sets[set_num]->set_hash & mask;
+    while (index[slot])
+        slot = (slot+1) & mask;
+    index[slot] = set_num+1;
+    count++;
+    return sets[set_num].get();
+}
+
+void pg_osd_set_dict_t::erase(pg_osd_set_state_t *st)
+{
+    size_t mask = index.size()-1;
+    size_t slot = st->set_hash & mask;
+    while (index[slot] != st->set_num+1)
+    {
+        assert(index[slot]);
+        slot = (slot+1) & mask;
+    }
+    // Backward shift deletion, so that lookups don't need tombstones
+    size_t next = slot;
+    while (true)
+    {
+        next = (next+1) & mask;
+        if (!index[next])
+            break;
+        size_t ideal = sets[index[next]-1]->set_hash & mask;
+        if (((next - ideal) & mask) >= ((next - slot) & mask))
+        {
+            index[slot] = index[next];
+            slot = next;
+        }
+    }
+    index[slot] = 0;
+    free_nums.push_back(st->set_num);
+    sets[st->set_num].reset();
+    count--;
+}
+
+void pg_osd_set_dict_t::rehash(size_t new_size)
+{
+    index.clear();
+    index.resize(new_size);
+    for (auto & st: sets)
+    {
+        if (st)
+        {
+            size_t slot = st->set_hash & (new_size-1);
+            while (index[slot])
+                slot = (slot+1) & (new_size-1);
+            index[slot] = st->set_num+1;
+        }
     }
-    return &it->second;
+}
+
+void pg_osd_set_dict_t::clear()
+{
+    sets.clear();
+    free_nums.clear();
+    index.clear();
+    count = 0;
+}
+
+pg_osd_set_dict_t::iterator pg_osd_set_dict_t::begin() const
+{
+    iterator it = { .pos = sets.data(), .end = sets.data()+sets.size() };
+    while (it.pos != it.end && !*it.pos)
+        it.pos++;
+    return it;
+}
+
+pg_osd_set_dict_t::iterator pg_osd_set_dict_t::end() const
+{
+    return (iterator){ .pos = sets.data()+sets.size(), .end = sets.data()+sets.size() };
 }
 
 // FIXME: Write at least some tests for this function
@@ -413,6 +535,10 @@ void pg_t::calc_object_states(int log_level)
     st.replicated = (this->scheme == POOL_SCHEME_REPLICATED);
     auto ps = peering_state;
     epoch = 0;
+    uint64_t total = 0;
+    for (auto & it: ps->list_results)
+        total += it.second.total_count;
+    st.list.reserve(total);
     for (auto it: ps->list_results)
     {
         auto nstab = it.second.stable_count;
@@ -461,7 +587,7 @@ void pg_t::calc_object_states(int log_level)
         for (auto & stp: state_dict)
         {
             osd_set_desc = "";
-            for (auto & loc: stp.first)
+            for (auto & loc: stp.osd_set)
             {
                 osd_set_desc += (osd_set_desc == "" ? "" : ", ")+
                     std::to_string(loc.osd_num)+
@@ -470,7 +596,7 @@ void pg_t::calc_object_states(int log_level)
                     (loc.loc_bad & LOC_CORRUPTED ? "(corrupted)" : "")+
                     (loc.loc_bad & LOC_INCONSISTENT ? "(inconsistent)" : "");
             }
-            printf("[PG %u/%u] %ju objects on OSD set %s\n", pool_id, pg_num, stp.second.object_count, osd_set_desc.c_str());
+            printf("[PG %u/%u] %ju objects on OSD set %s\n", pool_id, pg_num, stp.object_count, osd_set_desc.c_str());
         }
     }
 }
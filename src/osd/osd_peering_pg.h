@@ -2,6 +2,7 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include <map>
+#include <memory>
 #include <vector>
 #include <algorithm>
 #include <stdint.h>
@@ -32,6 +33,41 @@ struct pg_osd_set_state_t
     uint64_t state = 0;
     uint64_t object_count = 0;
     uint64_t ref_count = 0;
+    // number and hash of the set in pg_osd_set_dict_t
+    uint32_t set_num = 0;
+    size_t set_hash = 0;
+};
+
+// Dictionary of distinct OSD sets of non-clean objects. Each set is stored only once,
+// objects reference its pg_osd_set_state_t which doesn't move until it's erased.
+// Sets are numbered and looked up through an open-addressing hash table of their numbers.
+class pg_osd_set_dict_t
+{
+    std::vector<std::unique_ptr<pg_osd_set_state_t>> sets;
+    std::vector<uint32_t> free_nums;
+    // set_num+1 or 0 for empty slots, linear probing, size is a power of 2
+    std::vector<uint32_t> index;
+    size_t count = 0;
+
+    void rehash(size_t new_size);
+public:
+    struct iterator
+    {
+        const std::unique_ptr<pg_osd_set_state_t> *pos, *end;
+        pg_osd_set_state_t & operator*() const { return **pos; }
+        pg_osd_set_state_t *operator->() const { return pos->get(); }
+        iterator & operator++() { do pos++; while (pos != end && !*pos); return *this; }
+        bool operator!=(const iterator & other) const { return pos != other.pos; }
+    };
+
+    pg_osd_set_state_t *find(const pg_osd_set_t & osd_set);
+    // osd_set must not be present in the dictionary yet
+    pg_osd_set_state_t *add(const pg_osd_set_t & osd_set, std::vector<osd_num_t> && read_target, uint64_t state);
+    void erase(pg_osd_set_state_t *st);
+    void clear();
+    size_t size() const { return count; }
+    iterator begin() const;
+    iterator end() const;
 };
 
 struct pg_list_result_t
@@ -52,6 +88,8 @@ struct pg_peering_state_t
     pg_num_t pg_num = 0;
     bool locked = false;
     bool lists_done = false;
+    // Nonzero while object states are calculated in a worker thread
+    uint64_t calc_id = 0;
 };
 
 struct obj_piece_id_t
@@ -118,10 +156,10 @@ struct pg_t
     // this map stores all objects that differ.
     // it may consume up to ~ (raw storage / object size) * 24 bytes in the worst case scenario
     // which is up to ~192 MB per 1 TB in the worst case scenario
-    std::map<pg_osd_set_t, pg_osd_set_state_t> state_dict;
+    pg_osd_set_dict_t state_dict;
     uint64_t corrupted_count;
     btree::btree_map<object_id, pg_osd_set_state_t*> inconsistent_objects, incomplete_objects, misplaced_objects, degraded_objects;
-    std::map<obj_piece_id_t, flush_action_t> flush_actions;
+    btree::btree_map<obj_piece_id_t, flush_action_t> flush_actions;
     std::vector<obj_ver_osd_t> copies_to_delete_after_sync;
     btree::btree_map<object_id, uint64_t> ver_override;
     pg_peering_state_t *peering_state = NULL;
@@ -145,6 +183,11 @@ inline bool operator < (const pg_obj_loc_t &a, const pg_obj_loc_t &b)
         a.loc_bad == b.loc_bad && a.role == b.role && a.osd_num < b.osd_num;
 }
 
+inline bool operator == (const pg_obj_loc_t &a, const pg_obj_loc_t &b)
+{
+    return a.loc_bad == b.loc_bad && a.role == b.role && a.osd_num == b.osd_num;
+}
+
 inline bool operator == (const obj_piece_id_t & a, const obj_piece_id_t & b)
 {
     return a.oid == b.oid && a.osd_num == b.osd_num;
@@ -167,6 +210,7 @@ namespace std
                 // Copy-pasted from spp::hash_combine()
                 seed ^= (e.role + 0xc6a4a7935bd1e995 + (seed << 6) + (seed >> 2));
                 seed ^= (e.osd_num + 0xc6a4a7935bd1e995 + (seed << 6) + (seed >> 2));
+                seed ^= (e.loc_bad + 0xc6a4a7935bd1e995 + (seed << 6) + (seed >> 2));
             }
             return seed;
         }
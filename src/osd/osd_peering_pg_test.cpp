@@ -5,6 +5,11 @@
 #define _LARGEFILE64_SOURCE
 #endif
 
+#include <assert.h>
+#include <time.h>
+
+#include <thread>
+
 #include "malloc_or_die.h"
 #include "osd_peering_pg.h"
 #define STRIPE_SHIFT 12
@@ -22,40 +27,205 @@
  *    v1=1s,2s,6s -> misplaced
  * 2) ...
  */
-int main(int argc, char *argv[])
+
+// USAGE: osd_peering_pg_test [N_OBJECTS] [N_THREADS]
+// Peers EC 2+1 PGs with N_OBJECTS objects (1M by default) and prints peering speed,
+// then peers N_THREADS PGs (4 by default) with N_OBJECTS/N_THREADS objects each in parallel
+
+static void init_pg(pg_t & pg)
 {
-    pg_t pg = {
+    pg = (pg_t){
         .state = PG_PEERING,
+        .scheme = POOL_SCHEME_XOR,
+        .pg_cursize = 3,
+        .pg_size = 3,
+        .pg_minsize = 2,
+        .pg_data_size = 2,
         .pg_num = 1,
         .target_set = { 1, 2, 3 },
         .cur_set = { 1, 2, 3 },
         .peering_state = new pg_peering_state_t(),
     };
+}
+
+static void add_list(pg_t & pg, osd_num_t osd_num, std::vector<obj_ver_id> & unstable, std::vector<obj_ver_id> & stable)
+{
+    pg_list_result_t r = {
+        .buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * (stable.size()+unstable.size())),
+        .total_count = stable.size()+unstable.size(),
+        .stable_count = stable.size(),
+    };
+    memcpy(r.buf, stable.data(), sizeof(obj_ver_id) * stable.size());
+    memcpy(r.buf+stable.size(), unstable.data(), sizeof(obj_ver_id) * unstable.size());
+    pg.peering_state->list_results[osd_num] = r;
+}
+
+static void peer(pg_t & pg, const char *name, uint64_t n_objects)
+{
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pg.calc_object_states(0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1000000000.0;
+    printf(
+        "%s: %ju objects peered in %.3f s (%.0f objects/s), clean=%ju, osd sets=%zu, flush actions=%zu\n",
+        name, n_objects, elapsed, n_objects/elapsed, pg.clean_count, pg.state_dict.size(), pg.flush_actions.size()
+    );
+    delete pg.peering_state;
+    pg.peering_state = NULL;
+}
+
+// All objects are clean except the last 10 which have an unstable version on OSD 1 only
+static void test_unstable(uint64_t n_objects)
+{
+    pg_t pg;
+    init_pg(pg);
     for (uint64_t osd_num = 1; osd_num <= 3; osd_num++)
     {
-        pg_list_result_t r = {
-            .buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * 1024*1024*8),
-            .total_count = 1024*1024*8,
-            .stable_count = (uint64_t)(1024*1024*8 - (osd_num == 1 ? 10 : 0)),
-        };
-        for (uint64_t i = 0; i < r.total_count; i++)
+        std::vector<obj_ver_id> stable, unstable;
+        for (uint64_t i = 0; i < n_objects; i++)
         {
-            r.buf[i] = {
-                .oid = {
-                    .inode = 1,
-                    .stripe = (i << STRIPE_SHIFT) | (osd_num-1),
-                },
-                .version = (uint64_t)(osd_num == 1 && i >= r.total_count - 10 ? 2 : 1),
+            obj_ver_id ov = {
+                .oid = { .inode = 1, .stripe = (i << STRIPE_SHIFT) | (osd_num-1) },
+                .version = (uint64_t)(osd_num == 1 && i >= n_objects - 10 ? 2 : 1),
             };
+            (ov.version == 2 ? unstable : stable).push_back(ov);
         }
-        pg.peering_state->list_results[osd_num] = r;
+        add_list(pg, osd_num, unstable, stable);
     }
-    pg.calc_object_states(0);
-    printf("deviation variants=%jd clean=%ju\n", pg.state_dict.size(), pg.clean_count);
-    for (auto it: pg.state_dict)
+    peer(pg, "unstable", n_objects);
+    assert(pg.clean_count == n_objects-10);
+    assert(pg.state_dict.size() == 1);
+    assert(pg.degraded_objects.size() == 10);
+    assert(pg.flush_actions.size() == 10);
+    for (auto & act: pg.flush_actions)
     {
-        printf("dev: state=%jx\n", it.second.state);
+        assert(act.first.osd_num == 1);
+        assert(act.second.rollback && act.second.rollback_to == 0);
     }
-    delete pg.peering_state;
+}
+
+// 1/4 of objects are degraded, 1/4 are misplaced to OSD 4, 1/4 are misplaced to OSD 5
+static void test_degraded(uint64_t n_objects)
+{
+    pg_t pg;
+    init_pg(pg);
+    for (uint64_t osd_num = 1; osd_num <= 5; osd_num++)
+    {
+        std::vector<obj_ver_id> stable, unstable;
+        for (uint64_t i = 0; i < n_objects; i++)
+        {
+            uint64_t role = osd_num-1;
+            if (osd_num == 3 && (i % 4) != 3)
+                continue;
+            if (osd_num == 4 && (i % 4) != 1 || osd_num == 5 && (i % 4) != 2)
+                continue;
+            if (osd_num >= 4)
+                role = 2;
+            stable.push_back((obj_ver_id){
+                .oid = { .inode = 1, .stripe = (i << STRIPE_SHIFT) | role },
+                .version = 1,
+            });
+        }
+        add_list(pg, osd_num, unstable, stable);
+    }
+    peer(pg, "degraded", n_objects);
+    assert(pg.clean_count == n_objects/4);
+    assert(pg.state_dict.size() == 3);
+    assert(pg.degraded_objects.size() == n_objects/4);
+    assert(pg.misplaced_objects.size() == n_objects/2);
+    assert(pg.flush_actions.size() == 0);
+    // Check that sets are found and erased correctly
+    pg_osd_set_t osd4_set = {
+        { .role = 0, .osd_num = 1 },
+        { .role = 1, .osd_num = 2 },
+        { .role = 2, .osd_num = 4 },
+    };
+    pg_osd_set_state_t *st = pg.state_dict.find(osd4_set);
+    assert(st && st->object_count == n_objects/4 && (st->state & OBJ_MISPLACED));
+    object_id oid = { .inode = 1, .stripe = 1 << STRIPE_SHIFT };
+    assert(pg.misplaced_objects[oid] == st);
+    pg.state_dict.erase(st);
+    assert(pg.state_dict.size() == 2 && !pg.state_dict.find(osd4_set));
+    int n = 0;
+    for (auto & stp: pg.state_dict)
+    {
+        assert(stp.osd_set != osd4_set);
+        assert(pg.state_dict.find(stp.osd_set) == &stp);
+        n++;
+    }
+    assert(n == 2);
+}
+
+static void fill_clean(pg_t & pg, uint64_t n_objects)
+{
+    init_pg(pg);
+    for (uint64_t osd_num = 1; osd_num <= 3; osd_num++)
+    {
+        std::vector<obj_ver_id> stable, unstable;
+        for (uint64_t i = 0; i < n_objects; i++)
+        {
+            stable.push_back((obj_ver_id){
+                .oid = { .inode = 1, .stripe = (i << STRIPE_SHIFT) | (osd_num-1) },
+                .version = 1,
+            });
+        }
+        add_list(pg, osd_num, unstable, stable);
+    }
+}
+
+// The OSD calculates object states of different PGs in parallel threads,
+// so calc_object_states() must not share any state between PGs
+static void test_parallel(uint64_t n_objects, int n_threads)
+{
+    uint64_t per_pg = n_objects/n_threads;
+    double elapsed[2];
+    for (int parallel = 0; parallel < 2; parallel++)
+    {
+        std::vector<pg_t> pgs(n_threads);
+        for (auto & pg: pgs)
+            fill_clean(pg, per_pg);
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (parallel)
+        {
+            std::vector<std::thread> threads;
+            for (auto & pg: pgs)
+                threads.push_back(std::thread([&pg]() { pg.calc_object_states(0); }));
+            for (auto & t: threads)
+                t.join();
+        }
+        else
+        {
+            for (auto & pg: pgs)
+                pg.calc_object_states(0);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed[parallel] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1000000000.0;
+        for (auto & pg: pgs)
+        {
+            assert(pg.state == PG_ACTIVE);
+            assert(pg.clean_count == per_pg && pg.state_dict.size() == 0);
+            delete pg.peering_state;
+        }
+    }
+    printf(
+        "%d PGs x %ju objects: %.3f s sequentially, %.3f s in %d threads (%.0f objects/s)\n",
+        n_threads, per_pg, elapsed[0], elapsed[1], n_threads, per_pg*n_threads/elapsed[1]
+    );
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t n_objects = argc > 1 ? strtoull(argv[1], NULL, 10) : 1024*1024;
+    if (n_objects < 16)
+        n_objects = 16;
+    n_objects = n_objects/4*4;
+    test_unstable(n_objects);
+    test_degraded(n_objects);
+    int n_threads = argc > 2 ? atoi(argv[2]) : 4;
+    if (n_threads < 1)
+        n_threads = 1;
+    test_parallel(n_objects, n_threads);
     return 0;
 }
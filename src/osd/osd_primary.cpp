@@ -3,6 +3,7 @@
 
 #include "osd_primary.h"
 #include "allocator.h"
+#include "buffer_pool.h"
 
 // read: read directly or read paired stripe(s), reconstruct, return
 // write: read paired stripe(s), reconstruct, modify, calculate parity, write
@@ -303,7 +304,7 @@ resume_2:
             auto new_object_state = mark_object_corrupted(*pg, op_data->oid, op_data->object_state, op_data->stripes, false);
             if (new_object_state != op_data->object_state)
             {
-                free(cur_op->buf);
+                pool_free(cur_op->buf);
                 cur_op->buf = NULL;
                 goto resume_0;
             }
@@ -721,7 +722,7 @@ void osd_t::deref_object_state(pg_t & pg, pg_osd_set_state_t **object_state, boo
         }
         if (!(*object_state)->object_count && !(*object_state)->ref_count)
         {
-            pg.state_dict.erase((*object_state)->osd_set);
+            pg.state_dict.erase(*object_state);
             *object_state = NULL;
         }
     }
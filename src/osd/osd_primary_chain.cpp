@@ -3,6 +3,7 @@
 
 #include "osd_primary.h"
 #include "allocator.h"
+#include "buffer_pool.h"
 
 void osd_t::continue_chained_read(osd_op_t *cur_op)
 {
@@ -56,7 +57,7 @@ resume_4:
         {
             // Handle corrupted reads and retry...
             check_corrupted_chained(*pg, cur_op);
-            free(cur_op->buf);
+            pool_free(cur_op->buf);
             cur_op->buf = NULL;
             free(op_data->chain_reads);
             op_data->chain_reads = NULL;
@@ -469,7 +470,7 @@ int osd_t::submit_chained_read_requests(pg_t *pg, osd_op_t *cur_op)
         }
     }
     assert(!cur_op->buf);
-    cur_op->buf = memalign_or_die(MEM_ALIGNMENT, read_buffer_size);
+    cur_op->buf = pool_alloc(read_buffer_size);
     void *cur_buf = cur_op->buf;
     for (int cri = 0; cri < chain_reads.size(); cri++)
     {
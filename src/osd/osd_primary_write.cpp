@@ -3,6 +3,7 @@
 
 #include "osd_primary.h"
 #include "allocator.h"
+#include "buffer_pool.h"
 
 bool osd_t::check_write_queue(osd_op_t *cur_op, pg_t & pg)
 {
@@ -92,7 +93,7 @@ retry_1:
             op_data->stripes[0].read_start = 0;
             op_data->stripes[0].read_end = bs_block_size;
             assert(!cur_op->rmw_buf);
-            cur_op->rmw_buf = op_data->stripes[0].read_buf = memalign_or_die(MEM_ALIGNMENT, bs_block_size);
+            cur_op->rmw_buf = op_data->stripes[0].read_buf = pool_alloc(bs_block_size);
         }
     }
     else
@@ -128,7 +129,7 @@ resume_3:
                 op_data->prev_set = op_data->object_state ? op_data->object_state->read_target.data() : pg.cur_set.data();
                 if (cur_op->rmw_buf)
                 {
-                    free(cur_op->rmw_buf);
+                    pool_free(cur_op->rmw_buf);
                     cur_op->rmw_buf = NULL;
                 }
                 goto retry_1;
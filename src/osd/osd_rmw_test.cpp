@@ -191,7 +191,7 @@ void test4()
     check_pattern(stripes[2].write_buf, 4096, PATTERN0^PATTERN1); // new parity
     check_pattern(stripes[2].write_buf+4096, 128*1024-4096*2, 0); // new parity
     check_pattern(stripes[2].write_buf+128*1024-4096, 4096, PATTERN0^PATTERN1); // new parity
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
 }
 
@@ -232,7 +232,7 @@ void test5()
     assert(stripes[0].write_buf == write_buf);
     assert(stripes[1].write_buf == (uint8_t*)write_buf+128*1024);
     assert(stripes[2].write_buf == rmw_buf);
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
 }
 
@@ -269,7 +269,7 @@ void test6()
     assert(stripes[0].write_buf == write_buf);
     assert(stripes[1].write_buf == (uint8_t*)write_buf+128*1024);
     assert(stripes[2].write_buf == rmw_buf);
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
 }
 
@@ -327,7 +327,7 @@ void test7()
     check_pattern(stripes[2].write_buf, 4096, PATTERN0^PATTERN1); // new parity
     check_pattern(stripes[2].write_buf+4096, 128*1024-4096*2, 0); // new parity
     check_pattern(stripes[2].write_buf+128*1024-4096, 4096, PATTERN0^PATTERN1); // new parity
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
 }
 
@@ -390,7 +390,7 @@ void test_rmw_4k_degraded_into_lost_to_normal(bool ec)
     check_pattern(stripes[0].write_buf, 4096, PATTERN0);
     check_pattern(stripes[0].write_buf+48*1024, 4096, PATTERN2);
     check_pattern(stripes[2].write_buf, 4096, PATTERN2^PATTERN1); // new parity
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
 }
 
@@ -440,7 +440,7 @@ void test8()
     assert(stripes[2].write_buf == rmw_buf);                                 // recheck again
     check_pattern(stripes[2].write_buf, 4096, 0); // new parity
     check_pattern(stripes[2].write_buf+4096, 128*1024-4096, PATTERN0^PATTERN1); // new parity
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
 }
 
@@ -499,7 +499,7 @@ void test9()
     assert(stripes[2].write_buf == NULL);
     check_pattern(stripes[0].read_buf, 128*1024, PATTERN1);
     check_pattern(stripes[0].write_buf, 128*1024, PATTERN1);
-    free(rmw_buf);
+    pool_free(rmw_buf);
 }
 
 /***
@@ -554,7 +554,7 @@ void test10()
     assert(stripes[1].write_buf == (uint8_t*)write_buf+128*1024);
     assert(stripes[2].write_buf == rmw_buf);
     check_pattern(stripes[2].write_buf, 128*1024, PATTERN1^PATTERN2);
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
 }
 
@@ -610,7 +610,7 @@ void test11()
     assert(stripes[1].write_buf == write_buf);
     assert(stripes[2].write_buf == rmw_buf);
     check_pattern(stripes[2].write_buf, 128*1024, PATTERN1^PATTERN2);
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
 }
 
@@ -665,7 +665,7 @@ void test12()
     assert(stripes[1].write_buf == NULL);
     assert(stripes[2].write_buf == rmw_buf);
     check_pattern(stripes[2].write_buf, 128*1024, PATTERN1^PATTERN2);
-    free(rmw_buf);
+    pool_free(rmw_buf);
 }
 
 /***
@@ -759,7 +759,7 @@ void test13()
     check_pattern(stripes[0].read_buf+128*1024-4096, 4096, PATTERN3);
     check_pattern(stripes[1].read_buf, 4096, PATTERN3);
     check_pattern(stripes[1].read_buf+4096, 128*1024-4096, PATTERN2);
-    free(read_buf);
+    pool_free(read_buf);
     // Test 13.4 - partial decode (only 1st chunk) and verify
     memset(stripes, 0, sizeof(stripes));
     split_stripes(2, 128*1024, 0, 128*1024, stripes);
@@ -788,9 +788,9 @@ void test13()
     reconstruct_stripes_ec(stripes, 4, 2, 0);
     check_pattern(stripes[0].read_buf, 128*1024-4096, PATTERN1);
     check_pattern(stripes[0].read_buf+128*1024-4096, 4096, PATTERN3);
-    free(read_buf);
+    pool_free(read_buf);
     // Huh done
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
     use_ec(4, 2, false);
 }
@@ -887,9 +887,9 @@ void test14()
     reconstruct_stripes_ec(stripes, 3, 2, bmp);
     check_pattern(stripes[0].read_buf, 128*1024-4096, PATTERN1);
     check_pattern(stripes[0].read_buf+128*1024-4096, 4096, PATTERN3);
-    free(read_buf);
+    pool_free(read_buf);
     // Huh done
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
     use_ec(3, 2, false);
 }
@@ -961,7 +961,7 @@ void test15(bool second)
     // first parity is always xor :), second isn't...
     check_pattern(stripes[2+second].write_buf, 4*1024, second ? 0xb79a59a0ce8b9b81 : PATTERN1^PATTERN2);
     // Done
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
     use_ec(4, 2, false);
 }
@@ -1067,9 +1067,9 @@ void test16()
     assert(*(uint32_t*)stripes[3].bmp_buf == 0xF1F1F1F1);
     assert(bitmaps[0] == 0xFFFFFFFF);
     check_pattern(stripes[0].read_buf, 128*1024, PATTERN1);
-    free(read_buf);
+    pool_free(read_buf);
     // Done
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
     use_ec(4, 2, false);
 }
@@ -1184,7 +1184,7 @@ void test_ec43_error_bruteforce()
     res = ec_find_good(stripes, 7, 7, 4, false, 4096, 0, 100, true);
     assert_eq_vec(res, std::vector<int>());
     // Done
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
     use_ec(7, 4, false);
 }
@@ -1341,9 +1341,9 @@ void test_recover_22()
     assert(bitmaps[0] == 0xFFFFFFFF);
     assert(*(uint32_t*)stripes[1].bmp_buf == 0xFFFFFFFF);
     check_pattern(stripes[1].read_buf, 128*1024, PATTERN2);
-    free(read_buf);
+    pool_free(read_buf);
     // Done
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
     use_ec(4, 2, false);
 }
@@ -1394,7 +1394,7 @@ void test_ec_find_good_multi_chunks()
     auto res = ec_find_good(stripes, 15, 7, 4, false, 4096, 0, 100, true);
     assert_eq_vec(res, std::vector<int>({8, 9, 10, 11, 12, 14}));
     // Done
-    free(rmw_buf);
+    pool_free(rmw_buf);
     free(write_buf);
     use_ec(7, 4, false);
 }
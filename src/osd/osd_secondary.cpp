@@ -2,6 +2,7 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include "osd.h"
+#include "buffer_pool.h"
 #ifdef WITH_RDMA
 #include "msgr_rdma.h"
 #endif
@@ -158,7 +159,7 @@ void osd_t::exec_secondary_real(osd_op_t *cur_op)
             else
                 cur_op->bitmap = &cur_op->bmp_data;
             if (cur_op->req.sec_rw.len > 0)
-                cur_op->buf = memalign_or_die(MEM_ALIGNMENT, cur_op->req.sec_rw.len);
+                cur_op->buf = pool_alloc(cur_op->req.sec_rw.len);
         }
         cur_op->bs_op->oid = cur_op->req.sec_rw.oid;
         cur_op->bs_op->version = cur_op->req.sec_rw.version;
@@ -264,7 +265,7 @@ void osd_t::exec_sec_read_bmp(osd_op_t *cur_op)
             bs->read_bitmap(ov[i].oid, ov[i].version, (uint8_t*)cur_buf + sizeof(uint64_t), (uint64_t*)cur_buf);
             cur_buf = (uint8_t*)cur_buf + (8 + clean_entry_bitmap_size);
         }
-        free(cur_op->buf);
+        pool_free(cur_op->buf);
         cur_op->buf = reply_buf;
     }
     finish_op(cur_op, n * (8 + clean_entry_bitmap_size));
@@ -376,7 +377,7 @@ void osd_t::exec_show_config(osd_op_t *cur_op)
     }
 #endif
     if (cur_op->buf)
-        free(cur_op->buf);
+        pool_free(cur_op->buf);
     std::string cfg_str = json11::Json(wire_config).dump();
     cur_op->buf = malloc_or_die(cfg_str.size()+1);
     memcpy(cur_op->buf, cfg_str.c_str(), cfg_str.size()+1);
@@ -1,6 +1,8 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
 
+#include <errno.h>
+
 #include <random>
 
 #include "ringloop_mock.h"
@@ -70,6 +72,49 @@ int ring_loop_mock_t::register_eventfd()
     return -1;
 }
 
+int ring_loop_mock_t::register_fd(int fd)
+{
+    return -ENOTSUP;
+}
+
+void ring_loop_mock_t::unregister_fd(int fd)
+{
+}
+
+int ring_loop_mock_t::register_buffer_region(void *base, size_t size, size_t max_pinned,
+    std::function<void(void *slice, size_t len, bool pinned)> pin_cb)
+{
+    return -ENOTSUP;
+}
+
+io_uring_buf_ring* ring_loop_mock_t::setup_buf_ring(int bgid, unsigned entries, int *err)
+{
+    *err = -ENOTSUP;
+    return NULL;
+}
+
+void ring_loop_mock_t::free_buf_ring(io_uring_buf_ring *br, int bgid, unsigned entries)
+{
+}
+
+int ring_loop_mock_t::register_passthru(int fd, int nvme_fd, uint32_t nsid, uint32_t lba_size, uint32_t max_io)
+{
+    return -ENOTSUP;
+}
+
+void ring_loop_mock_t::unregister_passthru(int fd)
+{
+}
+
+int ring_loop_mock_t::register_iopoll_fd(int fd)
+{
+    return -ENOTSUP;
+}
+
+void ring_loop_mock_t::unregister_iopoll_fd(int fd)
+{
+}
+
 io_uring_sqe* ring_loop_mock_t::get_sqe()
 {
     if (free_ring_datas.size() == 0)
@@ -81,6 +126,7 @@ io_uring_sqe* ring_loop_mock_t::get_sqe()
     submit_ring_datas.push_back(d);
     io_uring_sqe *sqe = &sqes[d - ring_datas.data()];
     *sqe = { 0 };
+    d->cb = NULL;
     io_uring_sqe_set_data(sqe, d);
     return sqe;
 }
@@ -126,15 +172,16 @@ void ring_loop_mock_t::loop()
     {
         ring_data_t *d = completed_ring_datas.back();
         completed_ring_datas.pop_back();
-        if (d->callback)
+        if (d->has_callback())
         {
             struct ring_data_t dl;
             dl.iov = d->iov;
             dl.res = d->res;
+            dl.cqe_flags = 0;
             dl.more = dl.prev = false;
-            dl.callback.swap(d->callback);
+            d->move_callback(dl);
             free_ring_datas.push_back(d);
-            dl.callback(&dl);
+            dl.run_callback();
         }
         else
         {
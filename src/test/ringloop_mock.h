@@ -31,6 +31,16 @@ public:
     bool has_sendmsg_zc();
 
     int register_eventfd();
+    int register_fd(int fd);
+    void unregister_fd(int fd);
+    int register_buffer_region(void *base, size_t size, size_t max_pinned,
+        std::function<void(void *slice, size_t len, bool pinned)> pin_cb = NULL);
+    io_uring_buf_ring* setup_buf_ring(int bgid, unsigned entries, int *err);
+    void free_buf_ring(io_uring_buf_ring *br, int bgid, unsigned entries);
+    int register_passthru(int fd, int nvme_fd, uint32_t nsid, uint32_t lba_size, uint32_t max_io);
+    void unregister_passthru(int fd);
+    int register_iopoll_fd(int fd);
+    void unregister_iopoll_fd(int fd);
     io_uring_sqe* get_sqe();
     int submit();
     int wait();
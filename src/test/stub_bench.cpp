@@ -114,11 +114,12 @@ bool check_reply(int r, osd_any_op_t & op, osd_any_reply_t & reply, int expected
 
 void run_bench(int peer_fd)
 {
-    osd_any_op_t op;
+    osd_any_op_t op = {};
     osd_any_reply_t reply;
+    uint32_t bitmap;
     void *buf = NULL;
     int r;
-    iovec iov[2];
+    iovec iov[3];
     timespec tv_begin, tv_end;
     clock_gettime(CLOCK_REALTIME, &tv_begin);
     while (1)
@@ -136,9 +137,11 @@ void run_bench(int peer_fd)
         if (!r)
             break;
         buf = malloc(op.sec_rw.len);
+        // Stub OSD replies with a 4-byte bitmap before data
         iov[0] = { reply.buf, OSD_PACKET_SIZE };
-        iov[1] = { buf, op.sec_rw.len };
-        r = readv_blocking(peer_fd, iov, 2) == (OSD_PACKET_SIZE + op.sec_rw.len);
+        iov[1] = { &bitmap, sizeof(bitmap) };
+        iov[2] = { buf, op.sec_rw.len };
+        r = readv_blocking(peer_fd, iov, 3) == (OSD_PACKET_SIZE + sizeof(bitmap) + op.sec_rw.len);
         free(buf);
         if (!r || !check_reply(OSD_PACKET_SIZE, op, reply, op.sec_rw.len))
             break;
@@ -30,7 +30,14 @@ void stub_exec_op(osd_messenger_t *msgr, osd_op_t *op);
 int main(int narg, char *args[])
 {
     ring_consumer_t looper;
-    ring_loop_t *ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
+    json11::Json::object config = { { "log_level", 1 } };
+    // Messenger and io_uring options may be passed as --key value
+    for (int i = 1; i < narg-1; i += 2)
+    {
+        if (args[i][0] == '-' && args[i][1] == '-')
+            config[args[i]+2] = args[i+1];
+    }
+    ring_loop_t *ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false, false, osd_messenger_t::parse_ring_config(config, true));
     epoll_manager_t *epmgr = new epoll_manager_t(ringloop);
     osd_messenger_t *msgr = new osd_messenger_t();
     msgr->osd_num = 1351;
@@ -38,8 +45,8 @@ int main(int narg, char *args[])
     msgr->ringloop = ringloop;
     msgr->repeer_pgs = [](osd_num_t) {};
     msgr->exec_op = [msgr](osd_op_t *op) { stub_exec_op(msgr, op); };
-    json11::Json config = json11::Json::object { { "log_level", 1 } };
     msgr->parse_config(config);
+    msgr->init();
     // Accept new connections
     int listen_fd = create_and_bind_socket("0.0.0.0", 11203, 128, NULL);
     fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
@@ -2,9 +2,13 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "str_util.h"
 #include "ringloop_mock.h"
 #include "blockstore_impl.h"
+#include "blockstore_thread.h"
+#include "epoll_manager.h"
 
 struct bs_test_t
 {
@@ -699,8 +703,344 @@ static void test_compact_rollback()
     free(op2.buf);
 }
 
+static uint64_t elapsed_us(const timespec & since)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec-since.tv_sec)*1000000 + (now.tv_nsec-since.tv_nsec)/1000;
+}
+
+// Write objects and compact them so that old entries become garbage in many metadata blocks
+static void write_compacted_garbage(bs_test_t & test, int count)
+{
+    printf("writing %d objects\n", count);
+    blockstore_op_t op;
+    op.buf = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, 4096);
+    for (int i = 0; i < count; i++)
+    {
+        for (int v = 1; v <= 2; v++)
+        {
+            op.opcode = BS_OP_WRITE_STABLE;
+            op.oid = { .inode = 1, .stripe = (uint64_t)i << 17 };
+            op.version = v;
+            op.offset = v == 1 ? 8192 : 28*1024;
+            op.len = 4096;
+            memset(op.buf, 0xa0 + v, 4096);
+            test.exec_op(&op);
+            assert(op.retval == op.len);
+        }
+    }
+    free(op.buf);
+    test.bs->flusher->request_trim();
+    while (test.bs->heap->get_compact_queue_size())
+        test.ringloop->loop();
+    while (test.bs->flusher->is_active())
+        test.ringloop->loop();
+    test.bs->flusher->release_trim();
+    assert(!test.bs->heap->get_to_compact_count());
+    while (!test.bs->is_safe_to_stop())
+        test.ringloop->loop();
+    test.destroy_bs();
+}
+
+static void test_defer_meta_cleanup()
+{
+    printf("\n-- test_defer_meta_cleanup\n");
+
+    const int count = 256;
+    timespec tv_begin;
+
+    // Measure normal startup time
+    uint64_t full_us = 0;
+    {
+        bs_test_t test;
+        test.default_cfg();
+        test.config["csum_block_size"] = "16384";
+        test.config["log_level"] = "0";
+        test.init();
+        write_compacted_garbage(test, count);
+        clock_gettime(CLOCK_MONOTONIC, &tv_begin);
+        test.init();
+        full_us = elapsed_us(tv_begin);
+    }
+
+    bs_test_t test;
+    test.default_cfg();
+    test.config["csum_block_size"] = "16384";
+    test.config["log_level"] = "0";
+    test.init();
+    write_compacted_garbage(test, count);
+
+    // Restart with deferred cleanup
+    test.config["defer_meta_cleanup"] = "1";
+    test.config["meta_write_recheck_parallelism"] = "1";
+    clock_gettime(CLOCK_MONOTONIC, &tv_begin);
+    test.bs = new blockstore_impl_t(test.config, test.ringloop, test.tfd, true);
+    while (!test.bs->is_started())
+        test.ringloop->loop();
+    uint64_t ready_us = elapsed_us(tv_begin);
+    size_t deferred_blocks = test.bs->deferred_cleanup_blocks.size();
+    printf("started with %zu metadata blocks left to clear\n", deferred_blocks);
+    assert(deferred_blocks > 1);
+
+    // Objects are readable before the cleanup finishes
+    blockstore_op_t op;
+    op.opcode = BS_OP_READ;
+    op.oid = { .inode = 1, .stripe = 0 };
+    op.version = UINT64_MAX;
+    op.offset = 0;
+    op.len = 128*1024;
+    op.buf = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, 128*1024);
+    test.exec_op(&op);
+    assert(op.retval == op.len);
+    assert(memcheck(op.buf+8*1024, 0xa1, 4*1024));
+    assert(memcheck(op.buf+28*1024, 0xa2, 4*1024));
+    while (test.bs->deferred_cleanup_blocks.size() > 0)
+        test.ringloop->loop();
+    uint64_t cleanup_us = elapsed_us(tv_begin);
+    printf("normal start: %ju us; deferred cleanup: ready in %ju us, %zu blocks cleared in %ju us\n",
+        full_us, ready_us, deferred_blocks, cleanup_us);
+
+    // Restart again and check that all garbage is cleared
+    while (!test.bs->is_safe_to_stop())
+        test.ringloop->loop();
+    test.destroy_bs();
+    test.init();
+    assert(!test.bs->deferred_cleanup_blocks.size());
+    for (int i = 0; i < count; i++)
+    {
+        op.oid = { .inode = 1, .stripe = (uint64_t)i << 17 };
+        op.version = UINT64_MAX;
+        test.exec_op(&op);
+        assert(op.retval == op.len);
+        assert(memcheck(op.buf, 0, 8*1024));
+        assert(memcheck(op.buf+8*1024, 0xa1, 4*1024));
+        assert(memcheck(op.buf+12*1024, 0, 16*1024));
+        assert(memcheck(op.buf+28*1024, 0xa2, 4*1024));
+        assert(memcheck(op.buf+32*1024, 0, 96*1024));
+    }
+
+    free(op.buf);
+}
+
+static void test_compaction_budget()
+{
+    printf("\n-- test_compaction_budget\n");
+
+    const int count = 128;
+    bs_test_t test;
+    test.default_cfg();
+    test.config["csum_block_size"] = "16384";
+    test.config["log_level"] = "0";
+    test.config["compaction_target_iops"] = "10";
+    test.init();
+
+    // Overwrite objects with small writes so that each of them requires compaction
+    timespec tv_begin;
+    clock_gettime(CLOCK_MONOTONIC, &tv_begin);
+    blockstore_op_t op;
+    op.buf = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, 4096);
+    for (int i = 0; i < count; i++)
+    {
+        for (int v = 1; v <= 2; v++)
+        {
+            op.opcode = BS_OP_WRITE_STABLE;
+            op.oid = { .inode = 1, .stripe = (uint64_t)i << 17 };
+            op.version = v;
+            op.offset = v == 1 ? 8192 : 28*1024;
+            op.len = 4096;
+            memset(op.buf, 0xa0 + v, 4096);
+            test.exec_op(&op);
+            assert(op.retval == op.len);
+        }
+    }
+    free(op.buf);
+    uint64_t write_us = elapsed_us(tv_begin);
+
+    // Compaction is throttled while clients are active
+    auto st = test.bs->get_compaction_stats();
+    printf("after %ju us of writes: queue %ju, compacted %ju, pressure %d, limit %ju iops\n",
+        write_us, st.queue_size+st.future_queue_size, st.compacted_count, st.pressure, st.iops_limit);
+    assert(st.pressure == BS_COMPACT_THROTTLED || st.pressure == BS_COMPACT_ELEVATED);
+    assert(st.iops_limit >= 10 && st.iops_limit <= 40);
+    assert(st.compacted_count <= 40*write_us/1000000 + 8);
+    assert(st.queue_size+st.future_queue_size > 0);
+
+    // And runs at full speed when they are idle
+    while (test.bs->heap->get_compact_queue_size() || test.bs->flusher->is_active())
+        test.ringloop->loop();
+    st = test.bs->get_compaction_stats();
+    printf("idle: queue %ju, compacted %ju (%ju bytes), pressure %d\n",
+        st.queue_size, st.compacted_count, st.compacted_bytes, st.pressure);
+    assert(st.pressure == BS_COMPACT_IDLE);
+    assert(!st.queue_size);
+    assert(st.compacted_count >= count);
+}
+
+static void test_meta_write_batching()
+{
+    printf("\n-- test_meta_write_batching\n");
+
+    const int count = 128;
+    bs_test_t test;
+    test.default_cfg();
+    test.config["log_level"] = "0";
+    test.init();
+
+    // Submit many writes at once so that their entries land in several adjacent metadata blocks
+    blockstore_op_t ops[count];
+    uint8_t *buf = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, 4096*count);
+    int done = 0;
+    for (int i = 0; i < count; i++)
+    {
+        memset(buf + i*4096, i, 4096);
+        ops[i].opcode = BS_OP_WRITE_STABLE;
+        ops[i].oid = { .inode = 1, .stripe = (uint64_t)i << 17 };
+        ops[i].version = 1;
+        ops[i].offset = 0;
+        ops[i].len = 4096;
+        ops[i].buf = buf + i*4096;
+        ops[i].callback = [&](blockstore_op_t *op)
+        {
+            assert(op->retval == op->len);
+            done++;
+        };
+        test.bs->enqueue_op(&ops[i]);
+    }
+    while (done < count)
+        test.ringloop->loop();
+    auto st = test.bs->get_meta_write_stats();
+    printf("%ju client writes, %ju metadata writes, %ju metadata blocks\n", st.client_writes, st.meta_writes, st.meta_blocks);
+    assert(st.client_writes == count);
+    assert(st.meta_blocks > 1);
+    assert(st.meta_writes < st.meta_blocks);
+    assert(st.meta_writes*4 < st.client_writes);
+
+    // Check that everything is persisted correctly
+    while (!test.bs->is_safe_to_stop())
+        test.ringloop->loop();
+    test.destroy_bs();
+    test.init();
+    blockstore_op_t op;
+    op.opcode = BS_OP_READ;
+    op.offset = 0;
+    op.len = 4096;
+    op.buf = buf;
+    for (int i = 0; i < count; i++)
+    {
+        op.oid = { .inode = 1, .stripe = (uint64_t)i << 17 };
+        op.version = UINT64_MAX;
+        test.exec_op(&op);
+        assert(op.retval == op.len);
+        assert(memcheck(op.buf, (uint8_t)i, 4096));
+    }
+    free(buf);
+}
+
 // FIXME Add a simple intent_write / big_intent test
 
+// Runs a real blockstore over a sparse file in a separate thread and makes
+// synchronous calls into it while operations are in progress
+static void test_blockstore_thread()
+{
+    printf("\n-- test_blockstore_thread\n");
+
+    const char *path = "./test_bs_thread.bin";
+    const int count = 64;
+    int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    assert(fd >= 0);
+    int r = ftruncate(fd, 1073741824);
+    assert(r == 0);
+    close(fd);
+    blockstore_config_t config;
+    config["data_device"] = path;
+    config["data_io"] = "cached";
+    config["meta_offset"] = "0";
+    config["journal_offset"] = "16777216";
+    config["data_offset"] = "33554432";
+    config["disable_data_fsync"] = "1";
+    config["immediate_commit"] = "all";
+    config["data_csum_type"] = "crc32c";
+    config["csum_block_size"] = "4096";
+    config["meta_format"] = "3";
+    ring_loop_t *ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
+    epoll_manager_t *epmgr = new epoll_manager_t(ringloop);
+    blockstore_thread_t *bs = new blockstore_thread_t(config, ringloop, epmgr->tfd);
+    while (!bs->is_started())
+    {
+        ringloop->loop();
+        if (!bs->is_started())
+            ringloop->wait();
+    }
+    uint64_t free_blocks = bs->get_free_block_count();
+
+    // Write objects and query the blockstore while writes are in progress
+    blockstore_op_t ops[count];
+    int done = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ops[i].opcode = BS_OP_WRITE_STABLE;
+        ops[i].oid = { .inode = 1, .stripe = (uint64_t)i << 17 };
+        ops[i].version = 1;
+        ops[i].offset = 8192;
+        ops[i].len = 4096;
+        ops[i].buf = (uint8_t*)memalign_or_die(MEM_ALIGNMENT, 128*1024);
+        memset(ops[i].buf, 0x10+i, 4096);
+        ops[i].callback = [&](blockstore_op_t *op) { done++; };
+        bs->enqueue_op(&ops[i]);
+    }
+    uint8_t bitmap[32];
+    int queries = 0;
+    while (done < count)
+    {
+        ringloop->loop();
+        bs->read_bitmap(ops[count-1].oid, UINT64_MAX, bitmap);
+        bs->get_free_block_count();
+        queries++;
+        if (done < count)
+            ringloop->wait();
+    }
+    printf("%d writes completed, %d synchronous queries made meanwhile\n", count, queries);
+    for (int i = 0; i < count; i++)
+        assert(ops[i].retval == ops[i].len);
+    assert(bs->get_free_block_count() == free_blocks-count);
+    uint64_t version = 0;
+    r = bs->read_bitmap(ops[0].oid, UINT64_MAX, bitmap, &version);
+    assert(r == 0 && version == 1);
+
+    // Read them back
+    done = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ops[i].opcode = BS_OP_READ;
+        ops[i].version = UINT64_MAX;
+        ops[i].offset = 0;
+        ops[i].len = 128*1024;
+        bs->enqueue_op(&ops[i]);
+    }
+    while (done < count)
+    {
+        ringloop->loop();
+        if (done < count)
+            ringloop->wait();
+    }
+    for (int i = 0; i < count; i++)
+    {
+        assert(ops[i].retval == ops[i].len);
+        assert(memcheck(ops[i].buf, 0, 8192));
+        assert(memcheck(ops[i].buf+8192, 0x10+i, 4096));
+        assert(memcheck(ops[i].buf+12288, 0, 128*1024-12288));
+        free(ops[i].buf);
+    }
+
+    while (!bs->is_safe_to_stop())
+        ringloop->loop();
+    delete bs;
+    delete epmgr;
+    delete ringloop;
+    unlink(path);
+}
+
 int main(int narg, char *args[])
 {
     test_simple();
@@ -715,5 +1055,9 @@ int main(int narg, char *args[])
     test_padded_csum_parallel_read(false, 16384);
     test_padded_csum_parallel_read(true, 16384);
     test_compact_rollback();
+    test_defer_meta_cleanup();
+    test_compaction_budget();
+    test_meta_write_batching();
+    test_blockstore_thread();
     return 0;
 }
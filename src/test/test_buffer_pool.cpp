@@ -0,0 +1,128 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <thread>
+#include <vector>
+#include "buffer_pool.h"
+
+static void test_classes()
+{
+    size_t sizes[] = { 1, 4096, 4097, 8192, 12000, 16384, 20000, 32768, 131072, 131073, 1024*1024, 4*1024*1024-1, 16*1024*1024 };
+    for (size_t size: sizes)
+    {
+        uint8_t *buf = (uint8_t*)pool_alloc(size);
+        assert(((uintptr_t)buf % POOL_PAGE_SIZE) == 0);
+        assert(pool_owns(buf));
+        // Whole buffer must be writable
+        buf[0] = 1;
+        buf[size-1] = 2;
+        pool_free(buf);
+    }
+    printf("OK size classes\n");
+}
+
+static void test_reuse()
+{
+    buffer_pool_stats_t st0 = pool_get_stats();
+    void *a = pool_alloc(128*1024);
+    void *b = pool_alloc(128*1024);
+    assert(a != b);
+    buffer_pool_stats_t st1 = pool_get_stats();
+    assert(st1.used_bytes - st0.used_bytes == 256*1024);
+    assert(st1.alloc_count - st0.alloc_count == 2);
+    pool_free(b);
+    void *c = pool_alloc(100*1024);
+    assert(c == b);
+    pool_free(c);
+    pool_free(a);
+    buffer_pool_stats_t st2 = pool_get_stats();
+    assert(st2.used_bytes == st0.used_bytes);
+    assert(st2.region_used == st1.region_used);
+    printf("OK reuse\n");
+}
+
+static void test_fallback()
+{
+    buffer_pool_stats_t st0 = pool_get_stats();
+    void *big = pool_alloc(POOL_MAX_SIZE+1);
+    assert(!pool_owns(big));
+    assert(pool_get_stats().fallback_count == st0.fallback_count+1);
+    pool_free(big);
+    // Foreign buffers are just freed
+    void *m = malloc(100);
+    assert(!pool_owns(m));
+    pool_free(m);
+    printf("OK fallback\n");
+}
+
+static void test_cross_thread()
+{
+    const int count = 1000;
+    std::vector<void*> bufs;
+    // Allocate in one thread, free in another
+    std::thread([&]()
+    {
+        for (int i = 0; i < count; i++)
+            bufs.push_back(pool_alloc(128*1024));
+    }).join();
+    buffer_pool_stats_t st0 = pool_get_stats();
+    std::thread([&]()
+    {
+        for (auto buf: bufs)
+            pool_free(buf);
+    }).join();
+    buffer_pool_stats_t st1 = pool_get_stats();
+    // Only a limited amount of free buffers is kept resident
+    assert(st1.trimmed_bytes > st0.trimmed_bytes);
+    // Buffers cached by the exited thread are reused by others instead of taking new chunks
+    bufs.clear();
+    std::thread([&]()
+    {
+        for (int i = 0; i < count; i++)
+            bufs.push_back(pool_alloc(128*1024));
+        for (auto buf: bufs)
+            pool_free(buf);
+    }).join();
+    buffer_pool_stats_t st2 = pool_get_stats();
+    assert(st2.region_used == st1.region_used);
+    assert(st2.used_bytes == st1.used_bytes);
+    printf("OK cross-thread free\n");
+}
+
+static void test_pinned()
+{
+    const int count = 1000;
+    const size_t size = 192*1024;
+    std::vector<void*> bufs;
+    for (int i = 0; i < count; i++)
+    {
+        bufs.push_back(pool_alloc(size));
+        pool_set_pinned(bufs[i], size, true);
+    }
+    buffer_pool_stats_t st0 = pool_get_stats();
+    std::thread([&]()
+    {
+        for (auto buf: bufs)
+            pool_free(buf);
+    }).join();
+    buffer_pool_stats_t st1 = pool_get_stats();
+    // Pinned buffers are never returned to the OS
+    assert(st1.trimmed_bytes == st0.trimmed_bytes);
+    for (auto buf: bufs)
+        pool_set_pinned(buf, size, false);
+    printf("OK pinned\n");
+}
+
+int main(int narg, char *args[])
+{
+    test_classes();
+    test_reuse();
+    test_fallback();
+    test_cross_thread();
+    test_pinned();
+    return 0;
+}
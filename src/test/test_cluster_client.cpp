@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "cluster_client_impl.h"
 
@@ -13,22 +14,28 @@ public:
     {
         cli->continue_ops(cli->client_retry_interval);
     }
+
+    static bool has_write_barriers(cluster_client_t *cli)
+    {
+        return cli->write_barriers.head != NULL;
+    }
 };
 
-void configure_single_pg_pool(cluster_client_t *cli)
+void configure_single_pg_pool(cluster_client_t *cli, std::string immediate_commit = "")
 {
+    json11::Json::object pool_cfg = {
+        { "name", "hddpool" },
+        { "scheme", "replicated" },
+        { "pg_size", 2 },
+        { "pg_minsize", 1 },
+        { "pg_count", 1 },
+        { "failure_domain", "osd" },
+    };
+    if (immediate_commit != "")
+        pool_cfg["immediate_commit"] = immediate_commit;
     cli->st_cli.parse_state((etcd_kv_t){
         .key = "/config/pools",
-        .value = json11::Json::object {
-            { "1", json11::Json::object {
-                { "name", "hddpool" },
-                { "scheme", "replicated" },
-                { "pg_size", 2 },
-                { "pg_minsize", 1 },
-                { "pg_count", 1 },
-                { "failure_domain", "osd" },
-            } }
-        },
+        .value = json11::Json::object { { "1", pool_cfg } },
     });
     cli->st_cli.parse_state((etcd_kv_t){
         .key = "/pg/config",
@@ -90,11 +97,11 @@ int *test_write(cluster_client_t *cli, uint64_t offset, uint64_t len, uint8_t c,
     return r;
 }
 
-int *test_sync(cluster_client_t *cli)
+int *test_sync(cluster_client_t *cli, bool instant = false)
 {
     printf("Post sync\n");
     int *r = new int;
-    *r = -1;
+    *r = instant ? -2 : -1;
     cluster_op_t *op = new cluster_op_t();
     op->opcode = OSD_OP_SYNC;
     op->callback = [r](cluster_op_t *op)
@@ -107,6 +114,13 @@ int *test_sync(cluster_client_t *cli)
         delete op;
     };
     cli->execute(op);
+    if (instant)
+    {
+        long res = *r;
+        assert(*r >= 0);
+        delete r;
+        return (int*)res;
+    }
     return r;
 }
 
@@ -494,6 +508,43 @@ void test_writeback()
     printf("[ok] writeback test\n");
 }
 
+void test_immediate_commit()
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+
+    configure_single_pg_pool(cli, "all");
+    pretend_connected(cli, 1);
+
+    // SYNC doesn't wait for in-flight writes in an immediate_commit pool
+    int *r1 = test_write(cli, 0, 4096, 0x55);
+    int *r2 = test_write(cli, 4096, 4096, 0x56);
+    check_op_count(cli, 1, 2);
+    assert((long)test_sync(cli, true) == 1);
+    check_op_count(cli, 1, 2);
+    assert(!cluster_client_test_t::has_write_barriers(cli));
+
+    // Writes after the SYNC don't wait for previous writes either
+    int *r3 = test_write(cli, 8192, 4096, 0x57);
+    check_op_count(cli, 1, 3);
+    can_complete(r3);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 8192, 4096), 0);
+    check_completed(r3);
+    can_complete(r1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 4096), 0);
+    check_completed(r1);
+    can_complete(r2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 4096, 4096), 0);
+    check_completed(r2);
+    check_op_count(cli, 1, 0);
+
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] immediate_commit sync test\n");
+}
+
 static void copy_write_for_test(writeback_cache_t *wb, uint64_t offset, uint64_t len, int state, uint64_t new_flush_id)
 {
     void *buf = malloc_or_die(len);
@@ -559,11 +610,538 @@ void test_writeback_merge()
     printf("[ok] writeback merge test\n");
 }
 
+static int *test_read(cluster_client_t *cli, uint64_t offset, uint64_t len, uint8_t c, bool instant = false)
+{
+    printf("Post read %jx+%jx\n", offset, len);
+    int *r = new int;
+    *r = instant ? -2 : -1;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_READ;
+    op->inode = 0x1000000000001;
+    op->offset = offset;
+    op->len = len;
+    op->iov.push_back(malloc_or_die(len), len);
+    op->callback = [r, c](cluster_op_t *op)
+    {
+        if (*r == -1)
+            printf("Error: Not allowed to complete yet\n");
+        assert(*r != -1);
+        *r = op->retval == op->len ? 1 : 0;
+        for (uint64_t i = 0; i < op->len; i++)
+        {
+            if (((uint8_t*)op->iov.buf[0].iov_base)[i] != c)
+            {
+                printf("Error: unexpected data at %jx\n", op->offset+i);
+                *r = 0;
+                break;
+            }
+        }
+        free(op->iov.buf[0].iov_base);
+        printf("Done read %jx+%jx r=%d\n", op->offset, op->len, op->retval);
+        delete op;
+    };
+    cli->execute(op);
+    if (instant)
+    {
+        long res = *r;
+        assert(*r >= 0);
+        delete r;
+        return (int*)res;
+    }
+    return r;
+}
+
+static void pretend_read_completed(cluster_client_t *cli, osd_op_t *op, uint8_t c)
+{
+    assert(op);
+    for (int i = 0; i < op->iov.count; i++)
+        memset(op->iov.buf[i].iov_base, c, op->iov.buf[i].iov_len);
+    pretend_op_completed(cli, op, 0);
+}
+
+void test_read_cache()
+{
+    json11::Json config = json11::Json::object {
+        { "client_read_cache_size", 1024*1024 },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+
+    // First read goes to the OSD and fills the cache
+    int *r = test_read(cli, 0, 16384, 0xAA);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_read_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 16384), 0xAA);
+    check_completed(r);
+
+    // Fully cached reads complete instantly
+    assert((long)test_read(cli, 0, 16384, 0xAA, true) == 1);
+    assert((long)test_read(cli, 4096, 8192, 0xAA, true) == 1);
+    check_op_count(cli, 1, 0);
+
+    // Partially cached read is sent to the OSD as a whole
+    r = test_read(cli, 8192, 16384, 0xBB);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_read_completed(cli, find_op(cli, 1, OSD_OP_READ, 8192, 16384), 0xBB);
+    check_completed(r);
+    assert((long)test_read(cli, 8192, 16384, 0xBB, true) == 1);
+    check_op_count(cli, 1, 0);
+
+    // Own writes invalidate cached data
+    r = test_write(cli, 8192, 4096, 0x55);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 8192, 4096), 0);
+    check_completed(r);
+    // The written part is returned from the unsynced write buffer, the rest is read
+    r = test_read(cli, 8192, 8192, 0x55);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_read_completed(cli, find_op(cli, 1, OSD_OP_READ, 12288, 4096), 0x55);
+    check_completed(r);
+    assert((long)test_read(cli, 0, 8192, 0xAA, true) == 1);
+    check_op_count(cli, 1, 0);
+
+    // Inode metadata change invalidates all data of the inode
+    auto & inode_cfg = cli->st_cli.inode_config[0x1000000000001];
+    inode_cfg.num = 0x1000000000001;
+    inode_cfg.mod_revision = 10;
+    r = test_read(cli, 0, 8192, 0xCC);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_read_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 8192), 0xCC);
+    check_completed(r);
+    assert((long)test_read(cli, 0, 8192, 0xCC, true) == 1);
+
+    auto stats = cli->get_read_cache_stats();
+    assert(stats.hits == 5);
+    assert(stats.misses == 4);
+    assert(stats.hit_bytes == 16384+8192+16384+8192+8192);
+
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] read cache test\n");
+}
+
+void test_readahead()
+{
+    json11::Json config = json11::Json::object {
+        { "client_readahead_size", 8*1024*1024 },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+
+    // First reads aren't sequential enough to start read-ahead
+    for (uint64_t offset = 0; offset < 8192; offset += 4096)
+    {
+        int *r = test_read(cli, offset, 4096, 0xAA);
+        check_op_count(cli, 1, 1);
+        can_complete(r);
+        pretend_read_completed(cli, find_op(cli, 1, OSD_OP_READ, offset, 4096), 0xAA);
+        check_completed(r);
+    }
+
+    // Third sequential read starts prefetching 2 objects and waits for the first of them
+    int *r = test_read(cli, 8192, 4096, 0xAA);
+    check_op_count(cli, 1, 2);
+    can_complete(r);
+    pretend_read_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 128*1024), 0xAA);
+    check_completed(r);
+    check_op_count(cli, 1, 1);
+
+    // Next read is served from the prefetched object
+    assert((long)test_read(cli, 12288, 4096, 0xAA, true) == 1);
+    check_op_count(cli, 1, 1);
+
+    // Own write invalidates the object which is still being prefetched
+    r = test_write(cli, 128*1024+4096, 4096, 0x55);
+    check_op_count(cli, 1, 2);
+    can_complete(r);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 128*1024+4096, 4096), 0);
+    check_completed(r);
+    pretend_read_completed(cli, find_op(cli, 1, OSD_OP_READ, 128*1024, 128*1024), 0xAA);
+    check_op_count(cli, 1, 0);
+
+    auto stats = cli->get_readahead_stats();
+    assert(stats.prefetch_ops == 2);
+    assert(stats.prefetched_bytes == 256*1024);
+    assert(stats.hit_bytes == 8192);
+    assert(stats.wasted_bytes == 128*1024);
+    assert(stats.used_bytes == 128*1024);
+
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] read-ahead test\n");
+}
+
+void test_writeback_gaps()
+{
+    json11::Json config = json11::Json::object {
+        { "client_enable_writeback", true },
+        { "client_writeback_allowed", true },
+        { "client_max_buffered_bytes", 1024*1024 },
+        { "client_max_buffered_ops", 2 },
+        { "client_max_writeback_iodepth", 16 },
+        { "client_max_dirty_bytes", 16*1024*1024 },
+        { "client_max_dirty_ops", 1024 },
+        { "client_writeback_max_gap", 16384 },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+
+    // Sequential writes crossing an object boundary are only flushed up to it
+    assert((long)test_write(cli, 2*1024*1024-65536, 65536, 0x55, NULL, true) == 1);
+    assert((long)test_write(cli, 2*1024*1024, 32768, 0x55, NULL, true) == 1);
+    assert((long)test_write(cli, 3*1024*1024, 4096, 0x55, NULL, true) == 1);
+    check_op_count(cli, 1, 0);
+    assert((long)test_write(cli, 4*1024*1024, 4096, 0x55, NULL, true) == 1);
+    check_op_count(cli, 1, 2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 2*1024*1024-65536, 65536), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 3*1024*1024, 4096), 0);
+    check_op_count(cli, 1, 0);
+    int *r = test_sync(cli);
+    check_op_count(cli, 1, 2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 2*1024*1024, 32768), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 4*1024*1024, 4096), 0);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r);
+
+    // A short hole between writes to one object is read and the object is flushed with one write
+    assert((long)test_write(cli, 0, 49152, 0x55, NULL, true) == 1);
+    assert((long)test_write(cli, 65536, 65536, 0x55, NULL, true) == 1);
+    check_op_count(cli, 1, 0);
+    assert((long)test_write(cli, 1024*1024, 4096, 0x66, NULL, true) == 1);
+    check_op_count(cli, 1, 2);
+    pretend_read_completed(cli, find_op(cli, 1, OSD_OP_READ, 49152, 16384), 0x77);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 1024*1024, 4096), 0);
+    check_op_count(cli, 1, 0);
+    assert((long)test_read(cli, 49152, 16384, 0x77, true) == 1);
+    r = test_sync(cli);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 131072), 0);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r);
+
+    // Data read for a hole is dropped if the hole is written during the read
+    assert((long)test_write(cli, 0, 49152, 0x55, NULL, true) == 1);
+    assert((long)test_write(cli, 65536, 65536, 0x55, NULL, true) == 1);
+    assert((long)test_write(cli, 1024*1024, 4096, 0x66, NULL, true) == 1);
+    check_op_count(cli, 1, 2);
+    assert((long)test_write(cli, 49152, 4096, 0x88, NULL, true) == 1);
+    pretend_read_completed(cli, find_op(cli, 1, OSD_OP_READ, 49152, 16384), 0x77);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 1024*1024, 4096), 0);
+    check_op_count(cli, 1, 0);
+    assert((long)test_read(cli, 49152, 4096, 0x88, true) == 1);
+    r = test_sync(cli);
+    check_op_count(cli, 1, 2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 53248), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 65536, 65536), 0);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r);
+
+    // Holes aren't read when there's nothing else to flush and the run is flushed right away
+    assert((long)test_write(cli, 0, 49152, 0x55, NULL, true) == 1);
+    assert((long)test_write(cli, 65536, 32768, 0x55, NULL, true) == 1);
+    check_op_count(cli, 1, 0);
+    assert((long)test_write(cli, 114688, 16384, 0x55, NULL, true) == 1);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 0, 49152), 0);
+    check_op_count(cli, 1, 0);
+    r = test_sync(cli);
+    check_op_count(cli, 1, 2);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 65536, 32768), 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_WRITE, 114688, 16384), 0);
+    check_op_count(cli, 1, 1);
+    can_complete(r);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_SYNC, 0, 0), 0);
+    check_completed(r);
+
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] writeback gap filling test\n");
+}
+
+static void complete_quietly(cluster_client_t *cli, osd_op_t *op)
+{
+    cli->msgr.clients[op->client_id]->sent_ops.erase(op->req.hdr.id);
+    op->reply.hdr.magic = SECONDARY_OSD_REPLY_MAGIC;
+    op->reply.hdr.id = op->req.hdr.id;
+    op->reply.hdr.opcode = op->req.hdr.opcode;
+    op->reply.hdr.retval = op->req.hdr.opcode == OSD_OP_SYNC ? 0 : op->req.rw.len;
+    std::function<void(osd_op_t*)>(op->callback)(op);
+}
+
+// Keep <qd> writes in flight with a SYNC after every <sync_every> writes and complete them
+// in random order, checking that SYNCs are only sent after all previous writes are done
+static void bench_queue(int qd, int total, int sync_every)
+{
+    json11::Json config = json11::Json::object {
+        { "client_max_dirty_bytes", 1024*1024*1024 },
+        { "client_max_dirty_ops", 1024*1024 },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    void *buf = malloc_or_die(4096);
+    memset(buf, 0x55, 4096);
+    int submitted = 0, writes_submitted = 0, writes_done = 0, done = 0, inflight = 0;
+    std::function<void()> submit = [&]()
+    {
+        while (inflight < qd && submitted < total)
+        {
+            cluster_op_t *op = new cluster_op_t();
+            if (sync_every && (submitted % (sync_every+1)) == sync_every)
+            {
+                int writes_before = writes_submitted;
+                op->opcode = OSD_OP_SYNC;
+                op->callback = [&, writes_before](cluster_op_t *op)
+                {
+                    assert(op->retval == 0);
+                    assert(writes_done >= writes_before);
+                    inflight--;
+                    done++;
+                    delete op;
+                };
+            }
+            else
+            {
+                op->opcode = OSD_OP_WRITE;
+                op->inode = 0x1000000000001;
+                op->offset = (uint64_t)(submitted % 1024) * 4096;
+                op->len = 4096;
+                op->iov.push_back(buf, 4096);
+                op->callback = [&](cluster_op_t *op)
+                {
+                    assert(op->retval == op->len);
+                    inflight--;
+                    writes_done++;
+                    done++;
+                    delete op;
+                };
+                writes_submitted++;
+            }
+            submitted++;
+            inflight++;
+            cli->execute(op);
+        }
+    };
+    timespec tv_begin, tv_end;
+    clock_gettime(CLOCK_MONOTONIC, &tv_begin);
+    submit();
+    osd_client_t *cl = cli->msgr.osd_peers.at(1);
+    while (done < total)
+    {
+        assert(cl->sent_ops.size() > 0);
+        auto op_it = cl->sent_ops.begin();
+        std::advance(op_it, rand() % cl->sent_ops.size());
+        osd_op_t *op = op_it->second;
+        if (op->req.hdr.opcode == OSD_OP_SYNC)
+        {
+            // All writes sent before this SYNC should be completed by now
+            for (auto & other: cl->sent_ops)
+                assert(other.second->req.hdr.opcode != OSD_OP_WRITE || other.first > op_it->first);
+        }
+        complete_quietly(cli, op);
+        submit();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tv_end);
+    uint64_t us = (tv_end.tv_sec-tv_begin.tv_sec)*1000000 + (tv_end.tv_nsec-tv_begin.tv_nsec)/1000;
+    printf("qd %d, sync every %d writes: %d ops in %ju us (%.2f us/op)\n", qd, sync_every, total, us, (double)us/total);
+    free(buf);
+    delete cli;
+    delete tfd;
+}
+
+// Random 4K writes with write-back enabled and <dirty_mb> MB of buffered data,
+// with an fsync after every 2*<dirty_mb> MB and flushes completed out of order
+static void bench_writeback(int dirty_mb, int total)
+{
+    uint64_t dirty_limit = (uint64_t)dirty_mb*1024*1024;
+    json11::Json config = json11::Json::object {
+        { "client_enable_writeback", true },
+        { "client_writeback_allowed", true },
+        { "client_max_buffered_bytes", dirty_limit },
+        { "client_max_buffered_ops", dirty_limit/4096 },
+        { "client_max_writeback_iodepth", 256 },
+        { "client_max_dirty_bytes", 1024*1024*1024 },
+        { "client_max_dirty_ops", 1024*1024 },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    void *buf = malloc_or_die(4096);
+    memset(buf, 0x55, 4096);
+    osd_client_t *cl = cli->msgr.osd_peers.at(1);
+    int sync_every = 2*dirty_limit/4096;
+    srand(1);
+    timespec tv_begin, tv_end;
+    clock_gettime(CLOCK_MONOTONIC, &tv_begin);
+    for (int i = 0; i < total; i++)
+    {
+        cluster_op_t *op = new cluster_op_t();
+        bool done = false;
+        if (i % sync_every == sync_every-1)
+            op->opcode = OSD_OP_SYNC;
+        else
+        {
+            op->opcode = OSD_OP_WRITE;
+            op->inode = 0x1000000000001;
+            op->offset = (uint64_t)(rand() % (1024*1024)) * 4096;
+            op->len = 4096;
+            op->iov.push_back(buf, 4096);
+        }
+        op->callback = [&](cluster_op_t *op)
+        {
+            assert(op->retval == op->len);
+            done = true;
+            delete op;
+        };
+        cli->execute(op);
+        while (!done || cl->sent_ops.size() > 64)
+        {
+            // Hash map order is effectively random
+            assert(cl->sent_ops.size() > 0);
+            complete_quietly(cli, cl->sent_ops.begin()->second);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tv_end);
+    uint64_t us = (tv_end.tv_sec-tv_begin.tv_sec)*1000000 + (tv_end.tv_nsec-tv_begin.tv_nsec)/1000;
+    printf("writeback %d MB: %d ops in %ju us (%.2f us/op)\n", dirty_mb, total, us, (double)us/total);
+    free(buf);
+    delete cli;
+    delete tfd;
+}
+
+// Sequential 4K writes skipping every <skip_every>-th block, reports OSD operations used to flush them
+static void bench_writeback_stream(int dirty_mb, int total, int skip_every, int max_gap)
+{
+    uint64_t dirty_limit = (uint64_t)dirty_mb*1024*1024;
+    json11::Json config = json11::Json::object {
+        { "client_enable_writeback", true },
+        { "client_writeback_allowed", true },
+        { "client_max_buffered_bytes", dirty_limit },
+        { "client_max_buffered_ops", 1024 },
+        { "client_max_writeback_iodepth", 256 },
+        { "client_max_dirty_bytes", 1024*1024*1024 },
+        { "client_max_dirty_ops", 1024*1024 },
+        { "client_writeback_max_gap", max_gap },
+    };
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    configure_single_pg_pool(cli);
+    pretend_connected(cli, 1);
+    void *buf = malloc_or_die(4096);
+    memset(buf, 0x55, 4096);
+    osd_client_t *cl = cli->msgr.osd_peers.at(1);
+    int sync_every = 2*dirty_limit/4096;
+    uint64_t writes = 0, full_writes = 0, written = 0, reads = 0;
+    auto complete = [&]()
+    {
+        osd_op_t *op = cl->sent_ops.begin()->second;
+        if (op->req.hdr.opcode == OSD_OP_WRITE)
+        {
+            writes++;
+            written += op->req.rw.len;
+            if (op->req.rw.len == 128*1024 && !(op->req.rw.offset % (128*1024)))
+                full_writes++;
+        }
+        else if (op->req.hdr.opcode == OSD_OP_READ)
+            reads++;
+        complete_quietly(cli, op);
+    };
+    uint64_t block = 0;
+    for (int i = 0; i < total; i++)
+    {
+        cluster_op_t *op = new cluster_op_t();
+        bool done = false;
+        if (i % sync_every == sync_every-1)
+            op->opcode = OSD_OP_SYNC;
+        else
+        {
+            if (skip_every && block % skip_every == skip_every-1)
+                block++;
+            op->opcode = OSD_OP_WRITE;
+            op->inode = 0x1000000000001;
+            op->offset = block * 4096;
+            op->len = 4096;
+            op->iov.push_back(buf, 4096);
+            block++;
+        }
+        op->callback = [&](cluster_op_t *op)
+        {
+            assert(op->retval == op->len);
+            done = true;
+            delete op;
+        };
+        cli->execute(op);
+        while (!done || cl->sent_ops.size() > 64)
+        {
+            assert(cl->sent_ops.size() > 0);
+            complete();
+        }
+    }
+    while (cl->sent_ops.size() > 0)
+    {
+        complete();
+    }
+    printf("stream %d MB, skip every %d, max gap %d: %ju OSD writes (%ju full objects, avg %ju bytes), %ju reads\n",
+        dirty_mb, skip_every, max_gap, writes, full_writes, writes ? written/writes : 0, reads);
+    free(buf);
+    delete cli;
+    delete tfd;
+}
+
 int main(int narg, char *args[])
 {
+    if (narg >= 3 && !strcmp(args[1], "bench_queue"))
+    {
+        // Not run by default: test_cluster_client bench_queue <qd> [ops] [sync_every]
+        bench_queue(atoi(args[2]), narg >= 4 ? atoi(args[3]) : 100000, narg >= 5 ? atoi(args[4]) : 32);
+        return 0;
+    }
+    if (narg >= 3 && !strcmp(args[1], "bench_writeback"))
+    {
+        // Not run by default: test_cluster_client bench_writeback <dirty_mb> [ops]
+        bench_writeback(atoi(args[2]), narg >= 4 ? atoi(args[3]) : 100000);
+        return 0;
+    }
+    if (narg >= 3 && !strcmp(args[1], "bench_writeback_stream"))
+    {
+        // Not run by default: test_cluster_client bench_writeback_stream <dirty_mb> [ops] [skip_every] [max_gap]
+        bench_writeback_stream(atoi(args[2]), narg >= 4 ? atoi(args[3]) : 100000,
+            narg >= 5 ? atoi(args[4]) : 0, narg >= 6 ? atoi(args[5]) : 0);
+        return 0;
+    }
     test1();
     test2();
     test_writeback();
+    test_immediate_commit();
     test_writeback_merge();
+    test_writeback_gaps();
+    test_read_cache();
+    test_readahead();
+    bench_queue(256, 10000, 32);
+    printf("[ok] queue depth test\n");
     return 0;
 }
@@ -1,18 +1,212 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 (see README.md for details)
 
+// USAGE:
+// test_crc32 < FILE - calculate crc32c of the input
+// test_crc32 bench [SIZE_MB] - check all available implementations against each other
+//   and measure their throughput on 4 KB, 128 KB and 1 MB buffers and on 4 KB checksum blocks
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
+
+#include <vector>
 
 #undef WITH_ISAL
 #include "malloc_or_die.h"
 #include "errno.h"
 #include "crc32c.c"
 
+struct crc32c_impl_t
+{
+    const char *name;
+    crc32c_fn_t fn;
+};
+
+static std::vector<crc32c_impl_t> get_impls()
+{
+    std::vector<crc32c_impl_t> impls;
+    impls.push_back({ "sw", crc32c_sw });
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        impls.push_back({ "sse4.2", crc32c_hw });
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul"))
+        impls.push_back({ "pclmul", crc32c_pclmul });
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul") &&
+        __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("vpclmulqdq"))
+        impls.push_back({ "vpclmul", crc32c_vpclmul });
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        impls.push_back({ "armv8", crc32c_arm });
+#endif
+    return impls;
+}
+
+static void check(const std::vector<crc32c_impl_t> & impls)
+{
+    const int maxlen = 70000;
+    uint8_t *buf = (uint8_t*)malloc_or_die(maxlen+64);
+    for (int i = 0; i < maxlen+64; i++)
+        buf[i] = rand();
+    for (int len = 0; len < maxlen; len = len < 1100 ? len+1 : len*5/4)
+    {
+        for (int off = 0; off < 64; off += (len < 1100 ? 7 : 13))
+        {
+            uint32_t init = rand();
+            uint32_t ref = crc32c_sw(init, buf+off, len);
+            for (auto & impl: impls)
+            {
+                uint32_t r = impl.fn(init, buf+off, len);
+                if (r != ref)
+                {
+                    printf("%s: crc32c mismatch at len=%d off=%d: %08x != %08x\n", impl.name, len, off, r, ref);
+                    exit(1);
+                }
+            }
+            // Check combine and zero padding
+            int split = len ? rand() % len : 0;
+            uint32_t a = crc32c(init, buf+off, split);
+            uint32_t b = crc32c(0, buf+off+split, len-split);
+            if (crc32c_combine(a, b, len-split) != ref)
+            {
+                printf("crc32c_combine mismatch at len=%d split=%d\n", len, split);
+                exit(1);
+            }
+            memset(buf+maxlen, 0, 64);
+            if (crc32c_append_zeros(ref, 64-off) != crc32c_sw(ref, buf+maxlen, 64-off))
+            {
+                printf("crc32c_append_zeros mismatch at len=%d\n", 64-off);
+                exit(1);
+            }
+        }
+    }
+    // Check multi-buffer calculation
+    for (int len = 0; len < 9000; len = len*3/2+1)
+    {
+        const uint8_t *bufs[7];
+        uint32_t crcs[7], ref[7];
+        for (int i = 0; i < 7; i++)
+        {
+            bufs[i] = buf + (rand() % (maxlen-len));
+            crcs[i] = rand();
+            ref[i] = crc32c_sw(crcs[i], bufs[i], len);
+        }
+        crc32c_multi(crcs, bufs, 7, len);
+        if (memcmp(crcs, ref, sizeof(crcs)) != 0)
+        {
+            printf("crc32c_multi mismatch at len=%d\n", len);
+            exit(1);
+        }
+    }
+    // crc32c_pad must be the same as hashing real zeroes
+    uint8_t *padded = (uint8_t*)calloc_or_die(3*65536, 1);
+    for (int len = 1; len <= 65536; len *= 4)
+    {
+        memcpy(padded+len, buf, len);
+        uint32_t ref = crc32c_sw(0, padded, 3*len);
+        if (crc32c_pad(0, buf, len, len, len) != ref)
+        {
+            printf("crc32c_pad mismatch at len=%d\n", len);
+            exit(1);
+        }
+        memset(padded+len, 0, len);
+    }
+    free(padded);
+    free(buf);
+    printf("OK\n");
+}
+
+static double now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000.0 + ts.tv_nsec;
+}
+
+static void bench(const std::vector<crc32c_impl_t> & impls, size_t total)
+{
+    size_t sizes[] = { 4096, 128*1024, 1024*1024 };
+    uint8_t *buf = (uint8_t*)malloc_or_die(1024*1024);
+    for (size_t i = 0; i < 1024*1024; i++)
+        buf[i] = rand();
+    for (size_t size: sizes)
+    {
+        for (auto & impl: impls)
+        {
+            size_t iters = total/size;
+            uint32_t r = 0;
+            double start = now_ns();
+            for (size_t i = 0; i < iters; i++)
+                r = impl.fn(r, buf, size);
+            double elapsed = now_ns() - start;
+            printf("%-8s %8zu bytes: %8.2f GB/s (%08x)\n", impl.name, size, (double)iters*size/elapsed, r);
+        }
+    }
+    // 4 KB checksum blocks of a large buffer, as in blockstore reads
+    const int nblocks = 256;
+    const uint8_t *bufs[nblocks];
+    uint32_t crcs[nblocks];
+    for (int i = 0; i < nblocks; i++)
+        bufs[i] = buf + i*4096;
+    for (auto & impl: impls)
+    {
+        size_t iters = total/4096/nblocks;
+        double start = now_ns();
+        for (size_t i = 0; i < iters; i++)
+            for (int j = 0; j < nblocks; j++)
+                crcs[j] = impl.fn(0, bufs[j], 4096);
+        double elapsed = now_ns() - start;
+        printf("%-8s %8d blocks: %8.2f GB/s (%08x)\n", impl.name, nblocks, (double)iters*nblocks*4096/elapsed, crcs[nblocks-1]);
+    }
+    {
+        size_t iters = total/4096/nblocks;
+        double start = now_ns();
+        for (size_t i = 0; i < iters; i++)
+        {
+            memset(crcs, 0, sizeof(crcs));
+            crc32c_multi(crcs, bufs, nblocks, 4096);
+        }
+        double elapsed = now_ns() - start;
+        printf("%-8s %8d blocks: %8.2f GB/s (%08x)\n", "multi", nblocks, (double)iters*nblocks*4096/elapsed, crcs[nblocks-1]);
+    }
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        size_t iters = total/4096/nblocks;
+        double start = now_ns();
+        for (size_t i = 0; i < iters; i++)
+        {
+            memset(crcs, 0, sizeof(crcs));
+            for (int j = 0; j < nblocks; j += 4)
+                crc32c_hw_x4(crcs+j, bufs+j, 4096);
+        }
+        double elapsed = now_ns() - start;
+        printf("%-8s %8d blocks: %8.2f GB/s (%08x)\n", "sse4.2x4", nblocks, (double)iters*nblocks*4096/elapsed, crcs[nblocks-1]);
+    }
+#endif
+    // Zero padding of a 4 KB block which is done for unwritten parts of checksum blocks
+    size_t iters = total/4096;
+    uint32_t r = 0;
+    double start = now_ns();
+    for (size_t i = 0; i < iters; i++)
+        r = crc32c_append_zeros(r, 4096);
+    printf("%-8s %8d bytes: %8.1f ns/op (%08x)\n", "zeros", 4096, (now_ns() - start)/iters, r);
+    free(buf);
+}
+
 int main(int narg, char *args[])
 {
+    if (narg > 1 && !strcmp(args[1], "bench"))
+    {
+        size_t total_mb = narg > 2 ? strtoull(args[2], NULL, 10) : 1024;
+        auto impls = get_impls();
+        check(impls);
+        bench(impls, (total_mb ? total_mb : 1024) * 1024*1024);
+        return 0;
+    }
     int bufsize = 65536;
     uint8_t *buf = (uint8_t*)malloc_or_die(bufsize);
     uint32_t csum = 0;
@@ -5,6 +5,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+
+#include <algorithm>
+
 #include "../util/malloc_or_die.h"
 #include "../util/allocator.h"
 #include "blockstore_heap.h"
@@ -2687,10 +2691,377 @@ void test_postpone_load()
     }
 }
 
+void test_batch_csums(uint32_t csum_block_size)
+{
+    blockstore_disk_t dsk;
+    _test_init(dsk, true, [&](std::map<std::string, std::string> & config)
+    {
+        config["csum_block_size"] = std::to_string(csum_block_size);
+    });
+    std::vector<uint8_t> buffer_area(dsk.journal_device_size);
+    blockstore_heap_t heap(&dsk, buffer_area.data());
+
+    const uint32_t block_size = dsk.data_block_size;
+    const uint32_t csum_count = block_size/csum_block_size;
+    std::vector<uint8_t> data(block_size);
+    for (uint32_t i = 0; i < block_size; i++)
+        data[i] = rand();
+    uint8_t bitmap[dsk.clean_entry_bitmap_size];
+    memset(bitmap, 0xff, dsk.clean_entry_bitmap_size);
+    // Some holes to test partial blocks
+    bitmap_clear(bitmap, 4096, 4096, dsk.bitmap_granularity);
+    bitmap_clear(bitmap, 3*csum_block_size+8192, 4096, dsk.bitmap_granularity);
+
+    // Reference checksums, calculated with a single range
+    std::vector<uint32_t> ref(csum_count);
+    assert(heap.calc_block_checksums(ref.data(), data.data(), bitmap, 0, block_size, true, NULL));
+    for (uint32_t i = 0; i < csum_count; i++)
+    {
+        bool full = true;
+        for (uint32_t pos = i*csum_block_size; pos < (i+1)*csum_block_size; pos += dsk.bitmap_granularity)
+            full = full && (bitmap[pos/dsk.bitmap_granularity/8] & (1 << (pos/dsk.bitmap_granularity % 8)));
+        if (full)
+            assert(ref[i] == crc32c(0, data.data()+i*csum_block_size, csum_block_size));
+    }
+
+    // Same with 2 ranges split into iovecs at unaligned offsets
+    std::vector<uint32_t> csums(csum_count);
+    uint32_t split = 2*csum_block_size;
+    struct iovec iov[5] = {
+        { data.data(), 1000 },
+        { data.data()+1000, split-1000 },
+        { data.data()+split, 3*4096+123 },
+        { data.data()+split+3*4096+123, csum_block_size-123 },
+        { data.data()+split+3*4096+csum_block_size, block_size-split-3*4096-csum_block_size },
+    };
+    heap_csum_range_t ranges[2] = {
+        { .block_csums = csums.data(), .bitmap = bitmap, .start = 0, .end = split, .iov = iov, .iovcnt = 2 },
+        { .block_csums = csums.data()+split/csum_block_size, .bitmap = bitmap, .start = split, .end = block_size, .iov = iov+2, .iovcnt = 3 },
+    };
+    assert(heap.calc_block_checksums(ranges, 2, true, NULL));
+    assert(csums == ref);
+    assert(heap.calc_block_checksums(ranges, 2, false, NULL));
+
+    // Corrupt 2 blocks and check that both are reported
+    data[2*csum_block_size+5] ^= 1;
+    data[block_size-1] ^= 1;
+    std::vector<uint32_t> bad;
+    assert(!heap.calc_block_checksums(ranges, 2, false, [&](int range_idx, uint32_t pos, uint32_t expected, uint32_t real)
+    {
+        assert(expected != real);
+        assert(range_idx == (pos < split ? 0 : 1));
+        bad.push_back(pos);
+    }));
+    std::sort(bad.begin(), bad.end());
+    assert(bad.size() == 2);
+    assert(bad[0] == 2*csum_block_size && bad[1] == block_size-csum_block_size);
+
+    printf("OK test_batch_csums %u\n", csum_block_size);
+}
+
+void test_big_inode_index()
+{
+    blockstore_disk_t dsk;
+    _test_init(dsk, false);
+    dsk.data_device_size = (uint64_t)4*1024*1024*1024;
+    dsk.meta_device_size = 16*1024*1024;
+    dsk.calc_lengths(true);
+    std::vector<uint8_t> buffer_area(dsk.journal_device_size);
+    const uint64_t count = 5000;
+
+    {
+        blockstore_heap_t heap(&dsk, buffer_area.data());
+        heap.finish_recheck();
+        // list_item_overhead() of a big_write entry
+        const uint64_t item_size = (heap.get_big_entry_size() + sizeof(heap_list_item_t) - sizeof(heap_entry_t) + sizeof(void*) + 15) & ~15;
+
+        // Insert objects with even stripe numbers in random order
+        for (uint64_t i = 0; i < count; i++)
+        {
+            uint64_t n = (i*7919) % count;
+            _test_big_write(heap, dsk, 1, n*2*0x20000, 1, n*0x20000, true, 0, 0, buffer_area.data(), UINT32_MAX);
+        }
+        for (uint64_t n = 0; n < count*2; n++)
+        {
+            heap_entry_t *obj = heap.read_entry((object_id){ .inode = INODE_WITH_POOL(1, 1), .stripe = n*0x20000 });
+            assert(!(n % 2) == !!obj);
+            assert(!obj || obj->stripe == n*0x20000);
+        }
+        // Index memory is included in live memory. A hash set is at least 44% full
+        assert(heap.get_live_entries() == count);
+        uint64_t index_memory = heap.get_live_memory() - count*item_size;
+        assert(index_memory >= count*(sizeof(void*)+1) && index_memory < 3*count*(sizeof(void*)+1));
+
+        // Sparse and unaligned stripes in another inode
+        for (uint64_t n = 0; n < count/2; n++)
+        {
+            uint64_t stripe = n*n*0x20000 + (n % 8)*0x1000;
+            _test_big_write(heap, dsk, 2, stripe, 1, (2*count+n)*0x20000, true, 0, 0, buffer_area.data(), UINT32_MAX);
+        }
+        for (uint64_t n = 0; n < count/2; n++)
+        {
+            uint64_t stripe = n*n*0x20000 + (n % 8)*0x1000;
+            heap_entry_t *obj = heap.read_entry((object_id){ .inode = INODE_WITH_POOL(1, 2), .stripe = stripe });
+            assert(obj && obj->stripe == stripe);
+            assert(!heap.read_entry((object_id){ .inode = INODE_WITH_POOL(1, 2), .stripe = stripe+1 }));
+        }
+
+        // Overwrite some of them
+        for (uint64_t n = 0; n < count; n += 3)
+        {
+            _test_big_write(heap, dsk, 1, n*2*0x20000, 2, (count+n)*0x20000, true, 0, 0, buffer_area.data(), UINT32_MAX);
+        }
+        // Delete some of them
+        for (uint64_t n = 1; n < count; n += 2)
+        {
+            uint32_t mblock = 0;
+            heap_entry_t *obj = heap.read_entry((object_id){ .inode = INODE_WITH_POOL(1, 1), .stripe = n*2*0x20000 });
+            assert(obj);
+            int res = heap.add_delete(obj, &mblock);
+            assert(res == 0);
+            heap.start_block_write(mblock);
+            heap.complete_block_write(mblock);
+        }
+        // Some deletions should be already removed from the index by GC
+        assert(heap.get_live_entries() < count + count/3);
+
+        for (uint64_t n = 0; n < count; n++)
+        {
+            heap_entry_t *obj = heap.read_entry((object_id){ .inode = INODE_WITH_POOL(1, 1), .stripe = n*2*0x20000 });
+            if (n % 2)
+                assert(!obj || (obj->entry_type & ~BS_HEAP_GARBAGE) == (BS_HEAP_DELETE|BS_HEAP_STABLE));
+            else
+                assert(obj && obj->version == (n % 3 ? 1 : 2));
+        }
+
+        // Reshard in chunks
+        void *st = heap.reshard_start(1, 4, 0x20000, 1000);
+        assert(st != NULL);
+        while (!heap.reshard_continue(st, 1000)) {}
+        for (uint64_t n = 0; n < count; n += 2)
+        {
+            heap_entry_t *obj = heap.read_entry((object_id){ .inode = INODE_WITH_POOL(1, 1), .stripe = n*2*0x20000 });
+            assert(obj && obj->version == (n % 3 ? 1 : 2));
+        }
+        size_t total = 0;
+        for (uint32_t pg_num = 1; pg_num <= 4; pg_num++)
+        {
+            obj_ver_id *listing = NULL;
+            size_t stable_count = 0, unstable_count = 0;
+            int res = heap.list_objects(pg_num, (object_id){ .inode = INODE_WITH_POOL(1, 1) },
+                (object_id){ .inode = INODE_WITH_POOL(1, 1), .stripe = UINT64_MAX }, &listing, &stable_count, &unstable_count);
+            assert(res == 0);
+            total += stable_count;
+            free(listing);
+        }
+        assert(total >= count/2);
+    }
+
+    printf("OK test_big_inode_index\n");
+}
+
+void test_parallel_load()
+{
+    blockstore_disk_t dsk;
+    _test_init(dsk, false);
+    std::vector<uint8_t> buffer_area(dsk.journal_device_size);
+    std::vector<uint8_t> image;
+    const uint64_t obj_count = 2000;
+
+    {
+        // Make an image with 2 versions of every object, every 7th object is also deleted,
+        // entries of the same object are scattered over different blocks
+        blockstore_heap_t heap(&dsk, buffer_area.data());
+        uint32_t big_size = heap.get_big_entry_size();
+        uint32_t del_size = heap.get_simple_entry_size();
+        std::vector<heap_entry_t*> entries;
+        for (uint64_t i = 0; i < obj_count*3; i++)
+        {
+            uint64_t obj = i % obj_count, ver = i / obj_count + 1;
+            bool del = (ver == 3);
+            if (del && (obj % 7))
+                continue;
+            heap_entry_t *wr = (heap_entry_t*)malloc_or_die(del ? del_size : big_size);
+            memset(wr, 0, del ? del_size : big_size);
+            wr->size = del ? del_size : big_size;
+            wr->entry_type = (del ? BS_HEAP_DELETE : BS_HEAP_BIG_WRITE)|BS_HEAP_STABLE;
+            wr->lsn = i+1;
+            wr->inode = INODE_WITH_POOL(1, 1 + (obj % 3));
+            wr->stripe = (obj / 3) * dsk.data_block_size;
+            wr->version = ver;
+            if (!del)
+            {
+                wr->set_big_location(&heap, i * dsk.data_block_size);
+                memset(wr->get_ext_bitmap(&heap), 0xff, dsk.clean_entry_bitmap_size);
+                memset(wr->get_int_bitmap(&heap), 0xff, dsk.clean_entry_bitmap_size);
+            }
+            wr->crc32c = wr->calc_crc32c();
+            entries.push_back(wr);
+        }
+        for (size_t i = 0; i < entries.size(); i++)
+            std::swap(entries[i], entries[(i * 0x9E3779B1) % entries.size()]);
+        uint32_t used = dsk.meta_block_size;
+        for (auto wr: entries)
+        {
+            if (used+wr->size > dsk.meta_block_size)
+            {
+                if (image.size())
+                    heap.fill_block_empty_space(image.data() + image.size() - dsk.meta_block_size, used);
+                image.resize(image.size() + dsk.meta_block_size);
+                used = 0;
+            }
+            memcpy(image.data() + image.size() - dsk.meta_block_size + used, wr, wr->size);
+            used += wr->size;
+            free(wr);
+        }
+        heap.fill_block_empty_space(image.data() + image.size() - dsk.meta_block_size, used);
+    }
+
+    std::vector<std::vector<uint64_t>> objects[3];
+    std::vector<uint32_t> modified[3];
+    uint64_t stats[3][4];
+    for (int n = 0; n < 3; n++)
+    {
+        std::vector<uint8_t> buf = image;
+        blockstore_heap_t heap(&dsk, buffer_area.data());
+        // 1 thread, 4 threads, 4 threads with indexing in several batches
+        heap.set_load_threads(n == 0 ? 1 : 4, n == 2 ? 1000 : 0);
+        uint64_t entries_loaded = 0, total = 0;
+        // Load in several parts like blockstore_init does
+        uint64_t part_size = 4*dsk.meta_block_size;
+        for (uint64_t pos = 0; pos < buf.size(); pos += part_size)
+        {
+            int r = heap.load_blocks(pos, buf.size()-pos < part_size ? buf.size()-pos : part_size, buf.data()+pos, false, entries_loaded);
+            assert(r == 0);
+            total += entries_loaded;
+        }
+        heap.finish_load();
+        bool done = heap.recheck_small_writes([&](bool, uint64_t, uint64_t, uint8_t*, std::function<void()> cb) {}, 1);
+        assert(done);
+        assert(heap.finish_recheck() == 0);
+        modified[n] = heap.get_recheck_modified_blocks();
+        assert(total == obj_count*2 + (obj_count+6)/7);
+        heap.iterate_objects([&](heap_entry_t *obj, uint32_t block_num)
+        {
+            std::vector<uint64_t> lsns = { obj->inode, obj->stripe };
+            for (auto wr = obj; wr; wr = heap.prev(wr))
+                lsns.push_back(wr->lsn | (wr->is_garbage() ? GARBAGE_BIT : 0));
+            objects[n].push_back(lsns);
+        });
+        std::sort(objects[n].begin(), objects[n].end());
+        stats[n][0] = heap.get_live_entries();
+        stats[n][1] = heap.get_garbage_entries();
+        stats[n][2] = heap.get_meta_used_space();
+        stats[n][3] = heap.get_data_used_space();
+    }
+    for (int n = 1; n < 3; n++)
+    {
+        assert(objects[0] == objects[n]);
+        assert(modified[0] == modified[n]);
+        assert(!memcmp(stats[0], stats[n], sizeof(stats[0])));
+    }
+    // Only the latest version of every object stays live, some deletions stay as single garbage entries
+    assert(stats[0][0] == obj_count - (obj_count+6)/7);
+    assert(stats[0][0] + stats[0][1] == objects[0].size());
+    assert(stats[0][3] == stats[0][0] * dsk.data_block_size);
+
+    printf("OK test_parallel_load\n");
+}
+
 // FIXME: Add a test for big_intent, incl. explicit_complete with big_intent over big_write over deletion over big_write :)
 
+static uint64_t bench_elapsed_us(const timespec & since)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec-since.tv_sec)*1000000 + (now.tv_nsec-since.tv_nsec)/1000;
+}
+
+// Load a synthetic metadata image with <count> big_write entries, like OSD does on start
+void bench_load(uint64_t count, int threads)
+{
+    blockstore_disk_t dsk;
+    _test_init(dsk, true);
+    dsk.data_device_size = (count+1) * dsk.data_block_size;
+    dsk.meta_device_size = 1024*1024*1024;
+    dsk.calc_lengths(true);
+    const uint64_t buf_size = 4*1024*1024;
+    std::vector<uint8_t> buffer_area(dsk.journal_device_size);
+    timespec tv_begin;
+    uint8_t *image = NULL;
+    uint64_t image_size = 0;
+    {
+        blockstore_heap_t heap(&dsk, buffer_area.data());
+        uint32_t entry_size = heap.get_big_entry_size();
+        uint64_t per_block = dsk.meta_block_size / entry_size;
+        image_size = (count + per_block-1) / per_block * dsk.meta_block_size;
+        image_size = (image_size + buf_size-1) / buf_size * buf_size;
+        if (image_size > dsk.meta_area_size-dsk.meta_block_size)
+        {
+            fprintf(stderr, "Too many entries, %ju bytes of metadata don't fit into %ju\n", image_size, dsk.meta_area_size);
+            exit(1);
+        }
+        image = (uint8_t*)malloc_or_die(image_size);
+        printf("generating %ju entries in %ju MB of metadata\n", count, image_size/1024/1024);
+        uint64_t n = 0;
+        for (uint64_t pos = 0; pos < image_size; pos += dsk.meta_block_size)
+        {
+            uint32_t used = 0;
+            for (; n < count && used+entry_size <= dsk.meta_block_size; n++, used += entry_size)
+            {
+                // Objects of 16 inodes in shuffled order
+                uint64_t obj = (n * 0x9E3779B1) % count;
+                heap_entry_t *wr = (heap_entry_t*)(image + pos + used);
+                memset(wr, 0, entry_size);
+                wr->size = entry_size;
+                wr->entry_type = BS_HEAP_BIG_WRITE|BS_HEAP_STABLE;
+                wr->lsn = n+1;
+                wr->inode = INODE_WITH_POOL(1, 1 + (obj % 16));
+                wr->stripe = (obj / 16) * dsk.data_block_size;
+                wr->version = 1;
+                wr->set_big_location(&heap, n * dsk.data_block_size);
+                memset(wr->get_ext_bitmap(&heap), 0xff, dsk.clean_entry_bitmap_size);
+                memset(wr->get_int_bitmap(&heap), 0xff, dsk.clean_entry_bitmap_size);
+                wr->crc32c = wr->calc_crc32c();
+            }
+            heap.fill_block_empty_space(image + pos, used);
+        }
+    }
+    for (int load_threads: std::vector<int>{ 1, threads })
+    {
+        blockstore_heap_t heap(&dsk, buffer_area.data());
+        heap.set_load_threads(load_threads);
+        clock_gettime(CLOCK_MONOTONIC, &tv_begin);
+        uint64_t loaded = 0, total = 0;
+        for (uint64_t pos = 0; pos < image_size; pos += buf_size)
+        {
+            int r = heap.load_blocks(pos, buf_size, image+pos, false, loaded);
+            assert(r == 0);
+            total += loaded;
+        }
+        uint64_t load_us = bench_elapsed_us(tv_begin);
+        heap.finish_load();
+        uint64_t index_us = bench_elapsed_us(tv_begin);
+        bool done = heap.recheck_small_writes([&](bool, uint64_t, uint64_t, uint8_t*, std::function<void()> cb) {}, 1);
+        assert(done);
+        assert(heap.finish_recheck() == 0);
+        uint64_t total_us = bench_elapsed_us(tv_begin);
+        assert(total == count);
+        assert(heap.get_live_entries() == count);
+        printf("loaded %ju entries in %d thread(s): load_blocks %ju ms (%ju ns/entry), finish_load %ju ms, total %ju ms\n",
+            total, load_threads, load_us/1000, load_us*1000/count, (index_us-load_us)/1000, total_us/1000);
+    }
+    free(image);
+}
+
 int main(int narg, char *args[])
 {
+    if (narg >= 3 && !strcmp(args[1], "bench_load"))
+    {
+        // Not run by default: test_heap bench_load <entries> [threads]
+        bench_load(strtoull(args[2], NULL, 10), narg >= 4 ? atoi(args[3]) : 4);
+        return 0;
+    }
     test_mvcc(false);
     test_mvcc(true);
     test_update(true);
@@ -2713,6 +3084,7 @@ int main(int narg, char *args[])
     test_full_overwrite(false);
     test_reshard_list();
     test_reshard_chunked();
+    test_big_inode_index();
     test_destructor_mvcc();
     test_rollback();
     test_alloc_buffer();
@@ -2725,5 +3097,8 @@ int main(int narg, char *args[])
     test_explicit_complete();
     test_skip_double_claim();
     test_postpone_load();
+    test_parallel_load();
+    test_batch_csums(4096);
+    test_batch_csums(32768);
     return 0;
 }
@@ -0,0 +1,426 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Checks routing of NVMe passthrough and polled requests using a temporary file
+// in the current directory and /dev/null in place of the NVMe char device
+// (it completes commands without transferring any data since Linux 6.x).
+// Measures allocations and time per I/O for different ring_data_t completion callbacks
+// using no-op io_uring requests.
+// With FILE, also measures random 4 KB O_DIRECT reads from FILE at queue depth 128
+// with and without registered files and buffers, and with polled completions.
+// With NVME_CHAR_DEV (/dev/ngXnY of the namespace opened as FILE), also measures
+// the same reads submitted as NVMe passthrough commands.
+// USAGE: test_ringloop [N_OPS] [FILE [NVME_CHAR_DEV]]
+
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/nvme_ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+#include <string.h>
+#include <malloc.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include "ringloop.h"
+#include "buffer_pool.h"
+
+static uint64_t alloc_count = 0;
+
+void* operator new(size_t size)
+{
+    alloc_count++;
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t size) noexcept
+{
+    free(ptr);
+}
+
+struct bench_t
+{
+    ring_loop_t *ringloop;
+    uint64_t done = 0, sum = 0;
+    uint64_t ctx[4] = { 1, 2, 3, 4 };
+
+    void handle(ring_data_t *data, uint64_t *arg)
+    {
+        done++;
+        sum += *arg + data->res;
+    }
+
+    // mode 0: std::function capturing 2 pointers (fits into std::function internal buffer)
+    // mode 1: std::function capturing 4 pointers (like [this, op, buf, len])
+    // mode 2: set_callback()
+    void prepare(int mode, uint64_t *arg)
+    {
+        io_uring_sqe *sqe = ringloop->get_sqe();
+        assert(sqe);
+        ring_data_t *data = (ring_data_t*)sqe->user_data;
+        io_uring_prep_nop(sqe);
+        if (mode == 0)
+        {
+            data->callback = [this, arg](ring_data_t *data) { handle(data, arg); };
+        }
+        else if (mode == 1)
+        {
+            uint64_t *a1 = ctx+1, *a2 = ctx+2;
+            data->callback = [this, arg, a1, a2](ring_data_t *data) { handle(data, arg); sum += *a1 + *a2; };
+        }
+        else
+        {
+            data->set_callback([](void *self, void *arg, ring_data_t *data)
+            {
+                ((bench_t*)self)->handle(data, (uint64_t*)arg);
+            }, this, arg);
+        }
+    }
+
+    void run(int mode, const char *name, uint64_t n_ops)
+    {
+        const int batch = 256;
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t allocs_start = alloc_count;
+        done = 0;
+        for (uint64_t i = 0; i < n_ops; i += batch)
+        {
+            for (int j = 0; j < batch; j++)
+                prepare(mode, ctx+(j % 4));
+            ringloop->submit();
+            while (done < i+batch)
+            {
+                ringloop->wait();
+                ringloop->loop();
+            }
+        }
+        uint64_t allocs = alloc_count - allocs_start;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec)*1000000000.0 + (end.tv_nsec - start.tv_nsec);
+        printf("%-24s %8.3f allocs/op %8.1f ns/op\n", name, (double)allocs/done, elapsed/done);
+    }
+};
+
+struct file_bench_t
+{
+    ring_loop_t *ringloop;
+    int fd;
+    uint64_t blocks;
+    uint64_t done = 0, errors = 0;
+    iovec iov[128];
+
+    void prepare(int i)
+    {
+        io_uring_sqe *sqe = ringloop->get_sqe();
+        assert(sqe);
+        ring_data_t *data = (ring_data_t*)sqe->user_data;
+        io_uring_prep_readv(sqe, fd, &iov[i], 1, (lrand48() % blocks) * 4096);
+        data->set_callback([](void *self, void *arg, ring_data_t *data)
+        {
+            file_bench_t *b = (file_bench_t*)self;
+            b->done++;
+            if (data->res != 4096)
+                b->errors++;
+            b->prepare((int)(uint64_t)arg);
+        }, this, (void*)(uint64_t)i);
+    }
+
+    void run(const char *name, uint64_t n_ops)
+    {
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        done = errors = 0;
+        for (int i = 0; i < 128; i++)
+            prepare(i);
+        while (done < n_ops)
+        {
+            ringloop->submit();
+            ringloop->wait();
+            ringloop->loop();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        // Drain remaining requests
+        uint64_t target = done + 128;
+        while (done < target)
+        {
+            uint64_t prev = done;
+            ringloop->submit();
+            ringloop->wait();
+            ringloop->loop();
+            if (done == prev)
+                break;
+        }
+        double elapsed = (end.tv_sec - start.tv_sec)*1000000000.0 + (end.tv_nsec - start.tv_nsec);
+        printf("%-24s %8.0f iops %8.1f ns/op%s\n", name, n_ops*1000000000.0/elapsed, elapsed/n_ops, errors ? " (errors)" : "");
+    }
+};
+
+// Read through the ring and return the result, counting event loop passes in <loops>
+static int ring_read(ring_loop_t *ringloop, int fd, void *buf, size_t len, uint64_t offset, uint64_t *loops = NULL)
+{
+    io_uring_sqe *sqe = ringloop->get_sqe();
+    assert(sqe);
+    ring_data_t *data = (ring_data_t*)sqe->user_data;
+    data->iov = (struct iovec){ buf, len };
+    io_uring_prep_readv(sqe, fd, &data->iov, 1, offset);
+    bool done = false;
+    int res = 0;
+    data->callback = [&](ring_data_t *data)
+    {
+        done = true;
+        res = data->res;
+    };
+    ringloop->submit();
+    while (!done)
+    {
+        ringloop->wait();
+        ringloop->loop();
+        if (loops)
+            (*loops)++;
+    }
+    return res;
+}
+
+// Whether /dev/null accepts io_uring commands
+static bool null_uring_cmd = false;
+
+static int open_test_file(const char *path, uint8_t **data, size_t size)
+{
+    int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    assert(fd >= 0);
+    *data = (uint8_t*)malloc(size);
+    for (size_t i = 0; i < size; i++)
+        (*data)[i] = (uint8_t)(i/512 + i);
+    ssize_t r = write(fd, *data, size);
+    assert(r == size);
+    close(fd);
+    fd = open(path, O_RDWR|O_DIRECT);
+    if (fd < 0)
+    {
+        perror("open with O_DIRECT");
+        exit(1);
+    }
+    return fd;
+}
+
+// Aligned reads are converted to NVMe commands for the mapped char device, other reads go to the file
+static void test_passthru()
+{
+    printf("-- test_passthru\n");
+    const size_t size = 1024*1024;
+    uint8_t *data = NULL;
+    int fd = open_test_file("./test_ringloop.bin", &data, size);
+    int null_fd = open("/dev/null", O_RDWR);
+    assert(null_fd >= 0);
+    uint8_t *buf = (uint8_t*)memalign(4096, 256*1024);
+    ring_loop_t *ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false, false);
+    // NVMe commands require 128-byte SQEs
+    assert(ringloop->register_passthru(fd, null_fd, 1, 4096, 128*1024) == -EINVAL);
+    delete ringloop;
+    ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false, true);
+    int r = ringloop->register_passthru(fd, null_fd, 1, 4096, 128*1024);
+    assert(r == 0);
+    memset(buf, 0xff, 4096);
+    r = ring_read(ringloop, fd, buf, 4096, 8192);
+    null_uring_cmd = r >= 0;
+    if (!null_uring_cmd)
+        printf("/dev/null doesn't support io_uring commands: %s\n", strerror(-r));
+    assert(r < 0 || r == 4096 && memcmp(buf, data+8192, 4096) != 0);
+    // Not aligned to the LBA size
+    r = ring_read(ringloop, fd, buf, 512, 512);
+    assert(r == 512 && !memcmp(buf, data+512, 512));
+    // Larger than max_io
+    r = ring_read(ringloop, fd, buf, 256*1024, 0);
+    assert(r == 256*1024 && !memcmp(buf, data, 256*1024));
+    ringloop->unregister_passthru(fd);
+    r = ring_read(ringloop, fd, buf, 4096, 8192);
+    assert(r == 4096 && !memcmp(buf, data+8192, 4096));
+    delete ringloop;
+    free(buf);
+    free(data);
+    close(null_fd);
+    close(fd);
+    unlink("./test_ringloop.bin");
+}
+
+// save() and restore() return SQEs and ring data of 128-byte SQE rings back
+static void test_sqe128_restore()
+{
+    printf("-- test_sqe128_restore\n");
+    ring_loop_t *ringloop = new ring_loop_t(16, false, false);
+    unsigned left = ringloop->space_left();
+    delete ringloop;
+    ringloop = new ring_loop_t(16, false, true);
+    assert(ringloop->space_left() == left);
+    for (int round = 0; round < 2; round++)
+    {
+        unsigned saved = ringloop->save();
+        std::vector<ring_data_t*> datas;
+        for (unsigned i = 0; i < left; i++)
+        {
+            io_uring_sqe *sqe = ringloop->get_sqe();
+            assert(sqe);
+            assert(ringloop->space_left() == left-i-1);
+            datas.push_back((ring_data_t*)sqe->user_data);
+        }
+        ringloop->restore(saved);
+        assert(ringloop->space_left() == left);
+        // The same ring data are reused after restore
+        for (unsigned i = 0; i < left; i++)
+        {
+            io_uring_sqe *sqe = ringloop->get_sqe();
+            assert(std::find(datas.begin(), datas.end(), (ring_data_t*)sqe->user_data) != datas.end());
+        }
+        ringloop->restore(saved);
+    }
+    delete ringloop;
+}
+
+// Polled reads return correct data, and the event loop doesn't spin while waiting for them
+static void test_iopoll()
+{
+    printf("-- test_iopoll\n");
+    const size_t size = 1024*1024;
+    const int n_reads = 1000;
+    uint8_t *data = NULL;
+    int fd = open_test_file("./test_ringloop.bin", &data, size);
+    int null_fd = open("/dev/null", O_RDWR);
+    assert(null_fd >= 0);
+    uint8_t *buf = (uint8_t*)memalign(4096, 4096);
+    ring_loop_t *ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false, true);
+    int r = ringloop->register_iopoll_fd(fd);
+    if (r < 0)
+    {
+        printf("polled I/O is not supported here: %s, skipping\n", strerror(-r));
+    }
+    else
+    {
+        uint64_t loops = 0;
+        for (int i = 0; i < n_reads; i++)
+        {
+            uint64_t offset = (lrand48() % (size/4096)) * 4096;
+            r = ring_read(ringloop, fd, buf, 4096, offset, &loops);
+            assert(r == 4096 && !memcmp(buf, data+offset, 4096));
+        }
+        printf("%d polled reads in %ju loop passes\n", n_reads, loops);
+        assert(loops <= 2*n_reads);
+        // Passthrough commands for /dev/null can't be polled, so they must go to the main ring,
+        // and requests left to the file are still polled
+        r = ringloop->register_passthru(fd, null_fd, 1, 4096, 128*1024);
+        assert(r == 0);
+        memset(buf, 0xff, 4096);
+        r = ring_read(ringloop, fd, buf, 4096, 8192);
+        assert(null_uring_cmd ? (r == 4096 && memcmp(buf, data+8192, 4096) != 0) : r < 0);
+        loops = 0;
+        r = ring_read(ringloop, fd, buf, 512, 512, &loops);
+        assert(r == 512 && !memcmp(buf, data+512, 512));
+        assert(loops <= 2);
+        ringloop->unregister_passthru(fd);
+        ringloop->unregister_iopoll_fd(fd);
+    }
+    delete ringloop;
+    free(buf);
+    free(data);
+    close(null_fd);
+    close(fd);
+    unlink("./test_ringloop.bin");
+}
+
+static void bench_file(const char *path, const char *nvme_path, uint64_t n_ops)
+{
+    int fd = open(path, O_RDONLY|O_DIRECT);
+    if (fd < 0)
+    {
+        perror("open");
+        exit(1);
+    }
+    file_bench_t bench;
+    bench.fd = fd;
+    bench.blocks = lseek(fd, 0, SEEK_END) / 4096;
+    if (!bench.blocks)
+    {
+        fprintf(stderr, "%s is empty\n", path);
+        exit(1);
+    }
+    for (int i = 0; i < 128; i++)
+        bench.iov[i] = (struct iovec){ pool_alloc(4096), 4096 };
+    bench.ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
+    bench.run("readv", n_ops);
+    delete bench.ringloop;
+    bench.ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
+    void *base = NULL;
+    size_t size = 0;
+    pool_get_region(&base, &size);
+    int r1 = bench.ringloop->register_fd(fd);
+    int r2 = bench.ringloop->register_buffer_region(base, size, (size_t)256*1024*1024, pool_set_pinned);
+    if (r1 < 0 || r2 < 0)
+        fprintf(stderr, "Failed to register file or buffers: %s\n", strerror(-(r1 < 0 ? r1 : r2)));
+    bench.run("fixed file + buffer", n_ops);
+    bench.ringloop->unregister_fd(fd);
+    delete bench.ringloop;
+    bench.ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
+    int r = bench.ringloop->register_iopoll_fd(fd);
+    if (r < 0)
+        fprintf(stderr, "Failed to create polled io_uring: %s\n", strerror(-r));
+    bench.run("iopoll", n_ops);
+    bench.ringloop->unregister_iopoll_fd(fd);
+    delete bench.ringloop;
+    if (nvme_path)
+    {
+        int nvme_fd = open(nvme_path, O_RDONLY);
+        int nsid = ioctl(fd, NVME_IOCTL_ID);
+        int lba_size = 0;
+        if (nvme_fd < 0 || nsid <= 0 || ioctl(fd, BLKSSZGET, &lba_size) < 0)
+        {
+            perror("open NVMe device");
+            exit(1);
+        }
+        bench.ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE, false, true);
+        r = bench.ringloop->register_passthru(fd, nvme_fd, nsid, lba_size, 128*1024);
+        if (r < 0)
+            fprintf(stderr, "Failed to enable passthrough: %s\n", strerror(-r));
+        bench.ringloop->register_fd(nvme_fd);
+        bench.run("nvme passthru", n_ops);
+        bench.ringloop->unregister_fd(nvme_fd);
+        bench.ringloop->unregister_passthru(fd);
+        delete bench.ringloop;
+        close(nvme_fd);
+    }
+    for (int i = 0; i < 128; i++)
+        pool_free(bench.iov[i].iov_base);
+    close(fd);
+}
+
+int main(int narg, char *args[])
+{
+    uint64_t n_ops = narg > 1 ? strtoull(args[1], NULL, 10) : 1000000;
+    if (!n_ops)
+        n_ops = 1000000;
+    test_passthru();
+    test_sqe128_restore();
+    test_iopoll();
+    bench_t bench;
+    bench.ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
+    bench.run(0, "std::function, 2 ptrs", n_ops);
+    bench.run(1, "std::function, 4 ptrs", n_ops);
+    bench.run(2, "set_callback", n_ops);
+    delete bench.ringloop;
+    if (narg > 2)
+        bench_file(args[2], narg > 3 ? args[3] : NULL, n_ops);
+    return 0;
+}
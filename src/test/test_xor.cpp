@@ -0,0 +1,142 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// Checks all available memxor_multi() implementations against a trivial one
+// and reports their throughput for different chunk sizes.
+// USAGE: test_xor [N_SOURCES] [MAX_CHUNK_SIZE]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "malloc_or_die.h"
+#include "xor.h"
+
+struct xor_impl_t
+{
+    const char *name;
+    memxor_multi_fn fn;
+};
+
+static std::vector<xor_impl_t> get_impls()
+{
+    std::vector<xor_impl_t> impls;
+    for (const char *name: { "scalar", "avx2", "avx512", "neon" })
+    {
+        memxor_multi_fn fn = memxor_multi_get(name);
+        if (fn)
+            impls.push_back((xor_impl_t){ .name = name, .fn = fn });
+    }
+    return impls;
+}
+
+static void check_impl(xor_impl_t & impl)
+{
+    const int max_src = 8, max_len = 4096+131;
+    uint8_t *bufs[max_src];
+    const void *src[max_src];
+    uint8_t *res = (uint8_t*)malloc_or_die(max_len+1), *ref = (uint8_t*)malloc_or_die(max_len);
+    for (int i = 0; i < max_src; i++)
+    {
+        bufs[i] = (uint8_t*)malloc_or_die(max_len+1);
+        for (int j = 0; j < max_len+1; j++)
+            bufs[i][j] = rand();
+    }
+    for (int n_src = 1; n_src <= max_src; n_src++)
+    {
+        for (int len = 0; len < max_len; len += 1 + (len > 300 ? 97 : 0))
+        {
+            // Also check unaligned buffers
+            int shift = len % 2;
+            for (int i = 0; i < n_src; i++)
+                src[i] = bufs[i]+shift;
+            for (int j = 0; j < len; j++)
+            {
+                ref[j] = 0;
+                for (int i = 0; i < n_src; i++)
+                    ref[j] ^= bufs[i][j+shift];
+            }
+            impl.fn(src, n_src, res+shift, len);
+            if (memcmp(res+shift, ref, len) != 0)
+            {
+                fprintf(stderr, "%s: mismatch with n_src=%d len=%d\n", impl.name, n_src, len);
+                exit(1);
+            }
+        }
+    }
+    // Result in place of the first source
+    for (int j = 0; j < max_len; j++)
+        ref[j] = bufs[0][j] ^ bufs[1][j];
+    src[0] = bufs[0];
+    src[1] = bufs[1];
+    impl.fn(src, 2, bufs[0], max_len);
+    if (memcmp(bufs[0], ref, max_len) != 0)
+    {
+        fprintf(stderr, "%s: in-place mismatch\n", impl.name);
+        exit(1);
+    }
+    for (int i = 0; i < max_src; i++)
+        free(bufs[i]);
+    free(res);
+    free(ref);
+}
+
+static double bench_impl(xor_impl_t & impl, int n_src, uint32_t len)
+{
+    uint8_t *bufs[n_src];
+    const void *src[n_src];
+    for (int i = 0; i < n_src; i++)
+    {
+        bufs[i] = (uint8_t*)memalign_or_die(4096, len);
+        memset(bufs[i], i+1, len);
+        src[i] = bufs[i];
+    }
+    uint8_t *res = (uint8_t*)memalign_or_die(4096, len);
+    uint64_t total = 0;
+    timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double elapsed = 0;
+    while (elapsed < 0.2)
+    {
+        for (int i = 0; i < 64; i++)
+            impl.fn(src, n_src, res, len);
+        total += 64*(uint64_t)len*n_src;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec)/1000000000.0;
+    }
+    for (int i = 0; i < n_src; i++)
+        free(bufs[i]);
+    free(res);
+    return total/elapsed/1024/1024/1024;
+}
+
+int main(int narg, char *args[])
+{
+    int n_src = narg > 1 ? atoi(args[1]) : 2;
+    uint32_t max_chunk = narg > 2 ? strtoul(args[2], NULL, 10) : 1024*1024;
+    if (n_src < 1)
+        n_src = 2;
+    auto impls = get_impls();
+    for (auto & impl: impls)
+        check_impl(impl);
+    printf("selected implementation: ");
+    auto selected = memxor_multi_get(NULL);
+    for (auto & impl: impls)
+        if (impl.fn == selected)
+            printf("%s\n", impl.name);
+    printf("%d sources, input GB/s:\n%-10s", n_src, "chunk");
+    for (auto & impl: impls)
+        printf(" %10s", impl.name);
+    printf("\n");
+    for (uint32_t len = 64; len <= max_chunk; len *= 4)
+    {
+        printf("%-10u", len);
+        for (auto & impl: impls)
+            printf(" %10.2f", bench_impl(impl, n_src, len));
+        printf("\n");
+    }
+    return 0;
+}
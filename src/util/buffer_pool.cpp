@@ -0,0 +1,271 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "malloc_or_die.h"
+#include "buffer_pool.h"
+
+// Buffers of each size class are carved from 2 MB chunks (the huge page size)
+#define POOL_CHUNK_SIZE ((size_t)2*1024*1024)
+// Only address space is reserved, physical memory is only used for allocated chunks
+#define POOL_REGION_SIZE ((size_t)64*1024*1024*1024)
+// Free buffers cached by each thread per size class, the rest goes to shared lists
+#define POOL_THREAD_CACHE ((size_t)16*1024*1024)
+// Free buffers kept resident in shared lists per size class, the rest is returned to the OS
+#define POOL_SHARED_CACHE ((size_t)64*1024*1024)
+
+static std::once_flag pool_once;
+static std::atomic<uint8_t*> pool_base { NULL };
+static std::atomic<size_t> pool_used { 0 };
+// Size class of each chunk
+static uint8_t *pool_chunk_class = NULL;
+// Pin counter of each chunk. Pinned chunks (io_uring fixed buffers) are never trimmed,
+// because the kernel would keep using old pages after MADV_DONTNEED
+static uint8_t *pool_chunk_pinned = NULL;
+static std::mutex pool_pin_mu;
+static std::atomic<uint64_t> stat_used { 0 }, stat_allocs { 0 }, stat_fallbacks { 0 }, stat_trimmed { 0 };
+
+// Buffers are often freed by another thread than the one which allocated them
+// (network, blockstore, worker threads), so per-thread free lists are bounded and
+// the excess goes to shared lists. Buffers beyond the shared limit are returned to
+// the OS with MADV_DONTNEED, but stay in the <trimmed> list for reuse.
+struct pool_shared_list_t
+{
+    std::mutex mu;
+    std::vector<void*> resident, trimmed;
+};
+static pool_shared_list_t pool_shared_lists[POOL_CLASS_COUNT];
+
+static void pool_put_shared(int cls, void **bufs, size_t count);
+
+struct pool_free_lists_t
+{
+    std::vector<void*> lists[POOL_CLASS_COUNT];
+
+    ~pool_free_lists_t()
+    {
+        // Hand cached buffers over to other threads when the thread exits
+        for (int cls = 0; cls < POOL_CLASS_COUNT; cls++)
+        {
+            if (lists[cls].size())
+                pool_put_shared(cls, lists[cls].data(), lists[cls].size());
+        }
+    }
+};
+static thread_local pool_free_lists_t pool_free_lists;
+
+static void pool_init()
+{
+    size_t size = POOL_REGION_SIZE + POOL_CHUNK_SIZE;
+    void *mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to reserve %zu bytes for the buffer pool: %s, using memalign instead\n", size, strerror(errno));
+        return;
+    }
+    // Align to the huge page size
+    uint8_t *base = (uint8_t*)(((uintptr_t)mem + POOL_CHUNK_SIZE-1) & ~(POOL_CHUNK_SIZE-1));
+    madvise(base, POOL_REGION_SIZE, MADV_HUGEPAGE);
+    pool_chunk_class = (uint8_t*)calloc_or_die(POOL_REGION_SIZE / POOL_CHUNK_SIZE, 1);
+    pool_chunk_pinned = (uint8_t*)calloc_or_die(POOL_REGION_SIZE / POOL_CHUNK_SIZE, 1);
+    pool_base = base;
+}
+
+// Classes are 4K, 8K, 12K, 16K, 24K, 32K, 48K, ..., 12M, 16M
+static inline int pool_size_class(size_t size)
+{
+    size_t pages = size ? (size + POOL_PAGE_SIZE-1) / POOL_PAGE_SIZE : 1;
+    if (pages <= 2)
+        return pages-1;
+    int o = 63 - __builtin_clzll(pages-1);
+    return 2 + (o-1)*2 + (pages > ((size_t)3 << (o-1)) ? 1 : 0);
+}
+
+static inline size_t pool_class_size(int cls)
+{
+    if (cls < 2)
+        return (cls+1) * POOL_PAGE_SIZE;
+    int o = (cls-2)/2 + 1;
+    return ((cls & 1) ? ((size_t)2 << o) : ((size_t)3 << (o-1))) * POOL_PAGE_SIZE;
+}
+
+static inline size_t pool_cache_count(size_t cache_size, int cls)
+{
+    size_t n = cache_size / pool_class_size(cls);
+    return n < 2 ? 2 : n;
+}
+
+// Must be called with pool_pin_mu locked
+static bool pool_is_pinned(void *buf, size_t len)
+{
+    size_t first = ((uint8_t*)buf - pool_base) / POOL_CHUNK_SIZE;
+    size_t last = ((uint8_t*)buf + len - 1 - pool_base) / POOL_CHUNK_SIZE;
+    for (size_t c = first; c <= last; c++)
+    {
+        if (pool_chunk_pinned[c])
+            return true;
+    }
+    return false;
+}
+
+static void pool_put_shared(int cls, void **bufs, size_t count)
+{
+    size_t class_size = pool_class_size(cls);
+    size_t max_resident = pool_cache_count(POOL_SHARED_CACHE, cls);
+    auto & sh = pool_shared_lists[cls];
+    std::lock_guard<std::mutex> lk(sh.mu);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (sh.resident.size() < max_resident)
+        {
+            sh.resident.push_back(bufs[i]);
+            continue;
+        }
+        std::lock_guard<std::mutex> pin_lk(pool_pin_mu);
+        if (pool_is_pinned(bufs[i], class_size))
+        {
+            sh.resident.push_back(bufs[i]);
+        }
+        else
+        {
+            madvise(bufs[i], class_size, MADV_DONTNEED);
+            sh.trimmed.push_back(bufs[i]);
+            stat_trimmed += class_size;
+        }
+    }
+}
+
+// Refill the thread's free list from the shared one, resident buffers first
+static void pool_get_shared(int cls, std::vector<void*> & list)
+{
+    size_t want = pool_cache_count(POOL_THREAD_CACHE, cls) / 2;
+    auto & sh = pool_shared_lists[cls];
+    std::lock_guard<std::mutex> lk(sh.mu);
+    while (list.size() < want && sh.resident.size())
+    {
+        list.push_back(sh.resident.back());
+        sh.resident.pop_back();
+    }
+    if (!list.size() && sh.trimmed.size())
+    {
+        list.push_back(sh.trimmed.back());
+        sh.trimmed.pop_back();
+        stat_trimmed -= pool_class_size(cls);
+    }
+}
+
+void* pool_alloc(size_t size)
+{
+    if (size > POOL_MAX_SIZE)
+    {
+        stat_fallbacks++;
+        return memalign_or_die(MEM_ALIGNMENT, size);
+    }
+    std::call_once(pool_once, pool_init);
+    uint8_t *base = pool_base;
+    if (!base)
+    {
+        stat_fallbacks++;
+        return memalign_or_die(MEM_ALIGNMENT, size);
+    }
+    int cls = pool_size_class(size);
+    size_t class_size = pool_class_size(cls);
+    auto & list = pool_free_lists.lists[cls];
+    if (!list.size())
+    {
+        pool_get_shared(cls, list);
+    }
+    if (!list.size())
+    {
+        // Take a new chunk for this size class
+        size_t chunk = (class_size + POOL_CHUNK_SIZE-1) / POOL_CHUNK_SIZE * POOL_CHUNK_SIZE;
+        size_t pos = pool_used.fetch_add(chunk);
+        if (pos + chunk > POOL_REGION_SIZE)
+        {
+            stat_fallbacks++;
+            return memalign_or_die(MEM_ALIGNMENT, size);
+        }
+        for (size_t c = pos; c < pos+chunk; c += POOL_CHUNK_SIZE)
+            pool_chunk_class[c / POOL_CHUNK_SIZE] = cls;
+        for (size_t off = chunk / class_size * class_size; off > 0; off -= class_size)
+            list.push_back(base + pos + off - class_size);
+    }
+    void *buf = list.back();
+    list.pop_back();
+    stat_used += class_size;
+    stat_allocs++;
+    return buf;
+}
+
+bool pool_owns(void *buf)
+{
+    uint8_t *base = pool_base;
+    return base && (uint8_t*)buf >= base && (uint8_t*)buf < base + POOL_REGION_SIZE;
+}
+
+void pool_free(void *buf)
+{
+    if (!pool_owns(buf))
+    {
+        free(buf);
+        return;
+    }
+    int cls = pool_chunk_class[((uint8_t*)buf - pool_base) / POOL_CHUNK_SIZE];
+    stat_used -= pool_class_size(cls);
+    auto & list = pool_free_lists.lists[cls];
+    list.push_back(buf);
+    size_t max_cached = pool_cache_count(POOL_THREAD_CACHE, cls);
+    if (list.size() > max_cached)
+    {
+        // Move the older half of the list to the shared one, keep recently used buffers
+        size_t count = max_cached/2;
+        pool_put_shared(cls, list.data(), count);
+        list.erase(list.begin(), list.begin()+count);
+    }
+}
+
+buffer_pool_stats_t pool_get_stats()
+{
+    size_t used = pool_used;
+    return (buffer_pool_stats_t){
+        .region_used = pool_base ? (used < POOL_REGION_SIZE ? used : POOL_REGION_SIZE) : 0,
+        .used_bytes = stat_used,
+        .alloc_count = stat_allocs,
+        .fallback_count = stat_fallbacks,
+        .trimmed_bytes = stat_trimmed,
+    };
+}
+
+void pool_set_pinned(void *buf, size_t len, bool pinned)
+{
+    uint8_t *base = pool_base;
+    if (!base || (uint8_t*)buf < base || (uint8_t*)buf + len > base + POOL_REGION_SIZE || !len)
+    {
+        return;
+    }
+    size_t first = ((uint8_t*)buf - base) / POOL_CHUNK_SIZE;
+    size_t last = ((uint8_t*)buf + len - 1 - base) / POOL_CHUNK_SIZE;
+    std::lock_guard<std::mutex> lk(pool_pin_mu);
+    for (size_t c = first; c <= last; c++)
+    {
+        if (pinned)
+            pool_chunk_pinned[c]++;
+        else if (pool_chunk_pinned[c] > 0)
+            pool_chunk_pinned[c]--;
+    }
+}
+
+void pool_get_region(void **base, size_t *size)
+{
+    std::call_once(pool_once, pool_init);
+    *base = pool_base;
+    *size = pool_base ? POOL_REGION_SIZE : 0;
+}
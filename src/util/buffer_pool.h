@@ -0,0 +1,50 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Size-classed pool for page-aligned operation data buffers.
+//
+// Buffers are carved from a single virtual memory region which is reserved once and
+// backed by transparent huge pages, so they don't page fault after the first use.
+// Freed buffers are cached in bounded per-thread free lists and shared lists, buffers
+// beyond the shared list limit are returned to the OS. Sizes are rounded up to
+// 4 KB * (1 or 1.5) * 2^N. Buffers larger than POOL_MAX_SIZE or allocated after
+// the region is exhausted fall back to memalign().
+//
+// pool_free() accepts any malloc()'ed pointer, so it may be used for buffers of unknown origin.
+
+#define POOL_PAGE_SIZE 4096
+#define POOL_CLASS_COUNT 24
+#define POOL_MAX_SIZE ((size_t)16*1024*1024)
+
+#pragma GCC visibility push(default)
+
+struct buffer_pool_stats_t
+{
+    // Bytes of the region split into buffers
+    uint64_t region_used;
+    // Bytes currently allocated by the application (rounded to size classes)
+    uint64_t used_bytes;
+    // Total allocations and allocations which fell back to memalign
+    uint64_t alloc_count;
+    uint64_t fallback_count;
+    // Bytes of free buffers returned to the OS
+    uint64_t trimmed_bytes;
+};
+
+void* pool_alloc(size_t size);
+void pool_free(void *buf);
+bool pool_owns(void *buf);
+buffer_pool_stats_t pool_get_stats();
+// Memory region of the pool (e.g. for RDMA or io_uring buffer registration), reserved on the first call.
+// NULL if the region can't be reserved
+void pool_get_region(void **base, size_t *size);
+// Mark part of the region as pinned by the kernel (or unpinned). Free buffers in pinned
+// chunks are never returned to the OS
+void pool_set_pinned(void *buf, size_t len, bool pinned);
+
+#pragma GCC visibility pop
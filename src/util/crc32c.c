@@ -40,6 +40,17 @@
 #include <assert.h>
 #include "crc32c.h"
 
+#if defined(__x86_64__) && !defined(WITH_ISAL)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && !defined(WITH_ISAL)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
 #ifdef WITH_ISAL
 
 #include <isa-l/crc.h>
@@ -49,6 +60,12 @@ uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
     return crc32_iscsi((unsigned char*)buf, len, crc ^ 0xffffffff) ^ 0xffffffff;
 }
 
+void crc32c_multi(uint32_t *crcs, const uint8_t *const *bufs, int n, size_t len)
+{
+    for (int i = 0; i < n; i++)
+        crcs[i] = crc32c(crcs[i], bufs[i], len);
+}
+
 #else
 
 /* CRC-32C (iSCSI) polynomial in reversed bit order. */
@@ -356,62 +373,421 @@ static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
 #endif
 }
 
-/* Check for SSE 4.2.  SSE 4.2 was first supported in Nehalem processors
-   introduced in November, 2008.  This does not check for the existence of the
-   cpuid instruction itself, which was introduced on the 486SL in 1992, so this
-   will fail on earlier x86 processors.  cpuid works on all Pentium and later
-   processors. */
-#define SSE42(have) \
-    do { \
-        uint32_t eax, ecx; \
-        eax = 1; \
-        __asm__("cpuid" \
-            : "=c"(ecx) \
-            : "a"(eax) \
-            : "%ebx", "%edx"); \
-        (have) = (ecx >> 20) & 1; \
-    } while (0)
-
-/* Compute a CRC-32C.  If the crc32 instruction is available, use the hardware
-   version.  Otherwise, use the software version. */
-uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+#ifdef __x86_64__
+
+/* Folding constants are x^n mod P in the reflected bit order. Folding a 128-bit
+   lane forward by N bits multiplies its low half by x^(N+31) and its high half
+   by x^(N-33). */
+#define CRC32C_X86_TARGET __attribute__((target("sse4.2,pclmul")))
+#define CRC32C_AVX512_TARGET __attribute__((target("sse4.2,pclmul,avx512f,avx512vl,vpclmulqdq")))
+
+CRC32C_X86_TARGET
+static inline __m128i crc32c_fold_128(__m128i x, __m128i k, __m128i y)
 {
-#ifndef __x86_64__
-    return crc32c_sw(crc, buf, len);
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), y);
+}
+
+/* Compute CRC-32C folding 4 128-bit lanes with PCLMULQDQ and reducing the
+   result with the crc32 instruction. Takes and returns a non-inverted crc. */
+CRC32C_X86_TARGET
+static uint32_t crc32c_pclmul_raw(uint32_t crc0, const unsigned char *next, size_t len)
+{
+    while (len && ((uintptr_t)next & 7) != 0)
+    {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+    if (len >= 64)
+    {
+        __m128i x0 = _mm_loadu_si128((const __m128i*)next);
+        __m128i x1 = _mm_loadu_si128((const __m128i*)(next+16));
+        __m128i x2 = _mm_loadu_si128((const __m128i*)(next+32));
+        __m128i x3 = _mm_loadu_si128((const __m128i*)(next+48));
+        x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc0));
+        next += 64;
+        len -= 64;
+        /* fold by 512 bits */
+        __m128i k = _mm_setr_epi32(0x740eef02, 0, 0x9e4addf8, 0);
+        while (len >= 64)
+        {
+            x0 = crc32c_fold_128(x0, k, _mm_loadu_si128((const __m128i*)next));
+            x1 = crc32c_fold_128(x1, k, _mm_loadu_si128((const __m128i*)(next+16)));
+            x2 = crc32c_fold_128(x2, k, _mm_loadu_si128((const __m128i*)(next+32)));
+            x3 = crc32c_fold_128(x3, k, _mm_loadu_si128((const __m128i*)(next+48)));
+            next += 64;
+            len -= 64;
+        }
+        /* reduce 4 lanes to 1: fold by 128 bits, then by 256 bits */
+        k = _mm_setr_epi32(0xf20c0dfe, 0, 0x493c7d27, 0);
+        x0 = crc32c_fold_128(x0, k, x1);
+        x2 = crc32c_fold_128(x2, k, x3);
+        k = _mm_setr_epi32(0x3da6d0cb, 0, 0xba4fc28e, 0);
+        x0 = crc32c_fold_128(x0, k, x2);
+        /* reduce 128 bits to 32 bits */
+        crc0 = _mm_crc32_u64(0, _mm_cvtsi128_si64(x0));
+        crc0 = _mm_crc32_u64(crc0, _mm_extract_epi64(x0, 1));
+    }
+    while (len >= 8)
+    {
+        crc0 = _mm_crc32_u64(crc0, *(const uint64_t*)next);
+        next += 8;
+        len -= 8;
+    }
+    while (len)
+    {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+    return crc0;
+}
+
+CRC32C_X86_TARGET
+static uint32_t crc32c_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_pclmul_raw(crc ^ 0xffffffff, (const unsigned char*)buf, len) ^ 0xffffffff;
+}
+
+CRC32C_AVX512_TARGET
+static inline __m512i crc32c_fold_512(__m512i x, __m512i k, __m512i y)
+{
+    return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11), y, 0x96);
+}
+
+/* Same with 4 512-bit lanes using VPCLMULQDQ, the tail shorter than 256 bytes
+   is handled by crc32c_pclmul_raw(). */
+CRC32C_AVX512_TARGET
+static uint32_t crc32c_vpclmul_raw(uint32_t crc0, const unsigned char *next, size_t len)
+{
+    if (len >= 256)
+    {
+        __m512i x0 = _mm512_loadu_si512((const void*)next);
+        __m512i x1 = _mm512_loadu_si512((const void*)(next+64));
+        __m512i x2 = _mm512_loadu_si512((const void*)(next+128));
+        __m512i x3 = _mm512_loadu_si512((const void*)(next+192));
+        x0 = _mm512_xor_si512(x0, _mm512_inserti32x4(_mm512_setzero_si512(), _mm_cvtsi32_si128(crc0), 0));
+        next += 256;
+        len -= 256;
+        /* fold by 2048 bits */
+        __m512i k = _mm512_setr_epi32(
+            0xdcb17aa4, 0, 0xb9e02b86, 0, 0xdcb17aa4, 0, 0xb9e02b86, 0,
+            0xdcb17aa4, 0, 0xb9e02b86, 0, 0xdcb17aa4, 0, 0xb9e02b86, 0
+        );
+        while (len >= 256)
+        {
+            x0 = crc32c_fold_512(x0, k, _mm512_loadu_si512((const void*)next));
+            x1 = crc32c_fold_512(x1, k, _mm512_loadu_si512((const void*)(next+64)));
+            x2 = crc32c_fold_512(x2, k, _mm512_loadu_si512((const void*)(next+128)));
+            x3 = crc32c_fold_512(x3, k, _mm512_loadu_si512((const void*)(next+192)));
+            next += 256;
+            len -= 256;
+        }
+        /* reduce 4 lanes to 1 folding by 512 bits */
+        k = _mm512_setr_epi32(
+            0x740eef02, 0, 0x9e4addf8, 0, 0x740eef02, 0, 0x9e4addf8, 0,
+            0x740eef02, 0, 0x9e4addf8, 0, 0x740eef02, 0, 0x9e4addf8, 0
+        );
+        x0 = crc32c_fold_512(x0, k, x1);
+        x0 = crc32c_fold_512(x0, k, x2);
+        x0 = crc32c_fold_512(x0, k, x3);
+        /* fold 128-bit parts by 384, 256 and 128 bits onto the last one */
+        k = _mm512_setr_epi32(
+            0x1c291d04, 0, 0xddc0152b, 0,
+            0x3da6d0cb, 0, 0xba4fc28e, 0,
+            0xf20c0dfe, 0, 0x493c7d27, 0,
+            0, 0, 0, 0
+        );
+        x0 = crc32c_fold_512(x0, k, _mm512_maskz_mov_epi64(0xC0, x0));
+        uint64_t q[8];
+        _mm512_storeu_si512((void*)q, x0);
+        crc0 = _mm_crc32_u64(0, q[0] ^ q[2] ^ q[4] ^ q[6]);
+        crc0 = _mm_crc32_u64(crc0, q[1] ^ q[3] ^ q[5] ^ q[7]);
+    }
+    return crc32c_pclmul_raw(crc0, next, len);
+}
+
+CRC32C_AVX512_TARGET
+static uint32_t crc32c_vpclmul(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_vpclmul_raw(crc ^ 0xffffffff, (const unsigned char*)buf, len) ^ 0xffffffff;
+}
+
+/* Compute CRC-32C of 4 buffers of the same length in 4 independent streams.
+   This hides the latency of the crc32 instruction without combining partial
+   crcs of the same buffer. */
+__attribute__((target("sse4.2")))
+static void crc32c_hw_x4(uint32_t *crcs, const unsigned char *const *bufs, size_t len)
+{
+    const unsigned char *b0 = bufs[0], *b1 = bufs[1], *b2 = bufs[2], *b3 = bufs[3];
+    uint64_t crc0 = crcs[0] ^ 0xffffffff, crc1 = crcs[1] ^ 0xffffffff;
+    uint64_t crc2 = crcs[2] ^ 0xffffffff, crc3 = crcs[3] ^ 0xffffffff;
+    size_t i = 0;
+    for (; i+8 <= len; i += 8)
+    {
+        crc0 = _mm_crc32_u64(crc0, *(const uint64_t*)(b0+i));
+        crc1 = _mm_crc32_u64(crc1, *(const uint64_t*)(b1+i));
+        crc2 = _mm_crc32_u64(crc2, *(const uint64_t*)(b2+i));
+        crc3 = _mm_crc32_u64(crc3, *(const uint64_t*)(b3+i));
+    }
+    for (; i < len; i++)
+    {
+        crc0 = _mm_crc32_u8(crc0, b0[i]);
+        crc1 = _mm_crc32_u8(crc1, b1[i]);
+        crc2 = _mm_crc32_u8(crc2, b2[i]);
+        crc3 = _mm_crc32_u8(crc3, b3[i]);
+    }
+    crcs[0] = crc0 ^ 0xffffffff;
+    crcs[1] = crc1 ^ 0xffffffff;
+    crcs[2] = crc2 ^ 0xffffffff;
+    crcs[3] = crc3 ^ 0xffffffff;
+}
+
+#endif
+
+#ifdef __aarch64__
+
+#ifdef __clang__
+#define CRC32C_ARM_TARGET __attribute__((target("crc")))
 #else
-    static int sse42 = 0;
-    if (!sse42)
+#define CRC32C_ARM_TARGET __attribute__((target("+crc")))
+#endif
+
+/* Compute CRC-32C using the ARMv8 crc32c instructions, in three streams like
+   crc32c_hw(). */
+CRC32C_ARM_TARGET
+static uint32_t crc32c_arm(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = (const unsigned char*)buf;
+    const unsigned char *end;
+    uint32_t crc0, crc1, crc2;
+
+    if (!crc32c_hw_init)
+        crc32c_init_hw();
+
+    crc0 = crc ^ 0xffffffff;
+    while (len && ((uintptr_t)next & 7) != 0)
+    {
+        crc0 = __crc32cb(crc0, *next++);
+        len--;
+    }
+    while (len >= LONG*3)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG;
+        do
+        {
+            crc0 = __crc32cd(crc0, *(const uint64_t*)next);
+            crc1 = __crc32cd(crc1, *(const uint64_t*)(next + LONG));
+            crc2 = __crc32cd(crc2, *(const uint64_t*)(next + LONG*2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+        next += LONG*2;
+        len -= LONG*3;
+    }
+    while (len >= SHORT*3)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do
+        {
+            crc0 = __crc32cd(crc0, *(const uint64_t*)next);
+            crc1 = __crc32cd(crc1, *(const uint64_t*)(next + SHORT));
+            crc2 = __crc32cd(crc2, *(const uint64_t*)(next + SHORT*2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        next += SHORT*2;
+        len -= SHORT*3;
+    }
+    while (len >= 8)
     {
-        SSE42(sse42);
-        sse42 = sse42 ? 2 : 1;
+        crc0 = __crc32cd(crc0, *(const uint64_t*)next);
+        next += 8;
+        len -= 8;
+    }
+    while (len)
+    {
+        crc0 = __crc32cb(crc0, *next++);
+        len--;
+    }
+    return crc0 ^ 0xffffffff;
+}
+
+/* Compute CRC-32C of 4 buffers of the same length in 4 independent streams. */
+CRC32C_ARM_TARGET
+static void crc32c_arm_x4(uint32_t *crcs, const unsigned char *const *bufs, size_t len)
+{
+    const unsigned char *b0 = bufs[0], *b1 = bufs[1], *b2 = bufs[2], *b3 = bufs[3];
+    uint32_t crc0 = crcs[0] ^ 0xffffffff, crc1 = crcs[1] ^ 0xffffffff;
+    uint32_t crc2 = crcs[2] ^ 0xffffffff, crc3 = crcs[3] ^ 0xffffffff;
+    size_t i = 0;
+    for (; i+8 <= len; i += 8)
+    {
+        crc0 = __crc32cd(crc0, *(const uint64_t*)(b0+i));
+        crc1 = __crc32cd(crc1, *(const uint64_t*)(b1+i));
+        crc2 = __crc32cd(crc2, *(const uint64_t*)(b2+i));
+        crc3 = __crc32cd(crc3, *(const uint64_t*)(b3+i));
+    }
+    for (; i < len; i++)
+    {
+        crc0 = __crc32cb(crc0, b0[i]);
+        crc1 = __crc32cb(crc1, b1[i]);
+        crc2 = __crc32cb(crc2, b2[i]);
+        crc3 = __crc32cb(crc3, b3[i]);
+    }
+    crcs[0] = crc0 ^ 0xffffffff;
+    crcs[1] = crc1 ^ 0xffffffff;
+    crcs[2] = crc2 ^ 0xffffffff;
+    crcs[3] = crc3 ^ 0xffffffff;
+}
+
+#endif
+
+typedef uint32_t (*crc32c_fn_t)(uint32_t crc, const void *buf, size_t len);
+
+/* Select the fastest implementation supported by the CPU. */
+static crc32c_fn_t crc32c_select(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        if (__builtin_cpu_supports("pclmul"))
+        {
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+                __builtin_cpu_supports("vpclmulqdq"))
+            {
+                return crc32c_vpclmul;
+            }
+            return crc32c_pclmul;
+        }
+        return crc32c_hw;
     }
-    return sse42 == 2 ? crc32c_hw(crc, buf, len) : crc32c_sw(crc, buf, len);
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        return crc32c_arm;
 #endif
+    return crc32c_sw;
 }
 
+/* Selected by crc32c_init() when the library is loaded. */
+static crc32c_fn_t crc32c_impl = crc32c_sw;
+
+/* Compute a CRC-32C using the fastest available implementation. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_impl(crc, buf, len);
+}
+
+typedef void (*crc32c_x4_fn_t)(uint32_t *crcs, const unsigned char *const *bufs, size_t len);
+
+/* Multi-buffer implementation for the selected single-buffer one, or NULL if
+   calculating buffers one by one is faster. VPCLMULQDQ folding is faster than
+   4 interleaved crc32 streams. */
+static crc32c_x4_fn_t crc32c_select_x4(crc32c_fn_t impl)
+{
+#if defined(__x86_64__)
+    if (impl == crc32c_hw || impl == crc32c_pclmul)
+        return crc32c_hw_x4;
+#elif defined(__aarch64__)
+    if (impl == crc32c_arm)
+        return crc32c_arm_x4;
 #endif
+    return NULL;
+}
 
-static uint8_t zero_page[4096] = {};
+static crc32c_x4_fn_t crc32c_impl_x4 = NULL;
 
-uint32_t crc32c_pad(uint32_t prev_crc, const void *buf, size_t len, size_t left_pad, size_t right_pad)
+/* Select implementations eagerly instead of on the first call, because
+   CRCs are calculated by several threads. */
+__attribute__((constructor)) static void crc32c_init(void)
 {
-    assert(left_pad < 0x10000000 && right_pad < 0x10000000);
-    uint32_t r = prev_crc;
-    while (left_pad >= 4096)
+    crc32c_impl = crc32c_select();
+    crc32c_impl_x4 = crc32c_select_x4(crc32c_impl);
+}
+
+void crc32c_multi(uint32_t *crcs, const uint8_t *const *bufs, int n, size_t len)
+{
+    crc32c_x4_fn_t x4 = crc32c_impl_x4;
+    int i = 0;
+    if (x4)
     {
-        r = crc32c(r, zero_page, 4096);
-        left_pad -= 4096;
+        for (; i+4 <= n; i += 4)
+            x4(crcs+i, bufs+i, len);
     }
-    if (left_pad > 0)
-        r = crc32c(r, zero_page, left_pad);
-    r = crc32c(r, buf, len);
-    while (right_pad >= 4096)
+    for (; i < n; i++)
+        crcs[i] = crc32c_impl(crcs[i], bufs[i], len);
+}
+
+#endif
+
+/* x^(2^n) mod P for n = 0..30, in the reflected bit order. The sequence is
+   periodic with the period of 31 for the CRC-32C polynomial. */
+static const uint32_t crc32c_x2n_table[31] = {
+    0x40000000, 0x20000000, 0x08000000, 0x00800000, 0x00008000, 0x82f63b78, 0x6ea2d55c, 0x18b8ea18,
+    0x510ac59a, 0xb82be955, 0xb8fdb1e7, 0x88e56f72, 0x74c360a4, 0xe4172b16, 0x0d65762a, 0x35d73a62,
+    0x28461564, 0xbf455269, 0xe2ea32dc, 0xfe7740e6, 0xf946610b, 0x3c204f8f, 0x538586e3, 0x59726915,
+    0x734d5309, 0xbc1ac763, 0x7d0722cc, 0xd289cabe, 0xe94ca9bc, 0x05b74f3f, 0xa51e1f42,
+};
+
+/* Multiply a and b modulo P, both in the reflected bit order. Takes less
+   iterations when a has less bits set. */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    while (1)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if (!(a & (m-1)))
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0x82f63b78 : b >> 1;
+    }
+    return p;
+}
+
+/* x^(8*len) mod P, i.e. the operator for shifting a crc by len zero bytes. */
+static uint32_t crc32c_x8nmodp(size_t len)
+{
+    uint32_t p = (uint32_t)1 << 31;
+    int k = 3;
+    while (len)
     {
-        r = crc32c(r, zero_page, 4096);
-        right_pad -= 4096;
+        if (len & 1)
+            p = crc32c_multmodp(p, crc32c_x2n_table[k % 31]);
+        len >>= 1;
+        k++;
     }
+    return p;
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+    return crc32c_multmodp(crc32c_x8nmodp(len2), crc1) ^ crc2;
+}
+
+uint32_t crc32c_append_zeros(uint32_t crc, size_t len)
+{
+    return crc32c_multmodp(crc32c_x8nmodp(len), crc ^ 0xffffffff) ^ 0xffffffff;
+}
+
+uint32_t crc32c_pad(uint32_t prev_crc, const void *buf, size_t len, size_t left_pad, size_t right_pad)
+{
+    assert(left_pad < 0x10000000 && right_pad < 0x10000000);
+    uint32_t r = prev_crc;
+    if (left_pad > 0)
+        r = crc32c_append_zeros(r, left_pad);
+    if (len > 0)
+        r = crc32c(r, buf, len);
     if (right_pad > 0)
-        r = crc32c(r, zero_page, right_pad);
+        r = crc32c_append_zeros(r, right_pad);
     return r;
 }
 
@@ -14,8 +14,14 @@
 extern "C" {
 #endif
 uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+// Calculate CRCs of n buffers of the same length at once, crcs[] are initial values on input
+void crc32c_multi(uint32_t *crcs, const uint8_t *const *bufs, int n, size_t len);
 uint32_t crc32c_pad(uint32_t prev_crc, const void *buf, size_t len, size_t left_pad, size_t right_pad);
 uint32_t crc32c_nopad(uint32_t prev_crc, const void *buf, size_t len, size_t left_pad, size_t right_pad);
+// CRC of A+B given crc1 = crc32c(0, A), crc2 = crc32c(0, B) and len2 = length of B
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+// Same as crc32c(crc, <len zero bytes>, len), but in O(log(len)) time
+uint32_t crc32c_append_zeros(uint32_t crc, size_t len);
 #ifdef __cplusplus
 };
 #endif
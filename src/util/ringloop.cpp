@@ -3,14 +3,17 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include <stdexcept>
 
 #include <sys/eventfd.h>
+#include <linux/nvme_ioctl.h>
 
 #include "ringloop.h"
 
-ring_loop_t::ring_loop_t(int qd, bool multithreaded, bool sqe128)
+ring_loop_t::ring_loop_t(int qd, bool multithreaded, bool sqe128, const ring_loop_config_t & config)
 {
     mt = multithreaded;
     io_uring_params params = {};
@@ -18,11 +21,36 @@ ring_loop_t::ring_loop_t(int qd, bool multithreaded, bool sqe128)
     {
         params.flags = IORING_SETUP_SQE128;
     }
+    if (config.sqpoll)
+    {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = config.sqpoll_idle;
+        if (config.sqpoll_cpu >= 0)
+        {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = config.sqpoll_cpu;
+        }
+    }
+    else if (config.defer_taskrun && !multithreaded)
+    {
+        params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    }
     int ret = io_uring_queue_init_params(qd, &ring, &params);
+    if (ret < 0 && (params.flags & ~IORING_SETUP_SQE128))
+    {
+        // SQPOLL may be denied and DEFER_TASKRUN requires Linux 6.1+
+        fprintf(stderr, "Failed to create io_uring with %s: %s, falling back to the default mode\n",
+            config.sqpoll ? "SQPOLL" : "DEFER_TASKRUN", strerror(-ret));
+        params = {};
+        params.flags = sqe128 ? IORING_SETUP_SQE128 : 0;
+        ret = io_uring_queue_init_params(qd, &ring, &params);
+    }
     if (ret < 0)
     {
         throw std::runtime_error(std::string("io_uring_queue_init: ") + strerror(-ret));
     }
+    defer_taskrun = (params.flags & IORING_SETUP_DEFER_TASKRUN);
+    busy_poll_us = busy_poll_cur = config.busy_poll_us > 0 ? config.busy_poll_us : 0;
     free_ring_data_ptr = *ring.sq.kring_entries;
     ring_datas = (struct ring_data_t*)calloc(free_ring_data_ptr, sizeof(ring_data_t));
     free_ring_data = (int*)malloc(sizeof(int) * free_ring_data_ptr);
@@ -46,8 +74,16 @@ ring_loop_t::ring_loop_t(int qd, bool multithreaded, bool sqe128)
 
 ring_loop_t::~ring_loop_t()
 {
+    if (fixed_buf_base)
+    {
+        unregister_buffer_region();
+    }
     free(free_ring_data);
     free(ring_datas);
+    if (has_iopoll)
+    {
+        io_uring_queue_exit(&iopoll_ring);
+    }
     io_uring_queue_exit(&ring);
     if (ring_eventfd)
     {
@@ -91,7 +127,10 @@ io_uring_sqe* ring_loop_t::get_sqe()
     struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
     assert(sqe);
     *sqe = { 0 };
-    io_uring_sqe_set_data(sqe, ring_datas + free_ring_data[--free_ring_data_ptr]);
+    ring_data_t *d = ring_datas + free_ring_data[--free_ring_data_ptr];
+    d->cb = NULL;
+    d->passthru_len = 0;
+    io_uring_sqe_set_data(sqe, d);
     if (mt)
         mu.unlock();
     return sqe;
@@ -114,8 +153,47 @@ void ring_loop_t::loop()
             fprintf(stderr, "Error resetting eventfd: %s\n", strerror(errno));
         }
     }
+    if (defer_taskrun && ring_eventfd >= 0)
+    {
+        // Completions are only posted when the ring is entered, and it isn't when
+        // the ring is driven by the eventfd instead of wait()
+        io_uring_get_events(&ring);
+    }
+    reap(&ring);
+    if (iopoll_inflight)
+    {
+        // Polled completions are only reaped when the ring is entered
+        io_uring_get_events(&iopoll_ring);
+        iopoll_inflight -= reap(&iopoll_ring);
+    }
+    do
+    {
+        loop_again = false;
+        for (int i = 0; i < consumers.size(); i++)
+        {
+            if (loop_mu)
+                loop_mu->lock();
+            consumers[i]->loop();
+            if (immediate_queue.size())
+            {
+                immediate_queue2.swap(immediate_queue);
+                for (auto & cb: immediate_queue2)
+                    cb();
+                immediate_queue2.clear();
+            }
+            if (loop_mu)
+                loop_mu->unlock();
+        }
+    } while (loop_again);
+    in_loop = false;
+}
+
+// Handle all available completions and return their number
+unsigned ring_loop_t::reap(struct io_uring *r)
+{
+    unsigned done = 0;
     struct io_uring_cqe *cqe;
-    while (!io_uring_peek_cqe(&ring, &cqe))
+    while (!io_uring_peek_cqe(r, &cqe))
     {
         if (mt)
             mu.lock();
@@ -126,13 +204,20 @@ void ring_loop_t::loop()
             if (mt)
                 mu.unlock();
             d->res = cqe->res;
+            d->cqe_flags = cqe->flags;
             d->more = true;
-            if (d->callback)
-                d->callback(d);
+            if (d->has_callback())
+            {
+                if (loop_mu)
+                    loop_mu->lock();
+                d->run_callback();
+                if (loop_mu)
+                    loop_mu->unlock();
+            }
             d->prev = true;
             d->more = false;
         }
-        else if (d->callback)
+        else if (d->has_callback())
         {
             // First free ring_data item, then call the callback
             // so it has at least 1 free slot for the next event
@@ -140,14 +225,25 @@ void ring_loop_t::loop()
             struct ring_data_t dl;
             dl.iov = d->iov;
             dl.res = cqe->res;
+            if (d->passthru_len)
+            {
+                // NVMe commands return 0 or a positive NVMe status instead of the byte count
+                dl.res = cqe->res == 0 ? d->passthru_len : (cqe->res > 0 ? -EIO : cqe->res);
+                d->passthru_len = 0;
+            }
+            dl.cqe_flags = cqe->flags;
             dl.more = false;
             dl.prev = d->prev;
-            dl.callback.swap(d->callback);
+            d->move_callback(dl);
             d->prev = d->more = false;
             free_ring_data[free_ring_data_ptr++] = d - ring_datas;
             if (mt)
                 mu.unlock();
-            dl.callback(&dl);
+            if (loop_mu)
+                loop_mu->lock();
+            dl.run_callback();
+            if (loop_mu)
+                loop_mu->unlock();
         }
         else
         {
@@ -156,24 +252,69 @@ void ring_loop_t::loop()
             if (mt)
                 mu.unlock();
         }
-        io_uring_cqe_seen(&ring, cqe);
+        io_uring_cqe_seen(r, cqe);
+        done++;
     }
-    do
+    return done;
+}
+
+int ring_loop_t::wait()
+{
+    struct io_uring_cqe *cqe;
+    if (iopoll_inflight)
     {
-        loop_again = false;
-        for (int i = 0; i < consumers.size(); i++)
+        return wait_iopoll();
+    }
+    if (busy_poll_us > 0)
+    {
+        // Spin before sleeping to save the wakeup latency when events come often enough
+        timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (true)
         {
-            consumers[i]->loop();
-            if (immediate_queue.size())
+            if (defer_taskrun)
             {
-                immediate_queue2.swap(immediate_queue);
-                for (auto & cb: immediate_queue2)
-                    cb();
-                immediate_queue2.clear();
+                io_uring_get_events(&ring);
+            }
+            if (!io_uring_peek_cqe(&ring, &cqe))
+            {
+                busy_poll_cur = busy_poll_cur*2 < busy_poll_us ? busy_poll_cur*2 : busy_poll_us;
+                return 0;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - start.tv_sec)*1000000 + (now.tv_nsec - start.tv_nsec)/1000 >= busy_poll_cur)
+            {
+                break;
             }
         }
-    } while (loop_again);
-    in_loop = false;
+        int min_poll = busy_poll_us/RINGLOOP_BUSY_POLL_MIN_DIV;
+        busy_poll_cur = busy_poll_cur/2 > min_poll ? busy_poll_cur/2 : (min_poll > 0 ? min_poll : 1);
+    }
+    return io_uring_wait_cqe(&ring, &cqe);
+}
+
+// Polled completions are only found by entering the polled ring, so poll it together with the main
+// ring until either of them has completions. Don't sleep between polls: polled disk requests usually
+// complete in a few microseconds, and even the shortest timed sleep is rounded up by timer slack
+int ring_loop_t::wait_iopoll()
+{
+    struct io_uring_cqe *cqe;
+    while (true)
+    {
+        io_uring_get_events(&iopoll_ring);
+        if (!io_uring_peek_cqe(&iopoll_ring, &cqe))
+        {
+            return 0;
+        }
+        if (defer_taskrun)
+        {
+            io_uring_get_events(&ring);
+        }
+        if (!io_uring_peek_cqe(&ring, &cqe))
+        {
+            return 0;
+        }
+    }
 }
 
 unsigned ring_loop_t::save()
@@ -184,10 +325,11 @@ unsigned ring_loop_t::save()
 void ring_loop_t::restore(unsigned sqe_tail)
 {
     assert(ring.sq.sqe_tail >= sqe_tail);
-    unsigned inc = (1 << io_uring_sqe_shift(&ring));
-    for (unsigned i = sqe_tail; i < ring.sq.sqe_tail; i += inc)
+    // sqe_tail counts SQEs, but 128-byte SQEs take two slots in the sqes array
+    unsigned shift = io_uring_sqe_shift(&ring);
+    for (unsigned i = sqe_tail; i < ring.sq.sqe_tail; i++)
     {
-        free_ring_data[free_ring_data_ptr++] = ((ring_data_t*)ring.sq.sqes[i & *ring.sq.kring_mask].user_data) - ring_datas;
+        free_ring_data[free_ring_data_ptr++] = ((ring_data_t*)ring.sq.sqes[(i & ring.sq.ring_mask) << shift].user_data) - ring_datas;
     }
     ring.sq.sqe_tail = sqe_tail;
 }
@@ -197,7 +339,7 @@ unsigned ring_loop_t::space_left()
     struct io_uring_sq *sq = &ring.sq;
     unsigned int head = io_uring_smp_load_acquire(sq->khead);
     unsigned int next = sq->sqe_tail + 1;
-    int left = (*sq->kring_entries - (next - head)) >> io_uring_sqe_shift(&ring);
+    int left = *sq->kring_entries - (next - head);
     if (left > free_ring_data_ptr)
     {
         // return min(sqes left, ring_datas left)
@@ -228,3 +370,504 @@ int ring_loop_t::register_eventfd()
     loop();
     return ring_eventfd;
 }
+
+int ring_loop_t::register_fd(int fd)
+{
+    if (fd < 0)
+    {
+        return -EINVAL;
+    }
+    if (fd < fixed_file_index.size() && fixed_file_index[fd])
+    {
+        return 0;
+    }
+    if (fixed_files_failed)
+    {
+        return -ENOTSUP;
+    }
+    if (!fixed_file_index.size())
+    {
+        int r = io_uring_register_files_sparse(&ring, RINGLOOP_FIXED_FILES);
+        if (r < 0)
+        {
+            fixed_files_failed = true;
+            return r;
+        }
+        for (int i = RINGLOOP_FIXED_FILES-1; i >= 0; i--)
+        {
+            free_fixed_files.push_back(i);
+        }
+        if (has_iopoll)
+        {
+            iopoll_files = io_uring_register_files_sparse(&iopoll_ring, RINGLOOP_FIXED_FILES) >= 0;
+        }
+    }
+    if (!free_fixed_files.size())
+    {
+        return -ENOSPC;
+    }
+    int idx = free_fixed_files.back();
+    int r = io_uring_register_files_update(&ring, idx, &fd, 1);
+    if (r < 0)
+    {
+        return r;
+    }
+    free_fixed_files.pop_back();
+    if (fixed_file_index.size() <= fd)
+    {
+        fixed_file_index.resize(fd+1);
+    }
+    fixed_file_index[fd] = idx+1;
+    fixed_file_count++;
+    mirror_fixed_file(idx, fd);
+    return 0;
+}
+
+void ring_loop_t::unregister_fd(int fd)
+{
+    if (fd < 0 || fd >= fixed_file_index.size() || !fixed_file_index[fd])
+    {
+        return;
+    }
+    int idx = fixed_file_index[fd]-1;
+    int empty = -1;
+    int r = io_uring_register_files_update(&ring, idx, &empty, 1);
+    if (r < 0)
+    {
+        // The slot is leaked, but requests for this fd aren't submitted as fixed anymore
+        fprintf(stderr, "Failed to unregister file %d from io_uring: %s\n", fd, strerror(-r));
+    }
+    else
+    {
+        free_fixed_files.push_back(idx);
+    }
+    mirror_fixed_file(idx, -1);
+    fixed_file_index[fd] = 0;
+    fixed_file_count--;
+}
+
+// The polled ring has its own registered file table with the same indexes
+void ring_loop_t::mirror_fixed_file(int idx, int fd)
+{
+    if (!iopoll_files)
+    {
+        return;
+    }
+    int r = io_uring_register_files_update(&iopoll_ring, idx, &fd, 1);
+    if (r < 0)
+    {
+        fprintf(stderr, "Failed to update registered files of the polled io_uring: %s\n", strerror(-r));
+        io_uring_unregister_files(&iopoll_ring);
+        iopoll_files = false;
+    }
+}
+
+int ring_loop_t::register_iopoll_fd(int fd)
+{
+    if (fd < 0 || mt)
+    {
+        return -EINVAL;
+    }
+    if (!has_iopoll)
+    {
+        io_uring_params params = {};
+        params.flags = IORING_SETUP_IOPOLL | (ring.flags & IORING_SETUP_SQE128);
+        int r = io_uring_queue_init_params(*ring.sq.kring_entries, &iopoll_ring, &params);
+        if (r < 0)
+        {
+            return r;
+        }
+        has_iopoll = true;
+        if (fixed_file_index.size() && io_uring_register_files_sparse(&iopoll_ring, RINGLOOP_FIXED_FILES) >= 0)
+        {
+            iopoll_files = true;
+            for (int i = 0; i < fixed_file_index.size(); i++)
+            {
+                if (fixed_file_index[i])
+                    mirror_fixed_file(fixed_file_index[i]-1, i);
+            }
+        }
+    }
+    if (fd < iopoll_fds.size() && iopoll_fds[fd])
+    {
+        return 0;
+    }
+    if (iopoll_inflight)
+    {
+        return -EBUSY;
+    }
+    int r = probe_iopoll(fd, NULL);
+    if (r < 0)
+    {
+        return r;
+    }
+    if (iopoll_fds.size() <= fd)
+    {
+        iopoll_fds.resize(fd+1);
+    }
+    iopoll_fds[fd] = true;
+    iopoll_fd_count++;
+    for (auto & pt: passthru)
+    {
+        if (pt.fd == fd)
+        {
+            // Passthrough commands go to the NVMe char device, check it separately
+            pt.iopoll = probe_iopoll(pt.nvme_fd, &pt) >= 0;
+        }
+    }
+    return 0;
+}
+
+// Check that the file supports polling with a test read, otherwise all requests would fail with EOPNOTSUPP.
+// With <pt>, <fd> is the NVMe char device and the test read is an NVMe command
+int ring_loop_t::probe_iopoll(int fd, ring_passthru_t *pt)
+{
+    size_t len = pt && (1u << pt->lba_shift) > 4096 ? (1u << pt->lba_shift) : 4096;
+    void *buf = NULL;
+    if (posix_memalign(&buf, 4096, len) != 0)
+    {
+        return -ENOMEM;
+    }
+    io_uring_sqe *sqe = io_uring_get_sqe(&iopoll_ring);
+    if (pt)
+    {
+        // Read the first LBA
+        memset(sqe, 0, 128);
+        sqe->opcode = IORING_OP_URING_CMD;
+        sqe->fd = fd;
+        sqe->cmd_op = NVME_URING_CMD_IO;
+        nvme_uring_cmd *cmd = (nvme_uring_cmd*)sqe->cmd;
+        cmd->opcode = 0x02; // nvme_cmd_read
+        cmd->nsid = pt->nsid;
+        cmd->addr = (uint64_t)buf;
+        cmd->data_len = 1u << pt->lba_shift;
+    }
+    else
+    {
+        io_uring_prep_read(sqe, fd, buf, len, 0);
+    }
+    int r = io_uring_submit(&iopoll_ring);
+    if (r >= 0)
+    {
+        io_uring_cqe *cqe;
+        r = io_uring_wait_cqe(&iopoll_ring, &cqe);
+        if (r >= 0)
+        {
+            // NVMe commands return a positive status on error
+            r = pt && cqe->res > 0 ? -EIO : cqe->res;
+            io_uring_cqe_seen(&iopoll_ring, cqe);
+        }
+    }
+    free(buf);
+    return r;
+}
+
+void ring_loop_t::unregister_iopoll_fd(int fd)
+{
+    if (fd >= 0 && fd < iopoll_fds.size() && iopoll_fds[fd])
+    {
+        iopoll_fds[fd] = false;
+        iopoll_fd_count--;
+        for (auto & pt: passthru)
+        {
+            if (pt.fd == fd)
+                pt.iopoll = false;
+        }
+    }
+}
+
+int ring_loop_t::register_buffer_region(void *base, size_t size, size_t max_pinned,
+    std::function<void(void *slice, size_t len, bool pinned)> pin_cb)
+{
+    if (fixed_buf_base)
+    {
+        return -EBUSY;
+    }
+    size_t max_count = max_pinned / RINGLOOP_FIXED_BUF_SLICE;
+    if (max_count > RINGLOOP_FIXED_BUFS)
+    {
+        max_count = RINGLOOP_FIXED_BUFS;
+    }
+    if (!base || ((uintptr_t)base % RINGLOOP_FIXED_BUF_SLICE) || size < RINGLOOP_FIXED_BUF_SLICE || !max_count)
+    {
+        return -EINVAL;
+    }
+    int r = io_uring_register_buffers_sparse(&ring, max_count);
+    if (r < 0)
+    {
+        return r;
+    }
+    fixed_buf_base = (uint8_t*)base;
+    fixed_buf_size = size / RINGLOOP_FIXED_BUF_SLICE * RINGLOOP_FIXED_BUF_SLICE;
+    fixed_buf_index.clear();
+    fixed_buf_index.resize(size / RINGLOOP_FIXED_BUF_SLICE, -1);
+    fixed_buf_count = 0;
+    fixed_buf_max = max_count;
+    fixed_buf_pin_cb = pin_cb;
+    return 0;
+}
+
+void ring_loop_t::unregister_buffer_region()
+{
+    io_uring_unregister_buffers(&ring);
+    if (fixed_buf_pin_cb)
+    {
+        for (size_t idx = 0; idx < fixed_buf_index.size(); idx++)
+        {
+            if (fixed_buf_index[idx] >= 0)
+                fixed_buf_pin_cb(fixed_buf_base + idx*RINGLOOP_FIXED_BUF_SLICE, RINGLOOP_FIXED_BUF_SLICE, false);
+        }
+    }
+    fixed_buf_base = NULL;
+    fixed_buf_size = 0;
+    fixed_buf_index.clear();
+    fixed_buf_count = fixed_buf_max = 0;
+    fixed_buf_pin_cb = NULL;
+}
+
+io_uring_buf_ring* ring_loop_t::setup_buf_ring(int bgid, unsigned entries, int *err)
+{
+    return io_uring_setup_buf_ring(&ring, entries, bgid, 0, err);
+}
+
+void ring_loop_t::free_buf_ring(io_uring_buf_ring *br, int bgid, unsigned entries)
+{
+    io_uring_free_buf_ring(&ring, br, entries, bgid);
+}
+
+// Returns registered buffer index or -1
+int ring_loop_t::get_fixed_buf(void *buf, size_t len)
+{
+    size_t offset = (uint8_t*)buf - fixed_buf_base;
+    if ((uint8_t*)buf < fixed_buf_base || offset >= fixed_buf_size || !len ||
+        offset / RINGLOOP_FIXED_BUF_SLICE != (offset + len - 1) / RINGLOOP_FIXED_BUF_SLICE)
+    {
+        return -1;
+    }
+    size_t idx = offset / RINGLOOP_FIXED_BUF_SLICE;
+    if (fixed_buf_index[idx] < 0)
+    {
+        if (fixed_buf_count >= fixed_buf_max)
+        {
+            // Pinned memory limit is reached
+            return -1;
+        }
+        // Pin the slice. Buffers in it are in use anyway, so it doesn't waste memory
+        uint8_t *slice = fixed_buf_base + idx*RINGLOOP_FIXED_BUF_SLICE;
+        if (fixed_buf_pin_cb)
+            fixed_buf_pin_cb(slice, RINGLOOP_FIXED_BUF_SLICE, true);
+        iovec iov = { .iov_base = slice, .iov_len = RINGLOOP_FIXED_BUF_SLICE };
+        int r = io_uring_register_buffers_update_tag(&ring, fixed_buf_count, &iov, NULL, 1);
+        if (r < 0)
+        {
+            fprintf(stderr, "Failed to register buffer in io_uring: %s, disabling fixed buffers\n", strerror(-r));
+            if (fixed_buf_pin_cb)
+                fixed_buf_pin_cb(slice, RINGLOOP_FIXED_BUF_SLICE, false);
+            unregister_buffer_region();
+            return -1;
+        }
+        fixed_buf_index[idx] = fixed_buf_count++;
+    }
+    return fixed_buf_index[idx];
+}
+
+int ring_loop_t::register_passthru(int fd, int nvme_fd, uint32_t nsid, uint32_t lba_size, uint32_t max_io)
+{
+    if (!(ring.flags & IORING_SETUP_SQE128))
+    {
+        // NVMe commands don't fit into 64-byte SQEs
+        return -EINVAL;
+    }
+    if (fd < 0 || nvme_fd < 0 || !lba_size || (lba_size & (lba_size-1)) || max_io < lba_size)
+    {
+        return -EINVAL;
+    }
+    unregister_passthru(fd);
+    uint32_t lba_shift = 0;
+    while ((1u << lba_shift) < lba_size)
+        lba_shift++;
+    passthru.push_back((ring_passthru_t){ .fd = fd, .nvme_fd = nvme_fd, .nsid = nsid, .lba_shift = lba_shift, .max_io = max_io });
+    if (fd < iopoll_fds.size() && iopoll_fds[fd] && !iopoll_inflight)
+    {
+        passthru.back().iopoll = probe_iopoll(nvme_fd, &passthru.back()) >= 0;
+    }
+    return 0;
+}
+
+void ring_loop_t::unregister_passthru(int fd)
+{
+    for (size_t i = 0; i < passthru.size(); i++)
+    {
+        if (passthru[i].fd == fd)
+        {
+            passthru.erase(passthru.begin()+i);
+            break;
+        }
+    }
+}
+
+// Convert a read or write to an NVMe I/O command if its fd is mapped to an NVMe namespace
+ring_passthru_t* ring_loop_t::use_passthru(io_uring_sqe *sqe)
+{
+    if (sqe->flags & (IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT) ||
+        (sqe->rw_flags && sqe->rw_flags != RWF_DSYNC))
+    {
+        return NULL;
+    }
+    ring_passthru_t *pt = NULL;
+    for (auto & p: passthru)
+    {
+        if (p.fd == sqe->fd)
+        {
+            pt = &p;
+            break;
+        }
+    }
+    if (!pt)
+    {
+        return NULL;
+    }
+    bool vec = sqe->opcode == IORING_OP_READV || sqe->opcode == IORING_OP_WRITEV;
+    bool write = sqe->opcode == IORING_OP_WRITEV || sqe->opcode == IORING_OP_WRITE;
+    uint64_t len = 0;
+    if (vec)
+    {
+        iovec *iov = (iovec*)sqe->addr;
+        for (uint32_t i = 0; i < sqe->len; i++)
+            len += iov[i].iov_len;
+    }
+    else
+        len = sqe->len;
+    uint64_t lba_mask = (1 << pt->lba_shift) - 1;
+    if (!len || len > pt->max_io || (len >> pt->lba_shift) > 0x10000 || ((sqe->off | len) & lba_mask))
+    {
+        // Leave it to the block layer
+        return NULL;
+    }
+    uint64_t user_data = sqe->user_data;
+    uint64_t addr = sqe->addr;
+    uint32_t iovcnt = sqe->len;
+    uint64_t slba = sqe->off >> pt->lba_shift;
+    bool fua = sqe->rw_flags == RWF_DSYNC;
+    memset(sqe, 0, 128);
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = pt->nvme_fd;
+    sqe->cmd_op = vec && iovcnt > 1 ? NVME_URING_CMD_IO_VEC : NVME_URING_CMD_IO;
+    sqe->user_data = user_data;
+    nvme_uring_cmd *cmd = (nvme_uring_cmd*)sqe->cmd;
+    cmd->opcode = write ? 0x01 : 0x02; // nvme_cmd_write : nvme_cmd_read
+    cmd->nsid = pt->nsid;
+    if (vec && iovcnt > 1)
+    {
+        cmd->addr = addr;
+        cmd->data_len = iovcnt;
+    }
+    else
+    {
+        cmd->addr = vec ? (uint64_t)((iovec*)addr)->iov_base : addr;
+        cmd->data_len = len;
+    }
+    cmd->cdw10 = (uint32_t)slba;
+    cmd->cdw11 = (uint32_t)(slba >> 32);
+    // Number of LBAs minus one and Force Unit Access for O_DSYNC writes
+    cmd->cdw12 = (uint32_t)((len >> pt->lba_shift) - 1) | (fua && write ? (1u << 30) : 0);
+    ((ring_data_t*)user_data)->passthru_len = len;
+    return pt;
+}
+
+bool ring_loop_t::is_iopoll_sqe(io_uring_sqe *sqe)
+{
+    return iopoll_fd_count && (sqe->opcode == IORING_OP_READV || sqe->opcode == IORING_OP_WRITEV ||
+        sqe->opcode == IORING_OP_READ || sqe->opcode == IORING_OP_WRITE) &&
+        !(sqe->flags & (IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT)) &&
+        sqe->fd >= 0 && sqe->fd < iopoll_fds.size() && iopoll_fds[sqe->fd];
+}
+
+// Convert not yet submitted requests to NVMe passthrough commands and to fixed file and fixed buffer
+// variants, and move disk reads and writes to the polled ring
+void ring_loop_t::rewrite_sqes()
+{
+    if (mt)
+        mu.lock();
+    unsigned shift = io_uring_sqe_shift(&ring);
+    unsigned out = ring.sq.sqe_head;
+    unsigned moved = 0;
+    for (unsigned i = ring.sq.sqe_head; i != ring.sq.sqe_tail; i++)
+    {
+        io_uring_sqe *sqe = &ring.sq.sqes[(i & ring.sq.ring_mask) << shift];
+        ring_passthru_t *pt = NULL;
+        if (passthru.size() && (sqe->opcode == IORING_OP_READV || sqe->opcode == IORING_OP_WRITEV ||
+            sqe->opcode == IORING_OP_READ || sqe->opcode == IORING_OP_WRITE))
+        {
+            pt = use_passthru(sqe);
+        }
+        // Converted requests go to the NVMe char device which is probed for polling separately
+        bool polled = pt ? pt->iopoll : is_iopoll_sqe(sqe);
+        switch (sqe->opcode)
+        {
+        case IORING_OP_READV:
+        case IORING_OP_WRITEV:
+            // The polled ring doesn't have registered buffers
+            if (fixed_buf_base && !polled && sqe->len == 1 && !(sqe->flags & IOSQE_BUFFER_SELECT))
+            {
+                iovec *iov = (iovec*)sqe->addr;
+                int buf_index = get_fixed_buf(iov->iov_base, iov->iov_len);
+                if (buf_index >= 0)
+                {
+                    sqe->opcode = sqe->opcode == IORING_OP_READV ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                    sqe->addr = (uint64_t)iov->iov_base;
+                    sqe->len = iov->iov_len;
+                    sqe->buf_index = buf_index;
+                }
+            }
+            goto fixed_file;
+        case IORING_OP_READ:
+        case IORING_OP_WRITE:
+        case IORING_OP_READ_FIXED:
+        case IORING_OP_WRITE_FIXED:
+        case IORING_OP_FSYNC:
+        case IORING_OP_SENDMSG:
+        case IORING_OP_RECVMSG:
+        case IORING_OP_SENDMSG_ZC:
+        case IORING_OP_SEND:
+        case IORING_OP_RECV:
+        case IORING_OP_URING_CMD:
+        fixed_file:
+            if (!(sqe->flags & IOSQE_FIXED_FILE) && sqe->fd >= 0 && (!polled || iopoll_files) &&
+                sqe->fd < fixed_file_index.size() && fixed_file_index[sqe->fd])
+            {
+                sqe->fd = fixed_file_index[sqe->fd]-1;
+                sqe->flags |= IOSQE_FIXED_FILE;
+            }
+            break;
+        }
+        if (polled)
+        {
+            io_uring_sqe *polled_sqe = io_uring_get_sqe(&iopoll_ring);
+            if (polled_sqe)
+            {
+                memcpy(polled_sqe, sqe, sizeof(io_uring_sqe) << shift);
+                moved++;
+                continue;
+            }
+        }
+        if (out != i)
+        {
+            // Close the gap left by moved requests
+            memcpy(&ring.sq.sqes[(out & ring.sq.ring_mask) << shift], sqe, sizeof(io_uring_sqe) << shift);
+        }
+        out++;
+    }
+    if (moved)
+    {
+        ring.sq.sqe_tail = out;
+        int r = io_uring_submit(&iopoll_ring);
+        if (r < 0)
+        {
+            fprintf(stderr, "Failed to submit polled requests to io_uring: %s\n", strerror(-r));
+        }
+        iopoll_inflight += moved;
+    }
+    if (mt)
+        mu.unlock();
+}
@@ -18,14 +18,89 @@
 #include <mutex>
 
 #define RINGLOOP_DEFAULT_SIZE 1024
+// Size of the registered file table
+#define RINGLOOP_FIXED_FILES 4096
+// Registered buffer regions are split into slices of this size pinned on first use
+#define RINGLOOP_FIXED_BUF_SLICE ((size_t)2*1024*1024)
+// Kernel limit for the number of registered buffers
+#define RINGLOOP_FIXED_BUFS 16384
+
+// Busy-poll time is adaptive: it's doubled when an event arrives during polling
+// and halved when it doesn't, but never goes below busy_poll_us / RINGLOOP_BUSY_POLL_MIN_DIV
+#define RINGLOOP_BUSY_POLL_MIN_DIV 64
+
+struct ring_data_t;
+
+struct ring_loop_config_t
+{
+    // Use a kernel submission queue polling thread
+    bool sqpoll = false;
+    // Pin the polling thread to this CPU, -1 means don't pin
+    int sqpoll_cpu = -1;
+    // Polling thread goes to sleep after this number of milliseconds without submissions
+    int sqpoll_idle = 0;
+    // Run completion task work only when the ring is waited on. Incompatible with sqpoll.
+    // The ring must then only be used by the thread which created it
+    bool defer_taskrun = false;
+    // Poll the completion queue for up to this number of microseconds before sleeping in wait()
+    int busy_poll_us = 0;
+};
+
+// Completion callback which doesn't allocate memory: a plain function with two context
+// pointers, usually the object and its operation. Capture-less lambdas convert to it
+typedef void (*ring_cb_t)(void *ctx, void *arg, ring_data_t *data);
 
 struct ring_data_t
 {
     struct iovec iov; // for single-entry read/write operations
     int res;
+    unsigned cqe_flags; // for IORING_CQE_F_BUFFER and the selected buffer ID
+    uint32_t passthru_len; // length of a read/write converted to an NVMe passthrough command
     bool prev: 1;
     bool more: 1;
+    // cb is preferred for hot paths because std::function allocates memory for captures
+    // larger than 2 pointers. cb is reset by get_sqe() and takes precedence over callback
+    ring_cb_t cb;
+    void *cb_ctx, *cb_arg;
     std::function<void(ring_data_t*)> callback;
+
+    inline void set_callback(ring_cb_t cb, void *ctx, void *arg = NULL)
+    {
+        this->cb = cb;
+        this->cb_ctx = ctx;
+        this->cb_arg = arg;
+    }
+    inline bool has_callback()
+    {
+        return cb || callback;
+    }
+    // Move callback to another ring_data_t, leaving this one empty
+    inline void move_callback(ring_data_t & to)
+    {
+        to.cb = cb;
+        to.cb_ctx = cb_ctx;
+        to.cb_arg = cb_arg;
+        if (!cb)
+            to.callback.swap(callback);
+        cb = NULL;
+    }
+    inline void run_callback()
+    {
+        if (cb)
+            cb(cb_ctx, cb_arg, this);
+        else
+            callback(this);
+    }
+};
+
+struct ring_passthru_t
+{
+    int fd, nvme_fd;
+    uint32_t nsid;
+    uint32_t lba_shift;
+    uint32_t max_io;
+    // commands for nvme_fd go to the polled ring
+    bool iopoll;
 };
 
 struct ring_consumer_t
@@ -40,6 +115,16 @@ public:
     virtual void register_consumer(ring_consumer_t *consumer) = 0;
     virtual void unregister_consumer(ring_consumer_t *consumer) = 0;
     virtual int register_eventfd() = 0;
+    virtual int register_fd(int fd) = 0;
+    virtual void unregister_fd(int fd) = 0;
+    virtual int register_buffer_region(void *base, size_t size, size_t max_pinned,
+        std::function<void(void *slice, size_t len, bool pinned)> pin_cb = NULL) = 0;
+    virtual io_uring_buf_ring* setup_buf_ring(int bgid, unsigned entries, int *err) = 0;
+    virtual void free_buf_ring(io_uring_buf_ring *br, int bgid, unsigned entries) = 0;
+    virtual int register_passthru(int fd, int nvme_fd, uint32_t nsid, uint32_t lba_size, uint32_t max_io) = 0;
+    virtual void unregister_passthru(int fd) = 0;
+    virtual int register_iopoll_fd(int fd) = 0;
+    virtual void unregister_iopoll_fd(int fd) = 0;
     virtual io_uring_sqe* get_sqe() = 0;
     virtual void set_immediate(const std::function<void()> & cb) = 0;
     virtual int submit() = 0;
@@ -60,6 +145,7 @@ class __attribute__((visibility("default"))) ring_loop_t: public ring_loop_i
     struct ring_data_t *ring_datas;
     std::mutex mu;
     bool mt;
+    std::mutex *loop_mu = NULL;
     int *free_ring_data;
     unsigned free_ring_data_ptr;
     bool in_loop;
@@ -67,12 +153,77 @@ class __attribute__((visibility("default"))) ring_loop_t: public ring_loop_i
     struct io_uring ring;
     int ring_eventfd = -1;
     bool support_zc = false;
+    // fd => registered file index + 1
+    std::vector<int> fixed_file_index;
+    std::vector<int> free_fixed_files;
+    int fixed_file_count = 0;
+    bool fixed_files_failed = false;
+    uint8_t *fixed_buf_base = NULL;
+    size_t fixed_buf_size = 0;
+    // slice => registered buffer index or -1
+    std::vector<int> fixed_buf_index;
+    int fixed_buf_count = 0, fixed_buf_max = 0;
+    std::function<void(void *slice, size_t len, bool pinned)> fixed_buf_pin_cb;
+    bool defer_taskrun = false;
+    int busy_poll_us = 0, busy_poll_cur = 0;
+    std::vector<ring_passthru_t> passthru;
+    // Separate ring with polled completions for O_DIRECT reads and writes
+    struct io_uring iopoll_ring;
+    bool has_iopoll = false, iopoll_files = false;
+    std::vector<bool> iopoll_fds;
+    int iopoll_fd_count = 0;
+    unsigned iopoll_inflight = 0;
+
+    void rewrite_sqes();
+    int get_fixed_buf(void *buf, size_t len);
+    void unregister_buffer_region();
+    ring_passthru_t* use_passthru(io_uring_sqe *sqe);
+    bool is_iopoll_sqe(io_uring_sqe *sqe);
+    int probe_iopoll(int fd, ring_passthru_t *pt);
+    int wait_iopoll();
+    void mirror_fixed_file(int idx, int fd);
+    unsigned reap(struct io_uring *r);
 public:
-    ring_loop_t(int qd, bool multithreaded = false, bool sqe128 = false);
+    ring_loop_t(int qd, bool multithreaded = false, bool sqe128 = false, const ring_loop_config_t & config = ring_loop_config_t());
     ~ring_loop_t();
     void register_consumer(ring_consumer_t *consumer);
     void unregister_consumer(ring_consumer_t *consumer);
     int register_eventfd();
+    // Add fd to the registered file table. Readv, writev, sendmsg and similar requests
+    // for registered fds are then submitted with IOSQE_FIXED_FILE. fd must be unregistered
+    // before closing it, because the table holds a reference to the file
+    int register_fd(int fd);
+    void unregister_fd(int fd);
+    // Single-buffer readv and writev requests with buffers inside this region are submitted
+    // as READ_FIXED and WRITE_FIXED. Pages are pinned in slices on first use and stay pinned
+    // until the ring is destroyed. At most <max_pinned> bytes are pinned, requests with buffers
+    // in other slices go the usual way. <pin_cb> is called when a slice is pinned or unpinned
+    int register_buffer_region(void *base, size_t size, size_t max_pinned,
+        std::function<void(void *slice, size_t len, bool pinned)> pin_cb = NULL);
+    // Register a provided buffer ring with <entries> (power of 2) slots for buffer group <bgid>.
+    // Returns NULL and sets *err when the kernel doesn't support it (Linux < 5.19)
+    io_uring_buf_ring* setup_buf_ring(int bgid, unsigned entries, int *err);
+    void free_buf_ring(io_uring_buf_ring *br, int bgid, unsigned entries);
+    // Submit reads and writes for block device <fd> as NVMe I/O commands to the generic char
+    // device <nvme_fd> (/dev/ngXnY) of namespace <nsid>, bypassing the block layer. The ring must
+    // be created with sqe128. Requests which can't be converted (unaligned, larger than <max_io>
+    // or with rw_flags other than RWF_DSYNC) still go to <fd>. nvme_fd must stay open until
+    // the mapping is removed
+    int register_passthru(int fd, int nvme_fd, uint32_t nsid, uint32_t lba_size, uint32_t max_io);
+    void unregister_passthru(int fd);
+    // Submit reads and writes for <fd> (which must be opened with O_DIRECT) to a separate
+    // IORING_SETUP_IOPOLL ring, created on first use. Their completions don't raise interrupts
+    // and are polled by loop() and wait(). If <fd> is also mapped to an NVMe namespace,
+    // passthrough commands are polled too when the NVMe char device supports it
+    int register_iopoll_fd(int fd);
+    void unregister_iopoll_fd(int fd);
+    // Hold <mu> while running completion callbacks and consumers, but not while submitting,
+    // reaping or waiting, so that other threads may access the state of the loop's users
+    // between callbacks instead of waiting for the whole loop() pass
+    inline void set_loop_mutex(std::mutex *mu)
+    {
+        loop_mu = mu;
+    }
 
     io_uring_sqe* get_sqe();
     inline void set_immediate(const std::function<void()> & cb)
@@ -82,13 +233,11 @@ public:
     }
     inline int submit()
     {
+        if (fixed_file_count || fixed_buf_base || passthru.size() || iopoll_fd_count)
+            rewrite_sqes();
         return io_uring_submit(&ring);
     }
-    inline int wait()
-    {
-        struct io_uring_cqe *cqe;
-        return io_uring_wait_cqe(&ring, &cqe);
-    }
+    int wait();
     unsigned space_left();
     inline bool has_work()
     {
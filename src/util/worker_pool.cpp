@@ -0,0 +1,123 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#include "timerfd_manager.h"
+#include "worker_pool.h"
+
+worker_pool_t::worker_pool_t(int thread_count, timerfd_manager_t *tfd)
+{
+    this->tfd = tfd;
+    if (tfd)
+    {
+        done_eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (done_eventfd < 0)
+        {
+            throw std::runtime_error(std::string("failed to create eventfd: ") + strerror(errno));
+        }
+        tfd->set_fd_handler(done_eventfd, false, [this](int fd, int events) { handle_done(); });
+    }
+    for (int i = 0; i < thread_count; i++)
+    {
+        threads.push_back(std::thread(&worker_pool_t::run, this));
+    }
+}
+
+worker_pool_t::~worker_pool_t()
+{
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        stopped = true;
+        queue.clear();
+    }
+    cond.notify_all();
+    for (auto & t: threads)
+    {
+        t.join();
+    }
+    if (tfd)
+    {
+        tfd->set_fd_handler(done_eventfd, false, NULL);
+        close(done_eventfd);
+    }
+}
+
+void worker_pool_t::submit(std::function<void()> work, std::function<void()> done)
+{
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        queue.push_back((job_t){ .work = std::move(work), .done = std::move(done) });
+    }
+    cond.notify_one();
+}
+
+void worker_pool_t::run_parallel(int count, const std::function<void(int)> & fn)
+{
+    std::mutex wait_mu;
+    std::condition_variable wait_cond;
+    int left = count-1;
+    for (int i = 1; i < count; i++)
+    {
+        submit([&, i]()
+        {
+            fn(i);
+            std::lock_guard<std::mutex> lk(wait_mu);
+            if (!--left)
+                wait_cond.notify_one();
+        }, NULL);
+    }
+    fn(0);
+    std::unique_lock<std::mutex> lk(wait_mu);
+    while (left > 0)
+        wait_cond.wait(lk);
+}
+
+void worker_pool_t::run()
+{
+    std::unique_lock<std::mutex> lk(mu);
+    while (true)
+    {
+        while (!stopped && !queue.size())
+            cond.wait(lk);
+        if (stopped)
+            return;
+        job_t job = std::move(queue.front());
+        queue.pop_front();
+        lk.unlock();
+        job.work();
+        job.work = NULL;
+        lk.lock();
+        if (!job.done)
+            continue;
+        done_queue.push_back(std::move(job.done));
+        if (done_queue.size() == 1)
+        {
+            uint64_t n = 1;
+            if (write(done_eventfd, &n, sizeof(n)) < 0)
+                fprintf(stderr, "Error writing eventfd: %s\n", strerror(errno));
+        }
+    }
+}
+
+// Called in the event loop thread
+void worker_pool_t::handle_done()
+{
+    uint64_t n = 0;
+    if (read(done_eventfd, &n, sizeof(n)) < 0 && errno != EAGAIN && errno != EINTR)
+        fprintf(stderr, "Error resetting eventfd: %s\n", strerror(errno));
+    mu.lock();
+    done_queue2.swap(done_queue);
+    mu.unlock();
+    for (auto & cb: done_queue2)
+    {
+        cb();
+    }
+    done_queue2.clear();
+}
@@ -0,0 +1,45 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class timerfd_manager_t;
+
+// Runs CPU-heavy jobs in a fixed set of threads. Completion callbacks are called
+// back in the event loop thread, they're woken up through an eventfd.
+// Jobs must not touch data owned by the event loop, they should work on copies.
+// <tfd> may be NULL if jobs are only run with run_parallel() or without completion callbacks.
+class worker_pool_t
+{
+    struct job_t
+    {
+        std::function<void()> work;
+        std::function<void()> done;
+    };
+
+    timerfd_manager_t *tfd = NULL;
+    std::vector<std::thread> threads;
+    std::mutex mu;
+    std::condition_variable cond;
+    bool stopped = false;
+    std::deque<job_t> queue;
+    std::vector<std::function<void()>> done_queue, done_queue2;
+    int done_eventfd = -1;
+
+    void run();
+    void handle_done();
+public:
+    worker_pool_t(int thread_count, timerfd_manager_t *tfd);
+    // Waits for running jobs, discards queued jobs and undelivered completions
+    ~worker_pool_t();
+    void submit(std::function<void()> work, std::function<void()> done);
+    // Runs fn(0..count-1), fn(0) in the calling thread and others in the pool, and waits for all of them
+    void run_parallel(int count, const std::function<void(int)> & fn);
+};
@@ -0,0 +1,177 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <string.h>
+#include <assert.h>
+#include "xor.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Scalar version, also used for tails of vectorized versions
+static void memxor_multi_tail(const void **src, int n_src, void *res, unsigned int pos, unsigned int len)
+{
+    for (; pos+8 <= len; pos += 8)
+    {
+        uint64_t v, w;
+        memcpy(&v, (const uint8_t*)src[0] + pos, 8);
+        for (int i = 1; i < n_src; i++)
+        {
+            memcpy(&w, (const uint8_t*)src[i] + pos, 8);
+            v ^= w;
+        }
+        memcpy((uint8_t*)res + pos, &v, 8);
+    }
+    for (; pos < len; pos++)
+    {
+        uint8_t v = ((const uint8_t*)src[0])[pos];
+        for (int i = 1; i < n_src; i++)
+            v ^= ((const uint8_t*)src[i])[pos];
+        ((uint8_t*)res)[pos] = v;
+    }
+}
+
+static void memxor_multi_scalar(const void **src, int n_src, void *res, unsigned int len)
+{
+    memxor_multi_tail(src, n_src, res, 0, len);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static void memxor_multi_avx2(const void **src, int n_src, void *res, unsigned int len)
+{
+    unsigned int pos = 0;
+    for (; pos+64 <= len; pos += 64)
+    {
+        const uint8_t *s = (const uint8_t*)src[0] + pos;
+        __m256i a = _mm256_loadu_si256((const __m256i*)s);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s+32));
+        for (int i = 1; i < n_src; i++)
+        {
+            s = (const uint8_t*)src[i] + pos;
+            a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)s));
+            b = _mm256_xor_si256(b, _mm256_loadu_si256((const __m256i*)(s+32)));
+        }
+        _mm256_storeu_si256((__m256i*)((uint8_t*)res + pos), a);
+        _mm256_storeu_si256((__m256i*)((uint8_t*)res + pos + 32), b);
+    }
+    for (; pos+32 <= len; pos += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)((const uint8_t*)src[0] + pos));
+        for (int i = 1; i < n_src; i++)
+            a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)((const uint8_t*)src[i] + pos)));
+        _mm256_storeu_si256((__m256i*)((uint8_t*)res + pos), a);
+    }
+    memxor_multi_tail(src, n_src, res, pos, len);
+}
+
+__attribute__((target("avx512f")))
+static void memxor_multi_avx512(const void **src, int n_src, void *res, unsigned int len)
+{
+    if (len < 256)
+    {
+        // Short buffers (bitmaps) are faster with AVX2
+        memxor_multi_avx2(src, n_src, res, len);
+        return;
+    }
+    unsigned int pos = 0;
+    for (; pos+128 <= len; pos += 128)
+    {
+        const uint8_t *s = (const uint8_t*)src[0] + pos;
+        __m512i a = _mm512_loadu_si512((const void*)s);
+        __m512i b = _mm512_loadu_si512((const void*)(s+64));
+        for (int i = 1; i < n_src; i++)
+        {
+            s = (const uint8_t*)src[i] + pos;
+            a = _mm512_xor_si512(a, _mm512_loadu_si512((const void*)s));
+            b = _mm512_xor_si512(b, _mm512_loadu_si512((const void*)(s+64)));
+        }
+        _mm512_storeu_si512((void*)((uint8_t*)res + pos), a);
+        _mm512_storeu_si512((void*)((uint8_t*)res + pos + 64), b);
+    }
+    for (; pos+64 <= len; pos += 64)
+    {
+        __m512i a = _mm512_loadu_si512((const void*)((const uint8_t*)src[0] + pos));
+        for (int i = 1; i < n_src; i++)
+            a = _mm512_xor_si512(a, _mm512_loadu_si512((const void*)((const uint8_t*)src[i] + pos)));
+        _mm512_storeu_si512((void*)((uint8_t*)res + pos), a);
+    }
+    memxor_multi_tail(src, n_src, res, pos, len);
+}
+
+#elif defined(__aarch64__)
+
+static void memxor_multi_neon(const void **src, int n_src, void *res, unsigned int len)
+{
+    unsigned int pos = 0;
+    for (; pos+32 <= len; pos += 32)
+    {
+        const uint8_t *s = (const uint8_t*)src[0] + pos;
+        uint8x16_t a = vld1q_u8(s);
+        uint8x16_t b = vld1q_u8(s+16);
+        for (int i = 1; i < n_src; i++)
+        {
+            s = (const uint8_t*)src[i] + pos;
+            a = veorq_u8(a, vld1q_u8(s));
+            b = veorq_u8(b, vld1q_u8(s+16));
+        }
+        vst1q_u8((uint8_t*)res + pos, a);
+        vst1q_u8((uint8_t*)res + pos + 16, b);
+    }
+    for (; pos+16 <= len; pos += 16)
+    {
+        uint8x16_t a = vld1q_u8((const uint8_t*)src[0] + pos);
+        for (int i = 1; i < n_src; i++)
+            a = veorq_u8(a, vld1q_u8((const uint8_t*)src[i] + pos));
+        vst1q_u8((uint8_t*)res + pos, a);
+    }
+    memxor_multi_tail(src, n_src, res, pos, len);
+}
+
+#endif
+
+static memxor_multi_fn memxor_multi_select()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return memxor_multi_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return memxor_multi_avx2;
+#elif defined(__aarch64__)
+    return memxor_multi_neon;
+#endif
+    return memxor_multi_scalar;
+}
+
+// Selected during static initialization, so that threads never race to set it
+static const memxor_multi_fn memxor_multi_impl = memxor_multi_select();
+
+memxor_multi_fn memxor_multi_get(const char *name)
+{
+    if (!name)
+        return memxor_multi_impl;
+    if (!strcmp(name, "scalar"))
+        return memxor_multi_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+        return memxor_multi_avx2;
+    if (!strcmp(name, "avx512") && __builtin_cpu_supports("avx512f"))
+        return memxor_multi_avx512;
+#elif defined(__aarch64__)
+    if (!strcmp(name, "neon"))
+        return memxor_multi_neon;
+#endif
+    return NULL;
+}
+
+void memxor_multi(const void **src, int n_src, void *res, unsigned int len)
+{
+    assert(n_src > 0);
+    memxor_multi_impl(src, n_src, res, len);
+}
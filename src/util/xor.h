@@ -5,11 +5,19 @@
 
 #include <stdint.h>
 
+// XOR <n_src> buffers of <len> bytes into <res> in a single pass.
+// <res> may be equal to one of the sources, but must not partially overlap them.
+// Uses AVX-512, AVX2 or NEON when available (selected at runtime on x86).
+void memxor_multi(const void **src, int n_src, void *res, unsigned int len);
+
+typedef void (*memxor_multi_fn)(const void **src, int n_src, void *res, unsigned int len);
+
+// Get an implementation by name ("scalar", "avx2", "avx512", "neon") for tests and benchmarks.
+// Returns NULL if it's not supported by the CPU, or the selected one if <name> is NULL.
+memxor_multi_fn memxor_multi_get(const char *name);
+
 inline void memxor(const void *r1, const void *r2, void *res, unsigned int len)
 {
-    unsigned int i;
-    for (i = 0; i < len; ++i)
-    {
-        ((uint8_t*)res)[i] = ((uint8_t*)r1)[i] ^ ((uint8_t*)r2)[i];
-    }
+    const void *src[2] = { r1, r2 };
+    memxor_multi(src, 2, res, len);
 }